@@ -23,6 +23,7 @@
 #include <errno.h>
 #include <dirent.h>
 #include <inttypes.h>
+#include <fcntl.h>
 
 #include "lua.h"
 
@@ -39,6 +40,28 @@ extern uint32_t microgroom_stop_after;
 extern double K1, K2, K3;
 extern uint32_t max_token_size, max_long_tokens;
 extern uint32_t limit_token_size;
+extern uint32_t prefetch_distance;
+extern uint32_t map_populate, map_advice, map_hugepages, map_lock;
+extern uint32_t lock_timeout, lock_stripes;
+extern uint32_t durability, checkpoint_interval;
+
+/* mapping policy flags, given as booleans or numbers */
+static const char *const map_flag_options[] = {
+  "map_populate", "map_hugepages", "mlock", NULL
+};
+static uint32_t *const map_flag_vars[] = {
+  &map_populate, &map_hugepages, &map_lock
+};
+
+/* values of the map_advice option */
+static const char *const map_advice_names[] = {
+  "normal", "random", "willneed", NULL
+};
+
+/* values of the durability option, OSBF_DURABILITY_* */
+static const char *const durability_names[] = {
+  "none", "async", "sync", "checkpoint", NULL
+};
 
 /* macro to `unsign' a character */
 #ifndef uchar
@@ -66,7 +89,7 @@ static double pR_SCF = 0.59;
 static int
 lua_osbf_config (lua_State * L)
 {
-  int options_set = 0;
+  int options_set = 0, i;
 
   luaL_checktype (L, 1, LUA_TTABLE);
 
@@ -142,6 +165,15 @@ lua_osbf_config (lua_State * L)
     }
   lua_pop (L, 1);
 
+  lua_pushstring (L, "prefetch_distance");
+  lua_gettable (L, 1);
+  if (lua_isnumber (L, -1))
+    {
+      prefetch_distance = luaL_checknumber (L, -1);
+      options_set++;
+    }
+  lua_pop (L, 1);
+
   lua_pushstring (L, "pR_SCF");
   lua_gettable (L, 1);
   if (lua_isnumber (L, -1))
@@ -151,6 +183,72 @@ lua_osbf_config (lua_State * L)
     }
   lua_pop (L, 1);
 
+  for (i = 0; map_flag_options[i] != NULL; i++)
+    {
+      lua_getfield (L, 1, map_flag_options[i]);
+      if (lua_isboolean (L, -1) || lua_isnumber (L, -1))
+	{
+	  *map_flag_vars[i] = lua_isnumber (L, -1) ?
+	    lua_tonumber (L, -1) != 0 : lua_toboolean (L, -1);
+	  options_set++;
+	}
+      lua_pop (L, 1);
+    }
+
+  lua_pushstring (L, "lock_timeout");
+  lua_gettable (L, 1);
+  if (lua_isnumber (L, -1))
+    {
+      lock_timeout = luaL_checknumber (L, -1);
+      options_set++;
+    }
+  lua_pop (L, 1);
+
+  lua_pushstring (L, "lock_stripes");
+  lua_gettable (L, 1);
+  if (lua_isnumber (L, -1))
+    {
+      lock_stripes = luaL_checknumber (L, -1);
+      options_set++;
+    }
+  lua_pop (L, 1);
+
+  lua_getfield (L, 1, "map_advice");
+  if (lua_isstring (L, -1))
+    {
+      const char *advice = lua_tostring (L, -1);
+
+      for (i = 0; map_advice_names[i] != NULL &&
+	   strcmp (map_advice_names[i], advice) != 0; i++);
+      if (map_advice_names[i] == NULL)
+	return luaL_error (L, "invalid map_advice '%s'", advice);
+      map_advice = i;
+      options_set++;
+    }
+  lua_pop (L, 1);
+
+  lua_getfield (L, 1, "durability");
+  if (lua_isstring (L, -1))
+    {
+      const char *policy = lua_tostring (L, -1);
+
+      for (i = 0; durability_names[i] != NULL &&
+	   strcmp (durability_names[i], policy) != 0; i++);
+      if (durability_names[i] == NULL)
+	return luaL_error (L, "invalid durability '%s'", policy);
+      durability = i;
+      options_set++;
+    }
+  lua_pop (L, 1);
+
+  lua_getfield (L, 1, "checkpoint_interval");
+  if (lua_isnumber (L, -1))
+    {
+      checkpoint_interval = luaL_checknumber (L, -1);
+      options_set++;
+    }
+  lua_pop (L, 1);
+
   lua_pushnumber (L, (lua_Number) options_set);
   return 1;
 }
@@ -160,11 +258,12 @@ lua_osbf_config (lua_State * L)
 static int
 lua_osbf_createdb (lua_State * L)
 {
-  const char *cfcname;
+  const char **cfcnames;
   uint32_t buckets;
   uint32_t minor = 0;
   char errmsg[OSBF_ERROR_MESSAGE_LEN] = { '\0' };
   int32_t num_classes;
+  uint32_t mc_classes, i;
 
   /* check if the second arg is a table */
   luaL_checktype (L, 1, LUA_TTABLE);
@@ -175,19 +274,50 @@ lua_osbf_createdb (lua_State * L)
   /* get number of buckets */
   buckets = luaL_checknumber (L, 2);
 
+  /* number of classes in each file, if multi-class files are wanted */
+  mc_classes = luaL_optnumber (L, 3, 1);
+
+  /* options: a table with the fields robin_hood, fingerprints */
+  /* and bloom, or just a boolean for robin_hood                */
+  if (lua_istable (L, 4))
+    {
+      lua_getfield (L, 4, "robin_hood");
+      if (lua_toboolean (L, -1))
+	minor |= OSBF_DB_ROBIN_HOOD;
+      lua_getfield (L, 4, "fingerprints");
+      if (lua_toboolean (L, -1))
+	minor |= OSBF_DB_FINGERPRINTS;
+      lua_getfield (L, 4, "bloom");
+      if (lua_toboolean (L, -1))
+	minor |= OSBF_DB_BLOOM;
+      lua_pop (L, 3);
+    }
+  else if (lua_toboolean (L, 4))
+    minor |= OSBF_DB_ROBIN_HOOD;
+
+  if (minor != 0 && mc_classes > 1)
+    return luaL_argerror (L, 4, "not supported in multi-class databases");
+  if ((minor & OSBF_DB_ROBIN_HOOD) && (minor & OSBF_DB_FINGERPRINTS))
+    return luaL_argerror (L, 4,
+			  "robin_hood and fingerprints can't be combined");
+
+  /* the names stay in the table while the files are created */
   lua_pushnil (L);		/* first key */
-  while (lua_next (L, 1) != 0)
+  for (i = 0; lua_next (L, 1) != 0; i++)
+    lua_pop (L, 1);
+  cfcnames = lua_newuserdata (L, (i + 1) * sizeof (const char *));
+  lua_pushnil (L);
+  for (i = 0; lua_next (L, 1) != 0; i++)
     {
-      cfcname = luaL_checkstring (L, -1);
+      cfcnames[i] = luaL_checkstring (L, -1);
       lua_pop (L, 1);
-
-      if (osbf_create_cfcfile (cfcname, buckets, OSBF_VERSION,
-			       minor, errmsg) != EXIT_SUCCESS)
-	{
-	  num_classes = -1;
-	  break;
-	}
     }
+  cfcnames[i] = NULL;
+
+  /* all files are created at once, in parallel */
+  if (osbf_create_files (cfcnames, buckets, mc_classes, minor, errmsg) !=
+      EXIT_SUCCESS)
+    num_classes = -1;
 
   if (num_classes >= 0)
     lua_pushnumber (L, (lua_Number) num_classes);
@@ -199,6 +329,285 @@ lua_osbf_createdb (lua_State * L)
 
 /**********************************************************/
 
+/* get the file names in the array at index "idx", in order */
+static uint32_t
+get_class_list (lua_State * L, int idx, const char *classes[])
+{
+  uint32_t i, num_classes;
+
+  luaL_checktype (L, idx, LUA_TTABLE);
+  num_classes = (uint32_t) lua_rawlen (L, idx);
+  if (num_classes > OSBF_MAX_CLASSES)
+    return luaL_error (L, "too many classes");
+  for (i = 0; i < num_classes; i++)
+    {
+      lua_rawgeti (L, idx, i + 1);
+      classes[i] = luaL_checkstring (L, -1);
+      /* the string is kept alive by the table */
+      lua_pop (L, 1);
+    }
+  classes[num_classes] = NULL;
+
+  return num_classes;
+}
+
+/**********************************************************/
+
+/* interleave single-class files into a new multi-class file */
+static int
+lua_osbf_interleavedb (lua_State * L)
+{
+  const char *classes[OSBF_MAX_CLASSES + 1];
+  const char *mcfile;
+  uint32_t num_buckets;
+  char errmsg[OSBF_ERROR_MESSAGE_LEN] = { '\0' };
+
+  mcfile = luaL_checkstring (L, 2);
+  num_buckets = luaL_optnumber (L, 3, 0);
+  if (get_class_list (L, 1, classes) < 2)
+    return luaL_error (L, "at least two classes must be given");
+
+  if (osbf_interleave (classes, mcfile, num_buckets, errmsg) == 0)
+    {
+      lua_pushboolean (L, 1);
+      return 1;
+    }
+  else
+    {
+      lua_pushnil (L);
+      lua_pushstring (L, errmsg);
+      return 2;
+    }
+}
+
+/**********************************************************/
+
+/* split a multi-class file into new single-class files */
+static int
+lua_osbf_splitdb (lua_State * L)
+{
+  const char *classes[OSBF_MAX_CLASSES + 1];
+  const char *mcfile;
+  char errmsg[OSBF_ERROR_MESSAGE_LEN] = { '\0' };
+
+  mcfile = luaL_checkstring (L, 1);
+  get_class_list (L, 2, classes);
+
+  if (osbf_split (mcfile, classes, errmsg) == 0)
+    {
+      lua_pushboolean (L, 1);
+      return 1;
+    }
+  else
+    {
+      lua_pushnil (L);
+      lua_pushstring (L, errmsg);
+      return 2;
+    }
+}
+
+/**********************************************************/
+
+/* convert a single-class file to the standard or packed format,   */
+/* optionally adding or removing the fingerprints and Bloom filter */
+static int
+lua_osbf_convertdb (lua_State * L)
+{
+  static const char *const formats[] = { "packed", "standard", NULL };
+  static const uint32_t versions[] = { OSBF_PACKED_VERSION, OSBF_VERSION };
+  static const char *const options[] = { "fingerprints", "bloom", NULL };
+  static const uint32_t option_flags[] = { OSBF_DB_FINGERPRINTS,
+    OSBF_DB_BLOOM
+  };
+  const char *from, *to;
+  int format, i;
+  uint32_t db_flags = 0, flags_mask = 0;
+  char errmsg[OSBF_ERROR_MESSAGE_LEN] = { '\0' };
+
+  from = luaL_checkstring (L, 1);
+  to = luaL_checkstring (L, 2);
+  format = luaL_checkoption (L, 3, "packed", formats);
+
+  /* a table with the fields fingerprints and bloom, or just a */
+  /* boolean for fingerprints. nil fields are kept as they are */
+  if (lua_istable (L, 4))
+    {
+      for (i = 0; options[i] != NULL; i++)
+	{
+	  lua_getfield (L, 4, options[i]);
+	  if (!lua_isnil (L, -1))
+	    {
+	      flags_mask |= option_flags[i];
+	      if (lua_toboolean (L, -1))
+		db_flags |= option_flags[i];
+	    }
+	  lua_pop (L, 1);
+	}
+    }
+  else if (!lua_isnoneornil (L, 4))
+    {
+      flags_mask = OSBF_DB_FINGERPRINTS;
+      if (lua_toboolean (L, 4))
+	db_flags = OSBF_DB_FINGERPRINTS;
+    }
+
+  if (osbf_convert (from, to, versions[format], db_flags, flags_mask,
+		    errmsg) == 0)
+    {
+      lua_pushboolean (L, 1);
+      return 1;
+    }
+  else
+    {
+      lua_pushnil (L);
+      lua_pushstring (L, errmsg);
+      return 2;
+    }
+}
+
+/**********************************************************/
+
+/* rehash the files of the classes into files with new_buckets buckets */
+static int
+lua_osbf_resizedb (lua_State * L)
+{
+  const char *classes[OSBF_MAX_CLASSES + 1];
+  uint32_t num_buckets;
+  char errmsg[OSBF_ERROR_MESSAGE_LEN] = { '\0' };
+
+  get_class_list (L, 1, classes);
+  num_buckets = luaL_checknumber (L, 2);
+
+  if (osbf_resize_files (classes, num_buckets, errmsg) == 0)
+    {
+      lua_pushboolean (L, 1);
+      return 1;
+    }
+  else
+    {
+      lua_pushnil (L);
+      lua_pushstring (L, errmsg);
+      return 2;
+    }
+}
+
+/**********************************************************/
+
+/* file lock statistics of the process, reset if the arg is true */
+static int
+lua_osbf_lock_stats (lua_State * L)
+{
+  LOCK_STATS_STRUCT stats;
+
+  osbf_lock_stats (&stats, lua_toboolean (L, 1));
+
+  lua_newtable (L);
+
+  lua_pushliteral (L, "locks");
+  lua_pushnumber (L, (lua_Number) stats.locks);
+  lua_settable (L, -3);
+
+  lua_pushliteral (L, "contended");
+  lua_pushnumber (L, (lua_Number) stats.contended);
+  lua_settable (L, -3);
+
+  lua_pushliteral (L, "timeouts");
+  lua_pushnumber (L, (lua_Number) stats.timeouts);
+  lua_settable (L, -3);
+
+  /* in milliseconds */
+  lua_pushliteral (L, "wait");
+  lua_pushnumber (L, (lua_Number) stats.wait_ns / 1e6);
+  lua_settable (L, -3);
+
+  lua_pushliteral (L, "max_wait");
+  lua_pushnumber (L, (lua_Number) stats.max_wait_ns / 1e6);
+  lua_settable (L, -3);
+
+  lua_pushliteral (L, "read_retries");
+  lua_pushnumber (L, (lua_Number) stats.read_retries);
+  lua_settable (L, -3);
+
+  return 1;
+}
+
+/**********************************************************/
+
+/* durability statistics of the process, reset if the arg is true */
+static int
+lua_osbf_sync_stats (lua_State * L)
+{
+  SYNC_STATS_STRUCT stats;
+  double learnings;
+
+  osbf_sync_stats (&stats, lua_toboolean (L, 1));
+  learnings = stats.learnings > 0 ? (double) stats.learnings : 1;
+
+  lua_newtable (L);
+
+  lua_pushliteral (L, "learnings");
+  lua_pushnumber (L, (lua_Number) stats.learnings);
+  lua_settable (L, -3);
+
+  lua_pushliteral (L, "syncs");
+  lua_pushnumber (L, (lua_Number) stats.syncs);
+  lua_settable (L, -3);
+
+  lua_pushliteral (L, "pages");
+  lua_pushnumber (L, (lua_Number) stats.pages);
+  lua_settable (L, -3);
+
+  lua_pushliteral (L, "touches");
+  lua_pushnumber (L, (lua_Number) stats.touches);
+  lua_settable (L, -3);
+
+  /* in milliseconds */
+  lua_pushliteral (L, "time");
+  lua_pushnumber (L, (lua_Number) stats.sync_ns / 1e6);
+  lua_settable (L, -3);
+
+  /* per training */
+  lua_pushliteral (L, "syscalls_per_learning");
+  lua_pushnumber (L, (lua_Number) (stats.syncs + stats.touches) /
+		  learnings);
+  lua_settable (L, -3);
+
+  lua_pushliteral (L, "time_per_learning");
+  lua_pushnumber (L, (lua_Number) stats.sync_ns / 1e6 / learnings);
+  lua_settable (L, -3);
+
+  return 1;
+}
+
+/**********************************************************/
+
+/* compile the classes into a read-only frozen file */
+static int
+lua_osbf_freeze (lua_State * L)
+{
+  const char *classes[OSBF_MAX_CLASSES + 1];
+  const char *frozenfile;
+  char errmsg[OSBF_ERROR_MESSAGE_LEN] = { '\0' };
+
+  frozenfile = luaL_checkstring (L, 2);
+  if (get_class_list (L, 1, classes) < 1)
+    return luaL_error (L, "at least one class must be given");
+
+  if (osbf_freeze (classes, frozenfile, errmsg) == 0)
+    {
+      lua_pushboolean (L, 1);
+      return 1;
+    }
+  else
+    {
+      lua_pushnil (L);
+      lua_pushstring (L, errmsg);
+      return 2;
+    }
+}
+
+/**********************************************************/
+
 /* removes all classes (files) in a database */
 /* returns the number of files removed or error */
 /* and the number of the last file removed */
@@ -250,35 +659,15 @@ lua_osbf_removedb (lua_State * L)
 
 /**********************************************************/
 
-static int
-lua_osbf_classify (lua_State * L)
+/* extract the class names from the db table at index "idx" */
+static unsigned
+get_dbset_classes (lua_State * L, int idx, const char *classes[])
 {
-  const unsigned char *text;
-  size_t text_len;
-  const char *delimiters;	/* extra token delimiters */
-  size_t delimiters_len;
-  const char *classes[OSBF_MAX_CLASSES + 1];	/* set of classes */
-  unsigned ncfs;		/* defines a partition with 2 subsets of the set    */
-  /* "classes". The first "ncfs" classes form the  */
-  /* first subset. The others form the second one.          */
-  uint32_t flags = 0;		/* default value */
-  double min_p_ratio;		/* min pmax/p,in ratio */
-  /* class probabilities are returned in p_classes */
-  double p_classes[OSBF_MAX_CLASSES];
-  uint32_t p_trainings[OSBF_MAX_CLASSES];
-  char errmsg[OSBF_ERROR_MESSAGE_LEN] = { '\0' };
-  unsigned i, i_pmax, num_classes;
-  double p_first_subset, p_second_subset;
-
-  /* get text pointer and text len */
-  text = (unsigned char *) luaL_checklstring (L, 1, &text_len);
-
-  /* check if the second arg is a table */
-  luaL_checktype (L, 2, LUA_TTABLE);
+  unsigned num_classes;
 
   /* extract the class table from inside the db table */
   lua_pushstring (L, key_classes);
-  lua_gettable (L, 2);
+  lua_gettable (L, idx);
 
   /* extract the classes */
   /* check if the arg in the top is a table */
@@ -296,330 +685,1338 @@ lua_osbf_classify (lua_State * L)
   if (num_classes < 1)
     return luaL_error (L, "at least one class must be given");
 
-  /* extract the number of classes in the first subset */
+  return num_classes;
+}
+
+/**********************************************************/
+
+/*
+ * compute pR, log10 of the ratio between the sum of the
+ * probabilities in the first subset and the sum of the
+ * probabilities in the second one, and find the class with
+ * highest probability.
+ */
+static double
+classify_pR (double p_classes[], unsigned num_classes, unsigned ncfs,
+	     unsigned *i_pmax)
+{
+  unsigned i;
+  double p_first_subset, p_second_subset;
+
+  *i_pmax = 0;
+  p_first_subset = p_second_subset = 10 * DBL_MIN;
+  for (i = 0; i < num_classes; i++)
+    {
+      if (p_classes[i] > p_classes[*i_pmax])
+	*i_pmax = i;
+      if (i < ncfs)
+	p_first_subset += p_classes[i];
+      else
+	p_second_subset += p_classes[i];
+    }
+
+  return pR_SCF * log10 (p_first_subset / p_second_subset);
+}
+
+/**********************************************************/
+
+/* push the values returned by a classification */
+static int
+push_classify_results (lua_State * L, double p_classes[],
+		       uint32_t p_trainings[], unsigned num_classes,
+		       unsigned ncfs)
+{
+  unsigned i, i_pmax;
+
+  /* return pR */
+  lua_pushnumber (L, (lua_Number) classify_pR (p_classes, num_classes,
+					       ncfs, &i_pmax));
+
+  lua_newtable (L);
+  for (i = 0; i < num_classes; i++)
+    {
+      lua_pushnumber (L, (lua_Number) p_classes[i]);
+      lua_rawseti (L, -2, i + 1);
+    }
+
+  /* return index to the class with highest probability */
+  lua_pushnumber (L, (lua_Number) i_pmax + 1);
+
+  /* push table with number of trainings per class */
+  lua_newtable (L);
+  for (i = 0; i < num_classes; i++)
+    {
+      lua_pushnumber (L, (lua_Number) p_trainings[i]);
+      lua_rawseti (L, -2, i + 1);
+    }
+
+  return 4;
+}
+
+/**********************************************************/
+
+static int
+lua_osbf_classify (lua_State * L)
+{
+  const unsigned char *text;
+  size_t text_len;
+  const char *delimiters;	/* extra token delimiters */
+  size_t delimiters_len;
+  const char *classes[OSBF_MAX_CLASSES + 1];	/* set of classes */
+  unsigned ncfs;		/* defines a partition with 2 subsets of the set    */
+  /* "classes". The first "ncfs" classes form the  */
+  /* first subset. The others form the second one.          */
+  uint32_t flags = 0;		/* default value */
+  double min_p_ratio;		/* min pmax/p,in ratio */
+  /* class probabilities are returned in p_classes */
+  double p_classes[OSBF_MAX_CLASSES];
+  uint32_t p_trainings[OSBF_MAX_CLASSES];
+  char errmsg[OSBF_ERROR_MESSAGE_LEN] = { '\0' };
+  unsigned num_classes;
+
+  /* get text pointer and text len */
+  text = (unsigned char *) luaL_checklstring (L, 1, &text_len);
+
+  /* check if the second arg is a table */
+  luaL_checktype (L, 2, LUA_TTABLE);
+  num_classes = get_dbset_classes (L, 2, classes);
+
+  /* extract the number of classes in the first subset */
+
+  lua_pushstring (L, key_ncfs);
+  lua_gettable (L, 2);
+  ncfs = luaL_checknumber (L, -1);
+  lua_pop (L, 1);
+  if (ncfs > num_classes)
+    ncfs = num_classes;
+
+  /* extract the extra token delimiters */
+  lua_pushstring (L, key_delimiters);
+  lua_gettable (L, 2);
+  delimiters = luaL_checklstring (L, -1, &delimiters_len);
+  lua_pop (L, 1);
+
+  /* extract flags, if any */
+  flags = (uint32_t) luaL_optnumber (L, 3, 0);
+  /* extract p_min_ratio if any */
+  min_p_ratio = (double) luaL_optnumber (L, 4, OSBF_MIN_PMAX_PMIN_RATIO);
+
+  /* call osbf_classify */
+  if (osbf_bayes_classify (text, text_len, delimiters, classes,
+			   flags, min_p_ratio, p_classes, p_trainings,
+			   errmsg) < 0)
+    {
+      lua_pushnil (L);
+      lua_pushstring (L, errmsg);
+      return 2;
+    }
+  else
+    return push_classify_results (L, p_classes, p_trainings, num_classes,
+				  ncfs);
+}
+
+/**********************************************************/
+
+/*
+ * Get the texts of the array at index "idx". The arrays of text
+ * pointers and lengths are userdata left on the stack, so they are
+ * collected even if an error is raised.
+ */
+static uint32_t
+get_batch_texts (lua_State * L, int idx, const unsigned char ***texts,
+		 unsigned long **text_lens)
+{
+  uint32_t i, num_texts;
+  size_t len;
+
+  luaL_checktype (L, idx, LUA_TTABLE);
+  num_texts = (uint32_t) lua_rawlen (L, idx);
+  *texts = lua_newuserdata (L, num_texts * sizeof (unsigned char *) + 1);
+  *text_lens = lua_newuserdata (L, num_texts * sizeof (unsigned long) + 1);
+  for (i = 0; i < num_texts; i++)
+    {
+      lua_rawgeti (L, idx, i + 1);
+      if (lua_type (L, -1) != LUA_TSTRING)
+	return luaL_error (L, "text %d of the batch is not a string",
+			   (int) i + 1);
+      /* the string is kept alive by the array */
+      (*texts)[i] = (const unsigned char *) lua_tolstring (L, -1, &len);
+      (*text_lens)[i] = len;
+      lua_pop (L, 1);
+    }
+
+  return num_texts;
+}
+
+/**********************************************************/
+
+/*
+ * push the values returned by a batch classification: arrays with
+ * the pR, the table of class probabilities and the index of the
+ * class with highest probability of each text, and the table with
+ * the number of trainings per class.
+ */
+static int
+push_batch_results (lua_State * L, double ptc[], uint32_t p_trainings[],
+		    uint32_t num_texts, unsigned num_classes, unsigned ncfs)
+{
+  uint32_t i;
+  unsigned k, i_pmax;
+  double *p_classes;
+
+  lua_createtable (L, num_texts, 0);	/* pR */
+  lua_createtable (L, num_texts, 0);	/* class probabilities */
+  lua_createtable (L, num_texts, 0);	/* class with max probability */
+  for (i = 0; i < num_texts; i++)
+    {
+      p_classes = &ptc[i * num_classes];
+      lua_pushnumber (L, (lua_Number) classify_pR (p_classes, num_classes,
+						   ncfs, &i_pmax));
+      lua_rawseti (L, -4, i + 1);
+
+      lua_createtable (L, num_classes, 0);
+      for (k = 0; k < num_classes; k++)
+	{
+	  lua_pushnumber (L, (lua_Number) p_classes[k]);
+	  lua_rawseti (L, -2, k + 1);
+	}
+      lua_rawseti (L, -3, i + 1);
+
+      lua_pushnumber (L, (lua_Number) i_pmax + 1);
+      lua_rawseti (L, -2, i + 1);
+    }
+
+  /* push table with number of trainings per class */
+  lua_newtable (L);
+  for (k = 0; k < num_classes; k++)
+    {
+      lua_pushnumber (L, (lua_Number) p_trainings[k]);
+      lua_rawseti (L, -2, k + 1);
+    }
+
+  return 4;
+}
+
+/**********************************************************/
+
+/*
+ * Classify an array of texts, opening the classes only once.
+ * osbf.classify_batch(texts, dbset [, flags [, min_p_ratio
+ *                     [, num_threads]]])
+ */
+static int
+lua_osbf_classify_batch (lua_State * L)
+{
+  const unsigned char **texts;
+  unsigned long *text_lens;
+  uint32_t num_texts;
+  const char *delimiters;	/* extra token delimiters */
+  const char *classes[OSBF_MAX_CLASSES + 1];	/* set of classes */
+  unsigned ncfs, num_classes;
+  uint32_t flags, num_workers;
+  double min_p_ratio;
+  double *ptc;
+  uint32_t p_trainings[OSBF_MAX_CLASSES];
+  DBSET_STRUCT dbset;
+  char errmsg[OSBF_ERROR_MESSAGE_LEN] = { '\0' };
+  int err;
+
+  luaL_checktype (L, 2, LUA_TTABLE);
+  num_classes = get_dbset_classes (L, 2, classes);
+
+  lua_pushstring (L, key_ncfs);
+  lua_gettable (L, 2);
+  ncfs = luaL_checknumber (L, -1);
+  lua_pop (L, 1);
+  if (ncfs > num_classes)
+    ncfs = num_classes;
+
+  lua_pushstring (L, key_delimiters);
+  lua_gettable (L, 2);
+  delimiters = luaL_checkstring (L, -1);
+  lua_pop (L, 1);
+
+  flags = (uint32_t) luaL_optnumber (L, 3, 0);
+  min_p_ratio = (double) luaL_optnumber (L, 4, OSBF_MIN_PMAX_PMIN_RATIO);
+  num_workers = (uint32_t) luaL_optnumber (L, 5, 1);
+
+  /* the optional args must be read before pushing the arrays */
+  num_texts = get_batch_texts (L, 1, &texts, &text_lens);
+  ptc = lua_newuserdata (L, num_texts * num_classes * sizeof (double) + 1);
+
+  if (osbf_open_dbset (&dbset, classes, delimiters, O_RDONLY, errmsg) != 0)
+    {
+      lua_pushnil (L);
+      lua_pushstring (L, errmsg);
+      return 2;
+    }
+
+  err = osbf_bayes_classify_batch (&dbset, num_texts, texts, text_lens,
+				   flags, min_p_ratio, num_workers, ptc,
+				   p_trainings, errmsg);
+  osbf_close_dbset (&dbset, errmsg);
+  if (err < 0)
+    {
+      lua_pushnil (L);
+      lua_pushstring (L, errmsg);
+      return 2;
+    }
+
+  return push_batch_results (L, ptc, p_trainings, num_texts, num_classes,
+			     ncfs);
+}
+
+/**********************************************************/
+
+static int
+osbf_train (lua_State * L, int sense)
+{
+  const unsigned char *text;
+  size_t text_len;
+  const char *delimiters;	/* extra token delimiters */
+  size_t delimiters_len;
+  const char *classes[OSBF_MAX_CLASSES + 1];
+  size_t ctbt;			/* index of the class to be trained */
+  uint32_t flags = 0;		/* default value */
+  const char *journal;		/* journal to append the training to */
+  char errmsg[OSBF_ERROR_MESSAGE_LEN] = { '\0' };
+  int err;
+
+  /* get text pointer and text len */
+  text = (unsigned char *) luaL_checklstring (L, 1, &text_len);
+
+  /* check if the second arg is a table */
+  luaL_checktype (L, 2, LUA_TTABLE);
+  get_dbset_classes (L, 2, classes);
+
+  /* extract the extra token delimiters */
+  lua_pushstring (L, key_delimiters);
+  lua_gettable (L, 2);
+  delimiters = luaL_checklstring (L, -1, &delimiters_len);
+  lua_pop (L, 1);
+
+  /* get the index of the class to be trained */
+  ctbt = luaL_checknumber (L, 3) - 1;
+
+  /* get flags  */
+  if (lua_isnumber (L, 4))
+    flags = (uint32_t) luaL_checknumber (L, 4);
+
+  journal = luaL_optstring (L, 5, NULL);
+
+  if (journal != NULL)
+    err = osbf_journal_learn (journal, text, text_len, delimiters, classes,
+			      ctbt, sense, flags, errmsg);
+  else
+    err = osbf_bayes_learn (text, text_len, delimiters, classes,
+			    ctbt, sense, flags, errmsg);
+  if (err < 0)
+    {
+      lua_pushnil (L);
+      lua_pushstring (L, errmsg);
+      return 2;
+    }
+  else
+    {
+      lua_pushboolean (L, 1);
+      return 1;
+    }
+}
+
+/**********************************************************/
+
+static int
+lua_osbf_learn (lua_State * L)
+{
+  return osbf_train (L, 1);
+}
+
+/**********************************************************/
+
+static int
+lua_osbf_unlearn (lua_State * L)
+{
+  return osbf_train (L, -1);
+}
+
+/**********************************************************/
+
+static int
+lua_osbf_apply_journal (lua_State * L)
+{
+  const char *journal;
+  uint32_t applied = 0;
+  char errmsg[OSBF_ERROR_MESSAGE_LEN];
+
+  journal = luaL_checkstring (L, 1);
+
+  if (osbf_apply_journal (journal, &applied, errmsg) == 0)
+    {
+      lua_pushnumber (L, (lua_Number) applied);
+      return 1;
+    }
+  else
+    {
+      lua_pushnil (L);
+      lua_pushstring (L, errmsg);
+      lua_pushnumber (L, (lua_Number) applied);
+      return 3;
+    }
+}
+
+/**********************************************************/
+
+/* formats of osbf.dump and osbf.restore */
+static const char *const dump_formats[] = { "csv", "binary", NULL };
+
+static int
+lua_osbf_dump (lua_State * L)
+{
+  const char *cfcfile, *dumpfile;
+  char errmsg[OSBF_ERROR_MESSAGE_LEN];
+  int error;
+
+  cfcfile = luaL_checkstring (L, 1);
+  dumpfile = luaL_checkstring (L, 2);
+
+  if (luaL_checkoption (L, 3, "csv", dump_formats) == 0)
+    error = osbf_dump (cfcfile, dumpfile, errmsg);
+  else
+    error = osbf_dump_binary (cfcfile, dumpfile, errmsg);
+
+  if (error == 0)
+    {
+      lua_pushboolean (L, 1);
+      return 1;
+    }
+  else
+    {
+      lua_pushnil (L);
+      lua_pushstring (L, errmsg);
+      return 2;
+    }
+}
+
+/**********************************************************/
+
+static int
+lua_osbf_restore (lua_State * L)
+{
+  const char *cfcfile, *dumpfile;
+  char errmsg[OSBF_ERROR_MESSAGE_LEN];
+  int error;
+
+  cfcfile = luaL_checkstring (L, 1);
+  dumpfile = luaL_checkstring (L, 2);
+
+  if (luaL_checkoption (L, 3, "csv", dump_formats) == 0)
+    error = osbf_restore (cfcfile, dumpfile, errmsg);
+  else
+    error = osbf_restore_binary (cfcfile, dumpfile, errmsg);
+
+  if (error == 0)
+    {
+      lua_pushboolean (L, 1);
+      return 1;
+    }
+  else
+    {
+      lua_pushnil (L);
+      lua_pushstring (L, errmsg);
+      return 2;
+    }
+}
+
+/**********************************************************/
+
+/*
+ * Get the source files of an import, the file name or array of file
+ * names at index idx, as a NULL terminated array, kept in a userdata
+ * left on the stack.
+ */
+static const char **
+get_import_sources (lua_State * L, int idx)
+{
+  const char **sources;
+  uint32_t i, num_sources;
+
+  if (lua_type (L, idx) == LUA_TSTRING)
+    {
+      sources = lua_newuserdata (L, 2 * sizeof (const char *));
+      sources[0] = lua_tostring (L, idx);
+      sources[1] = NULL;
+      return sources;
+    }
+
+  luaL_checktype (L, idx, LUA_TTABLE);
+  num_sources = (uint32_t) lua_rawlen (L, idx);
+  if (num_sources == 0)
+    luaL_error (L, "no source files to import");
+  sources = lua_newuserdata (L, (num_sources + 1) * sizeof (const char *));
+  for (i = 0; i < num_sources; i++)
+    {
+      lua_rawgeti (L, idx, i + 1);
+      sources[i] = luaL_checkstring (L, -1);
+      /* the string is kept alive by the table */
+      lua_pop (L, 1);
+    }
+  sources[num_sources] = NULL;
+
+  return sources;
+}
+
+/*
+ * osbf.import (to_dbfile, from_dbfile | {from_dbfiles}) or
+ * osbf.import ({to_dbfiles}, {from_dbfile | {from_dbfiles}, ...}),
+ * which imports into the classes of a dbset in parallel.
+ */
+static int
+lua_osbf_import (lua_State * L)
+{
+  const char *files[OSBF_MAX_CLASSES + 1];
+  const char **sources[OSBF_MAX_CLASSES];
+  char errmsg[OSBF_ERROR_MESSAGE_LEN] = { '\0' };
+  int i, num_files, error;
+
+  if (lua_istable (L, 1))
+    {
+      num_files = get_class_list (L, 1, files);
+      luaL_checktype (L, 2, LUA_TTABLE);
+      if ((int) lua_rawlen (L, 2) != num_files)
+	return luaL_error (L, "sources must be given for each class");
+      luaL_checkstack (L, num_files + 2, "too many classes");
+      for (i = 0; i < num_files; i++)
+	{
+	  lua_rawgeti (L, 2, i + 1);
+	  sources[i] = get_import_sources (L, lua_gettop (L));
+	  /* the userdata stays on the stack, the table keeps the rest */
+	  lua_remove (L, -2);
+	}
+      error = osbf_import_files (files, sources, errmsg);
+    }
+  else
+    error = osbf_import_sources (luaL_checkstring (L, 1),
+				 get_import_sources (L, 2), errmsg);
+
+  if (error == 0)
+    {
+      lua_pushboolean (L, 1);
+      return 1;
+    }
+  else
+    {
+      lua_pushnil (L);
+      lua_pushstring (L, errmsg);
+      return 2;
+    }
+}
+
+/**********************************************************/
+
+/* push a table with the statistics of a class */
+static void
+push_stats (lua_State * L, STATS_STRUCT * stats, int full)
+{
+  lua_newtable (L);
+
+  lua_pushliteral (L, "version");
+  lua_pushnumber (L, (lua_Number) stats->version);
+  lua_settable (L, -3);
+
+  lua_pushliteral (L, "buckets");
+  lua_pushnumber (L, (lua_Number) stats->total_buckets);
+  lua_settable (L, -3);
+
+  lua_pushliteral (L, "bucket_size");
+  lua_pushnumber (L, (lua_Number) stats->bucket_size);
+  lua_settable (L, -3);
+
+  lua_pushliteral (L, "header_size");
+  lua_pushnumber (L, (lua_Number) stats->header_size);
+  lua_settable (L, -3);
+
+  lua_pushliteral (L, "learnings");
+  lua_pushnumber (L, (lua_Number) stats->learnings);
+  lua_settable (L, -3);
+
+  lua_pushliteral (L, "extra_learnings");
+  lua_pushnumber (L, (lua_Number) stats->extra_learnings);
+  lua_settable (L, -3);
+
+  lua_pushliteral (L, "mistakes");
+  lua_pushnumber (L, (lua_Number) stats->mistakes);
+  lua_settable (L, -3);
+
+  lua_pushliteral (L, "classifications");
+  lua_pushnumber (L, (lua_Number) stats->classifications);
+  lua_settable (L, -3);
+
+  lua_pushliteral (L, "classes");
+  lua_pushnumber (L, (lua_Number) stats->num_classes);
+  lua_settable (L, -3);
+
+  lua_pushliteral (L, "robin_hood");
+  lua_pushboolean (L, (stats->db_flags & OSBF_DB_ROBIN_HOOD) != 0);
+  lua_settable (L, -3);
+
+  lua_pushliteral (L, "fingerprints");
+  lua_pushboolean (L, (stats->db_flags & OSBF_DB_FINGERPRINTS) != 0);
+  lua_settable (L, -3);
+
+  lua_pushliteral (L, "bloom");
+  lua_pushboolean (L, (stats->db_flags & OSBF_DB_BLOOM) != 0);
+  lua_settable (L, -3);
+
+  if (full == 1)
+    {
+      lua_pushliteral (L, "chains");
+      lua_pushnumber (L, (lua_Number) stats->num_chains);
+      lua_settable (L, -3);
+
+      lua_pushliteral (L, "max_chain");
+      lua_pushnumber (L, (lua_Number) stats->max_chain);
+      lua_settable (L, -3);
+
+      lua_pushliteral (L, "avg_chain");
+      lua_pushnumber (L, (lua_Number) stats->avg_chain);
+      lua_settable (L, -3);
+
+      lua_pushliteral (L, "max_displacement");
+      lua_pushnumber (L, (lua_Number) stats->max_displacement);
+      lua_settable (L, -3);
+
+      lua_pushliteral (L, "unreachable");
+      lua_pushnumber (L, (lua_Number) stats->unreachable);
+      lua_settable (L, -3);
+
+      lua_pushliteral (L, "used_buckets");
+      lua_pushnumber (L, (lua_Number) stats->used_buckets);
+      lua_settable (L, -3);
+
+      lua_pushliteral (L, "use");
+      if (stats->total_buckets > 0)
+	lua_pushnumber (L, (lua_Number) ((double) stats->used_buckets /
+					 stats->total_buckets));
+      else
+	lua_pushnumber (L, (lua_Number) 100);
+      lua_settable (L, -3);
+
+      /* fraction of the fingerprints checked by lookups of the */
+      /* used buckets that match another key                    */
+      if (stats->db_flags & OSBF_DB_FINGERPRINTS)
+	{
+	  lua_pushliteral (L, "fingerprint_false_positives");
+	  lua_pushnumber (L, (lua_Number) (stats->fingerprint_probes > 0 ?
+					   (double)
+					   stats->fingerprint_false_hits /
+					   stats->fingerprint_probes : 0));
+	  lua_settable (L, -3);
+	}
+
+      /* freed buckets still in the Bloom filter, and the */
+      /* estimated rate of false positives of new features */
+      if (stats->db_flags & OSBF_DB_BLOOM)
+	{
+	  lua_pushliteral (L, "bloom_stale");
+	  lua_pushnumber (L, (lua_Number) stats->bloom_stale);
+	  lua_settable (L, -3);
+
+	  lua_pushliteral (L, "bloom_false_positives");
+	  lua_pushnumber (L, (lua_Number) stats->bloom_false_positives);
+	  lua_settable (L, -3);
+	}
+    }
+}
+
+/**********************************************************/
+
+static int
+lua_osbf_stats (lua_State * L)
+{
+
+  const char *cfcfile;
+  STATS_STRUCT class;
+  char errmsg[OSBF_ERROR_MESSAGE_LEN];
+  int full = 1;
+  uint32_t column;
+
+  cfcfile = luaL_checkstring (L, 1);
+  if (lua_isboolean (L, 2))
+    {
+      full = lua_toboolean (L, 2);
+    }
+  /* class of a multi-class file, starting at 1 */
+  column = luaL_optnumber (L, 3, 1);
+  if (column < 1)
+    return luaL_argerror (L, 3, "class index must be >= 1");
+
+  if (osbf_stats (cfcfile, column - 1, &class, errmsg, full) == 0)
+    {
+      push_stats (L, &class, full);
+      return 1;
+    }
+  else
+    {
+      lua_pushnil (L);
+      lua_pushstring (L, errmsg);
+      return 2;
+    }
+}
+
+/**********************************************************/
+/* Persistent database set handles                        */
+/**********************************************************/
+
+#define DBSET_HANDLE_MT "OSBF.dbset"
+
+typedef struct
+{
+  unsigned ncfs;		/* number of classes in the first subset */
+  DBSET_STRUCT dbset;
+} DBSET_HANDLE;
+
+static DBSET_HANDLE *
+check_dbset_handle (lua_State * L)
+{
+  DBSET_HANDLE *h = (DBSET_HANDLE *) luaL_checkudata (L, 1, DBSET_HANDLE_MT);
+
+  if (h->dbset.num_classes == 0)
+    luaL_error (L, "attempt to use a closed database set");
+  return h;
+}
+
+/**********************************************************/
+
+/*
+ * Open all classes of a dbset and keep them mapped until the
+ * returned handle is closed or collected. mode is "r" (default)
+ * or "rw", the latter needed for learn and unlearn.
+ */
+static int
+lua_osbf_open (lua_State * L)
+{
+  const char *classes[OSBF_MAX_CLASSES + 1];
+  const char *delimiters;
+  const char *mode;
+  unsigned num_classes, ncfs;
+  DBSET_HANDLE *h;
+  char errmsg[OSBF_ERROR_MESSAGE_LEN] = { '\0' };
+
+  luaL_checktype (L, 1, LUA_TTABLE);
+  num_classes = get_dbset_classes (L, 1, classes);
+
+  lua_pushstring (L, key_ncfs);
+  lua_gettable (L, 1);
+  ncfs = luaL_checknumber (L, -1);
+  lua_pop (L, 1);
+  if (ncfs > num_classes)
+    ncfs = num_classes;
+
+  lua_pushstring (L, key_delimiters);
+  lua_gettable (L, 1);
+  delimiters = luaL_checkstring (L, -1);
+  lua_pop (L, 1);
+
+  mode = luaL_optstring (L, 2, "r");
+  if (strcmp (mode, "r") != 0 && strcmp (mode, "rw") != 0)
+    return luaL_error (L, "invalid mode '%s'", mode);
+
+  h = (DBSET_HANDLE *) lua_newuserdata (L, sizeof (DBSET_HANDLE));
+  h->ncfs = ncfs;
+  h->dbset.num_classes = 0;
+  luaL_getmetatable (L, DBSET_HANDLE_MT);
+  lua_setmetatable (L, -2);
+
+  if (osbf_open_dbset (&h->dbset, classes, delimiters,
+		       mode[1] == 'w' ? O_RDWR : O_RDONLY, errmsg) != 0)
+    {
+      lua_pushnil (L);
+      lua_pushstring (L, errmsg);
+      return 2;
+    }
+
+  return 1;
+}
+
+/**********************************************************/
+
+static int
+lua_dbset_classify (lua_State * L)
+{
+  DBSET_HANDLE *h = check_dbset_handle (L);
+  const unsigned char *text;
+  size_t text_len;
+  uint32_t flags;
+  double min_p_ratio;
+  double p_classes[OSBF_MAX_CLASSES];
+  uint32_t p_trainings[OSBF_MAX_CLASSES];
+  char errmsg[OSBF_ERROR_MESSAGE_LEN] = { '\0' };
+
+  text = (unsigned char *) luaL_checklstring (L, 2, &text_len);
+  flags = (uint32_t) luaL_optnumber (L, 3, 0);
+  min_p_ratio = (double) luaL_optnumber (L, 4, OSBF_MIN_PMAX_PMIN_RATIO);
+
+  if (osbf_bayes_classify_dbset (&h->dbset, text, text_len, flags,
+				 min_p_ratio, p_classes, p_trainings,
+				 errmsg) < 0)
+    {
+      lua_pushnil (L);
+      lua_pushstring (L, errmsg);
+      return 2;
+    }
+
+  return push_classify_results (L, p_classes, p_trainings,
+				h->dbset.num_classes, h->ncfs);
+}
+
+/**********************************************************/
+
+static int
+lua_dbset_classify_batch (lua_State * L)
+{
+  DBSET_HANDLE *h = check_dbset_handle (L);
+  const unsigned char **texts;
+  unsigned long *text_lens;
+  uint32_t num_texts, flags, num_workers;
+  double min_p_ratio;
+  double *ptc;
+  uint32_t p_trainings[OSBF_MAX_CLASSES];
+  char errmsg[OSBF_ERROR_MESSAGE_LEN] = { '\0' };
+
+  flags = (uint32_t) luaL_optnumber (L, 3, 0);
+  min_p_ratio = (double) luaL_optnumber (L, 4, OSBF_MIN_PMAX_PMIN_RATIO);
+  num_workers = (uint32_t) luaL_optnumber (L, 5, 1);
+  num_texts = get_batch_texts (L, 2, &texts, &text_lens);
+  ptc = lua_newuserdata (L, num_texts * h->dbset.num_classes *
+			 sizeof (double) + 1);
+
+  if (osbf_bayes_classify_batch (&h->dbset, num_texts, texts, text_lens,
+				 flags, min_p_ratio, num_workers, ptc,
+				 p_trainings, errmsg) < 0)
+    {
+      lua_pushnil (L);
+      lua_pushstring (L, errmsg);
+      return 2;
+    }
+
+  return push_batch_results (L, ptc, p_trainings, num_texts,
+			     h->dbset.num_classes, h->ncfs);
+}
+
+/**********************************************************/
+
+static int
+dbset_train (lua_State * L, int sense)
+{
+  DBSET_HANDLE *h = check_dbset_handle (L);
+  const unsigned char *text;
+  size_t text_len;
+  size_t ctbt;			/* index of the class to be trained */
+  uint32_t flags = 0;
+  char errmsg[OSBF_ERROR_MESSAGE_LEN] = { '\0' };
+
+  text = (unsigned char *) luaL_checklstring (L, 2, &text_len);
+  ctbt = luaL_checknumber (L, 3) - 1;
+  if (lua_isnumber (L, 4))
+    flags = (uint32_t) luaL_checknumber (L, 4);
+
+  if (osbf_bayes_learn_dbset (&h->dbset, text, text_len, ctbt, sense,
+			      flags, errmsg) < 0)
+    {
+      lua_pushnil (L);
+      lua_pushstring (L, errmsg);
+      return 2;
+    }
+
+  lua_pushboolean (L, 1);
+  return 1;
+}
+
+static int
+lua_dbset_learn (lua_State * L)
+{
+  return dbset_train (L, 1);
+}
+
+static int
+lua_dbset_unlearn (lua_State * L)
+{
+  return dbset_train (L, -1);
+}
+
+/**********************************************************/
 
-  lua_pushstring (L, key_ncfs);
-  lua_gettable (L, 2);
-  ncfs = luaL_checknumber (L, -1);
-  lua_pop (L, 1);
-  if (ncfs > num_classes)
-    ncfs = num_classes;
+/* page faults taken by this thread since the dbset was opened, */
+/* and while it was being opened                                 */
+static int
+lua_dbset_faults (lua_State * L)
+{
+  DBSET_HANDLE *h = check_dbset_handle (L);
+  long minflt, majflt;
+  uint32_t i, mlocked = 0;
+
+  osbf_page_faults (&minflt, &majflt);
+  for (i = 0; i < h->dbset.num_classes; i++)
+    mlocked += h->dbset.class[i].mlocked;
+
+  lua_newtable (L);
+  lua_pushnumber (L, (lua_Number) (minflt - h->dbset.minflt));
+  lua_setfield (L, -2, "minor");
+  lua_pushnumber (L, (lua_Number) (majflt - h->dbset.majflt));
+  lua_setfield (L, -2, "major");
+  lua_pushnumber (L, (lua_Number) h->dbset.open_minflt);
+  lua_setfield (L, -2, "open_minor");
+  lua_pushnumber (L, (lua_Number) h->dbset.open_majflt);
+  lua_setfield (L, -2, "open_major");
+  lua_pushnumber (L, (lua_Number) mlocked);
+  lua_setfield (L, -2, "mlocked");
+  return 1;
+}
 
-  /* extract the extra token delimiters */
-  lua_pushstring (L, key_delimiters);
-  lua_gettable (L, 2);
-  delimiters = luaL_checklstring (L, -1, &delimiters_len);
-  lua_pop (L, 1);
+/**********************************************************/
 
-  /* extract flags, if any */
-  flags = (uint32_t) luaL_optnumber (L, 3, 0);
-  /* extract p_min_ratio if any */
-  min_p_ratio = (double) luaL_optnumber (L, 4, OSBF_MIN_PMAX_PMIN_RATIO);
+static int
+lua_dbset_close (lua_State * L)
+{
+  DBSET_HANDLE *h = (DBSET_HANDLE *) luaL_checkudata (L, 1, DBSET_HANDLE_MT);
+  char errmsg[OSBF_ERROR_MESSAGE_LEN] = { '\0' };
 
-  /* call osbf_classify */
-  if (osbf_bayes_classify (text, text_len, delimiters, classes,
-			   flags, min_p_ratio, p_classes, p_trainings,
-			   errmsg) < 0)
+  if (h->dbset.num_classes > 0 && osbf_close_dbset (&h->dbset, errmsg) != 0)
     {
       lua_pushnil (L);
       lua_pushstring (L, errmsg);
       return 2;
     }
-  else
-    {
-      lua_newtable (L);
-      i_pmax = 0;
-      p_first_subset = p_second_subset = 10 * DBL_MIN;
-      for (i = 0; i < num_classes; i++)
-	{
-	  lua_pushnumber (L, (lua_Number) p_classes[i]);
-	  lua_rawseti (L, -2, i + 1);
-	  if (p_classes[i] > p_classes[i_pmax])
-	    i_pmax = i;
-	  if (i < ncfs)
-	    p_first_subset += p_classes[i];
-	  else
-	    p_second_subset += p_classes[i];
-	}
-
-      /*
-       * return pR, log10 of the ratio between the sum of the
-       * probabilities in the first subset and the sum of the
-       * probabilities in the second one.
-       */
-      lua_pushnumber (L,
-		      (lua_Number) pR_SCF *
-		      log10 (p_first_subset / p_second_subset));
-
-      /* exchange array and pR positions on the stack */
-      lua_insert (L, -2);
 
-      /* return index to the class with highest probability */
-      lua_pushnumber (L, (lua_Number) i_pmax + 1);
+  lua_pushboolean (L, 1);
+  return 1;
+}
 
-      /* push table with number of trainings per class */
-      lua_newtable (L);
-      for (i = 0; i < num_classes; i++)
-	{
-	  lua_pushnumber (L, (lua_Number) p_trainings[i]);
-	  lua_rawseti (L, -2, i + 1);
-	}
-    }
+static int
+dbset_gc (lua_State * L)
+{
+  DBSET_HANDLE *h = (DBSET_HANDLE *) lua_touserdata (L, 1);
+  char errmsg[OSBF_ERROR_MESSAGE_LEN];
 
-  return 4;
+  if (h && h->dbset.num_classes > 0)
+    osbf_close_dbset (&h->dbset, errmsg);
+  return 0;
 }
 
+static const struct luaL_Reg dbset_methods[] = {
+  {"classify", lua_dbset_classify},
+  {"classify_batch", lua_dbset_classify_batch},
+  {"learn", lua_dbset_learn},
+  {"unlearn", lua_dbset_unlearn},
+  {"faults", lua_dbset_faults},
+  {"close", lua_dbset_close},
+  {"__gc", dbset_gc},
+  {NULL, NULL}
+};
+
 /**********************************************************/
+/* Classification server and its clients                  */
+/**********************************************************/
+
+#define CLIENT_HANDLE_MT "OSBF.client"
 
+typedef struct
+{
+  int fd;			/* connection to the server, or -1 */
+} CLIENT_HANDLE;
+
+/*
+ * Serve the classes of a dbset on a Unix domain socket until a client
+ * asks the server to shut down. Doesn't return before that.
+ */
 static int
-osbf_train (lua_State * L, int sense)
+lua_osbf_serve (lua_State * L)
 {
-  const unsigned char *text;
-  size_t text_len;
-  const char *delimiters;	/* extra token delimiters */
-  size_t delimiters_len;
+  const char *socket_path;
   const char *classes[OSBF_MAX_CLASSES + 1];
-  int num_classes;
-  size_t ctbt;			/* index of the class to be trained */
-  uint32_t flags = 0;		/* default value */
+  const char *delimiters;
+  unsigned num_classes, ncfs;
+  uint32_t num_workers;
   char errmsg[OSBF_ERROR_MESSAGE_LEN] = { '\0' };
 
-  /* get text pointer and text len */
-  text = (unsigned char *) luaL_checklstring (L, 1, &text_len);
-
-  /* check if the second arg is a table */
+  socket_path = luaL_checkstring (L, 1);
   luaL_checktype (L, 2, LUA_TTABLE);
-  /* extract the class table from inside the db table */
-  lua_pushstring (L, key_classes);
-  lua_gettable (L, 2);
+  num_classes = get_dbset_classes (L, 2, classes);
 
-  /* extract the classes */
-  /* check if the arg in the top is a table */
-  luaL_checktype (L, -1, LUA_TTABLE);
-  lua_pushnil (L);
-  num_classes = 0;
-  while (num_classes < OSBF_MAX_CLASSES && lua_next (L, -2) != 0)
-    {
-      classes[num_classes++] = luaL_checkstring (L, -1);
-      lua_pop (L, 1);
-    }
-  classes[num_classes] = NULL;
-  /* remove last index of the class table and the table itself */
+  lua_pushstring (L, key_ncfs);
+  lua_gettable (L, 2);
+  ncfs = luaL_checknumber (L, -1);
   lua_pop (L, 1);
-  if (num_classes < 1)
-    return luaL_error (L, "at least one class must be given");
+  if (ncfs > num_classes)
+    ncfs = num_classes;
 
-  /* extract the extra token delimiters */
   lua_pushstring (L, key_delimiters);
   lua_gettable (L, 2);
-  delimiters = luaL_checklstring (L, -1, &delimiters_len);
+  delimiters = luaL_checkstring (L, -1);
   lua_pop (L, 1);
 
-  /* get the index of the class to be trained */
-  ctbt = luaL_checknumber (L, 3) - 1;
-
-  /* get flags  */
-  if (lua_isnumber (L, 4))
-    flags = (uint32_t) luaL_checknumber (L, 4);
+  num_workers = (uint32_t) luaL_optnumber (L, 3, OSBF_SERVER_WORKERS);
 
-  if (osbf_bayes_learn (text, text_len, delimiters, classes,
-			ctbt, sense, flags, errmsg) < 0)
+  if (osbf_serve (socket_path, classes, delimiters, ncfs, num_workers,
+		  errmsg) != 0)
     {
       lua_pushnil (L);
       lua_pushstring (L, errmsg);
       return 2;
     }
-  else
-    {
-      lua_pushboolean (L, 1);
-      return 1;
-    }
+
+  lua_pushboolean (L, 1);
+  return 1;
 }
 
 /**********************************************************/
 
-static int
-lua_osbf_learn (lua_State * L)
+static CLIENT_HANDLE *
+check_client_handle (lua_State * L)
 {
-  return osbf_train (L, 1);
-}
+  CLIENT_HANDLE *c = (CLIENT_HANDLE *) luaL_checkudata (L, 1,
+							CLIENT_HANDLE_MT);
 
-/**********************************************************/
+  if (c->fd < 0)
+    luaL_error (L, "attempt to use a closed connection");
+  return c;
+}
 
+/* connect to a server started with osbf.serve */
 static int
-lua_osbf_unlearn (lua_State * L)
+lua_osbf_connect (lua_State * L)
 {
-  return osbf_train (L, -1);
+  const char *socket_path;
+  CLIENT_HANDLE *c;
+  char errmsg[OSBF_ERROR_MESSAGE_LEN] = { '\0' };
+
+  socket_path = luaL_checkstring (L, 1);
+
+  c = (CLIENT_HANDLE *) lua_newuserdata (L, sizeof (CLIENT_HANDLE));
+  c->fd = -1;
+  luaL_getmetatable (L, CLIENT_HANDLE_MT);
+  lua_setmetatable (L, -2);
+
+  c->fd = osbf_connect (socket_path, errmsg);
+  if (c->fd < 0)
+    {
+      lua_pushnil (L);
+      lua_pushstring (L, errmsg);
+      return 2;
+    }
+
+  return 1;
 }
 
 /**********************************************************/
 
 static int
-lua_osbf_dump (lua_State * L)
+lua_client_classify (lua_State * L)
 {
-  const char *cfcfile, *csvfile;
-  char errmsg[OSBF_ERROR_MESSAGE_LEN];
+  CLIENT_HANDLE *c = check_client_handle (L);
+  OSBF_REQUEST_STRUCT req;
+  OSBF_REPLY_STRUCT reply;
+  size_t text_len;
+  const unsigned char *text;
+  /* probabilities, then trainings */
+  unsigned char result[OSBF_MAX_CLASSES * (sizeof (double) +
+					   sizeof (uint32_t))];
+  double p_classes[OSBF_MAX_CLASSES];
+  uint32_t p_trainings[OSBF_MAX_CLASSES];
+  char errmsg[OSBF_ERROR_MESSAGE_LEN] = { '\0' };
 
-  cfcfile = luaL_checkstring (L, 1);
-  csvfile = luaL_checkstring (L, 2);
+  memset (&req, 0, sizeof (req));
+  text = (unsigned char *) luaL_checklstring (L, 2, &text_len);
+  req.op = OSBF_OP_CLASSIFY;
+  req.text_len = (uint32_t) text_len;
+  req.flags = (uint32_t) luaL_optnumber (L, 3, 0);
+  req.min_pmax_pmin_ratio =
+    (double) luaL_optnumber (L, 4, OSBF_MIN_PMAX_PMIN_RATIO);
 
-  if (osbf_dump (cfcfile, csvfile, errmsg) == 0)
-    {
-      lua_pushboolean (L, 1);
-      return 1;
-    }
-  else
+  if (osbf_server_request (c->fd, &req, text, &reply, result,
+			   sizeof (result), errmsg) != 0)
     {
       lua_pushnil (L);
       lua_pushstring (L, errmsg);
       return 2;
     }
+  if (reply.num_classes > OSBF_MAX_CLASSES)
+    reply.num_classes = OSBF_MAX_CLASSES;
+  memcpy (p_classes, result, reply.num_classes * sizeof (double));
+  memcpy (p_trainings, result + reply.num_classes * sizeof (double),
+	  reply.num_classes * sizeof (uint32_t));
+
+  return push_classify_results (L, p_classes, p_trainings,
+				reply.num_classes, reply.ncfs);
 }
 
 /**********************************************************/
 
 static int
-lua_osbf_restore (lua_State * L)
+client_train (lua_State * L, int sense)
 {
-  const char *cfcfile, *csvfile;
-  char errmsg[OSBF_ERROR_MESSAGE_LEN];
+  CLIENT_HANDLE *c = check_client_handle (L);
+  OSBF_REQUEST_STRUCT req;
+  OSBF_REPLY_STRUCT reply;
+  size_t text_len;
+  const unsigned char *text;
+  char errmsg[OSBF_ERROR_MESSAGE_LEN] = { '\0' };
 
-  cfcfile = luaL_checkstring (L, 1);
-  csvfile = luaL_checkstring (L, 2);
+  memset (&req, 0, sizeof (req));
+  text = (unsigned char *) luaL_checklstring (L, 2, &text_len);
+  req.op = sense > 0 ? OSBF_OP_LEARN : OSBF_OP_UNLEARN;
+  req.text_len = (uint32_t) text_len;
+  req.class_idx = (uint32_t) luaL_checknumber (L, 3) - 1;
+  if (lua_isnumber (L, 4))
+    req.flags = (uint32_t) luaL_checknumber (L, 4);
 
-  if (osbf_restore (cfcfile, csvfile, errmsg) == 0)
-    {
-      lua_pushboolean (L, 1);
-      return 1;
-    }
-  else
+  if (osbf_server_request (c->fd, &req, text, &reply, NULL, 0, errmsg) != 0)
     {
       lua_pushnil (L);
       lua_pushstring (L, errmsg);
       return 2;
     }
+
+  lua_pushboolean (L, 1);
+  return 1;
+}
+
+static int
+lua_client_learn (lua_State * L)
+{
+  return client_train (L, 1);
+}
+
+static int
+lua_client_unlearn (lua_State * L)
+{
+  return client_train (L, -1);
 }
 
 /**********************************************************/
 
 static int
-lua_osbf_import (lua_State * L)
+lua_client_stats (lua_State * L)
 {
-  const char *cfcfile, *csvfile;
-  char errmsg[OSBF_ERROR_MESSAGE_LEN];
+  CLIENT_HANDLE *c = check_client_handle (L);
+  OSBF_REQUEST_STRUCT req;
+  OSBF_REPLY_STRUCT reply;
+  STATS_STRUCT stats;
+  int full = 1;
+  char errmsg[OSBF_ERROR_MESSAGE_LEN] = { '\0' };
 
-  cfcfile = luaL_checkstring (L, 1);
-  csvfile = luaL_checkstring (L, 2);
+  memset (&req, 0, sizeof (req));
+  req.op = OSBF_OP_STATS;
+  req.class_idx = (uint32_t) luaL_checknumber (L, 2) - 1;
+  if (lua_isboolean (L, 3))
+    full = lua_toboolean (L, 3);
+  req.flags = full;
 
-  if (osbf_import (cfcfile, csvfile, errmsg) == 0)
-    {
-      lua_pushboolean (L, 1);
-      return 1;
-    }
-  else
+  if (osbf_server_request (c->fd, &req, NULL, &reply, &stats,
+			   sizeof (stats), errmsg) != 0)
     {
       lua_pushnil (L);
       lua_pushstring (L, errmsg);
       return 2;
     }
+
+  push_stats (L, &stats, full);
+  return 1;
 }
 
 /**********************************************************/
 
 static int
-lua_osbf_stats (lua_State * L)
+lua_client_shutdown (lua_State * L)
 {
+  CLIENT_HANDLE *c = check_client_handle (L);
+  OSBF_REQUEST_STRUCT req;
+  OSBF_REPLY_STRUCT reply;
+  char errmsg[OSBF_ERROR_MESSAGE_LEN] = { '\0' };
 
-  const char *cfcfile;
-  STATS_STRUCT class;
-  char errmsg[OSBF_ERROR_MESSAGE_LEN];
-  int full = 1;
-
-  cfcfile = luaL_checkstring (L, 1);
-  if (lua_isboolean (L, 2))
+  memset (&req, 0, sizeof (req));
+  req.op = OSBF_OP_SHUTDOWN;
+  if (osbf_server_request (c->fd, &req, NULL, &reply, NULL, 0, errmsg) != 0)
     {
-      full = lua_toboolean (L, 2);
+      lua_pushnil (L);
+      lua_pushstring (L, errmsg);
+      return 2;
     }
 
-  if (osbf_stats (cfcfile, &class, errmsg, full) == 0)
-    {
-      lua_newtable (L);
-
-      lua_pushliteral (L, "version");
-      lua_pushnumber (L, (lua_Number) class.version);
-      lua_settable (L, -3);
+  lua_pushboolean (L, 1);
+  return 1;
+}
 
-      lua_pushliteral (L, "buckets");
-      lua_pushnumber (L, (lua_Number) class.total_buckets);
-      lua_settable (L, -3);
+static int
+lua_client_close (lua_State * L)
+{
+  CLIENT_HANDLE *c = (CLIENT_HANDLE *) luaL_checkudata (L, 1,
+							CLIENT_HANDLE_MT);
 
-      lua_pushliteral (L, "bucket_size");
-      lua_pushnumber (L, (lua_Number) class.bucket_size);
-      lua_settable (L, -3);
+  if (c->fd >= 0)
+    {
+      close (c->fd);
+      c->fd = -1;
+    }
+  lua_pushboolean (L, 1);
+  return 1;
+}
 
-      lua_pushliteral (L, "header_size");
-      lua_pushnumber (L, (lua_Number) class.header_size);
-      lua_settable (L, -3);
+static int
+client_gc (lua_State * L)
+{
+  CLIENT_HANDLE *c = (CLIENT_HANDLE *) lua_touserdata (L, 1);
 
-      lua_pushliteral (L, "learnings");
-      lua_pushnumber (L, (lua_Number) class.learnings);
-      lua_settable (L, -3);
+  if (c && c->fd >= 0)
+    {
+      close (c->fd);
+      c->fd = -1;
+    }
+  return 0;
+}
 
-      lua_pushliteral (L, "extra_learnings");
-      lua_pushnumber (L, (lua_Number) class.extra_learnings);
-      lua_settable (L, -3);
+static const struct luaL_Reg client_methods[] = {
+  {"classify", lua_client_classify},
+  {"learn", lua_client_learn},
+  {"unlearn", lua_client_unlearn},
+  {"stats", lua_client_stats},
+  {"shutdown", lua_client_shutdown},
+  {"close", lua_client_close},
+  {"__gc", client_gc},
+  {NULL, NULL}
+};
 
-      lua_pushliteral (L, "mistakes");
-      lua_pushnumber (L, (lua_Number) class.mistakes);
-      lua_settable (L, -3);
+/**********************************************************/
+/* Corpus runner */
+/**********************************************************/
 
-      lua_pushliteral (L, "classifications");
-      lua_pushnumber (L, (lua_Number) class.classifications);
-      lua_settable (L, -3);
+/* value of the number field "key" of the table at "idx", or "def" */
+static double
+opt_number_field (lua_State * L, int idx, const char *key, double def)
+{
+  double value = def;
 
-      if (full == 1)
-	{
-	  lua_pushliteral (L, "chains");
-	  lua_pushnumber (L, (lua_Number) class.num_chains);
-	  lua_settable (L, -3);
+  lua_getfield (L, idx, key);
+  if (!lua_isnil (L, -1))
+    value = luaL_checknumber (L, -1);
+  lua_pop (L, 1);
+  return value;
+}
 
-	  lua_pushliteral (L, "max_chain");
-	  lua_pushnumber (L, (lua_Number) class.max_chain);
-	  lua_settable (L, -3);
+/* set the number field "key" of the table on the top of the stack */
+static void
+set_number_field (lua_State * L, const char *key, double value)
+{
+  lua_pushnumber (L, (lua_Number) value);
+  lua_setfield (L, -2, key);
+}
 
-	  lua_pushliteral (L, "avg_chain");
-	  lua_pushnumber (L, (lua_Number) class.avg_chain);
-	  lua_settable (L, -3);
+/*
+ * Train and evaluate the dbset with the corpus listed in "index", as
+ * spamfilter/toer.lua, optionally changing its parameters with the
+ * fields of the table "params". Returns a table with the counters.
+ */
+static int
+lua_osbf_run_corpus (lua_State * L)
+{
+  const char *index;
+  const char *classes[OSBF_MAX_CLASSES + 1];
+  const char *delimiters;
+  unsigned num_classes, ncfs;
+  OSBF_CORPUS_PARAMS_STRUCT p;
+  OSBF_CORPUS_RESULTS_STRUCT r;
+  char errmsg[OSBF_ERROR_MESSAGE_LEN] = { '\0' };
 
-	  lua_pushliteral (L, "max_displacement");
-	  lua_pushnumber (L, (lua_Number) class.max_displacement);
-	  lua_settable (L, -3);
+  index = luaL_checkstring (L, 1);
+  luaL_checktype (L, 2, LUA_TTABLE);
+  num_classes = get_dbset_classes (L, 2, classes);
 
-	  lua_pushliteral (L, "unreachable");
-	  lua_pushnumber (L, (lua_Number) class.unreachable);
-	  lua_settable (L, -3);
+  lua_pushstring (L, key_ncfs);
+  lua_gettable (L, 2);
+  ncfs = luaL_checknumber (L, -1);
+  lua_pop (L, 1);
+  if (ncfs > num_classes)
+    ncfs = num_classes;
 
-	  lua_pushliteral (L, "used_buckets");
-	  lua_pushnumber (L, (lua_Number) class.used_buckets);
-	  lua_settable (L, -3);
+  lua_pushstring (L, key_delimiters);
+  lua_gettable (L, 2);
+  delimiters = luaL_checkstring (L, -1);
+  lua_pop (L, 1);
 
-	  lua_pushliteral (L, "use");
-	  if (class.total_buckets > 0)
-	    lua_pushnumber (L, (lua_Number) ((double) class.used_buckets /
-					     class.total_buckets));
-	  else
-	    lua_pushnumber (L, (lua_Number) 100);
-	  lua_settable (L, -3);
-	}
+  osbf_corpus_defaults (&p);
+  p.pR_scf = pR_SCF;
+  if (!lua_isnoneornil (L, 3))
+    {
+      luaL_checktype (L, 3, LUA_TTABLE);
+      p.threshold_offset =
+	opt_number_field (L, 3, "threshold_offset", p.threshold_offset);
+      p.thick_threshold =
+	opt_number_field (L, 3, "thick_threshold", p.thick_threshold);
+      p.header_learn_threshold =
+	opt_number_field (L, 3, "header_learn_threshold",
+			  p.header_learn_threshold);
+      p.reinforcement_degree =
+	opt_number_field (L, 3, "reinforcement_degree",
+			  p.reinforcement_degree);
+      p.threshold_reinforcement_degree =
+	opt_number_field (L, 3, "threshold_reinforcement_degree",
+			  p.threshold_reinforcement_degree);
+      p.ham_reinforcement_limit = (uint32_t)
+	opt_number_field (L, 3, "ham_reinforcement_limit",
+			  p.ham_reinforcement_limit);
+      p.spam_reinforcement_limit = (uint32_t)
+	opt_number_field (L, 3, "spam_reinforcement_limit",
+			  p.spam_reinforcement_limit);
+      p.max_text_size = (uint32_t)
+	opt_number_field (L, 3, "max_text_size", p.max_text_size);
+      p.testsize = (uint32_t) opt_number_field (L, 3, "testsize",
+						p.testsize);
+      p.nonspam_index = (uint32_t)
+	opt_number_field (L, 3, "nonspam_index", p.nonspam_index + 1) - 1;
+      p.spam_index = (uint32_t)
+	opt_number_field (L, 3, "spam_index", p.spam_index + 1) - 1;
+      p.min_pmax_pmin_ratio =
+	opt_number_field (L, 3, "min_p_ratio", p.min_pmax_pmin_ratio);
+      p.num_workers = (uint32_t) opt_number_field (L, 3, "workers",
+						   p.num_workers);
+
+      lua_getfield (L, 3, "train_in_testset");
+      if (!lua_isnil (L, -1))
+	p.train_in_testset = lua_toboolean (L, -1);
+      lua_pop (L, 1);
 
-      return 1;
+      /* the string stays in the params table during the run */
+      lua_getfield (L, 3, "training_log");
+      if (!lua_isnil (L, -1))
+	p.training_log = luaL_checkstring (L, -1);
+      lua_pop (L, 1);
     }
-  else
+
+  if (osbf_run_corpus (index, classes, delimiters, ncfs, &p, &r,
+		       errmsg) != 0)
     {
       lua_pushnil (L);
       lua_pushstring (L, errmsg);
       return 2;
     }
+
+  lua_newtable (L);
+  set_number_field (L, "messages", r.messages);
+  set_number_field (L, "hams", r.hams);
+  set_number_field (L, "spams", r.spams);
+  set_number_field (L, "hams_test", r.hams_test);
+  set_number_field (L, "spams_test", r.spams_test);
+  set_number_field (L, "false_positives", r.false_positives);
+  set_number_field (L, "false_negatives", r.false_negatives);
+  set_number_field (L, "false_positives_test", r.false_positives_test);
+  set_number_field (L, "false_negatives_test", r.false_negatives_test);
+  set_number_field (L, "trainings", r.trainings);
+  set_number_field (L, "trainings_test", r.trainings_test);
+  set_number_field (L, "reinforcements", r.reinforcements);
+  set_number_field (L, "reinforcements_test", r.reinforcements_test);
+  set_number_field (L, "learnings", r.learnings);
+  set_number_field (L, "duration", r.duration);
+  return 1;
 }
 
 /**********************************************************/
@@ -746,14 +2143,27 @@ dir_gc (lua_State * L)
 static const struct luaL_Reg osbf[] = {
   {"create_db", lua_osbf_createdb},
   {"remove_db", lua_osbf_removedb},
+  {"interleave_db", lua_osbf_interleavedb},
+  {"split_db", lua_osbf_splitdb},
+  {"convert_db", lua_osbf_convertdb},
+  {"resize_db", lua_osbf_resizedb},
+  {"freeze", lua_osbf_freeze},
   {"config", lua_osbf_config},
   {"classify", lua_osbf_classify},
+  {"classify_batch", lua_osbf_classify_batch},
   {"learn", lua_osbf_learn},
   {"unlearn", lua_osbf_unlearn},
+  {"apply_journal", lua_osbf_apply_journal},
   {"dump", lua_osbf_dump},
   {"restore", lua_osbf_restore},
   {"import", lua_osbf_import},
   {"stats", lua_osbf_stats},
+  {"lock_stats", lua_osbf_lock_stats},
+  {"sync_stats", lua_osbf_sync_stats},
+  {"open", lua_osbf_open},
+  {"serve", lua_osbf_serve},
+  {"connect", lua_osbf_connect},
+  {"run_corpus", lua_osbf_run_corpus},
   {"getdir", lua_osbf_getdir},
   {"chdir", lua_osbf_changedir},
   {"dir", l_dir},
@@ -776,6 +2186,20 @@ luaopen_osbf (lua_State * L)
   lua_pushcfunction (L, dir_gc);
   lua_settable (L, -3);
 
+  /* database set handles: methods are looked up in the metatable */
+  luaL_newmetatable (L, DBSET_HANDLE_MT);
+  lua_pushvalue (L, -1);
+  lua_setfield (L, -2, "__index");
+  luaL_setfuncs (L, dbset_methods, 0);
+  lua_pop (L, 1);
+
+  /* connections to a classification server, the same way */
+  luaL_newmetatable (L, CLIENT_HANDLE_MT);
+  lua_pushvalue (L, -1);
+  lua_setfield (L, -2, "__index");
+  luaL_setfuncs (L, client_methods, 0);
+  lua_pop (L, 1);
+
   n_funcs = sizeof(osbf)/sizeof(*osbf) - 1;
   lua_createtable( L, 0, n_funcs );
   luaL_setfuncs( L, osbf, 0 );
@@ -18,12 +18,31 @@
 #include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
+#include <math.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <unistd.h>
 #include <errno.h>
+#include <time.h>
+#include <sched.h>
+#ifndef OSBF_NO_THREADS
+#include <pthread.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+/* CRC32C with the SSE4.2 instruction */
+#if defined(__SSE4_2__) && defined(__x86_64__)
+#define HW_CRC32C
+#if !defined(__AVX2__)
+#include <nmmintrin.h>
+#endif
+#endif
 
 #include "osbflib.h"
 
@@ -37,12 +56,263 @@ const char *db_version_names[] = {
   "Neural",
   "OSB-Winnow",
   "OSBF-Bayes",
+  "OSBF-Bayes multi-class",
+  "OSBF-Bayes packed",
+  "OSBF-Bayes frozen",
   "Unknown"
 };
 
 uint32_t microgroom_chain_length = OSBF_MICROGROOM_CHAIN_LENGTH;
 uint32_t microgroom_stop_after = OSBF_MICROGROOM_STOP_AFTER;
 
+/* mapping policy of the class files */
+uint32_t map_populate = 0;
+uint32_t map_advice = OSBF_MAP_NORMAL;
+uint32_t map_hugepages = 0;
+uint32_t map_lock = 0;
+
+/* max time waited for a file lock, in milliseconds */
+uint32_t lock_timeout = OSBF_LOCK_TIMEOUT;
+/* number of stripes of the training locks, 0 => whole-file locks */
+uint32_t lock_stripes = 0;
+static LOCK_STATS_STRUCT lock_stats;
+/* when the trainings are flushed to the files, OSBF_DURABILITY_* */
+uint32_t durability = OSBF_DURABILITY_NONE;
+/* seconds between the flushes of OSBF_DURABILITY_CHECKPOINT */
+uint32_t checkpoint_interval = OSBF_CHECKPOINT_INTERVAL;
+static SYNC_STATS_STRUCT sync_stats;
+
+/* add to a counter of lock_stats, which threads may update together */
+#define LOCK_STATS_ADD(field, n) \
+  __atomic_fetch_add (&lock_stats.field, (n), __ATOMIC_RELAXED)
+#define SYNC_STATS_ADD(field, n) \
+  __atomic_fetch_add (&sync_stats.field, (n), __ATOMIC_RELAXED)
+/* page p is in the dirty bitmap of a class */
+#define PAGE_DIRTY(class, p) ((class)->dirty[(p) >> 3] & (1 << ((p) & 7)))
+
+/* initial size of the bucket flags set, in entries */
+#define BFLAGS_MIN_SIZE 256
+
+/*****************************************************************/
+
+/*
+ * Bucket flags are kept only for the buckets touched by the current
+ * document, in an open-addressed set indexed by bucket index. Entries
+ * of previous documents are discarded just by changing the generation
+ * number, so a set can be reused for many documents without clearing.
+ */
+
+/* slot of a bucket index in the set - Fibonacci hashing */
+#define BFLAGS_SLOT(bf, i) ((uint32_t) ((i) * 2654435769U) >> (32 - (bf)->bits))
+
+static int
+bflags_resize (BFLAGS_STRUCT * bf, uint32_t bits)
+{
+  BFLAGS_ENTRY *old = bf->entries;
+  uint32_t old_size = bf->size, i, slot;
+
+  bf->entries = calloc ((size_t) 1 << bits, sizeof (BFLAGS_ENTRY));
+  if (bf->entries == NULL)
+    {
+      bf->entries = old;
+      bf->error = 1;
+      return -1;
+    }
+  bf->size = (uint32_t) 1 << bits;
+  bf->bits = bits;
+
+  /* move the entries of the current generation */
+  for (i = 0; i < old_size; i++)
+    if (old[i].gen == bf->gen)
+      {
+	slot = BFLAGS_SLOT (bf, old[i].bindex);
+	while (bf->entries[slot].gen == bf->gen)
+	  slot = (slot + 1) & (bf->size - 1);
+	bf->entries[slot] = old[i];
+      }
+  free (old);
+
+  return 0;
+}
+
+/* start a new document, expecting about "expected" touched buckets */
+void
+osbf_bflags_reset (BFLAGS_STRUCT * bf, uint32_t expected)
+{
+  uint32_t bits = 0;
+
+  bf->count = 0;
+  bf->error = 0;
+  if (++bf->gen == 0)
+    {
+      /* generation counter wrapped around */
+      if (bf->entries)
+	memset (bf->entries, 0, bf->size * sizeof (BFLAGS_ENTRY));
+      bf->gen = 1;
+    }
+
+  /* keep the load factor below 1/2 */
+  while (bits < 31 && ((uint32_t) 1 << bits) < 2 * expected)
+    bits++;
+  if (((uint32_t) 1 << bits) < BFLAGS_MIN_SIZE)
+    bits = 0;
+  if (((uint32_t) 1 << bits) > bf->size)
+    bflags_resize (bf, bits > 0 ? bits : 8);
+}
+
+void
+osbf_bflags_free (BFLAGS_STRUCT * bf)
+{
+  free (bf->entries);
+  bf->entries = NULL;
+  bf->size = bf->bits = bf->count = 0;
+  bf->gen = 0;
+}
+
+unsigned char
+osbf_get_bflags (BFLAGS_STRUCT * bf, uint32_t bindex)
+{
+  uint32_t slot;
+
+  if (bf->count == 0)
+    return 0;
+
+  slot = BFLAGS_SLOT (bf, bindex);
+  while (bf->entries[slot].gen == bf->gen)
+    {
+      if (bf->entries[slot].bindex == bindex)
+	return bf->entries[slot].flags;
+      slot = (slot + 1) & (bf->size - 1);
+    }
+
+  return 0;
+}
+
+void
+osbf_set_bflags (BFLAGS_STRUCT * bf, uint32_t bindex, unsigned char flags)
+{
+  uint32_t slot;
+
+  if (bf->gen == 0)
+    osbf_bflags_reset (bf, 0);
+
+  if (bf->count > 0)
+    {
+      slot = BFLAGS_SLOT (bf, bindex);
+      while (bf->entries[slot].gen == bf->gen)
+	{
+	  if (bf->entries[slot].bindex == bindex)
+	    {
+	      bf->entries[slot].flags = flags;
+	      return;
+	    }
+	  slot = (slot + 1) & (bf->size - 1);
+	}
+    }
+
+  /* absent buckets have no flags set */
+  if (flags == 0)
+    return;
+
+  /* grow the set if it's half full */
+  if (2 * (bf->count + 1) > bf->size)
+    bflags_resize (bf, bf->size > 0 ? bf->bits + 1 : 8);
+  if (bf->count + 1 >= bf->size)
+    {
+      /* couldn't grow and there's no room left */
+      bf->error = 1;
+      return;
+    }
+
+  slot = BFLAGS_SLOT (bf, bindex);
+  while (bf->entries[slot].gen == bf->gen)
+    slot = (slot + 1) & (bf->size - 1);
+  bf->entries[slot].bindex = bindex;
+  bf->entries[slot].gen = bf->gen;
+  bf->entries[slot].flags = flags;
+  bf->count++;
+}
+
+/*****************************************************************/
+
+/*
+ * Add n to the version counters of the regions of the buckets from
+ * first to last, wrapping around the end of the file if first > last.
+ */
+static void
+seq_add (CLASS_STRUCT * class, uint32_t first, uint32_t last, uint32_t n)
+{
+  uint32_t r, end;
+
+  r = first >> class->seq_shift;
+  end = last >> class->seq_shift;
+  if (first > last && r == end)
+    {
+      /* all regions */
+      r = end + 1 == class->seq_regions ? 0 : end + 1;
+    }
+  for (;;)
+    {
+      __atomic_fetch_add (&class->seq[r], n, __ATOMIC_RELEASE);
+      if (r == end)
+	break;
+      r = r + 1 == class->seq_regions ? 0 : r + 1;
+    }
+}
+
+/*
+ * Record that the buckets from first to last, wrapping around the end
+ * of the file if first > last, were written, with their fingerprints.
+ */
+static void
+mark_buckets (CLASS_STRUCT * class, uint32_t first, uint32_t last)
+{
+  size_t base, start, end;
+
+  if (durability == OSBF_DURABILITY_NONE)
+    return;
+
+  if (first > last)
+    {
+      mark_buckets (class, first, NUM_BUCKETS (class) - 1);
+      first = 0;
+    }
+
+  base = (unsigned char *) class->buckets - (unsigned char *) class->map;
+  if (class->packed)
+    {
+      start = base + (size_t) (first / OSBF_LINE_BUCKETS) * OSBF_LINE_SIZE;
+      end = base + (size_t) (last / OSBF_LINE_BUCKETS + 1) * OSBF_LINE_SIZE;
+    }
+  else
+    {
+      start = base + (size_t) first * class->bucket_words * sizeof (uint32_t);
+      end = base + ((size_t) last + 1) * class->bucket_words *
+	sizeof (uint32_t);
+    }
+  osbf_mark_dirty (class, start, end - start);
+
+  if (class->fingerprints != NULL)
+    osbf_mark_dirty (class, class->fingerprints + first -
+		     (unsigned char *) class->map, last - first + 1);
+}
+
+/* tell the readers that the buckets from first to last will change */
+static void
+seq_begin (CLASS_STRUCT * class, uint32_t first, uint32_t last)
+{
+  seq_add (class, first, last, 1);
+  /* the counters must be seen before any bucket changes */
+  __atomic_thread_fence (__ATOMIC_SEQ_CST);
+}
+
+/* and that they changed */
+static void
+seq_end (CLASS_STRUCT * class, uint32_t first, uint32_t last)
+{
+  seq_add (class, first, last, OSBF_SEQ_DONE - 1);
+}
+
 /*****************************************************************/
 
 /*
@@ -103,10 +373,8 @@ osbf_packchain (CLASS_STRUCT * class, uint32_t packstart, uint32_t packlen)
 	      if (MARKED_FREE (class, ito))
 		{
 		  /* copy bucket and flags */
-		  BUCKET_HASH (class, ito) = thash;
-		  BUCKET_KEY (class, ito) = BUCKET_KEY (class, ifrom);
-		  BUCKET_VALUE (class, ito) = BUCKET_VALUE (class, ifrom);
-		  BUCKET_FLAGS (class, ito) = BUCKET_FLAGS (class, ifrom);
+		  COPY_BUCKET (class, ito, ifrom);
+		  SET_BUCKET_FLAGS (class, ito, BUCKET_FLAGS (class, ifrom));
 		  /* mark the from bucket as free */
 		  MARK_IT_FREE (class, ifrom);
 		}
@@ -136,8 +404,10 @@ osbf_packchain (CLASS_STRUCT * class, uint32_t packstart, uint32_t packlen)
   for (ito = packstart; ito != packend; ito = NEXT_BUCKET (class, ito))
     if (MARKED_FREE (class, ito))
       {
-	BUCKET_VALUE (class, ito) = 0;
+	CLEAR_BUCKET (class, ito);
 	UNMARK_IT_FREE (class, ito);
+	if (class->bloom_stale != NULL)
+	  __atomic_fetch_add (class->bloom_stale, 1, __ATOMIC_RELAXED);
       }
 
 #ifdef DEBUG_packchain
@@ -188,18 +458,18 @@ osbf_microgroom (CLASS_STRUCT * class, uint32_t bindex)
    */
   min_value = OSBF_MAX_BUCKET_VALUE;
   i_aux = j_aux = HASH_INDEX (class, bindex);
-  min_value_any = BUCKET_VALUE (class, i_aux);
+  min_value_any = BUCKET_GROOM_VALUE (class, i_aux);
 
   if (!BUCKET_IN_CHAIN (class, i_aux))
     return 0;			/* initial bucket not in a chain! */
 
   while (BUCKET_IN_CHAIN (class, i_aux))
     {
-      if (BUCKET_VALUE (class, i_aux) < min_value_any)
-	min_value_any = BUCKET_VALUE (class, i_aux);
-      if (BUCKET_VALUE (class, i_aux) < min_value &&
+      if (BUCKET_GROOM_VALUE (class, i_aux) < min_value_any)
+	min_value_any = BUCKET_GROOM_VALUE (class, i_aux);
+      if (BUCKET_GROOM_VALUE (class, i_aux) < min_value &&
 	  !BUCKET_IS_LOCKED (class, i_aux))
-	min_value = BUCKET_VALUE (class, i_aux);
+	min_value = BUCKET_GROOM_VALUE (class, i_aux);
       i_aux = PREV_BUCKET (class, i_aux);
       if (i_aux == j_aux)
 	break;			/* don't hang if we have a 100% full .css file */
@@ -310,7 +580,7 @@ osbf_microgroom (CLASS_STRUCT * class, uint32_t bindex)
       while (BUCKET_IN_CHAIN (class, i_aux) && zeroed_countdown > 0)
 	{
 	  /* check if it's a candidate */
-	  if ((BUCKET_VALUE (class, i_aux) == min_value) &&
+	  if ((BUCKET_GROOM_VALUE (class, i_aux) == min_value) &&
 	      (!BUCKET_IS_LOCKED (class, i_aux) || (groom_locked != 0)))
 	    {
 	      /* if it is, check the distance */
@@ -448,12 +718,312 @@ osbf_first_in_chain (CLASS_STRUCT * class, uint32_t bindex)
 
 /*****************************************************************/
 
+/* distance of a used bucket from its right position */
+static uint32_t
+bucket_displacement (CLASS_STRUCT * class, uint32_t bindex)
+{
+  uint32_t right_index = HASH_INDEX (class, BUCKET_HASH (class, bindex));
+
+  return (bindex >= right_index) ? bindex - right_index :
+    NUM_BUCKETS (class) - (right_index - bindex);
+}
+
+/*****************************************************************/
+
+/*
+ * Fingerprint block compare. Returns a bit mask with the bits set for
+ * the fingerprints equal to fp, in a block of FP_BLOCK fingerprints
+ * starting at p, and in *empty the mask of the free buckets.
+ */
+#if defined(__AVX2__)
+#define FP_BLOCK 32
+static uint32_t
+fp_block_mask (const unsigned char *p, unsigned char fp, uint32_t * empty)
+{
+  __m256i v = _mm256_loadu_si256 ((const __m256i *) p);
+
+  *empty = (uint32_t) _mm256_movemask_epi8 (_mm256_cmpeq_epi8 (v,
+							       _mm256_setzero_si256
+							       ()));
+  return (uint32_t)
+    _mm256_movemask_epi8 (_mm256_cmpeq_epi8 (v, _mm256_set1_epi8 (fp)));
+}
+#elif defined(__SSE2__)
+#define FP_BLOCK 16
+static uint32_t
+fp_block_mask (const unsigned char *p, unsigned char fp, uint32_t * empty)
+{
+  __m128i v = _mm_loadu_si128 ((const __m128i *) p);
+
+  *empty = (uint32_t) _mm_movemask_epi8 (_mm_cmpeq_epi8 (v,
+							 _mm_setzero_si128 ()));
+  return (uint32_t) _mm_movemask_epi8 (_mm_cmpeq_epi8 (v,
+						       _mm_set1_epi8 (fp)));
+}
+#else
+#define FP_BLOCK 16
+static uint32_t
+fp_block_mask (const unsigned char *p, unsigned char fp, uint32_t * empty)
+{
+  uint32_t i, mask = 0;
+
+  *empty = 0;
+  for (i = 0; i < FP_BLOCK; i++)
+    {
+      if (p[i] == fp)
+	mask |= 1u << i;
+      else if (p[i] == 0)
+	*empty |= 1u << i;
+    }
+  return mask;
+}
+#endif
+
+/*
+ * Linear probing with fingerprints: a block of fingerprints is
+ * checked at once and only the buckets whose fingerprints match
+ * are loaded. Returns the same as osbf_find_bucket.
+ */
+static uint32_t
+fp_find_bucket (CLASS_STRUCT * class, uint32_t hash, uint32_t key,
+		uint32_t bindex)
+{
+  unsigned char fp = OSBF_FINGERPRINT (key);
+  uint32_t num_buckets = NUM_BUCKETS (class);
+  uint32_t hits, empty, len, probed = 0;
+
+  for (;;)
+    {
+      hits = fp_block_mask (class->fingerprints + bindex, fp, &empty);
+
+      /* the array is padded, but the chain wraps around at the end */
+      len = num_buckets - bindex;
+      if (len < FP_BLOCK)
+	{
+	  hits &= (1u << len) - 1;
+	  empty &= (1u << len) - 1;
+	}
+      else
+	len = FP_BLOCK;
+
+      /* only the buckets before the end of the chain count */
+      if (empty != 0)
+	hits &= (1u << __builtin_ctz (empty)) - 1;
+
+      while (hits != 0)
+	{
+	  uint32_t i = bindex + __builtin_ctz (hits);
+
+	  if (BUCKET_HASH_COMPARE (class, i, hash, key))
+	    return i;
+	  hits &= hits - 1;
+	}
+
+      if (empty != 0)
+	return bindex + __builtin_ctz (empty);
+
+      probed += len;
+      if (probed >= num_buckets)
+	return num_buckets + 1;
+      bindex += len;
+      if (bindex == num_buckets)
+	bindex = 0;
+    }
+}
+
+/*****************************************************************/
+
+/*
+ * Blocked Bloom filter of the features of a single class file: each
+ * feature sets OSBF_BLOOM_HASHES bits in one 64-byte block, so a check
+ * touches a single cache line. Buckets freed by unlearning or
+ * microgrooming can't be removed, they're counted as stale and the
+ * filter is rebuilt when there are too many of them.
+ */
+static uint64_t *
+bloom_block (CLASS_STRUCT * class, uint32_t hash, uint32_t key,
+	     uint64_t * bits)
+{
+  uint64_t v = (((uint64_t) key << 32) | hash) * 0x9E3779B97F4A7C15ULL;
+  uint64_t w = (v ^ (v >> 29)) * 0xBF58476D1CE4E5B9ULL;
+
+  *bits = w ^ (w >> 32);
+  return class->bloom + 8 *
+    (uint32_t) (((v >> 32) * class->bloom_blocks) >> 32);
+}
+
+void
+osbf_bloom_add (CLASS_STRUCT * class, uint32_t hash, uint32_t key)
+{
+  uint64_t bits, *block;
+  uint32_t k, bit;
+
+  if (class->bloom == NULL)
+    return;
+  block = bloom_block (class, hash, key, &bits);
+  for (k = 0; k < OSBF_BLOOM_HASHES; k++, bits >>= 9)
+    {
+      bit = (uint32_t) bits & 511;
+      /* trainings with striped locks may share the block */
+      __atomic_fetch_or (&block[bit >> 6], (uint64_t) 1 << (bit & 63),
+			 __ATOMIC_RELAXED);
+    }
+  /* the block may be the one of osbf_bloom_rebuild, out of the map */
+  osbf_mark_dirty (class, (uintptr_t) block - (uintptr_t) class->map,
+		   OSBF_LINE_SIZE);
+}
+
+/* returns 0 if the feature is surely not in the class, 1 if it may be */
+int
+osbf_bloom_check (CLASS_STRUCT * class, uint32_t hash, uint32_t key)
+{
+  uint64_t bits, *block;
+  uint32_t k, bit;
+
+  block = bloom_block (class, hash, key, &bits);
+  for (k = 0; k < OSBF_BLOOM_HASHES; k++, bits >>= 9)
+    {
+      bit = (uint32_t) bits & 511;
+      if ((block[bit >> 6] & ((uint64_t) 1 << (bit & 63))) == 0)
+	return 0;
+    }
+  return 1;
+}
+
+/*
+ * Rebuild the Bloom filter from the used buckets. The new filter is
+ * built apart and copied word by word over the old one, which has all
+ * its bits, so unlocked readers never miss a feature.
+ */
+int
+osbf_bloom_rebuild (CLASS_STRUCT * class, char *errmsg)
+{
+  uint64_t *bloom, *fresh;
+  size_t words;
+  uint32_t i;
+
+  if (class->bloom == NULL)
+    return 0;
+  words = (size_t) class->bloom_blocks * 8;
+  fresh = calloc (words, sizeof (uint64_t));
+  if (fresh == NULL)
+    {
+      strncpy (errmsg, "Error allocating memory", OSBF_ERROR_MESSAGE_LEN);
+      return -1;
+    }
+
+  bloom = class->bloom;
+  class->bloom = fresh;
+  for (i = 0; i < NUM_BUCKETS (class); i++)
+    if (BUCKET_IN_CHAIN (class, i))
+      osbf_bloom_add (class, BUCKET_HASH (class, i), BUCKET_KEY (class, i));
+  class->bloom = bloom;
+
+  for (i = 0; i < words; i++)
+    bloom[i] = fresh[i];
+  *class->bloom_stale = 0;
+  osbf_mark_dirty (class, (unsigned char *) class->bloom_stale -
+		   (unsigned char *) class->map,
+		   OSBF_LINE_SIZE + words * sizeof (uint64_t));
+  free (fresh);
+  return 0;
+}
+
+/*****************************************************************/
+
+/*
+ * Minimal perfect hash of the frozen files: the 64-bit hash of a
+ * feature selects a pilot, and the pilot perturbs the hash to give
+ * the position of the feature. The pilots are found by osbf_freeze.
+ */
+static uint64_t
+mph_mix (uint64_t x)
+{
+  x ^= x >> 33;
+  x *= 0xFF51AFD7ED558CCDULL;
+  x ^= x >> 33;
+  x *= 0xC4CEB9FE1A85EC53ULL;
+  x ^= x >> 33;
+  return x;
+}
+
+static uint64_t
+mph_hash (uint64_t seed, uint32_t hash, uint32_t key)
+{
+  return mph_mix ((((uint64_t) hash << 32) | key) ^ seed);
+}
+
+static uint32_t
+mph_pilot_index (uint64_t h, uint32_t num_pilots)
+{
+  return (uint32_t) (((h >> 32) * num_pilots) >> 32);
+}
+
+static uint32_t
+mph_position (uint64_t h, uint32_t pilot, uint32_t table_size)
+{
+  uint64_t x = mph_mix (h ^ ((uint64_t) pilot * 0x9E3779B97F4A7C15ULL));
+
+  return (uint32_t) (((x >> 32) * table_size) >> 32);
+}
+
+/* the bucket of a feature in a frozen file, or an invalid index */
+static uint32_t
+frozen_find_bucket (CLASS_STRUCT * class, uint32_t hash, uint32_t key)
+{
+  uint64_t h;
+  uint32_t pos;
+
+  if (NUM_BUCKETS (class) == 0)
+    return 1;
+  h = mph_hash (class->mph_seed, hash, key);
+  pos = mph_position (h, class->pilots[mph_pilot_index (h,
+							 class->mph_pilots)],
+		      class->mph_size);
+  if (pos >= NUM_BUCKETS (class))
+    pos = class->remap[pos - NUM_BUCKETS (class)];
+  if (BUCKET_HASH_COMPARE (class, pos, hash, key))
+    return pos;
+  return NUM_BUCKETS (class) + 1;
+}
+
+/*****************************************************************/
+
 uint32_t
 osbf_find_bucket (CLASS_STRUCT * class, uint32_t hash, uint32_t key)
 {
-  uint32_t bindex, start;
+  uint32_t bindex, start, distance;
+
+  if (class->frozen)
+    return frozen_find_bucket (class, hash, key);
 
   bindex = start = HASH_INDEX (class, hash);
+
+  if (class->robin_hood)
+    {
+      /*
+       * the buckets of a chain are sorted by their right positions,
+       * so the search can stop at the first bucket closer to its
+       * right position than the feature would be. That bucket is
+       * where the feature must be inserted.
+       */
+      distance = 0;
+      while (BUCKET_IN_CHAIN (class, bindex))
+	{
+	  if (BUCKET_HASH_COMPARE (class, bindex, hash, key) ||
+	      bucket_displacement (class, bindex) < distance)
+	    return bindex;
+	  bindex = NEXT_BUCKET (class, bindex);
+	  distance++;
+	  if (bindex == start)
+	    return NUM_BUCKETS (class) + 1;
+	}
+      return bindex;
+    }
+
+  if (class->fingerprints != NULL)
+    return fp_find_bucket (class, hash, key, bindex);
+
   while (BUCKET_IN_CHAIN (class, bindex) &&
 	 !BUCKET_HASH_COMPARE (class, bindex, hash, key))
     {
@@ -472,6 +1042,100 @@ osbf_find_bucket (CLASS_STRUCT * class, uint32_t hash, uint32_t key)
   return bindex;
 }
 
+/*
+ * Called when OSBF_READ_CHANGED says a read must be repeated, because
+ * a writer was changing the buckets during it. Returns 0 if it was
+ * already repeated OSBF_SEQ_RETRIES times, counted in *retries, and
+ * must be taken as it is, else 1.
+ */
+int
+osbf_read_retry (uint32_t version, uint32_t * retries)
+{
+  if (*retries >= OSBF_SEQ_RETRIES)
+    return 0;
+
+  (*retries)++;
+  LOCK_STATS_ADD (read_retries, 1);
+  /* let the writer finish */
+  if (version & OSBF_SEQ_WRITERS)
+    sched_yield ();
+  return 1;
+}
+
+/*****************************************************************/
+
+/*
+ * Robin Hood insertion: the feature is put at bindex, returned by
+ * osbf_find_bucket, and the buckets from there to the end of the
+ * chain are shifted by one position. If any of them would get
+ * farther than microgroom_chain_length from its right position, or
+ * more than that many buckets would be shifted, the chain is
+ * microgroomed first, as in the linear insertion.
+ */
+static void
+rh_insert_bucket (CLASS_STRUCT * class,
+		  uint32_t bindex, uint32_t hash, uint32_t key, int value)
+{
+  uint32_t right_index, distance, d, free_index, shifted;
+
+  right_index = HASH_INDEX (class, hash);
+  for (;;)
+    {
+      /* new bucket distance */
+      distance = (bindex >= right_index) ? bindex - right_index :
+	NUM_BUCKETS (class) - (right_index - bindex);
+
+      /* find the free bucket at the end of the chain and the max */
+      /* distance of the shifted buckets                          */
+      free_index = bindex;
+      shifted = 0;
+      while (BUCKET_IN_CHAIN (class, free_index))
+	{
+	  d = bucket_displacement (class, free_index) + 1;
+	  if (d > distance)
+	    distance = d;
+	  if (++shifted > distance)
+	    distance = shifted;
+	  free_index = NEXT_BUCKET (class, free_index);
+	  if (free_index == bindex)
+	    {
+	      /* no free bucket */
+	      distance = NUM_BUCKETS (class);
+	      break;
+	    }
+	  if (distance > microgroom_chain_length && value > 0)
+	    break;
+	}
+
+      if (distance <= microgroom_chain_length ||
+	  (value <= 0 && distance < NUM_BUCKETS (class)))
+	break;
+      if (value <= 0)
+	return;
+
+      osbf_microgroom (class, BUCKET_IN_CHAIN (class, bindex) ?
+		       bindex : PREV_BUCKET (class, bindex));
+      bindex = osbf_find_bucket (class, hash, key);
+      if (!VALID_BUCKET (class, bindex))
+	return;
+    }
+
+  /* shift the buckets, with their flags, to open room at bindex */
+  for (; free_index != bindex; free_index = PREV_BUCKET (class, free_index))
+    {
+      d = PREV_BUCKET (class, free_index);
+      COPY_BUCKET (class, free_index, d);
+      SET_BUCKET_FLAGS (class, free_index, BUCKET_FLAGS (class, d));
+    }
+  SET_BUCKET_FLAGS (class, bindex, 0);
+
+  SETL_BUCKET_VALUE (class, bindex, value);
+  BUCKET_HASH (class, bindex) = hash;
+  BUCKET_KEY (class, bindex) = key;
+  SET_FINGERPRINT (class, bindex, OSBF_FINGERPRINT (key));
+  osbf_bloom_add (class, hash, key);
+}
+
 /*****************************************************************/
 
 void
@@ -490,9 +1154,14 @@ osbf_update_bucket (CLASS_STRUCT * class, uint32_t bindex, int delta)
     }
   else if (delta < 0 && BUCKET_VALUE (class, bindex) <= (uint32_t) (-delta))
     {
-      if (BUCKET_VALUE (class, bindex) != 0)
+      if (class->num_columns > 1 && osbf_bucket_shared (class, bindex))
+	{
+	  /* still used by other classes, just zero this count */
+	  SET_BUCKET_VALUE (class, bindex, 0);
+	}
+      else if (BUCKET_VALUE (class, bindex) != 0)
 	{
-	  uint32_t i, packlen;
+	  uint32_t i, packlen, first, last;
 
 	  MARK_IT_FREE (class, bindex);
 
@@ -506,32 +1175,34 @@ osbf_update_bucket (CLASS_STRUCT * class, uint32_t bindex, int delta)
 	    fprintf (stderr, "packing: %" PRIu32 ", %" PRIu32 "\n", i,
 		     bindex);
 */
-	  osbf_packchain (class, bindex, packlen);
+	  if (class->seq == NULL && durability == OSBF_DURABILITY_NONE)
+	    osbf_packchain (class, bindex, packlen);
+	  else
+	    {
+	      osbf_bucket_cluster (class, bindex, &first, &last);
+	      if (class->seq != NULL)
+		seq_begin (class, first, last);
+	      osbf_packchain (class, bindex, packlen);
+	      if (class->seq != NULL)
+		seq_end (class, first, last);
+	      mark_buckets (class, first, last);
+	    }
 	}
     }
   else
     {
       SETL_BUCKET_VALUE (class, bindex, BUCKET_VALUE (class, bindex) + delta);
     }
+  mark_buckets (class, bindex, bindex);
 }
 
 
 /*****************************************************************/
 
-void
-osbf_insert_bucket (CLASS_STRUCT * class,
-		    uint32_t bindex, uint32_t hash, uint32_t key, int value)
+/* if not specified, max chain len is automatically specified */
+static void
+set_chain_length (CLASS_STRUCT * class)
 {
-  uint32_t right_index, distance;
-  int microgroom = 1;
-
-  /* "right" bucket index */
-  right_index = HASH_INDEX (class, hash);
-  /* distance from right position to free position */
-  distance = (bindex >= right_index) ? bindex - right_index :
-    NUM_BUCKETS (class) - (right_index - bindex);
-
-  /* if not specified, max chain len is automatically specified */
   if (microgroom_chain_length == 0)
     {
       /* from experimental values */
@@ -540,6 +1211,28 @@ osbf_insert_bucket (CLASS_STRUCT * class,
       if (microgroom_chain_length < 29)
 	microgroom_chain_length = 29;
     }
+}
+
+static void
+insert_bucket (CLASS_STRUCT * class,
+	       uint32_t bindex, uint32_t hash, uint32_t key, int value)
+{
+  uint32_t right_index, distance;
+  int microgroom = 1;
+
+  set_chain_length (class);
+
+  if (class->robin_hood)
+    {
+      rh_insert_bucket (class, bindex, hash, key, value);
+      return;
+    }
+
+  /* "right" bucket index */
+  right_index = HASH_INDEX (class, hash);
+  /* distance from right position to free position */
+  distance = (bindex >= right_index) ? bindex - right_index :
+    NUM_BUCKETS (class) - (right_index - bindex);
 
   if (microgroom && (value > 0))
     while (distance > microgroom_chain_length)
@@ -564,6 +1257,71 @@ osbf_insert_bucket (CLASS_STRUCT * class,
   SETL_BUCKET_VALUE (class, bindex, value);
   BUCKET_HASH (class, bindex) = hash;
   BUCKET_KEY (class, bindex) = key;
+  SET_FINGERPRINT (class, bindex, OSBF_FINGERPRINT (key));
+  osbf_bloom_add (class, hash, key);
+}
+
+/*
+ * Insert a feature at bindex, returned by osbf_find_bucket. The
+ * insertion and its microgrooming only change the buckets between
+ * the free ones around bindex, whose regions are marked as changing
+ * meanwhile, and which are marked as written for osbf_sync_class.
+ */
+void
+osbf_insert_bucket (CLASS_STRUCT * class,
+		    uint32_t bindex, uint32_t hash, uint32_t key, int value)
+{
+  uint32_t first, last;
+
+  if ((class->seq == NULL && durability == OSBF_DURABILITY_NONE) ||
+      !VALID_BUCKET (class, bindex))
+    {
+      insert_bucket (class, bindex, hash, key, value);
+      return;
+    }
+
+  osbf_bucket_cluster (class, bindex, &first, &last);
+  if (class->seq != NULL)
+    seq_begin (class, first, last);
+  insert_bucket (class, bindex, hash, key, value);
+  if (class->seq != NULL)
+    seq_end (class, first, last);
+  mark_buckets (class, first, last);
+}
+
+/*****************************************************************/
+
+/* check if a bucket of a multi-class file is used by another class */
+int
+osbf_bucket_shared (CLASS_STRUCT * class, uint32_t bindex)
+{
+  uint32_t c;
+
+  /* the buckets of a frozen file only hold used features */
+  if (class->frozen)
+    return 1;
+
+  for (c = 0; c < class->num_columns; c++)
+    if (c != class->column && BUCKET_WORD (class, bindex, 2 + c) != 0)
+      return 1;
+
+  return 0;
+}
+
+/*****************************************************************/
+
+/* sum of the counts of all classes in a bucket, limited to the max value */
+uint32_t
+osbf_bucket_total (CLASS_STRUCT * class, uint32_t bindex)
+{
+  uint32_t c, total = 0;
+
+  for (c = 0; c < class->num_columns; c++)
+    total += class->frozen ?
+      ((uint16_t *) & BUCKET_WORD (class, bindex, 2))[c] :
+      BUCKET_WORD (class, bindex, 2 + c);
+
+  return total < OSBF_MAX_BUCKET_VALUE ? total : OSBF_MAX_BUCKET_VALUE;
 }
 
 /*****************************************************************/
@@ -612,725 +1370,4018 @@ strnhash (unsigned char *str, uint32_t len)
 
 /*****************************************************************/
 
-static OSBF_HEADER_BUCKET_UNION hu;
-int
-osbf_create_cfcfile (const char *cfcfile, uint32_t num_buckets,
-		     uint32_t major, uint32_t minor, char *errmsg)
+/*
+ * Size of a single class file whose buckets end at buckets_end, with
+ * the extensions selected in db_flags after them. Their offsets are
+ * returned in *fingerprints_start and *bloom_start, 0 if not used.
+ */
+static off_t
+extensions_layout (off_t buckets_end, uint32_t num_buckets,
+		   uint32_t db_flags, off_t * fingerprints_start,
+		   off_t * bloom_start)
+{
+  off_t end = buckets_end;
+
+  *fingerprints_start = *bloom_start = 0;
+  if (db_flags & OSBF_DB_FINGERPRINTS)
+    {
+      *fingerprints_start = OSBF_LINE_ALIGN (end);
+      end = *fingerprints_start + OSBF_FINGERPRINTS_SIZE (num_buckets);
+    }
+  if (db_flags & OSBF_DB_BLOOM)
+    {
+      *bloom_start = OSBF_LINE_ALIGN (end);
+      end = *bloom_start + OSBF_BLOOM_SIZE (num_buckets);
+    }
+  return end;
+}
+
+/*
+ * Create a new class file, failing if it already exists. Returns it
+ * opened for writing, or NULL.
+ */
+static FILE *
+create_new_file (const char *file, char *errmsg)
 {
   FILE *f;
-  uint32_t i_aux;
-  OSBF_BUCKET_STRUCT bucket = { 0, 0, 0 };
+  int fd;
 
-  if (cfcfile == NULL || *cfcfile == '\0')
+  if (file == NULL || *file == '\0')
     {
-      if (cfcfile != NULL)
+      if (file != NULL)
 	snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
-		  "Invalid file name: '%s'", cfcfile);
+		  "Invalid file name: '%s'", file);
       else
 	strncpy (errmsg, "Invalid (NULL) pointer to cfc file name",
 		 OSBF_ERROR_MESSAGE_LEN);
-      return -1;
+      return NULL;
     }
 
-  f = fopen (cfcfile, "r");
-  if (f)
+  fd = open (file, O_WRONLY | O_CREAT | O_EXCL, 0666);
+  if (fd < 0)
     {
-      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
-		"File already exists: '%s'", cfcfile);
-      fclose(f);
-      return -1;
+      if (errno == EEXIST)
+	snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		  "File already exists: '%s'", file);
+      else
+	snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		  "Couldn't create the file: '%s'", file);
+      return NULL;
     }
 
-  f = fopen (cfcfile, "wb");
-  if (!f)
+  f = fdopen (fd, "wb");
+  if (f == NULL)
     {
+      close (fd);
+      remove (file);
       snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
-		"Couldn't create the file: '%s'", cfcfile);
-      return -1;
+		"Couldn't create the file: '%s'", file);
     }
+  return f;
+}
 
-  /* Set the header. */
-  hu.header.version = major;
-  hu.header.db_flags = minor;
-  hu.header.buckets_start = OSBF_CFC_HEADER_SIZE;
-  hu.header.num_buckets = num_buckets;
-  hu.header.learnings = 0;
+/*
+ * Extend a new file, whose header was just written, with zeros up to
+ * "size" bytes, and close it. The space is preallocated where the
+ * filesystem supports it, so running out of it is reported now and not
+ * when the mapped file is trained. Otherwise the file is extended with
+ * ftruncate, which leaves it sparse, and only if that fails the zeros
+ * are written. On error the file is removed. Returns 0 if ok.
+ */
+static int
+close_new_file (FILE * f, const char *file, off_t size, char *errmsg)
+{
+  static const unsigned char zeros[65536];
+  off_t len;
+  size_t n;
+  int err = 0, fd = fileno (f);
+
+  len = size - (off_t) ftell (f);
+  if (fflush (f) != 0)
+    err = -1;
+  else if (len > 0)
+    {
+      err = posix_fallocate (fd, size - len, len);
+      if (err != 0 && err != ENOSPC && ftruncate (fd, size) == 0)
+	err = 0;
+      else if (err != 0 && err != ENOSPC)
+	for (err = 0; len > 0 && err == 0; len -= n)
+	  {
+	    n = len < (off_t) sizeof (zeros) ? (size_t) len : sizeof (zeros);
+	    if (fwrite (zeros, 1, n, f) != n)
+	      err = -1;
+	  }
+    }
 
-  /* Write header */
-  if (fwrite (&hu, sizeof (hu), 1, f) != 1)
+  if (fclose (f) != 0)
+    err = -1;
+  if (err != 0)
     {
+      remove (file);
       snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
-		"Couldn't initialize the file header: '%s'", cfcfile);
+		"Couldn't write to: '%s'", file);
       return -1;
     }
+  return 0;
+}
 
-  /*  Initialize CFC hashes - zero all buckets */
-  for (i_aux = 0; i_aux < num_buckets; i_aux++)
+/* write the header of a new file, or close and remove it on error */
+static int
+write_new_header (FILE * f, const char *file, const void *header,
+		  size_t size, char *errmsg)
+{
+  if (fwrite (header, size, 1, f) != 1)
     {
-      /* Write buckets */
-      if (fwrite (&bucket, sizeof (bucket), 1, f) != 1)
-	{
-	  snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
-		    "Couldn't write to: '%s'", cfcfile);
-	  return -1;
-	}
+      fclose (f);
+      remove (file);
+      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		"Couldn't initialize the file header: '%s'", file);
+      return -1;
     }
-  fclose (f);
   return 0;
 }
 
 /*****************************************************************/
 
-/* Check if a file exists. Return its length if yes and < 0 if no */
-off_t
-check_file (const char *file)
+int
+osbf_create_cfcfile (const char *cfcfile, uint32_t num_buckets,
+		     uint32_t major, uint32_t minor, char *errmsg)
 {
-  int fd;
-  off_t fsize;
+  FILE *f;
+  OSBF_HEADER_BUCKET_UNION hu;
+  off_t size, fingerprints_start, bloom_start;
 
-  fd = open (file, O_RDONLY);
-  if (fd < 0)
+  f = create_new_file (cfcfile, errmsg);
+  if (f == NULL)
     return -1;
-  fsize = lseek (fd, 0L, SEEK_END);
-  if (fsize < 0)
-    return -2;
-  close (fd);
 
-  return fsize;
+  /* Set the header. */
+  memset (&hu, 0, sizeof (hu));
+  hu.header.version = major;
+  hu.header.db_flags = minor;
+  hu.header.buckets_start = OSBF_CFC_HEADER_SIZE;
+  hu.header.num_buckets = num_buckets;
+  hu.header.learnings = 0;
+
+  /* Write header */
+  if (write_new_header (f, cfcfile, &hu, sizeof (hu), errmsg) != 0)
+    return -1;
+
+  /* the buckets, zeroed, start a bit before the end of the header */
+  size = extensions_layout ((off_t) (OSBF_CFC_HEADER_SIZE + num_buckets) *
+			    sizeof (OSBF_BUCKET_STRUCT), num_buckets, minor,
+			    &fingerprints_start, &bloom_start);
+  if (size < (off_t) sizeof (hu) + (off_t) num_buckets *
+      (off_t) sizeof (OSBF_BUCKET_STRUCT))
+    size = (off_t) sizeof (hu) + (off_t) num_buckets *
+      (off_t) sizeof (OSBF_BUCKET_STRUCT);
+  return close_new_file (f, cfcfile, size, errmsg);
 }
 
 /*****************************************************************/
 
+/*
+ * Create a multi-class file with num_classes classes. Each class
+ * has its own header, at the start of the file, and its own count
+ * in each bucket.
+ */
 int
-osbf_open_class (const char *classname, int flags, CLASS_STRUCT * class,
-		 char *errmsg)
+osbf_create_mc_file (const char *mcfile, uint32_t num_buckets,
+		     uint32_t num_classes, char *errmsg)
 {
-  int prot;
-  off_t fsize;
-
-  /* clear class structure */
-  class->fd = -1;
-  class->flags = O_RDONLY;
-  class->classname = NULL;
-  class->header = NULL;
-  class->buckets = NULL;
-  class->bflags = NULL;
+  FILE *f;
+  OSBF_HEADER_STRUCT header;
+  uint32_t *buf;
+  size_t bucket_size, header_words;
+  uint32_t c, buckets_start;
 
-  fsize = check_file (classname);
-  if (fsize < 0)
+  if (num_classes < 2 || num_classes > OSBF_MAX_CLASSES)
     {
-      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN, "Couldn't open %s.",
-		classname);
-      return (-1);
+      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		"Invalid number of classes: %" PRIu32, num_classes);
+      return -1;
     }
 
-  /* open the class to be trained and mmap it into memory */
-  class->fd = open (classname, flags);
+  /* the headers take about 4 Kbytes, or more if there are many classes */
+  bucket_size = (2 + num_classes) * sizeof (uint32_t);
+  buckets_start = (4096 + bucket_size - 1) / bucket_size;
+  if (buckets_start * bucket_size < num_classes * sizeof (header))
+    buckets_start = (num_classes * sizeof (header) + bucket_size - 1) /
+      bucket_size;
+  header_words = buckets_start * bucket_size / sizeof (uint32_t);
 
-  if (class->fd < 0)
+  buf = calloc (header_words, sizeof (uint32_t));
+  if (buf == NULL)
     {
-      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
-		"Couldn't open the file %s.", classname);
-      return -2;
+      strncpy (errmsg, "Error allocating memory", OSBF_ERROR_MESSAGE_LEN);
+      return -1;
     }
 
-  if (flags == O_RDWR)
+  f = create_new_file (mcfile, errmsg);
+  if (f == NULL)
     {
-      class->flags = O_RDWR;
-      prot = PROT_READ + PROT_WRITE;
+      free (buf);
+      return -1;
+    }
 
-#if !defined(OSBF_NO_FILE_LOCKING)
-      if (osbf_lock_file (class->fd, 0, 0) != 0)
-	{
-	  fprintf (stderr, "Couldn't lock the file %s.", classname);
-	  close (class->fd);
-	  snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
-		    "Couldn't lock the file %s.", classname);
-	  return -3;
-	}
-#endif
+  /* Set the headers. */
+  memset (&header, 0, sizeof (header));
+  header.version = OSBF_MC_VERSION;
+  header.db_flags = 0;
+  header.buckets_start = buckets_start;
+  header.num_buckets = num_buckets;
+  header.num_classes = num_classes;
+  for (c = 0; c < num_classes; c++)
+    memcpy ((OSBF_HEADER_STRUCT *) buf + c, &header, sizeof (header));
+
+  /* Write headers */
+  c = write_new_header (f, mcfile, buf, header_words * sizeof (uint32_t),
+			errmsg);
+  free (buf);
+  if (c != 0)
+    return -1;
 
-    }
-  else
-    {
-      class->flags = O_RDONLY;
-      prot = PROT_READ;
-    }
+  /*  zero all buckets */
+  return close_new_file (f, mcfile, (off_t) (buckets_start + num_buckets) *
+			 (off_t) bucket_size, errmsg);
+}
 
-  class->header = (OSBF_HEADER_STRUCT *) mmap (NULL, fsize, prot,
-					       MAP_SHARED, class->fd, 0);
-  if (class->header == MAP_FAILED)
-    {
-      close (class->fd);
-      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN, "Couldn't mmap %s.",
-		classname);
-      return (-4);
-    }
+/*****************************************************************/
 
-  /* check file version */
-  if (class->header->version != OSBF_VERSION || class->header->db_flags != 0)
-    {
-      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
-		"%s is not an OSBF_Bayes-spectrum file.", classname);
-      return (-5);
-    }
+/* Create a single-class file in the packed, cache-line aligned format */
+int
+osbf_create_packed_file (const char *cfcfile, uint32_t num_buckets,
+			 uint32_t db_flags, char *errmsg)
+{
+  FILE *f;
+  OSBF_HEADER_STRUCT header;
+  unsigned char lines[4096];
+  uint32_t num_lines, buckets_start;
+  off_t fingerprints_start, bloom_start;
 
-  class->bflags = calloc (class->header->num_buckets, sizeof (unsigned char));
-  if (!class->bflags)
-    {
-      close (class->fd);
-      munmap ((void *) class->header, (class->header->buckets_start +
-				       class->header->num_buckets) *
-	      sizeof (OSBF_BUCKET_STRUCT));
-      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
-		"Couldn't allocate memory for seen features array.");
-      return (-6);
-    }
+  f = create_new_file (cfcfile, errmsg);
+  if (f == NULL)
+    return -1;
 
-  class->classname = classname;
-  class->buckets = (OSBF_BUCKET_STRUCT *) class->header +
-    class->header->buckets_start;
+  /* Set the header, padded to 4 Kbytes. */
+  buckets_start = sizeof (lines) / OSBF_LINE_SIZE;
+  memset (&header, 0, sizeof (header));
+  header.version = OSBF_PACKED_VERSION;
+  header.db_flags = db_flags;
+  header.buckets_start = buckets_start;
+  header.num_buckets = num_buckets;
 
-  return 0;
+  /* Write header */
+  memset (lines, 0, sizeof (lines));
+  memcpy (lines, &header, sizeof (header));
+  if (write_new_header (f, cfcfile, lines, sizeof (lines), errmsg) != 0)
+    return -1;
+
+  /*  zero all buckets */
+  num_lines = (num_buckets + OSBF_LINE_BUCKETS - 1) / OSBF_LINE_BUCKETS;
+  return close_new_file (f, cfcfile,
+			 extensions_layout ((off_t) (buckets_start +
+						     num_lines) *
+					    OSBF_LINE_SIZE, num_buckets,
+					    db_flags, &fingerprints_start,
+					    &bloom_start), errmsg);
 }
 
 /*****************************************************************/
 
-int
-osbf_close_class (CLASS_STRUCT * class, char *errmsg)
+/* point a mapped multi-class file to another of its classes */
+static void
+select_column (CLASS_STRUCT * class, uint32_t column)
 {
-  int err = 0;
+  class->column = column;
+  class->header = (OSBF_HEADER_STRUCT *) class->map + column;
+}
 
-  if (class->header)
-    {
-      munmap ((void *) class->header, (class->header->buckets_start +
-				       class->header->num_buckets) *
-	      sizeof (OSBF_BUCKET_STRUCT));
-      class->header = NULL;
-      class->buckets = NULL;
-    }
+/* copy the counters of a class header */
+static void
+copy_header_counters (OSBF_HEADER_STRUCT * to, OSBF_HEADER_STRUCT * from)
+{
+  to->learnings = from->learnings;
+  to->extra_learnings = from->extra_learnings;
+  to->mistakes = from->mistakes;
+  to->classifications = from->classifications;
+}
 
-  if (class->bflags)
-    {
-      free (class->bflags);
-      class->bflags = NULL;
-    }
+/*
+ * Copy the features of the selected class of a file into the
+ * selected class of another one. Returns 0 if ok.
+ */
+static int
+copy_class (CLASS_STRUCT * to, CLASS_STRUCT * from, char *errmsg)
+{
+  uint32_t i, bindex;
 
-  if (class->fd >= 0)
+  for (i = 0; i < NUM_BUCKETS (from); i++)
     {
-      if (class->flags == O_RDWR)
-	{
-	  /* "touch" the file */
-	  OSBF_HEADER_STRUCT foo;
-	  read (class->fd, &foo, sizeof (foo));
-	  lseek (class->fd, 0, SEEK_SET);
-	  write (class->fd, &foo, sizeof (foo));
+      if (BUCKET_VALUE (from, i) == 0)
+	continue;
 
-#if !defined(OSBF_NO_FILE_LOCKING)
-	  if (osbf_unlock_file (class->fd, 0, 0) != 0)
-	    {
-	      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
-			"Couldn't unlock file: %s", class->classname);
-	      err = -1;
-	    }
-#endif
+      bindex = osbf_find_bucket (to, BUCKET_HASH (from, i),
+				 BUCKET_KEY (from, i));
+      if (!VALID_BUCKET (to, bindex))
+	{
+	  snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		    "%s is full!", to->classname);
+	  return -1;
+	}
 
+      /* put it in the free bucket at the end of the chain, without */
+      /* microgrooming, so no feature is lost in the copy          */
+      if (!BUCKET_IN_CHAIN (to, bindex))
+	{
+	  BUCKET_HASH (to, bindex) = BUCKET_HASH (from, i);
+	  BUCKET_KEY (to, bindex) = BUCKET_KEY (from, i);
+	  SET_FINGERPRINT (to, bindex, OSBF_FINGERPRINT (BUCKET_KEY (to,
+								    bindex)));
+	  osbf_bloom_add (to, BUCKET_HASH (to, bindex),
+			  BUCKET_KEY (to, bindex));
 	}
-      close (class->fd);
-      class->fd = -1;
+      SET_BUCKET_VALUE (to, bindex, BUCKET_VALUE (from, i));
     }
+  osbf_mark_dirty (to, 0, to->fsize);
 
-  return err;
+  return 0;
 }
 
-/*****************************************************************/
-
+/*
+ * Interleave the single-class files in classnames into a new
+ * multi-class file, keeping their order. If num_buckets is 0, the
+ * new file will have as many buckets as all of them together, so
+ * it can hold all their features.
+ */
 int
-osbf_lock_file (int fd, uint32_t start, uint32_t len)
+osbf_interleave (const char *classnames[], const char *mcfile,
+		 uint32_t num_buckets, char *errmsg)
 {
-  struct flock fl;
-  int max_lock_attempts = 20;
-  int errsv = 0;
-
-  fl.l_type = F_WRLCK;		/* write lock */
-  fl.l_whence = SEEK_SET;
-  fl.l_start = start;
-  fl.l_len = len;
+  CLASS_STRUCT mc, class;
+  uint32_t i, num_classes = 0;
+  uint64_t total_buckets = 0;
+  int error = 0;
 
-  while (max_lock_attempts > 0)
+  /* check the sources and get their total size */
+  for (i = 0; classnames[i] != NULL; i++)
     {
-      errsv = 0;
-      if (fcntl (fd, F_SETLK, &fl) < 0)
+      if (i >= OSBF_MAX_CLASSES)
 	{
-	  errsv = errno;
-	  if (errsv == EAGAIN || errsv == EACCES)
-	    {
-	      max_lock_attempts--;
-	      sleep (1);
-	    }
-	  else
-	    break;
+	  strncpy (errmsg, "Too many classes", OSBF_ERROR_MESSAGE_LEN);
+	  return -1;
 	}
-      else
-	break;
+      if (osbf_map_class (classnames[i], 0, O_RDONLY, &class, errmsg) != 0)
+	return -1;
+      if (class.num_columns > 1)
+	{
+	  osbf_close_class (&class, errmsg);
+	  snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		    "%s is already a multi-class file.", classnames[i]);
+	  return -1;
+	}
+      total_buckets += NUM_BUCKETS (&class);
+      osbf_close_class (&class, errmsg);
+      num_classes++;
     }
-  return errsv;
-}
 
-/*****************************************************************/
+  if (num_buckets == 0)
+    num_buckets = total_buckets < UINT32_MAX ? total_buckets : UINT32_MAX;
 
-int
-osbf_unlock_file (int fd, uint32_t start, uint32_t len)
+  if (osbf_create_mc_file (mcfile, num_buckets, num_classes, errmsg) != 0)
+    return -1;
+  if (osbf_open_class (mcfile, 0, O_RDWR, &mc, errmsg) != 0)
+    return -1;
+
+  for (i = 0; i < num_classes && error == 0; i++)
+    {
+      error = osbf_map_class (classnames[i], 0, O_RDONLY, &class, errmsg);
+      if (error != 0)
+	break;
+
+      select_column (&mc, i);
+      copy_header_counters (mc.header, class.header);
+      error = copy_class (&mc, &class, errmsg);
+      osbf_close_class (&class, errmsg);
+    }
+
+  if (osbf_close_class (&mc, errmsg) != 0 && error == 0)
+    error = -1;
+  if (error != 0)
+    unlink (mcfile);
+
+  return error;
+}
+
+/*****************************************************************/
+
+/*
+ * Split a multi-class file into new single-class files, one per
+ * class, with the same number of buckets, or 50% more if it's frozen.
+ */
+int
+osbf_split (const char *mcfile, const char *classnames[], char *errmsg)
 {
-  struct flock fl;
+  CLASS_STRUCT mc, class;
+  uint32_t i, num_classes, num_buckets;
+  int error = 0;
 
-  fl.l_type = F_UNLCK;
-  fl.l_whence = SEEK_SET;
-  fl.l_start = start;
-  fl.l_len = len;
-  if (fcntl (fd, F_SETLK, &fl) == -1)
+  if (osbf_map_class (mcfile, 0, O_RDONLY, &mc, errmsg) != 0)
     return -1;
-  else
-    return 0;
+
+  num_classes = mc.num_columns;
+  for (i = 0; i < num_classes; i++)
+    if (classnames[i] == NULL)
+      break;
+  if (mc.num_columns < 2 || i != num_classes || classnames[i] != NULL)
+    {
+      osbf_close_class (&mc, errmsg);
+      if (num_classes < 2)
+	snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		  "%s is not a multi-class file.", mcfile);
+      else
+	snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		  "%s has %" PRIu32 " classes.", mcfile, num_classes);
+      return -1;
+    }
+
+  /* a frozen file has no free buckets, leave room to learn */
+  num_buckets = NUM_BUCKETS (&mc);
+  if (mc.frozen)
+    num_buckets += num_buckets / 2 + 1;
+
+  for (i = 0; i < num_classes && error == 0; i++)
+    {
+      error = osbf_create_cfcfile (classnames[i], num_buckets,
+				   OSBF_VERSION, 0, errmsg);
+      if (error != 0)
+	break;
+      error = osbf_open_class (classnames[i], 0, O_RDWR, &class, errmsg);
+      if (error != 0)
+	break;
+
+      select_column (&mc, i);
+      copy_header_counters (class.header, mc.header);
+      error = copy_class (&class, &mc, errmsg);
+      if (osbf_close_class (&class, errmsg) != 0 && error == 0)
+	error = -1;
+    }
+
+  osbf_close_class (&mc, errmsg);
+  return error;
+}
+
+/*****************************************************************/
+
+/* a feature of a class to be frozen */
+struct freeze_item
+{
+  uint32_t hash;
+  uint32_t key;
+  uint32_t column;		/* class in the frozen file */
+  uint32_t value;
+};
+
+static int
+compare_freeze_items (const void *a, const void *b)
+{
+  const struct freeze_item *ia = a, *ib = b;
+
+  if (ia->hash != ib->hash)
+    return ia->hash < ib->hash ? -1 : 1;
+  if (ia->key != ib->key)
+    return ia->key < ib->key ? -1 : 1;
+  return ia->column < ib->column ? -1 : ia->column > ib->column;
+}
+
+/* average number of features per pilot */
+#define FREEZE_PILOT_LOAD 4
+/* seeds of the feature hash tried before giving up */
+#define FREEZE_MAX_SEEDS 16
+
+/*
+ * Find a pilot for each group of features with the same pilot index,
+ * largest groups first, that puts all its features in free positions.
+ * The position of feature i is returned in pos[i]. Returns 0 if ok,
+ * 1 if a group has no such pilot and another seed must be tried, or
+ * -1 if out of memory.
+ */
+static int
+find_pilots (const uint64_t * h, uint32_t n, uint32_t num_pilots,
+	     uint32_t table_size, uint16_t * pilots, uint32_t * pos)
+{
+  uint32_t *start, *members, *order, *count;
+  unsigned char *taken;
+  uint32_t i, j, k, g, max_size = 0;
+  uint32_t pilot;
+  int err = 0;
+
+  start = calloc ((size_t) num_pilots + 1, sizeof (uint32_t));
+  members = malloc ((size_t) n * sizeof (uint32_t) + 1);
+  order = malloc ((size_t) num_pilots * sizeof (uint32_t));
+  taken = calloc (table_size, 1);
+  count = NULL;
+  if (start == NULL || members == NULL || order == NULL || taken == NULL)
+    err = -1;
+
+  /* group the features by pilot index */
+  if (err == 0)
+    {
+      for (i = 0; i < n; i++)
+	start[mph_pilot_index (h[i], num_pilots) + 1]++;
+      for (g = 0; g < num_pilots; g++)
+	{
+	  if (start[g + 1] > max_size)
+	    max_size = start[g + 1];
+	  start[g + 1] += start[g];
+	}
+      for (i = 0; i < n; i++)
+	members[start[mph_pilot_index (h[i], num_pilots)]++] = i;
+      for (g = num_pilots; g > 0; g--)
+	start[g] = start[g - 1];
+      start[0] = 0;
+
+      /* and the groups by size, largest first */
+      count = calloc ((size_t) max_size + 2, sizeof (uint32_t));
+      if (count == NULL)
+	err = -1;
+    }
+  if (err == 0)
+    {
+      for (g = 0; g < num_pilots; g++)
+	count[max_size - (start[g + 1] - start[g]) + 1]++;
+      for (k = 0; k <= max_size; k++)
+	count[k + 1] += count[k];
+      for (g = 0; g < num_pilots; g++)
+	order[count[max_size - (start[g + 1] - start[g])]++] = g;
+    }
+
+  for (k = 0; err == 0 && k < num_pilots; k++)
+    {
+      g = order[k];
+      pilots[g] = 0;
+      if (start[g] == start[g + 1])
+	continue;
+      for (pilot = 0; pilot <= UINT16_MAX; pilot++)
+	{
+	  for (i = start[g]; i < start[g + 1]; i++)
+	    {
+	      pos[members[i]] = mph_position (h[members[i]], pilot,
+					      table_size);
+	      if (taken[pos[members[i]]])
+		break;
+	      for (j = start[g]; j < i; j++)
+		if (pos[members[j]] == pos[members[i]])
+		  break;
+	      if (j < i)
+		break;
+	    }
+	  if (i == start[g + 1])
+	    break;
+	}
+      if (pilot > UINT16_MAX)
+	err = 1;
+      else
+	{
+	  pilots[g] = (uint16_t) pilot;
+	  for (i = start[g]; i < start[g + 1]; i++)
+	    taken[pos[members[i]]] = 1;
+	}
+    }
+
+  free (start);
+  free (members);
+  free (order);
+  free (taken);
+  free (count);
+  return err;
+}
+
+/*
+ * Collect the features of the classes in classnames, a NULL terminated
+ * array, sorted by feature and class, in *items. Only the features a
+ * lookup finds are taken. The counters of each class are copied to
+ * headers. Returns the number of items, or -1 on error.
+ */
+static int64_t
+collect_features (const char *classnames[], uint32_t num_classes,
+		  OSBF_HEADER_STRUCT * headers, struct freeze_item **items,
+		  char *errmsg)
+{
+  CLASS_STRUCT class;
+  struct freeze_item *all = NULL, *more;
+  uint64_t total = 0, used;
+  uint32_t c, i;
+
+  for (c = 0; c < num_classes; c++)
+    {
+      if (osbf_map_class (classnames[c], osbf_class_column (classnames, c),
+			  O_RDONLY, &class, errmsg) != 0)
+	{
+	  free (all);
+	  return -1;
+	}
+      copy_header_counters (&headers[c], class.header);
+
+      for (used = 0, i = 0; i < NUM_BUCKETS (&class); i++)
+	if (BUCKET_IN_CLASS (&class, i))
+	  used++;
+      more = realloc (all, (total + used) * sizeof (struct freeze_item) + 1);
+      if (more == NULL)
+	{
+	  osbf_close_class (&class, errmsg);
+	  free (all);
+	  strncpy (errmsg, "Error allocating memory", OSBF_ERROR_MESSAGE_LEN);
+	  return -1;
+	}
+      all = more;
+
+      for (i = 0; i < NUM_BUCKETS (&class); i++)
+	if (BUCKET_IN_CLASS (&class, i) &&
+	    osbf_find_bucket (&class, BUCKET_HASH (&class, i),
+			      BUCKET_KEY (&class, i)) == i)
+	  {
+	    if (BUCKET_VALUE (&class, i) > UINT16_MAX)
+	      {
+		osbf_close_class (&class, errmsg);
+		free (all);
+		snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+			  "%s has a count too large to be frozen.",
+			  classnames[c]);
+		return -1;
+	      }
+	    all[total].hash = BUCKET_HASH (&class, i);
+	    all[total].key = BUCKET_KEY (&class, i);
+	    all[total].column = c;
+	    all[total].value = BUCKET_VALUE (&class, i);
+	    total++;
+	  }
+      osbf_close_class (&class, errmsg);
+    }
+
+  qsort (all, total, sizeof (struct freeze_item), compare_freeze_items);
+  *items = all;
+  return (int64_t) total;
+}
+
+/* first word of a bucket in the image of a frozen file */
+static uint32_t *
+first_word (unsigned char *image, uint32_t buckets_start,
+	    size_t bucket_size, uint32_t i)
+{
+  return (uint32_t *) (image + ((size_t) buckets_start + i) * bucket_size);
 }
 
+/*
+ * Compile the classes in classnames, a NULL terminated array, into a
+ * frozen file with the same classes, in the same order. Classes of a
+ * multi-class file are given by repeating its name, and so must be
+ * the classes of the frozen file when it's used. The file is written
+ * under a temporary name and renamed, so it replaces an older
+ * snapshot atomically. Returns 0 if ok.
+ */
+int
+osbf_freeze (const char *classnames[], const char *frozenfile,
+	     char *errmsg)
+{
+  OSBF_HEADER_STRUCT headers[OSBF_MAX_CLASSES];
+  OSBF_FROZEN_STRUCT fz;
+  struct freeze_item *items = NULL;
+  uint64_t *h = NULL;
+  uint32_t *first = NULL, *pos = NULL, *words, *remap;
+  uint16_t *pilots = NULL;
+  unsigned char *image = NULL;
+  char *tmpfile = NULL;
+  FILE *f;
+  int64_t num_items;
+  size_t bucket_size, header_size, size;
+  uint32_t num_classes, buckets_start, n, i, j, c, free_pos, attempt;
+  int error = 0;
+
+  for (num_classes = 0; classnames[num_classes] != NULL; num_classes++)
+    if (num_classes >= OSBF_MAX_CLASSES)
+      {
+	strncpy (errmsg, "Too many classes", OSBF_ERROR_MESSAGE_LEN);
+	return -1;
+      }
+  if (num_classes == 0)
+    {
+      strncpy (errmsg, "At least one class must be given.",
+	       OSBF_ERROR_MESSAGE_LEN);
+      return -1;
+    }
+
+  memset (headers, 0, sizeof (headers));
+  num_items = collect_features (classnames, num_classes, headers, &items,
+				errmsg);
+  if (num_items < 0)
+    return -1;
+
+  /* one bucket per feature, with the counts of all classes */
+  first = malloc (((size_t) num_items + 1) * sizeof (uint32_t));
+  if (first == NULL)
+    error = -1;
+  for (n = 0, i = 0; error == 0 && i < num_items; i++)
+    if (i == 0 || items[i].hash != items[i - 1].hash ||
+	items[i].key != items[i - 1].key)
+      first[n++] = i;
+  if (first != NULL)
+    first[n] = (uint32_t) num_items;
+
+  fz.num_pilots = n / FREEZE_PILOT_LOAD + 1;
+  fz.table_size = n + n / 50 + 1;
+  if (error == 0)
+    {
+      h = malloc ((size_t) n * sizeof (uint64_t) + 1);
+      pos = malloc ((size_t) n * sizeof (uint32_t) + 1);
+      pilots = malloc ((size_t) fz.num_pilots * sizeof (uint16_t));
+      if (h == NULL || pos == NULL || pilots == NULL)
+	error = -1;
+    }
+
+  /* find the perfect hash, trying other seeds if needed */
+  fz.seed = 0x6F7362662D6C7561ULL;
+  for (attempt = 0; error == 0; attempt++)
+    {
+      for (i = 0; i < n; i++)
+	h[i] = mph_hash (fz.seed, items[first[i]].hash, items[first[i]].key);
+      error = find_pilots (h, n, fz.num_pilots, fz.table_size, pilots, pos);
+      if (error != 1)
+	break;
+      if (attempt + 1 == FREEZE_MAX_SEEDS)
+	{
+	  snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		    "Couldn't find a perfect hash for %" PRIu32
+		    " features.", n);
+	  break;
+	}
+      error = 0;
+      fz.seed = mph_mix (fz.seed + attempt + 1);
+    }
+  if (error < 0)
+    strncpy (errmsg, "Error allocating memory", OSBF_ERROR_MESSAGE_LEN);
+
+  /* the headers take about 4 Kbytes, like in a multi-class file */
+  bucket_size = (2 + (num_classes + 1) / 2) * sizeof (uint32_t);
+  header_size = num_classes * sizeof (OSBF_HEADER_STRUCT) + sizeof (fz);
+  buckets_start = (4096 + bucket_size - 1) / bucket_size;
+  if (buckets_start * bucket_size < header_size)
+    buckets_start = (header_size + bucket_size - 1) / bucket_size;
+  fz.pilots_start = OSBF_LINE_ALIGN (((uint64_t) buckets_start + n) *
+				     bucket_size);
+  fz.remap_start = OSBF_LINE_ALIGN (fz.pilots_start +
+				    (uint64_t) fz.num_pilots *
+				    sizeof (uint16_t));
+  size = fz.remap_start + (size_t) (fz.table_size - n) * sizeof (uint32_t);
+
+  if (error == 0)
+    {
+      image = calloc (size, 1);
+      tmpfile = malloc (strlen (frozenfile) + 32);
+      if (image == NULL || tmpfile == NULL)
+	{
+	  strncpy (errmsg, "Error allocating memory", OSBF_ERROR_MESSAGE_LEN);
+	  error = -1;
+	}
+    }
+
+  if (error == 0)
+    {
+      for (c = 0; c < num_classes; c++)
+	{
+	  headers[c].version = OSBF_FROZEN_VERSION;
+	  headers[c].db_flags = 0;
+	  headers[c].buckets_start = buckets_start;
+	  headers[c].num_buckets = n;
+	  headers[c].num_classes = num_classes;
+	}
+      memcpy (image, headers, num_classes * sizeof (OSBF_HEADER_STRUCT));
+      memcpy (image + num_classes * sizeof (OSBF_HEADER_STRUCT), &fz,
+	      sizeof (fz));
+      memcpy (image + fz.pilots_start, pilots,
+	      (size_t) fz.num_pilots * sizeof (uint16_t));
+
+      /* positions beyond the features go to the free ones below */
+      remap = (uint32_t *) (image + fz.remap_start);
+      free_pos = 0;
+      for (i = 0; i < n; i++)
+	if (pos[i] < n)
+	  first_word (image, buckets_start, bucket_size, pos[i])[1] = 1;
+      for (i = 0; i < n; i++)
+	if (pos[i] >= n)
+	  {
+	    while (first_word (image, buckets_start, bucket_size,
+			       free_pos)[1] != 0)
+	      free_pos++;
+	    first_word (image, buckets_start, bucket_size, free_pos)[1] = 1;
+	    remap[pos[i] - n] = free_pos;
+	    pos[i] = free_pos;
+	  }
+
+      for (i = 0; i < n; i++)
+	{
+	  words = first_word (image, buckets_start, bucket_size, pos[i]);
+	  words[0] = items[first[i]].hash;
+	  words[1] = items[first[i]].key;
+	  for (j = first[i]; j < first[i + 1]; j++)
+	    ((uint16_t *) (words + 2))[items[j].column] =
+	      (uint16_t) items[j].value;
+	}
+    }
+
+  if (error == 0)
+    {
+      sprintf (tmpfile, "%s.%ld.tmp", frozenfile, (long) getpid ());
+      unlink (tmpfile);
+      f = create_new_file (tmpfile, errmsg);
+      if (f == NULL)
+	error = -1;
+      else if (fwrite (image, size, 1, f) != 1)
+	{
+	  fclose (f);
+	  unlink (tmpfile);
+	  snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		    "Couldn't write to: '%s'", tmpfile);
+	  error = -1;
+	}
+      else if (close_new_file (f, tmpfile, size, errmsg) != 0)
+	error = -1;
+      else if (rename (tmpfile, frozenfile) != 0)
+	{
+	  unlink (tmpfile);
+	  snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		    "Couldn't rename %s to %s.", tmpfile, frozenfile);
+	  error = -1;
+	}
+    }
+
+  free (items);
+  free (first);
+  free (h);
+  free (pos);
+  free (pilots);
+  free (image);
+  free (tmpfile);
+  return error;
+}
 
 /*****************************************************************/
 
+/*
+ * Convert a single-class file to a new file in the given format,
+ * OSBF_VERSION or OSBF_PACKED_VERSION, with the same number of
+ * buckets. The buckets keep their positions, so the chains are
+ * unchanged. The db_flags bits selected by flags_mask are taken from
+ * db_flags, the others are kept from the old file.
+ */
 int
-osbf_dump (const char *cfcfile, const char *csvfile, char *errmsg)
+osbf_convert (const char *cfcfile_from, const char *cfcfile_to,
+	      uint32_t version, uint32_t db_flags, uint32_t flags_mask,
+	      char *errmsg)
+{
+  CLASS_STRUCT from, to;
+  uint32_t i;
+  int error;
+
+  if (version != OSBF_VERSION && version != OSBF_PACKED_VERSION)
+    {
+      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		"Invalid version: %" PRIu32, version);
+      return -1;
+    }
+
+  if (osbf_map_class (cfcfile_from, 0, O_RDONLY, &from, errmsg) != 0)
+    return -1;
+  if (from.num_columns > 1 || from.frozen)
+    {
+      osbf_close_class (&from, errmsg);
+      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		from.frozen ? "%s is a frozen file." :
+		"%s is a multi-class file.", cfcfile_from);
+      return -1;
+    }
+
+  db_flags = (from.header->db_flags & ~flags_mask) | (db_flags & flags_mask);
+  if ((db_flags & OSBF_DB_ROBIN_HOOD) && (db_flags & OSBF_DB_FINGERPRINTS))
+    {
+      osbf_close_class (&from, errmsg);
+      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		"Robin Hood files can't have fingerprints.");
+      return -1;
+    }
+
+  if (version == OSBF_PACKED_VERSION)
+    error = osbf_create_packed_file (cfcfile_to, NUM_BUCKETS (&from),
+				     db_flags, errmsg);
+  else
+    error = osbf_create_cfcfile (cfcfile_to, NUM_BUCKETS (&from),
+				 OSBF_VERSION, db_flags, errmsg);
+  if (error == 0)
+    error = osbf_open_class (cfcfile_to, 0, O_RDWR, &to, errmsg);
+  if (error != 0)
+    {
+      osbf_close_class (&from, errmsg);
+      return -1;
+    }
+
+  copy_header_counters (to.header, from.header);
+  for (i = 0; i < NUM_BUCKETS (&from); i++)
+    {
+      BUCKET_HASH (&to, i) = BUCKET_HASH (&from, i);
+      BUCKET_KEY (&to, i) = BUCKET_KEY (&from, i);
+      SET_BUCKET_VALUE (&to, i, BUCKET_VALUE (&from, i));
+      if (BUCKET_IN_CHAIN (&to, i))
+	{
+	  SET_FINGERPRINT (&to, i, OSBF_FINGERPRINT (BUCKET_KEY (&to, i)));
+	  osbf_bloom_add (&to, BUCKET_HASH (&to, i), BUCKET_KEY (&to, i));
+	}
+    }
+  osbf_mark_dirty (&to, 0, to.fsize);
+
+  osbf_close_class (&from, errmsg);
+  if (osbf_close_class (&to, errmsg) != 0)
+    return -1;
+
+  return 0;
+}
+
+/*****************************************************************/
+
+/* create an empty file in the same format as a mapped one */
+static int
+create_like (CLASS_STRUCT * class, const char *file, uint32_t num_buckets,
+	     char *errmsg)
+{
+  OSBF_HEADER_STRUCT *header = (OSBF_HEADER_STRUCT *) class->map;
+
+  if (class->num_columns > 1)
+    return osbf_create_mc_file (file, num_buckets, class->num_columns,
+				errmsg);
+  if (class->packed)
+    return osbf_create_packed_file (file, num_buckets, header->db_flags,
+				    errmsg);
+  return osbf_create_cfcfile (file, num_buckets, OSBF_VERSION,
+			      header->db_flags, errmsg);
+}
+
+/* copy a bucket, with the counts of all classes, between two files */
+/* in the same format                                               */
+static void
+copy_bucket_to (CLASS_STRUCT * to, uint32_t ti,
+		CLASS_STRUCT * from, uint32_t fi)
+{
+  if (to->packed)
+    {
+      PACKED_WORD (to, ti, 0) = PACKED_WORD (from, fi, 0);
+      PACKED_WORD (to, ti, 1) = PACKED_WORD (from, fi, 1);
+      PACKED_VALUE (to, ti) = PACKED_VALUE (from, fi);
+    }
+  else
+    memcpy (&BUCKET_WORD (to, ti, 0), &BUCKET_WORD (from, fi, 0),
+	    to->bucket_words * sizeof (uint32_t));
+  SET_FINGERPRINT (to, ti, OSBF_FINGERPRINT (BUCKET_KEY (to, ti)));
+  osbf_bloom_add (to, BUCKET_HASH (to, ti), BUCKET_KEY (to, ti));
+}
+
+/* a used bucket of the old file and its place in the new one */
+struct resize_entry
+{
+  uint32_t home;		/* right position in the new file */
+  uint32_t from;		/* position in the old file */
+  uint64_t pos;			/* position in the new file, may be >= */
+				/* num_buckets before wrapping around  */
+};
+
+static int
+compare_resize_entries (const void *a, const void *b)
+{
+  const struct resize_entry *ea = a, *eb = b;
+
+  if (ea->home != eb->home)
+    return ea->home < eb->home ? -1 : 1;
+  return ea->from < eb->from ? -1 : ea->from > eb->from;
+}
+
+/*
+ * Rehash the used buckets of a mapped file into an empty one, in the
+ * same format. The buckets are sorted by their right positions in the
+ * new file and placed in that order, each at its right position or
+ * right after the previous one, so the new file is written in bucket
+ * order and the chains are the same linear probing would build, also
+ * valid for Robin Hood files. Returns 0 if ok.
+ */
+static int
+rehash_class (CLASS_STRUCT * to, CLASS_STRUCT * from, char *errmsg)
+{
+  struct resize_entry *e;
+  uint32_t i, n, used = 0;
+  uint64_t next;
+
+  for (i = 0; i < NUM_BUCKETS (from); i++)
+    if (BUCKET_IN_CHAIN (from, i))
+      used++;
+
+  /* at least one free bucket is needed to end the chains */
+  n = NUM_BUCKETS (to);
+  if (used >= n)
+    {
+      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		"%s has %" PRIu32 " used buckets, too many for %" PRIu32
+		" buckets.", from->classname, used, n);
+      return -1;
+    }
+  if (used == 0)
+    return 0;
+
+  e = malloc (used * sizeof (struct resize_entry));
+  if (e == NULL)
+    {
+      strncpy (errmsg, "Error allocating memory", OSBF_ERROR_MESSAGE_LEN);
+      return -1;
+    }
+
+  used = 0;
+  for (i = 0; i < NUM_BUCKETS (from); i++)
+    if (BUCKET_IN_CHAIN (from, i))
+      {
+	e[used].home = HASH_INDEX (to, BUCKET_HASH (from, i));
+	e[used].from = i;
+	used++;
+      }
+  qsort (e, used, sizeof (struct resize_entry), compare_resize_entries);
+
+  next = 0;
+  for (i = 0; i < used; i++)
+    {
+      e[i].pos = e[i].home > next ? e[i].home : next;
+      next = e[i].pos + 1;
+    }
+  /* buckets past the end wrap around and push the first ones */
+  if (next > n)
+    {
+      next -= n;
+      for (i = 0; i < used && e[i].pos < next; i++)
+	e[i].pos = next++;
+    }
+
+  for (i = 0; i < used; i++)
+    copy_bucket_to (to, (uint32_t) (e[i].pos % n), from, e[i].from);
+
+  free (e);
+  return 0;
+}
+
+/* give a new file the mode, owner and group of the one it replaces */
+static int
+copy_file_mode (int from_fd, int to_fd)
+{
+  struct stat st;
+
+  if (fstat (from_fd, &st) != 0)
+    return -1;
+  if (fchown (to_fd, st.st_uid, st.st_gid) != 0 &&
+      fchown (to_fd, (uid_t) - 1, st.st_gid) != 0)
+    {
+      /* not allowed, it keeps the owner and group of its creator */
+    }
+  /* after fchown, which may clear the set-id bits */
+  return fchmod (to_fd, st.st_mode & 07777);
+}
+
+/* flush the directory of path, to make a rename into it durable */
+static int
+sync_dir_of (const char *path)
+{
+  char *dir, *slash;
+  int fd, err = -1;
+
+  dir = strdup (path);
+  if (dir == NULL)
+    return -1;
+  slash = strrchr (dir, '/');
+  if (slash == NULL)
+    strcpy (dir, ".");
+  else if (slash == dir)
+    slash[1] = '\0';
+  else
+    *slash = '\0';
+  fd = open (dir, O_RDONLY);
+  if (fd >= 0)
+    {
+      err = fsync (fd);
+      close (fd);
+    }
+  free (dir);
+  return err;
+}
+
+/*
+ * Resize a class file to num_buckets buckets. The used buckets are
+ * rehashed, with their counts and the header counters, into a new
+ * file in the same format, which then replaces the old one with
+ * rename, so readers see either of them complete. The new file is
+ * created before the old one is locked, so the lock is held only
+ * while the buckets are copied.
+ */
+int
+osbf_resize (const char *cfcfile, uint32_t num_buckets, char *errmsg)
+{
+  CLASS_STRUCT from, to;
+  OSBF_HEADER_STRUCT *hfrom, *hto;
+  char *tmpfile;
+  uint32_t c;
+  int attempts = 3;
+  int error;
+
+  if (num_buckets == 0)
+    {
+      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		"Invalid number of buckets: %" PRIu32, num_buckets);
+      return -1;
+    }
+
+  tmpfile = malloc (strlen (cfcfile) + 32);
+  if (tmpfile == NULL)
+    {
+      strncpy (errmsg, "Error allocating memory", OSBF_ERROR_MESSAGE_LEN);
+      return -1;
+    }
+  sprintf (tmpfile, "%s.%ld.tmp", cfcfile, (long) getpid ());
+
+  if (osbf_map_class (cfcfile, 0, O_RDWR, &from, errmsg) != 0)
+    {
+      free (tmpfile);
+      return -1;
+    }
+
+  /* a leftover of a process with the same pid */
+  unlink (tmpfile);
+  error = create_like (&from, tmpfile, num_buckets, errmsg);
+  if (error == 0)
+    {
+      error = osbf_map_class (tmpfile, 0, O_RDWR, &to, errmsg);
+      if (error != 0)
+	unlink (tmpfile);
+      else if (copy_file_mode (from.fd, to.fd) != 0)
+	{
+	  snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		    "Couldn't set the mode of %s: %s", tmpfile,
+		    strerror (errno));
+	  osbf_close_class (&to, errmsg);
+	  unlink (tmpfile);
+	  error = -1;
+	}
+    }
+  if (error != 0)
+    {
+      osbf_close_class (&from, errmsg);
+      free (tmpfile);
+      return -1;
+    }
+
+  /* the file may be replaced while we wait for the lock */
+  while ((error = osbf_lock_class (&from, errmsg)) == 0 &&
+	 osbf_class_changed (&from))
+    {
+      osbf_unlock_class (&from, errmsg);
+      if (--attempts == 0)
+	{
+	  snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		    "File keeps changing: %s.", cfcfile);
+	  error = -1;
+	  break;
+	}
+      error = osbf_check_class (&from, errmsg);
+      if (error != 0)
+	break;
+      if (from.num_columns != to.num_columns || from.packed != to.packed)
+	{
+	  snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		    "%s changed format while being resized.", cfcfile);
+	  error = -1;
+	  break;
+	}
+    }
+
+  if (error == 0)
+    error = rehash_class (&to, &from, errmsg);
+
+  if (error == 0)
+    {
+      hfrom = (OSBF_HEADER_STRUCT *) from.map;
+      hto = (OSBF_HEADER_STRUCT *) to.map;
+      for (c = 0; c < from.num_columns; c++)
+	{
+	  copy_header_counters (hto + c, hfrom + c);
+	  hto[c].db_flags = hfrom[c].db_flags;
+	}
+      if (fsync (to.fd) != 0 || rename (tmpfile, cfcfile) != 0)
+	{
+	  snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		    "Couldn't replace %s: %s", cfcfile, strerror (errno));
+	  error = -1;
+	}
+      else if (sync_dir_of (cfcfile) != 0)
+	{
+	  /* replaced, but the rename may not survive a crash */
+	  snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		    "Couldn't sync the directory of %s: %s", cfcfile,
+		    strerror (errno));
+	  error = -1;
+	}
+    }
+
+  osbf_close_class (&to, errmsg);
+  if (error != 0)
+    unlink (tmpfile);
+  osbf_close_class (&from, errmsg);
+  free (tmpfile);
+
+  return error;
+}
+
+/*****************************************************************/
+
+/* work on a set of files, spread across worker threads */
+struct file_job
+{
+  int (*work) (const char *file, struct file_job * job, char *errmsg);
+  const char **files;
+  uint32_t num_files;
+  uint32_t first;
+  uint32_t step;
+  uint32_t num_buckets;
+  uint32_t num_classes;
+  uint32_t db_flags;
+  const char **const *sources;	/* of each file, for import_job */
+  uint32_t current;		/* index of the file being worked on */
+  int err;
+  char errmsg[OSBF_ERROR_MESSAGE_LEN];
+#ifndef OSBF_NO_THREADS
+  pthread_t thread;
+  int started;
+#endif
+};
+
+static void *
+file_worker (void *arg)
+{
+  struct file_job *job = (struct file_job *) arg;
+  uint32_t i;
+
+  for (i = job->first; i < job->num_files && job->err == 0; i += job->step)
+    {
+      job->current = i;
+      job->err = job->work (job->files[i], job, job->errmsg);
+    }
+
+  return NULL;
+}
+
+/*
+ * Run the work of "proto" on each of the num_files files, up to
+ * OSBF_MAX_WORKERS at a time. Returns the first error found.
+ */
+static int
+run_file_jobs (struct file_job *proto, const char **files,
+	       uint32_t num_files, char *errmsg)
+{
+  struct file_job jobs[OSBF_MAX_WORKERS];
+  uint32_t t, num_workers;
+  int err = 0;
+
+  if (num_files == 0)
+    return 0;
+  num_workers = num_files < OSBF_MAX_WORKERS ? num_files : OSBF_MAX_WORKERS;
+#ifdef OSBF_NO_THREADS
+  if (num_workers > 1)
+    num_workers = 1;
+#endif
+
+  for (t = 0; t < num_workers; t++)
+    {
+      jobs[t] = *proto;
+      jobs[t].files = files;
+      jobs[t].num_files = num_files;
+      jobs[t].first = t;
+      jobs[t].step = num_workers;
+      jobs[t].err = 0;
+      jobs[t].errmsg[0] = '\0';
+    }
+
+#ifndef OSBF_NO_THREADS
+  /* if a thread can't be created, its share is done below */
+  for (t = 1; t < num_workers; t++)
+    jobs[t].started =
+      pthread_create (&jobs[t].thread, NULL, file_worker, &jobs[t]) == 0;
+#endif
+
+  for (t = 0; t < num_workers; t++)
+    {
+#ifndef OSBF_NO_THREADS
+      if (t > 0 && jobs[t].started)
+	{
+	  pthread_join (jobs[t].thread, NULL);
+	  continue;
+	}
+#endif
+      file_worker (&jobs[t]);
+    }
+
+  for (t = 0; t < num_workers; t++)
+    if (jobs[t].err != 0 && err == 0)
+      {
+	err = jobs[t].err;
+	snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN, "%s", jobs[t].errmsg);
+      }
+
+  return err;
+}
+
+static int
+resize_job (const char *file, struct file_job *job, char *errmsg)
+{
+  return osbf_resize (file, job->num_buckets, errmsg);
+}
+
+/*
+ * Resize the files of the classes in classnames, a NULL terminated
+ * array, to num_buckets buckets each. A multi-class file, given once
+ * per class, is resized once. The files are resized in parallel, up
+ * to OSBF_MAX_WORKERS at a time.
+ */
+int
+osbf_resize_files (const char *classnames[], uint32_t num_buckets,
+		   char *errmsg)
+{
+  const char *files[OSBF_MAX_CLASSES];
+  struct file_job job;
+  uint32_t i, num_files = 0;
+
+  for (i = 0; classnames[i] != NULL && i < OSBF_MAX_CLASSES; i++)
+    if (osbf_class_column (classnames, i) == 0)
+      files[num_files++] = classnames[i];
+
+  job.work = resize_job;
+  job.num_buckets = num_buckets;
+  return run_file_jobs (&job, files, num_files, errmsg);
+}
+
+static int
+import_job (const char *file, struct file_job *job, char *errmsg)
+{
+  return osbf_import_sources (file, job->sources[job->current], errmsg);
+}
+
+/*
+ * Import into each class file files[i], of a NULL terminated array,
+ * the class files in the NULL terminated array sources[i], with
+ * osbf_import_sources. The files are merged in parallel, up to
+ * OSBF_MAX_WORKERS at a time. Returns 0 if ok or 1 on errors.
+ */
+int
+osbf_import_files (const char *files[], const char **const sources[],
+		   char *errmsg)
+{
+  struct file_job job;
+  uint32_t num_files;
+
+  for (num_files = 0; files[num_files] != NULL; num_files++);
+
+  job.work = import_job;
+  job.sources = sources;
+  return run_file_jobs (&job, files, num_files, errmsg) != 0;
+}
+
+static int
+create_job (const char *file, struct file_job *job, char *errmsg)
+{
+  if (job->num_classes > 1)
+    return osbf_create_mc_file (file, job->num_buckets, job->num_classes,
+				errmsg);
+  return osbf_create_cfcfile (file, job->num_buckets, OSBF_VERSION,
+			      job->db_flags, errmsg);
+}
+
+/*
+ * Create the files in the NULL terminated array files, in parallel,
+ * with num_buckets buckets each: multi-class files with num_classes
+ * classes if num_classes > 1, else single class files with db_flags.
+ */
+int
+osbf_create_files (const char *files[], uint32_t num_buckets,
+		   uint32_t num_classes, uint32_t db_flags, char *errmsg)
+{
+  struct file_job job;
+  uint32_t num_files;
+
+  /* don't create any if one of them already exists */
+  for (num_files = 0; files[num_files] != NULL; num_files++)
+    if (check_file (files[num_files]) >= 0)
+      {
+	snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		  "File already exists: '%s'", files[num_files]);
+	return -1;
+      }
+
+  job.work = create_job;
+  job.num_buckets = num_buckets;
+  job.num_classes = num_classes;
+  job.db_flags = db_flags;
+  return run_file_jobs (&job, files, num_files, errmsg);
+}
+
+/*****************************************************************/
+
+/* Check if a file exists. Return its length if yes and < 0 if no */
+off_t
+check_file (const char *file)
+{
+  int fd;
+  off_t fsize;
+
+  fd = open (file, O_RDONLY);
+  if (fd < 0)
+    return -1;
+  fsize = lseek (fd, 0L, SEEK_END);
+  if (fsize < 0)
+    return -2;
+  close (fd);
+
+  return fsize;
+}
+
+/*****************************************************************/
+
+/* page faults taken so far by this thread, or process */
+void
+osbf_page_faults (long *minor, long *major)
+{
+  struct rusage ru;
+
+#ifdef RUSAGE_THREAD
+  if (getrusage (RUSAGE_THREAD, &ru) != 0)
+#endif
+    if (getrusage (RUSAGE_SELF, &ru) != 0)
+      {
+	*minor = *major = 0;
+	return;
+      }
+  *minor = ru.ru_minflt;
+  *major = ru.ru_majflt;
+}
+
+/* apply the map_advice and map_hugepages policy to a mapped class */
+static void
+advise_class (CLASS_STRUCT * class)
+{
+#ifdef MADV_RANDOM
+  if (map_advice == OSBF_MAP_RANDOM)
+    madvise (class->map, class->fsize, MADV_RANDOM);
+  else if (map_advice == OSBF_MAP_WILLNEED)
+    madvise (class->map, class->fsize, MADV_WILLNEED);
+#endif
+#ifdef MADV_HUGEPAGE
+  /* only honored where the kernel has huge pages for file mappings */
+  if (map_hugepages)
+    madvise (class->map, class->fsize, MADV_HUGEPAGE);
+#endif
+}
+
+/*
+ * Lock the pages of a mapped class in memory, for databases kept open
+ * by osbf_open_dbset. They're unlocked by munmap. Returns 0 if ok.
+ */
+int
+osbf_mlock_class (CLASS_STRUCT * class, char *errmsg)
+{
+  if (mlock (class->map, class->fsize) != 0)
+    {
+      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		"Couldn't lock %s in memory: %s", class->classname,
+		strerror (errno));
+      return -1;
+    }
+  class->mlocked = 1;
+  return 0;
+}
+
+/*****************************************************************/
+
+/*
+ * Open a class file and mmap it into memory, without locking it.
+ * The whole file is mapped for writing if flags == O_RDWR. "column"
+ * selects the class in a multi-class file and is ignored otherwise.
+ */
+int
+osbf_map_class (const char *classname, uint32_t column, int flags,
+		CLASS_STRUCT * class, char *errmsg)
+{
+  int prot, mflags = MAP_SHARED;
+  struct stat st;
+  OSBF_HEADER_STRUCT *header;
+  off_t buckets_end = 0, fingerprints_start = 0, bloom_start = 0;
+
+  /* clear class structure */
+  class->fd = -1;
+  class->flags = O_RDONLY;
+  class->locked = 0;
+  class->num_stripes = 0;
+  class->stripes = NULL;
+  class->header_locked = 0;
+  class->seq = NULL;
+  class->seq_regions = 0;
+  class->checkpoint = NULL;
+  class->seq_shift = 0;
+  /* set even if the mapping fails, for osbf_check_class to retry it */
+  class->classname = classname;
+  class->header = NULL;
+  class->counters = NULL;
+  class->buckets = NULL;
+  class->map = NULL;
+  class->packed = 0;
+  class->robin_hood = 0;
+  class->frozen = 0;
+  class->pilots = NULL;
+  class->remap = NULL;
+  class->fingerprints = NULL;
+  class->bloom = NULL;
+  class->bloom_stale = NULL;
+  class->bloom_blocks = 0;
+  memset (&class->bflags, 0, sizeof (class->bflags));
+  class->fsize = 0;
+  class->mlocked = 0;
+  class->dirty = NULL;
+  class->checkpoint_time = 0;
+
+  /* open the class to be trained and mmap it into memory */
+  class->fd = open (classname, flags);
+
+  if (class->fd < 0)
+    {
+      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		"Couldn't open the file %s.", classname);
+      return -2;
+    }
+
+  if (fstat (class->fd, &st) != 0)
+    {
+      close (class->fd);
+      class->fd = -1;
+      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN, "Couldn't open %s.",
+		classname);
+      return (-1);
+    }
+
+  if (flags == O_RDWR)
+    {
+      class->flags = O_RDWR;
+      prot = PROT_READ + PROT_WRITE;
+    }
+  else
+    {
+      class->flags = O_RDONLY;
+      prot = PROT_READ;
+    }
+
+#ifdef MAP_POPULATE
+  if (map_populate)
+    mflags |= MAP_POPULATE;
+#endif
+  class->map = mmap (NULL, st.st_size, prot, mflags, class->fd, 0);
+  if (class->map == MAP_FAILED)
+    {
+      class->map = NULL;
+      close (class->fd);
+      class->fd = -1;
+      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN, "Couldn't mmap %s.",
+		classname);
+      return (-4);
+    }
+  class->fsize = st.st_size;
+  class->dev = st.st_dev;
+  class->ino = st.st_ino;
+
+  /* check file version */
+  header = (OSBF_HEADER_STRUCT *) class->map;
+  if (st.st_size >= (off_t) sizeof (OSBF_HEADER_STRUCT) &&
+      header->version == OSBF_VERSION &&
+      (header->db_flags & ~OSBF_DB_KNOWN_FLAGS) == 0)
+    {
+      class->num_columns = 1;
+      class->column = 0;
+    }
+  else if (st.st_size >= (off_t) sizeof (OSBF_HEADER_STRUCT) &&
+	   (header->version == OSBF_MC_VERSION ||
+	    header->version == OSBF_FROZEN_VERSION) &&
+	   header->num_classes > 0 && header->num_classes <= OSBF_MAX_CLASSES)
+    {
+      if (column >= header->num_classes)
+	{
+	  snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		    "%s has only %" PRIu32 " classes.", classname,
+		    header->num_classes);
+	  class->header = NULL;
+	  munmap (class->map, class->fsize);
+	  close (class->fd);
+	  class->map = NULL;
+	  class->fd = -1;
+	  return (-5);
+	}
+      class->num_columns = header->num_classes;
+      class->column = column;
+      class->frozen = header->version == OSBF_FROZEN_VERSION;
+      if (class->frozen && flags == O_RDWR)
+	{
+	  osbf_close_class (class, errmsg);
+	  snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		    "%s is a frozen, read-only file.", classname);
+	  return OSBF_FROZEN_ERROR;
+	}
+    }
+  else if (st.st_size >= (off_t) sizeof (OSBF_HEADER_STRUCT) &&
+	   header->version == OSBF_PACKED_VERSION &&
+	   (header->db_flags & ~OSBF_DB_KNOWN_FLAGS) == 0)
+    {
+      class->num_columns = 1;
+      class->column = 0;
+      class->packed = 1;
+    }
+  else
+    class->num_columns = 0;
+
+  /* check file size */
+  class->bucket_words = 2 + class->num_columns;
+  if (class->frozen)
+    {
+      /* 16-bit counts, and the perfect hash after the buckets */
+      OSBF_FROZEN_STRUCT *fz = (OSBF_FROZEN_STRUCT *)
+	(header + header->num_classes);
+
+      class->bucket_words = 2 + (class->num_columns + 1) / 2;
+      buckets_end = st.st_size + 1;
+      if (st.st_size >= (char *) (fz + 1) - (char *) header &&
+	  fz->table_size >= header->num_buckets &&
+	  fz->pilots_start >= (header->buckets_start +
+			       (uint64_t) header->num_buckets) *
+	  class->bucket_words * sizeof (uint32_t) &&
+	  fz->remap_start >= fz->pilots_start +
+	  (uint64_t) fz->num_pilots * sizeof (uint16_t) &&
+	  (fz->num_pilots > 0 || header->num_buckets == 0))
+	buckets_end = fz->remap_start + (uint64_t) (fz->table_size -
+						    header->num_buckets) *
+	  sizeof (uint32_t);
+    }
+  else if (class->num_columns > 0)
+    {
+      if (class->packed)
+	buckets_end = (header->buckets_start +
+		       ((off_t) header->num_buckets + OSBF_LINE_BUCKETS -
+			1) / OSBF_LINE_BUCKETS) * OSBF_LINE_SIZE;
+      else
+	buckets_end = (header->buckets_start +
+		       (off_t) header->num_buckets) *
+	  class->bucket_words * sizeof (uint32_t);
+      buckets_end = extensions_layout (buckets_end, header->num_buckets,
+				       class->num_columns == 1 ?
+				       header->db_flags : 0,
+				       &fingerprints_start, &bloom_start);
+    }
+  if (class->num_columns == 0 || st.st_size < buckets_end)
+    {
+      osbf_close_class (class, errmsg);
+      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		"%s is not an OSBF_Bayes-spectrum file.", classname);
+      return (-5);
+    }
+
+  class->header = header + class->column;
+  class->hash_magic = OSBF_FASTMOD_MAGIC ((uint64_t) header->num_buckets);
+  if (class->num_columns == 1 && !class->frozen)
+    class->robin_hood = (header->db_flags & OSBF_DB_ROBIN_HOOD) != 0;
+  if (class->frozen)
+    {
+      OSBF_FROZEN_STRUCT *fz = (OSBF_FROZEN_STRUCT *)
+	(header + header->num_classes);
+
+      class->pilots = (const uint16_t *) ((unsigned char *) class->map +
+					  fz->pilots_start);
+      class->remap = (const uint32_t *) ((unsigned char *) class->map +
+					 fz->remap_start);
+      class->mph_seed = fz->seed;
+      class->mph_pilots = fz->num_pilots;
+      class->mph_size = fz->table_size;
+    }
+  if (fingerprints_start != 0)
+    class->fingerprints = (unsigned char *) class->map + fingerprints_start;
+  if (bloom_start != 0)
+    {
+      class->bloom_stale =
+	(uint32_t *) ((unsigned char *) class->map + bloom_start);
+      class->bloom = (uint64_t *) ((unsigned char *) class->map +
+				   bloom_start + OSBF_LINE_SIZE);
+      class->bloom_blocks = OSBF_BLOOM_BLOCKS (header->num_buckets);
+    }
+  if (class->packed)
+    class->buckets = (uint32_t *) class->map +
+      (size_t) header->buckets_start * OSBF_LINE_WORDS;
+  else
+    class->buckets = (uint32_t *) class->map +
+      (size_t) header->buckets_start * class->bucket_words;
+
+  /* version counters in the end of the header, if there's room */
+  if (!class->frozen)
+    {
+      off_t seq_start = OSBF_LINE_ALIGN ((off_t) class->num_columns *
+					 sizeof (OSBF_HEADER_STRUCT));
+      off_t room = ((unsigned char *) class->buckets -
+		    (unsigned char *) class->map - seq_start) /
+	(off_t) sizeof (uint32_t);
+
+      if (room > OSBF_SEQ_REGIONS)
+	room = OSBF_SEQ_REGIONS;
+      if (room > 0 && header->num_buckets > 0)
+	{
+	  /* regions of 2^seq_shift buckets */
+	  while (((header->num_buckets - 1) >> class->seq_shift) >= room)
+	    class->seq_shift++;
+	  class->seq = (uint32_t *) ((unsigned char *) class->map +
+				     seq_start);
+	  class->seq_regions = ((header->num_buckets - 1) >>
+				class->seq_shift) + 1;
+	}
+
+      /* then the time of the last checkpoint */
+      if (OSBF_CHECKPOINT_OFFSET (class->num_columns) + sizeof (uint64_t) <=
+	  (size_t) ((unsigned char *) class->buckets -
+		    (unsigned char *) class->map))
+	class->checkpoint = (uint64_t *) ((unsigned char *) class->map +
+					  OSBF_CHECKPOINT_OFFSET
+					  (class->num_columns));
+    }
+
+  advise_class (class);
+  return 0;
+}
+
+/*****************************************************************/
+
+/* open, mmap and lock a class with the given lock function */
+static int
+open_class (const char *classname, uint32_t column, int flags,
+	    CLASS_STRUCT * class, char *errmsg,
+	    int (*lock) (CLASS_STRUCT *, char *))
+{
+  int attempts = 3;
+  int err;
+
+  err = osbf_map_class (classname, column, flags, class, errmsg);
+  if (err != 0)
+    return err;
+
+  while (flags == O_RDWR)
+    {
+      err = lock (class, errmsg);
+      if (err != 0)
+	{
+	  fprintf (stderr, "Couldn't lock the file %s.", classname);
+	  osbf_close_class (class, errmsg);
+	  snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		    "Couldn't lock the file %s.", classname);
+	  return err;
+	}
+      if (!osbf_class_changed (class))
+	break;
+
+      osbf_close_class (class, errmsg);
+      if (--attempts == 0)
+	{
+	  /* the locked mapping is of a file no longer there */
+	  snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		    "File keeps changing: %s.", classname);
+	  return (-1);
+	}
+      err = osbf_map_class (classname, column, flags, class, errmsg);
+      if (err != 0)
+	return err;
+    }
+
+  return 0;
+}
+
+/*
+ * Open and mmap a class. If flags == O_RDWR the class is also
+ * locked for writing until osbf_close_class is called. The file is
+ * mapped again if it was replaced, e.g. by osbf_resize, while we
+ * waited for the lock.
+ */
+int
+osbf_open_class (const char *classname, uint32_t column, int flags,
+		 CLASS_STRUCT * class, char *errmsg)
+{
+  return open_class (classname, column, flags, class, errmsg,
+		     osbf_lock_class);
+}
+
+/* open and mmap a class for training, locked by osbf_lock_class_striped */
+int
+osbf_open_class_striped (const char *classname, uint32_t column,
+			 CLASS_STRUCT * class, char *errmsg)
+{
+  return open_class (classname, column, O_RDWR, class, errmsg,
+		     osbf_lock_class_striped);
+}
+
+/*****************************************************************/
+
+int
+osbf_close_class (CLASS_STRUCT * class, char *errmsg)
+{
+  int err = 0;
+
+  /* unlock first, it may still update the mapped file */
+  if (class->fd >= 0 && class->locked)
+    err = osbf_unlock_class (class, errmsg);
+
+  /* flush what wasn't yet; only OSBF_DURABILITY_SYNC waits for it */
+  if (class->dirty != NULL)
+    {
+      if (osbf_sync_class (class, durability == OSBF_DURABILITY_SYNC ?
+			   MS_SYNC : MS_ASYNC, errmsg) != 0)
+	err = -1;
+      free (class->dirty);
+      class->dirty = NULL;
+    }
+
+  if (class->map)
+    {
+      munmap (class->map, class->fsize);
+      class->map = NULL;
+      class->header = NULL;
+      class->buckets = NULL;
+      class->fingerprints = NULL;
+      class->bloom = NULL;
+      class->bloom_stale = NULL;
+    }
+
+  if (class->counters)
+    {
+      munmap (class->counters, (class->column + 1) *
+	      sizeof (OSBF_HEADER_STRUCT));
+      class->counters = NULL;
+    }
+
+  osbf_bflags_free (&class->bflags);
+
+  if (class->fd >= 0)
+    {
+      close (class->fd);
+      class->fd = -1;
+    }
+
+  return err;
+}
+
+/*****************************************************************/
+
+static uint64_t
+monotonic_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*****************************************************************/
+
+static size_t
+page_size (void)
+{
+  static size_t size = 0;
+
+  if (size == 0)
+    size = sysconf (_SC_PAGESIZE);
+  return size;
+}
+
+/*
+ * Record that len bytes from offset in the mapping of a class were
+ * written, so that osbf_sync_class flushes their pages. Bytes out of
+ * the mapping are ignored. Nothing is recorded with
+ * OSBF_DURABILITY_NONE, which leaves the flushes to the kernel.
+ */
+void
+osbf_mark_dirty (CLASS_STRUCT * class, size_t offset, size_t len)
+{
+  size_t page, last;
+
+  if (durability == OSBF_DURABILITY_NONE || class->flags != O_RDWR ||
+      offset >= (size_t) class->fsize || len == 0)
+    return;
+
+  if (class->dirty == NULL)
+    {
+      class->dirty = calloc ((class->fsize / page_size () + 8) / 8, 1);
+      if (class->dirty == NULL)
+	return;
+      if (class->checkpoint_time == 0)
+	class->checkpoint_time = (uint64_t) time (NULL);
+    }
+
+  if (len > (size_t) class->fsize - offset)
+    len = class->fsize - offset;
+  last = (offset + len - 1) / page_size ();
+  for (page = offset / page_size (); page <= last; page++)
+    class->dirty[page >> 3] |= 1 << (page & 7);
+}
+
+/*
+ * Flush the pages of a class written since its last flush, and its
+ * header, with msync and flags MS_ASYNC or MS_SYNC. Dirty pages close
+ * enough are given to the same msync call, which only writes the
+ * dirty ones.
+ */
+int
+osbf_sync_class (CLASS_STRUCT * class, int flags, char *errmsg)
+{
+  size_t ps = page_size (), bytes, page, start, end, num_pages, gap;
+  uint64_t begin;
+  int err = 0;
+
+  if (class->dirty == NULL || class->map == NULL)
+    return 0;
+  num_pages = (class->fsize + ps - 1) / ps;
+  bytes = (num_pages + 7) / 8;
+  gap = num_pages / OSBF_SYNC_MAX_CALLS;
+  if (gap < OSBF_SYNC_GAP)
+    gap = OSBF_SYNC_GAP;
+  for (page = 0; page < bytes && class->dirty[page] == 0; page++);
+  if (page == bytes)
+    return 0;
+
+  /* the counters in the header change with every training */
+  osbf_mark_dirty (class, 0, (unsigned char *) class->buckets -
+		   (unsigned char *) class->map);
+  if (class->bloom_stale != NULL)
+    osbf_mark_dirty (class, (unsigned char *) class->bloom_stale -
+		     (unsigned char *) class->map, sizeof (uint32_t));
+
+  begin = monotonic_ns ();
+  page = 0;
+  while (page < num_pages)
+    {
+      if (class->dirty[page >> 3] == 0)
+	{
+	  page = (page | 7) + 1;
+	  continue;
+	}
+      if (!PAGE_DIRTY (class, page))
+	{
+	  page++;
+	  continue;
+	}
+
+      start = page;
+      end = page + 1;
+      for (page = end; page < num_pages && page < end + gap; page++)
+	if (PAGE_DIRTY (class, page))
+	  end = page + 1;
+      page = end;
+
+      if (msync ((unsigned char *) class->map + start * ps,
+		 (end - start) * ps, flags) != 0)
+	{
+	  snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		    "Couldn't msync %s: %s", class->classname,
+		    strerror (errno));
+	  err = -1;
+	}
+      SYNC_STATS_ADD (syncs, 1);
+      SYNC_STATS_ADD (pages, end - start);
+    }
+  SYNC_STATS_ADD (sync_ns, monotonic_ns () - begin);
+
+  memset (class->dirty, 0, bytes);
+  return err;
+}
+
+/*
+ * Flush the pages written with MS_SYNC if checkpoint_interval seconds
+ * passed since the last checkpoint of the file, by any writer.
+ */
+static int
+checkpoint_class (CLASS_STRUCT * class, char *errmsg)
+{
+  uint64_t now = (uint64_t) time (NULL), last;
+
+  if (class->checkpoint != NULL)
+    last = __atomic_load_n (class->checkpoint, __ATOMIC_RELAXED);
+  else
+    last = class->checkpoint_time;
+  /* a clock set back doesn't put off the next one */
+  if (now >= last && now - last < checkpoint_interval)
+    return 0;
+
+  /* recorded first, to be flushed with the header */
+  if (class->checkpoint != NULL)
+    __atomic_store_n (class->checkpoint, now, __ATOMIC_RELAXED);
+  class->checkpoint_time = now;
+  return osbf_sync_class (class, MS_SYNC, errmsg);
+}
+
+/*
+ * End of a training: update the mtime of the file, which writes to
+ * the mapping don't always do, and flush the pages written as the
+ * durability policy says.
+ */
+static int
+finish_training (CLASS_STRUCT * class, char *errmsg)
+{
+  uint64_t now = monotonic_ns ();
+  int err = 0;
+
+  if (class->flags != O_RDWR)
+    return 0;
+
+  futimens (class->fd, NULL);
+  SYNC_STATS_ADD (touches, 1);
+  SYNC_STATS_ADD (learnings, 1);
+  SYNC_STATS_ADD (sync_ns, monotonic_ns () - now);
+
+  if (durability == OSBF_DURABILITY_ASYNC)
+    err = osbf_sync_class (class, MS_ASYNC, errmsg);
+  else if (durability == OSBF_DURABILITY_CHECKPOINT && class->dirty != NULL)
+    err = checkpoint_class (class, errmsg);
+  return err;
+}
+
+/* get the durability statistics and optionally reset them */
+void
+osbf_sync_stats (SYNC_STATS_STRUCT * stats, int reset)
+{
+  stats->learnings = __atomic_load_n (&sync_stats.learnings,
+				      __ATOMIC_RELAXED);
+  stats->syncs = __atomic_load_n (&sync_stats.syncs, __ATOMIC_RELAXED);
+  stats->pages = __atomic_load_n (&sync_stats.pages, __ATOMIC_RELAXED);
+  stats->touches = __atomic_load_n (&sync_stats.touches, __ATOMIC_RELAXED);
+  stats->sync_ns = __atomic_load_n (&sync_stats.sync_ns, __ATOMIC_RELAXED);
+  if (reset)
+    {
+      __atomic_store_n (&sync_stats.learnings, 0, __ATOMIC_RELAXED);
+      __atomic_store_n (&sync_stats.syncs, 0, __ATOMIC_RELAXED);
+      __atomic_store_n (&sync_stats.pages, 0, __ATOMIC_RELAXED);
+      __atomic_store_n (&sync_stats.touches, 0, __ATOMIC_RELAXED);
+      __atomic_store_n (&sync_stats.sync_ns, 0, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Lock a region of a file for reading or writing. If wait is set, a
+ * busy lock is retried after short waits, doubled each time, until
+ * lock_timeout milliseconds are over. Returns 0 if ok or the errno
+ * of the last attempt.
+ */
+static int
+lock_region (int fd, short type, uint32_t start, uint32_t len, int wait)
+{
+  struct flock fl;
+  struct timespec pause;
+  uint64_t begin = 0, waited = 0, max_wait;
+  uint32_t wait_us = OSBF_LOCK_MIN_WAIT;
+  int errsv = 0;
+
+  fl.l_type = type;
+  fl.l_whence = SEEK_SET;
+  fl.l_start = start;
+  fl.l_len = len;
+
+  while (fcntl (fd, F_SETLK, &fl) < 0)
+    {
+      errsv = errno;
+      if (errsv == EINTR)
+	continue;
+      if (errsv != EAGAIN && errsv != EACCES)
+	return errsv;
+
+      if (begin == 0)
+	begin = monotonic_ns ();
+      waited = monotonic_ns () - begin;
+      if (!wait || waited >= (uint64_t) lock_timeout * 1000000)
+	{
+	  LOCK_STATS_ADD (contended, 1);
+	  if (wait)
+	    LOCK_STATS_ADD (timeouts, 1);
+	  LOCK_STATS_ADD (wait_ns, waited);
+	  return errsv;
+	}
+      pause.tv_sec = 0;
+      pause.tv_nsec = (long) wait_us * 1000;
+      nanosleep (&pause, NULL);
+      if (wait_us < OSBF_LOCK_MAX_WAIT)
+	wait_us *= 2;
+    }
+
+  LOCK_STATS_ADD (locks, 1);
+  if (begin != 0)
+    {
+      waited = monotonic_ns () - begin;
+      LOCK_STATS_ADD (contended, 1);
+      LOCK_STATS_ADD (wait_ns, waited);
+      max_wait = __atomic_load_n (&lock_stats.max_wait_ns, __ATOMIC_RELAXED);
+      while (waited > max_wait &&
+	     !__atomic_compare_exchange_n (&lock_stats.max_wait_ns, &max_wait,
+					   waited, 0, __ATOMIC_RELAXED,
+					   __ATOMIC_RELAXED))
+	;
+    }
+  return 0;
+}
+
+/* write lock a region of a file, waiting at most lock_timeout ms */
+int
+osbf_lock_file (int fd, uint32_t start, uint32_t len)
+{
+  return lock_region (fd, F_WRLCK, start, len, 1);
+}
+
+/* read lock a region of a file, waiting at most lock_timeout ms */
+int
+osbf_read_lock_file (int fd, uint32_t start, uint32_t len)
+{
+  return lock_region (fd, F_RDLCK, start, len, 1);
+}
+
+/*****************************************************************/
+
+/* get the lock statistics and optionally reset them */
+void
+osbf_lock_stats (LOCK_STATS_STRUCT * stats, int reset)
+{
+  stats->locks = __atomic_load_n (&lock_stats.locks, __ATOMIC_RELAXED);
+  stats->contended = __atomic_load_n (&lock_stats.contended,
+				      __ATOMIC_RELAXED);
+  stats->timeouts = __atomic_load_n (&lock_stats.timeouts,
+				     __ATOMIC_RELAXED);
+  stats->wait_ns = __atomic_load_n (&lock_stats.wait_ns, __ATOMIC_RELAXED);
+  stats->max_wait_ns = __atomic_load_n (&lock_stats.max_wait_ns,
+					__ATOMIC_RELAXED);
+  stats->read_retries = __atomic_load_n (&lock_stats.read_retries,
+					 __ATOMIC_RELAXED);
+  if (reset)
+    {
+      __atomic_store_n (&lock_stats.locks, 0, __ATOMIC_RELAXED);
+      __atomic_store_n (&lock_stats.contended, 0, __ATOMIC_RELAXED);
+      __atomic_store_n (&lock_stats.timeouts, 0, __ATOMIC_RELAXED);
+      __atomic_store_n (&lock_stats.wait_ns, 0, __ATOMIC_RELAXED);
+      __atomic_store_n (&lock_stats.max_wait_ns, 0, __ATOMIC_RELAXED);
+      __atomic_store_n (&lock_stats.read_retries, 0, __ATOMIC_RELAXED);
+    }
+}
+
+/*****************************************************************/
+
+int
+osbf_unlock_file (int fd, uint32_t start, uint32_t len)
+{
+  struct flock fl;
+
+  fl.l_type = F_UNLCK;
+  fl.l_whence = SEEK_SET;
+  fl.l_start = start;
+  fl.l_len = len;
+  if (fcntl (fd, F_SETLK, &fl) == -1)
+    return -1;
+  else
+    return 0;
+}
+
+/*****************************************************************/
+
+/*
+ * Clear the writers counted in the version counters of a class whose
+ * buckets no other writer can change now: they were killed while
+ * changing the buckets.
+ */
+static void
+clear_stale_writers (CLASS_STRUCT * class)
+{
+  uint32_t r;
+
+  if (class->seq != NULL && (class->flags & O_RDWR))
+    for (r = 0; r < class->seq_regions; r++)
+      if (class->seq[r] & OSBF_SEQ_WRITERS)
+	class->seq[r] = (class->seq[r] & ~OSBF_SEQ_WRITERS) + OSBF_SEQ_DONE;
+}
+
+/* check for writers counted in the version counters of a class */
+static int
+has_seq_writers (CLASS_STRUCT * class)
+{
+  uint32_t r;
+
+  if (class->seq != NULL && (class->flags & O_RDWR))
+    for (r = 0; r < class->seq_regions; r++)
+      if (__atomic_load_n (&class->seq[r], __ATOMIC_RELAXED) &
+	  OSBF_SEQ_WRITERS)
+	return 1;
+  return 0;
+}
+
+/* lock a class mapped for writing */
+int
+osbf_lock_class (CLASS_STRUCT * class, char *errmsg)
+{
+#if !defined(OSBF_NO_FILE_LOCKING)
+  if (osbf_lock_file (class->fd, 0, 0) != 0)
+    {
+      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		"Couldn't lock the file %s.", class->classname);
+      return -3;
+    }
+#else
+  (void) errmsg;
+#endif
+
+  /* no other writer now */
+  clear_stale_writers (class);
+
+  class->locked = 1;
+  return 0;
+}
+
+/*****************************************************************/
+
+/* stripe of a bucket */
+#define BUCKET_STRIPE(class, i) \
+  ((uint32_t) ((uint64_t) (i) * (class)->num_stripes / NUM_BUCKETS (class)))
+
+/*
+ * Lock a class mapped for writing for a training, with a striped
+ * lock if lock_stripes > 0: only the byte before the stripe locks is
+ * read locked here, the buckets are locked by osbf_lock_buckets and
+ * the header by osbf_lock_header.
+ */
+int
+osbf_lock_class_striped (CLASS_STRUCT * class, char *errmsg)
+{
+#if !defined(OSBF_NO_FILE_LOCKING)
+  uint32_t num_stripes = lock_stripes;
+
+  if (num_stripes > OSBF_MAX_LOCK_STRIPES)
+    num_stripes = OSBF_MAX_LOCK_STRIPES;
+  if (num_stripes > NUM_BUCKETS (class))
+    num_stripes = NUM_BUCKETS (class);
+  if (num_stripes == 0)
+    return osbf_lock_class (class, errmsg);
+
+  class->stripes = calloc (num_stripes, 1);
+  if (class->stripes == NULL)
+    {
+      strncpy (errmsg, "Error allocating memory", OSBF_ERROR_MESSAGE_LEN);
+      return -1;
+    }
+  if (lock_region (class->fd, F_RDLCK, OSBF_STRIPE_LOCK_START - 1, 1, 1)
+      != 0)
+    {
+      free (class->stripes);
+      class->stripes = NULL;
+      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		"Couldn't lock the file %s.", class->classname);
+      return -3;
+    }
+  class->num_stripes = num_stripes;
+  class->stripes_low = class->stripes_high = 0;
+#else
+  (void) errmsg;
+#endif
+
+  class->locked = 1;
+  return 0;
+}
+
+/* lock or unlock, if type is F_UNLCK, the stripes in [first, end) */
+static int
+lock_stripes_run (CLASS_STRUCT * class, short type, uint32_t first,
+		  uint32_t end, int wait)
+{
+  int err;
+
+  if (type == F_UNLCK)
+    err = osbf_unlock_file (class->fd, OSBF_STRIPE_LOCK_START + first,
+			    end - first);
+  else
+    err = lock_region (class->fd, type, OSBF_STRIPE_LOCK_START + first,
+		       end - first, wait);
+  if (err != 0)
+    return err;
+
+  memset (class->stripes + first, type != F_UNLCK, end - first);
+  if (type == F_UNLCK)
+    {
+      if (first <= class->stripes_low && end > class->stripes_low)
+	class->stripes_low = end;
+      if (class->stripes_low >= class->stripes_high)
+	class->stripes_low = class->stripes_high = 0;
+    }
+  else
+    {
+      if (first < class->stripes_low ||
+	  class->stripes_low == class->stripes_high)
+	class->stripes_low = first;
+      if (end > class->stripes_high)
+	class->stripes_high = end;
+    }
+  return 0;
+}
+
+/* lock the stripes in [first, end) not locked yet, a run at a time */
+static int
+lock_missing_stripes (CLASS_STRUCT * class, uint32_t first, uint32_t end,
+		      int wait)
+{
+  uint32_t s, run;
+
+  for (s = first; s < end; s = run)
+    {
+      for (; s < end && class->stripes[s]; s++);
+      for (run = s; run < end && !class->stripes[run]; run++);
+      if (run > s && lock_stripes_run (class, F_WRLCK, s, run, wait) != 0)
+	return -1;
+    }
+  return 0;
+}
+
+/*
+ * Write lock the stripes of the buckets from first to last, wrapping
+ * around the end of the file if first > last. To avoid deadlocks,
+ * stripes are waited for only in increasing order: if one below a
+ * stripe already locked is busy, all are unlocked and the needed
+ * ones locked again in order. Returns 0 if ok.
+ */
+int
+osbf_lock_buckets (CLASS_STRUCT * class, uint32_t first, uint32_t last,
+		   char *errmsg)
+{
+  uint32_t start[2], end[2], num_ranges, r, s;
+  int missing = 0, in_order = 1;
+
+  if (class->num_stripes == 0)
+    return 0;
+
+  if (first <= last)
+    {
+      start[0] = BUCKET_STRIPE (class, first);
+      end[0] = BUCKET_STRIPE (class, last) + 1;
+      num_ranges = 1;
+    }
+  else
+    {
+      start[0] = 0;
+      end[0] = BUCKET_STRIPE (class, last) + 1;
+      start[1] = BUCKET_STRIPE (class, first);
+      end[1] = class->num_stripes;
+      num_ranges = 2;
+    }
+
+  for (r = 0; r < num_ranges; r++)
+    for (s = start[r]; s < end[r]; s++)
+      if (!class->stripes[s])
+	{
+	  missing = 1;
+	  if (s < class->stripes_high)
+	    in_order = 0;
+	}
+  if (!missing)
+    return 0;
+
+  /* try the stripes out of order without waiting */
+  if (!in_order)
+    {
+      for (r = 0; r < num_ranges; r++)
+	if (lock_missing_stripes (class, start[r], end[r], 0) != 0)
+	  break;
+      if (r == num_ranges)
+	return 0;
+      lock_stripes_run (class, F_UNLCK, 0, class->num_stripes, 0);
+    }
+
+  for (r = 0; r < num_ranges; r++)
+    if (lock_missing_stripes (class, start[r], end[r], 1) != 0)
+      {
+	snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		  "Couldn't lock the file %s.", class->classname);
+	return -3;
+      }
+
+  return 0;
+}
+
+/* unlock the stripes before the one of a bucket */
+void
+osbf_release_buckets (CLASS_STRUCT * class, uint32_t bindex)
+{
+  uint32_t end;
+
+  if (class->num_stripes == 0)
+    return;
+
+  end = BUCKET_STRIPE (class, bindex);
+  if (class->stripes_low < class->stripes_high && class->stripes_low < end)
+    lock_stripes_run (class, F_UNLCK, class->stripes_low, end, 0);
+}
+
+/* write lock the header of a class locked by osbf_lock_class_striped */
+int
+osbf_lock_header (CLASS_STRUCT * class, char *errmsg)
+{
+  if (class->num_stripes == 0 || class->header_locked)
+    return 0;
+
+  if (osbf_lock_file (class->fd, class->column * sizeof (OSBF_HEADER_STRUCT),
+		      sizeof (OSBF_HEADER_STRUCT)) != 0)
+    {
+      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		"Couldn't lock the header of %s.", class->classname);
+      return -3;
+    }
+  class->header_locked = 1;
+  return 0;
+}
+
+/*
+ * Get the buckets a training of a feature may change: the chains of
+ * the buckets around bindex, up to a free bucket on each side. If
+ * there's no free bucket, the whole file is returned.
+ */
+void
+osbf_bucket_cluster (CLASS_STRUCT * class, uint32_t bindex,
+		     uint32_t * first, uint32_t * last)
+{
+  uint32_t i, n;
+
+  for (i = bindex, n = 0; BUCKET_IN_CHAIN (class, i); n++)
+    {
+      i = NEXT_BUCKET (class, i);
+      if (n >= NUM_BUCKETS (class))
+	break;
+    }
+  *last = i;
+
+  for (i = PREV_BUCKET (class, bindex), n = 0; BUCKET_IN_CHAIN (class, i);
+       n++)
+    {
+      i = PREV_BUCKET (class, i);
+      if (n >= NUM_BUCKETS (class))
+	break;
+    }
+  *first = i;
+
+  if (n >= NUM_BUCKETS (class))
+    {
+      *first = 0;
+      *last = NUM_BUCKETS (class) - 1;
+    }
+}
+
+/*****************************************************************/
+
+/*
+ * Unlock a class locked by osbf_lock_class_striped. The Bloom filter
+ * is rebuilt, and the writers killed while changing the buckets are
+ * cleared from the version counters, only if all stripes can be
+ * locked at once, else it's left for a later training. They're not
+ * waited for: the header lock is still held, and a writer holding
+ * stripes may be waiting for it.
+ */
+static int
+unlock_striped (CLASS_STRUCT * class, char *errmsg)
+{
+  off_t offset = class->column * sizeof (OSBF_HEADER_STRUCT);
+  int err = 0, rebuild;
+
+  lock_stripes_run (class, F_UNLCK, 0, class->num_stripes, 0);
+
+  rebuild = class->bloom != NULL &&
+    __atomic_load_n (class->bloom_stale, __ATOMIC_RELAXED) >
+    OSBF_BLOOM_MAX_STALE (NUM_BUCKETS (class));
+  if ((rebuild || has_seq_writers (class)) &&
+      lock_stripes_run (class, F_WRLCK, 0, class->num_stripes, 0) == 0)
+    {
+      /* no other writer now */
+      clear_stale_writers (class);
+      if (rebuild)
+	err = osbf_bloom_rebuild (class, errmsg);
+      lock_stripes_run (class, F_UNLCK, 0, class->num_stripes, 0);
+    }
+
+  if (finish_training (class, errmsg) != 0)
+    err = -1;
+
+  if (osbf_unlock_file (class->fd, offset,
+			sizeof (OSBF_HEADER_STRUCT)) != 0 ||
+      osbf_unlock_file (class->fd, OSBF_STRIPE_LOCK_START - 1, 1) != 0)
+    {
+      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		"Couldn't unlock file: %s", class->classname);
+      err = -1;
+    }
+
+  free (class->stripes);
+  class->stripes = NULL;
+  class->num_stripes = 0;
+  class->header_locked = 0;
+  class->locked = 0;
+  return err;
+}
+
+/*****************************************************************/
+
+/* flush, as durability says, and unlock a class locked with */
+/* osbf_lock_class                                            */
+int
+osbf_unlock_class (CLASS_STRUCT * class, char *errmsg)
+{
+  int err = 0;
+
+  if (!class->locked)
+    return 0;
+
+  if (class->num_stripes > 0)
+    return unlock_striped (class, errmsg);
+
+  /* too many freed features left in the Bloom filter */
+  if (class->bloom != NULL && (class->flags & O_RDWR) &&
+      *class->bloom_stale > OSBF_BLOOM_MAX_STALE (NUM_BUCKETS (class)))
+    err = osbf_bloom_rebuild (class, errmsg);
+
+  if (finish_training (class, errmsg) != 0)
+    err = -1;
+
+#if !defined(OSBF_NO_FILE_LOCKING)
+  if (osbf_unlock_file (class->fd, 0, 0) != 0)
+    {
+      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		"Couldn't unlock file: %s", class->classname);
+      err = -1;
+    }
+#endif
+
+  class->locked = 0;
+  return err;
+}
+
+/*****************************************************************/
+
+/*
+ * Check if the file of a mapped class was replaced or resized
+ * since it was mapped. Returns 1 if yes.
+ */
+int
+osbf_class_changed (CLASS_STRUCT * class)
+{
+  struct stat st;
+
+  if (stat (class->classname, &st) != 0)
+    return 1;
+
+  return (st.st_dev != class->dev || st.st_ino != class->ino ||
+	  st.st_size != class->fsize);
+}
+
+/*****************************************************************/
+
+/*
+ * Remap a class if its file was replaced or resized, or if a previous
+ * remap failed and left it unmapped.
+ */
+int
+osbf_check_class (CLASS_STRUCT * class, char *errmsg)
+{
+  const char *classname = class->classname;
+  uint32_t column = class->column;
+  int flags = class->flags;
+  int mlocked = class->mlocked;
+  int err;
+
+  if (class->map != NULL && !osbf_class_changed (class))
+    return 0;
+
+  osbf_close_class (class, errmsg);
+  err = osbf_map_class (classname, column, flags, class, errmsg);
+  if (err != 0)
+    {
+      /* keep how it was opened, for the next check to map it again */
+      class->column = column;
+      class->flags = flags;
+      class->mlocked = mlocked;
+      return err;
+    }
+  if (mlocked)
+    osbf_mlock_class (class, errmsg);
+  return 0;
+}
+
+/*****************************************************************/
+
+/*
+ * Column of the class classnames[idx] in its file: classes of a
+ * multi-class file are given by repeating its name, once per class,
+ * in column order. Returns the number of earlier equal names.
+ */
+uint32_t
+osbf_class_column (const char *classnames[], uint32_t idx)
+{
+  uint32_t i, column = 0;
+
+  for (i = 0; i < idx; i++)
+    if (strcmp (classnames[i], classnames[idx]) == 0)
+      column++;
+
+  return column;
+}
+
+/*****************************************************************/
+
+/*
+ * Open and mmap all classes of a database set, to be kept open
+ * across calls. If flags == O_RDWR the classes are mapped for
+ * writing, but they are only locked while being trained.
+ */
+int
+osbf_open_dbset (DBSET_STRUCT * dbset, const char *classnames[],
+		 const char *delims, int flags, char *errmsg)
+{
+  uint32_t i;
+  int err;
+
+  dbset->num_classes = 0;
+  dbset->flags = flags;
+  dbset->mlock_errors = 0;
+  osbf_page_faults (&dbset->minflt, &dbset->majflt);
+  osbf_build_delim_table (&dbset->dt, delims);
+
+  for (i = 0; classnames[i] != NULL && i < OSBF_MAX_CLASSES; i++)
+    {
+      dbset->classnames[i] = malloc (strlen (classnames[i]) + 1);
+      if (dbset->classnames[i] == NULL)
+	{
+	  osbf_close_dbset (dbset, errmsg);
+	  snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		    "Couldn't allocate memory for class names.");
+	  return (-6);
+	}
+      strcpy (dbset->classnames[i], classnames[i]);
+
+      err = osbf_map_class (dbset->classnames[i],
+			    osbf_class_column (classnames, i), flags,
+			    &dbset->class[i], errmsg);
+      if (err != 0)
+	{
+	  free (dbset->classnames[i]);
+	  osbf_close_dbset (dbset, errmsg);
+	  if (err != OSBF_FROZEN_ERROR)
+	    snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		      "Couldn't open the file %s.", classnames[i]);
+	  return err;
+	}
+      /* hot databases: not being able to lock them isn't fatal */
+      if (map_lock && osbf_mlock_class (&dbset->class[i], errmsg) != 0)
+	dbset->mlock_errors++;
+      dbset->num_classes++;
+    }
+
+  if (dbset->num_classes == 0)
+    {
+      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		"At least one class must be given.");
+      return (-1);
+    }
+
+  /* faults taken while mapping, more with map_populate and map_lock */
+  osbf_page_faults (&dbset->open_minflt, &dbset->open_majflt);
+  dbset->open_minflt -= dbset->minflt;
+  dbset->open_majflt -= dbset->majflt;
+
+  return 0;
+}
+
+/*****************************************************************/
+
+int
+osbf_close_dbset (DBSET_STRUCT * dbset, char *errmsg)
+{
+  uint32_t i;
+  int err = 0;
+
+  for (i = 0; i < dbset->num_classes; i++)
+    {
+      if (osbf_close_class (&dbset->class[i], errmsg) != 0)
+	err = -1;
+      free (dbset->classnames[i]);
+      dbset->classnames[i] = NULL;
+    }
+  dbset->num_classes = 0;
+
+  return err;
+}
+
+/*****************************************************************/
+
+/* remap the classes of a database set whose files have changed */
+int
+osbf_check_dbset (DBSET_STRUCT * dbset, char *errmsg)
+{
+  uint32_t i;
+
+  for (i = 0; i < dbset->num_classes; i++)
+    if (osbf_check_class (&dbset->class[i], errmsg) != 0)
+      return (-1);
+
+  return 0;
+}
+
+/*****************************************************************/
+
+/*
+ * Lock a class of a database set for a training, with a striped lock
+ * if lock_stripes > 0. The file is checked again after the lock is
+ * acquired, because it may have been replaced while we waited for it.
+ */
+int
+osbf_lock_dbset_class (DBSET_STRUCT * dbset, uint32_t idx, char *errmsg)
+{
+  CLASS_STRUCT *class = &dbset->class[idx];
+  int attempts = 3;
+  int err;
+
+  while (attempts-- > 0)
+    {
+      if (osbf_check_class (class, errmsg) != 0)
+	return (-1);
+
+      err = osbf_lock_class_striped (class, errmsg);
+      if (err != 0)
+	return err;
+
+      if (!osbf_class_changed (class))
+	return 0;
+
+      osbf_unlock_class (class, errmsg);
+    }
+
+  snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+	    "File keeps changing: %s.", class->classname);
+  return (-1);
+}
+
+/*****************************************************************/
+
+int
+osbf_dump (const char *cfcfile, const char *csvfile, char *errmsg)
+{
+  FILE *fp_cfc, *fp_csv;
+  OSBF_BUCKET_STRUCT buckets[BUCKET_BUFFER_SIZE];
+  OSBF_HEADER_STRUCT header = { 0 };
+  int32_t i, size_in_buckets;
+  int error = 0;
+
+  fp_cfc = fopen (cfcfile, "rb");
+  if (fp_cfc != NULL)
+    {
+      int32_t num_buckets;
+
+      if (1 == fread (&header, sizeof (header), 1, fp_cfc) &&
+	  header.version != OSBF_MC_VERSION &&
+	  header.version != OSBF_PACKED_VERSION &&
+	  header.version != OSBF_FROZEN_VERSION)
+	{
+	  size_in_buckets = header.num_buckets + header.buckets_start;
+	  fp_csv = fopen (csvfile, "w");
+	  if (fp_csv != NULL)
+	    {
+	      fseek (fp_cfc, 0, SEEK_SET);
+	      while (size_in_buckets > 0)
+		{
+		  /* don't read past the buckets, into the fingerprints */
+		  num_buckets = fread (buckets, sizeof (OSBF_BUCKET_STRUCT),
+				       size_in_buckets < BUCKET_BUFFER_SIZE ?
+				       size_in_buckets : BUCKET_BUFFER_SIZE,
+				       fp_cfc);
+		  if (num_buckets <= 0)
+		    break;
+		  if (num_buckets > 0)
+		    {
+		      for (i = 0; i < num_buckets; i++)
+			{
+			  fprintf (fp_csv,
+				   "%" PRIu32 ";%" PRIu32 ";%" PRIu32 "\n",
+				   buckets[i].hash, buckets[i].key,
+				   buckets[i].value);
+			}
+		    }
+		  size_in_buckets -= num_buckets;
+		}
+	      fclose (fp_cfc);
+	      fclose (fp_csv);
+	      if (size_in_buckets != 0)
+		{
+		  error = 1;
+		  strncpy (errmsg, "Not a valid cfc file",
+			   OSBF_ERROR_MESSAGE_LEN);
+		}
+	    }
+	  else
+	    {
+	      error = 1;
+	      strncpy (errmsg, "Can't create csv file",
+		       OSBF_ERROR_MESSAGE_LEN);
+	    }
+	}
+      else
+	{
+	  fclose (fp_cfc);
+	  error = 1;
+	  if (header.version == OSBF_MC_VERSION)
+	    strncpy (errmsg, "Dump of multi-class files is not supported",
+		     OSBF_ERROR_MESSAGE_LEN);
+	  else if (header.version == OSBF_PACKED_VERSION)
+	    strncpy (errmsg, "Dump of packed files is not supported",
+		     OSBF_ERROR_MESSAGE_LEN);
+	  else if (header.version == OSBF_FROZEN_VERSION)
+	    strncpy (errmsg, "Dump of frozen files is not supported",
+		     OSBF_ERROR_MESSAGE_LEN);
+	  else
+	    strncpy (errmsg, "Error reading cfc file",
+		     OSBF_ERROR_MESSAGE_LEN);
+	}
+    }
+  else
+    {
+      error = 1;
+      strncpy (errmsg, "Can't open cfc file", OSBF_ERROR_MESSAGE_LEN);
+    }
+
+  return error;
+}
+
+/*****************************************************************/
+
+/*
+ * Extend a restored file with the fingerprint array and the Bloom
+ * filter its header asks for, and fill them from the buckets.
+ * Returns 0 if ok.
+ */
+static int
+rebuild_extensions (const char *cfcfile, char *errmsg)
+{
+  CLASS_STRUCT class;
+  OSBF_HEADER_STRUCT header;
+  off_t end, fingerprints_start, bloom_start;
+  uint32_t i;
+  int fd, error = 0;
+
+  fd = open (cfcfile, O_RDWR);
+  if (fd < 0)
+    {
+      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		"Couldn't open the file %s.", cfcfile);
+      return -1;
+    }
+  end = 0;
+  if (pread (fd, &header, sizeof (header), 0) == sizeof (header))
+    end = extensions_layout ((header.buckets_start +
+			      (off_t) header.num_buckets) *
+			     sizeof (OSBF_BUCKET_STRUCT), header.num_buckets,
+			     header.db_flags, &fingerprints_start,
+			     &bloom_start);
+  if (end == 0 || ftruncate (fd, end) != 0)
+    error = -1;
+  close (fd);
+  if (error != 0)
+    {
+      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		"Couldn't write to: '%s'", cfcfile);
+      return -1;
+    }
+
+  if (osbf_open_class (cfcfile, 0, O_RDWR, &class, errmsg) != 0)
+    return -1;
+  for (i = 0; i < NUM_BUCKETS (&class); i++)
+    SET_FINGERPRINT (&class, i, BUCKET_IN_CHAIN (&class, i) ?
+		     OSBF_FINGERPRINT (BUCKET_KEY (&class, i)) : 0);
+  osbf_mark_dirty (&class, 0, class.fsize);
+  if (osbf_bloom_rebuild (&class, errmsg) != 0)
+    {
+      osbf_close_class (&class, errmsg);
+      return -1;
+    }
+  return osbf_close_class (&class, errmsg);
+}
+
+/*****************************************************************/
+
+int
+osbf_restore (const char *cfcfile, const char *csvfile, char *errmsg)
+{
+  FILE *fp_cfc, *fp_csv;
+  OSBF_BUCKET_STRUCT buckets[BUCKET_BUFFER_SIZE];
+  OSBF_HEADER_STRUCT *header = (OSBF_HEADER_STRUCT *) buckets;
+  int32_t size_in_buckets;
+  uint32_t db_flags = 0;
+  int error = 0;
+
+/*
+  if (check_file(cfcfile) >= 0)
+    {
+      strncpy (errmsg, "The .cfc file already exists!", OSBF_ERROR_MESSAGE_LEN);
+      return 1;
+    }
+*/
+
+  fp_csv = fopen (csvfile, "r");
+  if (fp_csv != NULL)
+    {
+      /* read header */
+      if (5 ==
+	  fscanf (fp_csv,
+		  "%" SCNu32 ";%" SCNu32 ";%" SCNu32 "\n%" SCNu32 ";%" SCNu32
+		  "\n", &header->version, &header->db_flags,
+		  &header->buckets_start, &header->num_buckets,
+		  &header->learnings))
+	{
+	  size_in_buckets = header->buckets_start + header->num_buckets;
+	  db_flags = header->db_flags;
+	  fp_cfc = fopen (cfcfile, "wb");
+	  fseek (fp_csv, 0, SEEK_SET);
+	  if (fp_cfc != NULL)
+	    {
+
+	      while (error == 0
+		     && 3 == fscanf (fp_csv,
+				     "%" SCNu32 ";%" SCNu32 ";%" SCNu32
+				     "\n", (uint32_t *) & buckets[0].hash,
+				     (uint32_t *) & buckets[0].key,
+				     (uint32_t *) & buckets[0].value))
+		{
+		  if (1 ==
+		      fwrite (buckets, sizeof (OSBF_BUCKET_STRUCT), 1,
+			      fp_cfc))
+		    {
+		      size_in_buckets--;
+		    }
+		  else
+		    {
+		      error = 1;
+		      strncpy (errmsg, "Error writing to cfc file",
+			       OSBF_ERROR_MESSAGE_LEN);
+		    }
+		}
+	      if (!(feof (fp_csv) && size_in_buckets == 0))
+		{
+		  remove (cfcfile);
+		  error = 1;
+		  strncpy (errmsg,
+			   "Error reading csv or not a valid csv file",
+			   OSBF_ERROR_MESSAGE_LEN);
+		}
+	      fclose (fp_cfc);
+	      fclose (fp_csv);
+	    }
+	  else
+	    {
+	      fclose (fp_csv);
+	      error = 1;
+	      strncpy (errmsg, "Can't create cfc file",
+		       OSBF_ERROR_MESSAGE_LEN);
+	    }
+	}
+      else
+	{
+	  fclose (fp_csv);
+	  remove (cfcfile);
+	  error = 1;
+	  strncpy (errmsg, "csv file doesn't have a valid header",
+		   OSBF_ERROR_MESSAGE_LEN);
+	}
+    }
+  else
+    {
+      error = 1;
+      strncpy (errmsg, "Can't open csv file", OSBF_ERROR_MESSAGE_LEN);
+    }
+
+  /* the fingerprints and the Bloom filter aren't in the csv file */
+  if (error == 0 && (db_flags & (OSBF_DB_FINGERPRINTS | OSBF_DB_BLOOM)) &&
+      rebuild_extensions (cfcfile, errmsg) != 0)
+    error = 1;
+
+  return error;
+}
+
+/*****************************************************************/
+
+/*
+ * CRC32C (Castagnoli) of len bytes, with the SSE4.2 instruction if
+ * enabled, or else with 8 lookup tables, a byte each.
+ */
+#if !defined(HW_CRC32C)
+static uint32_t crc32c_table[8][256];
+
+static void
+crc32c_init (void)
+{
+  uint32_t i, j, crc;
+
+  for (i = 0; i < 256; i++)
+    {
+      crc = i;
+      for (j = 0; j < 8; j++)
+	crc = (crc >> 1) ^ (0x82F63B78 & -(crc & 1));
+      crc32c_table[0][i] = crc;
+    }
+  for (i = 0; i < 256; i++)
+    for (j = 1; j < 8; j++)
+      crc32c_table[j][i] = (crc32c_table[j - 1][i] >> 8) ^
+	crc32c_table[0][crc32c_table[j - 1][i] & 0xff];
+}
+
+#ifndef OSBF_NO_THREADS
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+#else
+static int crc32c_ready = 0;
+#endif
+#endif
+
+static uint32_t
+crc32c (const unsigned char *p, size_t len)
+{
+  uint32_t crc = 0xffffffff;
+#if defined(HW_CRC32C)
+  uint64_t crc64 = crc, w;
+
+  for (; len >= 8; p += 8, len -= 8)
+    {
+      memcpy (&w, p, sizeof (w));
+      crc64 = _mm_crc32_u64 (crc64, w);
+    }
+  crc = (uint32_t) crc64;
+  for (; len > 0; p++, len--)
+    crc = _mm_crc32_u8 (crc, *p);
+#else
+  uint32_t (*t)[256] = crc32c_table;
+
+#ifndef OSBF_NO_THREADS
+  pthread_once (&crc32c_once, crc32c_init);
+#else
+  if (!crc32c_ready)
+    {
+      crc32c_init ();
+      crc32c_ready = 1;
+    }
+#endif
+  for (; len >= 8; p += 8, len -= 8)
+    {
+      crc ^= (uint32_t) p[0] | (uint32_t) p[1] << 8 |
+	(uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+      crc = t[7][crc & 0xff] ^ t[6][(crc >> 8) & 0xff] ^
+	t[5][(crc >> 16) & 0xff] ^ t[4][crc >> 24] ^
+	t[3][p[4]] ^ t[2][p[5]] ^ t[1][p[6]] ^ t[0][p[7]];
+    }
+  for (; len > 0; p++, len--)
+    crc = (crc >> 8) ^ t[0][(crc ^ *p) & 0xff];
+#endif
+  return ~crc;
+}
+
+/* 32-bit words of the binary snapshots, little-endian */
+static void
+put_le32 (unsigned char *p, uint32_t v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+static uint32_t
+get_le32 (const unsigned char *p)
+{
+  return (uint32_t) p[0] | (uint32_t) p[1] << 8 |
+    (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+#define SNAPSHOT_HEADER_SIZE \
+  (sizeof (OSBF_SNAPSHOT_MAGIC) - 1 + 4 * OSBF_SNAPSHOT_HEADER_WORDS)
+#define SNAPSHOT_RECORD_SIZE 16
+
+/* write the n records after the 8 bytes reserved at block, 1 on errors */
+static int
+write_snapshot_block (FILE * fp, unsigned char *block, uint32_t n)
+{
+  put_le32 (block, n);
+  put_le32 (block + 4, crc32c (block + 8, (size_t) n *
+			       SNAPSHOT_RECORD_SIZE));
+  return fwrite (block, 8 + (size_t) n * SNAPSHOT_RECORD_SIZE, 1,
+		 fp) == 1 ? 0 : 1;
+}
+
+/*
+ * Write a binary snapshot of cfcfile to snapfile, reading and writing
+ * up to OSBF_SNAPSHOT_BLOCK_RECORDS buckets at a time. Returns 0 if ok
+ * or 1 on errors.
+ */
+int
+osbf_dump_binary (const char *cfcfile, const char *snapfile, char *errmsg)
+{
+  FILE *fp_cfc, *fp_snap;
+  OSBF_HEADER_STRUCT header = { 0 };
+  OSBF_BUCKET_STRUCT *buckets;
+  unsigned char head[SNAPSHOT_HEADER_SIZE], *block, *p;
+  uint32_t i, n, left, gap = 0, records = 0;
+  int error = 0;
+
+  fp_cfc = fopen (cfcfile, "rb");
+  if (fp_cfc == NULL)
+    {
+      strncpy (errmsg, "Can't open cfc file", OSBF_ERROR_MESSAGE_LEN);
+      return 1;
+    }
+  if (fread (&header, sizeof (header), 1, fp_cfc) != 1 ||
+      header.version == OSBF_MC_VERSION ||
+      header.version == OSBF_PACKED_VERSION ||
+      header.version == OSBF_FROZEN_VERSION)
+    {
+      fclose (fp_cfc);
+      if (header.version == OSBF_MC_VERSION)
+	strncpy (errmsg, "Dump of multi-class files is not supported",
+		 OSBF_ERROR_MESSAGE_LEN);
+      else if (header.version == OSBF_PACKED_VERSION)
+	strncpy (errmsg, "Dump of packed files is not supported",
+		 OSBF_ERROR_MESSAGE_LEN);
+      else if (header.version == OSBF_FROZEN_VERSION)
+	strncpy (errmsg, "Dump of frozen files is not supported",
+		 OSBF_ERROR_MESSAGE_LEN);
+      else
+	strncpy (errmsg, "Error reading cfc file", OSBF_ERROR_MESSAGE_LEN);
+      return 1;
+    }
+
+  buckets = malloc (OSBF_SNAPSHOT_BLOCK_RECORDS * sizeof (*buckets));
+  block = malloc (8 + OSBF_SNAPSHOT_BLOCK_RECORDS * SNAPSHOT_RECORD_SIZE);
+  if (buckets == NULL || block == NULL)
+    {
+      free (buckets);
+      free (block);
+      fclose (fp_cfc);
+      strncpy (errmsg, "Error allocating memory", OSBF_ERROR_MESSAGE_LEN);
+      return 1;
+    }
+  fp_snap = fopen (snapfile, "wb");
+  if (fp_snap == NULL)
+    {
+      free (buckets);
+      free (block);
+      fclose (fp_cfc);
+      strncpy (errmsg, "Can't create snapshot file",
+	       OSBF_ERROR_MESSAGE_LEN);
+      return 1;
+    }
+
+  memcpy (head, OSBF_SNAPSHOT_MAGIC, sizeof (OSBF_SNAPSHOT_MAGIC) - 1);
+  p = head + sizeof (OSBF_SNAPSHOT_MAGIC) - 1;
+  put_le32 (p, OSBF_SNAPSHOT_VERSION);
+  put_le32 (p + 4, header.version);
+  put_le32 (p + 8, header.db_flags);
+  put_le32 (p + 12, header.buckets_start);
+  put_le32 (p + 16, header.num_buckets);
+  put_le32 (p + 20, header.learnings);
+  put_le32 (p + 24, header.mistakes);
+  put_le32 (p + 28, (uint32_t) header.classifications);
+  put_le32 (p + 32, (uint32_t) (header.classifications >> 32));
+  put_le32 (p + 36, header.extra_learnings);
+  put_le32 (p + 40, header.num_classes);
+  put_le32 (p + 44, crc32c (head, p + 44 - head));
+  if (fwrite (head, sizeof (head), 1, fp_snap) != 1 ||
+      fseeko (fp_cfc, (off_t) header.buckets_start *
+	      sizeof (OSBF_BUCKET_STRUCT), SEEK_SET) != 0)
+    error = 1;
+
+  /* the used buckets, each with the number of free ones before it */
+  p = block + 8;
+  for (left = header.num_buckets; error == 0 && left > 0; left -= n)
+    {
+      n = fread (buckets, sizeof (*buckets),
+		 left < OSBF_SNAPSHOT_BLOCK_RECORDS ?
+		 left : OSBF_SNAPSHOT_BLOCK_RECORDS, fp_cfc);
+      if (n == 0)
+	{
+	  error = 2;
+	  break;
+	}
+      for (i = 0; i < n && error == 0; i++)
+	{
+	  if (buckets[i].value == 0)
+	    {
+	      gap++;
+	      continue;
+	    }
+	  put_le32 (p, gap);
+	  put_le32 (p + 4, buckets[i].hash);
+	  put_le32 (p + 8, buckets[i].key);
+	  put_le32 (p + 12, buckets[i].value);
+	  p += SNAPSHOT_RECORD_SIZE;
+	  gap = 0;
+	  if (++records == OSBF_SNAPSHOT_BLOCK_RECORDS)
+	    {
+	      error = write_snapshot_block (fp_snap, block, records);
+	      p = block + 8;
+	      records = 0;
+	    }
+	}
+    }
+  if (error == 0 && records > 0)
+    error = write_snapshot_block (fp_snap, block, records);
+  /* the empty block at the end */
+  if (error == 0)
+    error = write_snapshot_block (fp_snap, block, 0);
+
+  free (buckets);
+  free (block);
+  fclose (fp_cfc);
+  if (fclose (fp_snap) != 0 && error == 0)
+    error = 1;
+  if (error != 0)
+    {
+      remove (snapfile);
+      if (error == 2)
+	strncpy (errmsg, "Not a valid cfc file", OSBF_ERROR_MESSAGE_LEN);
+      else
+	strncpy (errmsg, "Error writing to snapshot file",
+		 OSBF_ERROR_MESSAGE_LEN);
+      return 1;
+    }
+  return 0;
+}
+
+/*****************************************************************/
+
+/*
+ * Restore cfcfile from a binary snapshot written by osbf_dump_binary,
+ * checking the CRC32C of the header and of each block. The file is
+ * built aside and renamed over cfcfile, with its mode and owner, only
+ * if the whole snapshot is good, so an existing cfcfile is left alone
+ * on errors. Returns 0 if ok or 1 on errors.
+ */
+int
+osbf_restore_binary (const char *cfcfile, const char *snapfile,
+		     char *errmsg)
+{
+  FILE *fp_cfc, *fp_snap;
+  OSBF_HEADER_STRUCT header = { 0 };
+  OSBF_BUCKET_STRUCT *buckets = NULL;
+  unsigned char head[SNAPSHOT_HEADER_SIZE], block_head[8], *block, *p;
+  uint32_t i, n, base, window, pos, gap;
+  size_t header_size;
+  void *header_area = NULL;
+  char *tmpfile = NULL;
+  int fd, old_fd, error = 0;
+
+  fp_snap = fopen (snapfile, "rb");
+  if (fp_snap == NULL)
+    {
+      strncpy (errmsg, "Can't open snapshot file", OSBF_ERROR_MESSAGE_LEN);
+      return 1;
+    }
+  p = head + sizeof (OSBF_SNAPSHOT_MAGIC) - 1;
+  if (fread (head, sizeof (head), 1, fp_snap) != 1 ||
+      memcmp (head, OSBF_SNAPSHOT_MAGIC,
+	      sizeof (OSBF_SNAPSHOT_MAGIC) - 1) != 0 ||
+      get_le32 (p + 44) != crc32c (head, p + 44 - head))
+    {
+      fclose (fp_snap);
+      strncpy (errmsg, "Not a valid snapshot file", OSBF_ERROR_MESSAGE_LEN);
+      return 1;
+    }
+  if (get_le32 (p) != OSBF_SNAPSHOT_VERSION)
+    {
+      fclose (fp_snap);
+      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		"Unsupported snapshot version: %" PRIu32, get_le32 (p));
+      return 1;
+    }
+  header.version = get_le32 (p + 4);
+  header.db_flags = get_le32 (p + 8);
+  header.buckets_start = get_le32 (p + 12);
+  header.num_buckets = get_le32 (p + 16);
+  header.learnings = get_le32 (p + 20);
+  header.mistakes = get_le32 (p + 24);
+  header.classifications = get_le32 (p + 28) |
+    (uint64_t) get_le32 (p + 32) << 32;
+  header.extra_learnings = get_le32 (p + 36);
+  header.num_classes = get_le32 (p + 40);
+
+  /* osbf_dump_binary only writes single class files */
+  if (header.version != OSBF_VERSION)
+    {
+      fclose (fp_snap);
+      if (header.version == OSBF_MC_VERSION)
+	strncpy (errmsg, "Restore of multi-class files is not supported",
+		 OSBF_ERROR_MESSAGE_LEN);
+      else if (header.version == OSBF_PACKED_VERSION)
+	strncpy (errmsg, "Restore of packed files is not supported",
+		 OSBF_ERROR_MESSAGE_LEN);
+      else if (header.version == OSBF_FROZEN_VERSION)
+	strncpy (errmsg, "Restore of frozen files is not supported",
+		 OSBF_ERROR_MESSAGE_LEN);
+      else
+	strncpy (errmsg, "Not a valid snapshot file", OSBF_ERROR_MESSAGE_LEN);
+      return 1;
+    }
+
+  /* the header area is at most as large as the standard one */
+  header_size = (size_t) header.buckets_start * sizeof (*buckets);
+  if (header_size < sizeof (header) ||
+      header.buckets_start > OSBF_CFC_HEADER_SIZE ||
+      header.num_buckets == 0 ||
+      (header.db_flags & ~OSBF_DB_KNOWN_FLAGS) != 0)
+    {
+      fclose (fp_snap);
+      strncpy (errmsg, "Not a valid snapshot file", OSBF_ERROR_MESSAGE_LEN);
+      return 1;
+    }
+
+  header_area = calloc (1, header_size);
+  buckets = calloc (OSBF_SNAPSHOT_BLOCK_RECORDS, sizeof (*buckets));
+  block = malloc (OSBF_SNAPSHOT_BLOCK_RECORDS * SNAPSHOT_RECORD_SIZE);
+  tmpfile = malloc (strlen (cfcfile) + 32);
+  if (header_area == NULL || buckets == NULL || block == NULL ||
+      tmpfile == NULL)
+    {
+      free (header_area);
+      free (buckets);
+      free (block);
+      free (tmpfile);
+      fclose (fp_snap);
+      strncpy (errmsg, "Error allocating memory", OSBF_ERROR_MESSAGE_LEN);
+      return 1;
+    }
+  sprintf (tmpfile, "%s.%ld.tmp", cfcfile, (long) getpid ());
+  fp_cfc = fopen (tmpfile, "wb");
+  if (fp_cfc == NULL)
+    {
+      free (header_area);
+      free (buckets);
+      free (block);
+      free (tmpfile);
+      fclose (fp_snap);
+      strncpy (errmsg, "Can't create cfc file", OSBF_ERROR_MESSAGE_LEN);
+      return 1;
+    }
+  memcpy (header_area, &header, sizeof (header));
+  if (fwrite (header_area, header_size, 1, fp_cfc) != 1)
+    error = 2;
+
+  /*
+   * the buckets are built in a window of OSBF_SNAPSHOT_BLOCK_RECORDS,
+   * from bucket base on, written when a record falls past it
+   */
+  base = pos = 0;
+  window = header.num_buckets < OSBF_SNAPSHOT_BLOCK_RECORDS ?
+    header.num_buckets : OSBF_SNAPSHOT_BLOCK_RECORDS;
+  while (error == 0)
+    {
+      if (fread (block_head, sizeof (block_head), 1, fp_snap) != 1)
+	{
+	  error = 1;
+	  break;
+	}
+      n = get_le32 (block_head);
+      if (n == 0)
+	break;
+      if (n > OSBF_SNAPSHOT_BLOCK_RECORDS ||
+	  fread (block, (size_t) n * SNAPSHOT_RECORD_SIZE, 1, fp_snap) != 1)
+	{
+	  error = 1;
+	  break;
+	}
+      if (crc32c (block, (size_t) n * SNAPSHOT_RECORD_SIZE) !=
+	  get_le32 (block_head + 4))
+	{
+	  error = 3;
+	  break;
+	}
+      for (i = 0, p = block; i < n && error == 0;
+	   i++, p += SNAPSHOT_RECORD_SIZE)
+	{
+	  gap = get_le32 (p);
+	  if (gap >= header.num_buckets - pos)
+	    {
+	      error = 1;
+	      break;
+	    }
+	  pos += gap;
+	  while (pos - base >= window && error == 0)
+	    {
+	      if (fwrite (buckets, sizeof (*buckets), window, fp_cfc) != window)
+		error = 2;
+	      memset (buckets, 0, window * sizeof (*buckets));
+	      base += window;
+	      if (header.num_buckets - base < window)
+		window = header.num_buckets - base;
+	    }
+	  buckets[pos - base].hash = get_le32 (p + 4);
+	  buckets[pos - base].key = get_le32 (p + 8);
+	  buckets[pos - base].value = get_le32 (p + 12);
+	  pos++;
+	}
+    }
+  /* the rest of the buckets, free after the last record */
+  while (error == 0 && base < header.num_buckets)
+    {
+      if (fwrite (buckets, sizeof (*buckets), window, fp_cfc) != window)
+	error = 2;
+      memset (buckets, 0, window * sizeof (*buckets));
+      base += window;
+      if (header.num_buckets - base < window)
+	window = header.num_buckets - base;
+    }
+
+  free (header_area);
+  free (buckets);
+  free (block);
+  fclose (fp_snap);
+  if (fclose (fp_cfc) != 0 && error == 0)
+    error = 2;
+  if (error != 0)
+    {
+      remove (tmpfile);
+      free (tmpfile);
+      if (error == 2)
+	strncpy (errmsg, "Error writing to cfc file", OSBF_ERROR_MESSAGE_LEN);
+      else if (error == 3)
+	strncpy (errmsg, "Snapshot block checksum mismatch",
+		 OSBF_ERROR_MESSAGE_LEN);
+      else
+	strncpy (errmsg,
+		 "Error reading snapshot or not a valid snapshot file",
+		 OSBF_ERROR_MESSAGE_LEN);
+      return 1;
+    }
+
+  /* the fingerprints and the Bloom filter aren't in the snapshot */
+  if ((header.db_flags & (OSBF_DB_FINGERPRINTS | OSBF_DB_BLOOM)) &&
+      rebuild_extensions (tmpfile, errmsg) != 0)
+    {
+      remove (tmpfile);
+      free (tmpfile);
+      return 1;
+    }
+
+  /* the restored file replaces cfcfile, keeping its mode and owner */
+  fd = open (tmpfile, O_RDWR);
+  if (fd < 0)
+    error = 2;
+  else
+    {
+      old_fd = open (cfcfile, O_RDONLY);
+      if (old_fd >= 0)
+	{
+	  if (copy_file_mode (old_fd, fd) != 0)
+	    error = 2;
+	  close (old_fd);
+	}
+      if (fsync (fd) != 0)
+	error = 2;
+      close (fd);
+    }
+  if (error == 0 && rename (tmpfile, cfcfile) != 0)
+    error = 2;
+  if (error != 0)
+    {
+      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		"Couldn't replace %s: %s", cfcfile, strerror (errno));
+      remove (tmpfile);
+      free (tmpfile);
+      return 1;
+    }
+  free (tmpfile);
+  if (sync_dir_of (cfcfile) != 0)
+    {
+      /* replaced, but the rename may not survive a crash */
+      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		"Couldn't sync the directory of %s: %s", cfcfile,
+		strerror (errno));
+      return 1;
+    }
+
+  return 0;
+}
+
+/*****************************************************************/
+
+/* a used bucket of the sources of an import */
+struct import_entry
+{
+  uint32_t home;		/* right position in the destination */
+  uint32_t hash;
+  uint32_t key;
+  uint32_t value;
+};
+
+/*
+ * Sort the entries by home with a radix sort, 16 bits at a time,
+ * using tmp, of n entries too. The order is stable, so the entries
+ * of a feature found in several sources stay in the order of these.
+ */
+static int
+sort_entries (struct import_entry *e, struct import_entry *tmp, uint32_t n)
+{
+  uint32_t *count, i, d, sum, c;
+  struct import_entry *from = e, *to = tmp, *swap;
+
+  count = malloc (65536 * sizeof (uint32_t));
+  if (count == NULL)
+    return -1;
+  for (d = 0; d < 32; d += 16)
+    {
+      memset (count, 0, 65536 * sizeof (uint32_t));
+      for (i = 0; i < n; i++)
+	count[(from[i].home >> d) & 0xffff]++;
+      for (i = sum = 0; i < 65536; i++)
+	{
+	  c = count[i];
+	  count[i] = sum;
+	  sum += c;
+	}
+      for (i = 0; i < n; i++)
+	to[count[(from[i].home >> d) & 0xffff]++] = from[i];
+      swap = from;
+      from = to;
+      to = swap;
+    }
+  /* after an even number of passes the result is back in e */
+  free (count);
+  return 0;
+}
+
+/*
+ * Microgroom the chains with buckets farther than
+ * microgroom_chain_length from their right positions, as the
+ * insertions would have done, in a single pass over the class.
+ */
+static void
+groom_class (CLASS_STRUCT * class)
+{
+  uint32_t i, n, home, distance, zeroed, first = 0, last = 0;
+
+  set_chain_length (class);
+  n = NUM_BUCKETS (class);
+  for (i = 0; i < n; i++)
+    while (BUCKET_IN_CHAIN (class, i))
+      {
+	home = HASH_INDEX (class, BUCKET_HASH (class, i));
+	distance = i >= home ? i - home : n - (home - i);
+	if (distance <= microgroom_chain_length)
+	  break;
+	if (class->seq != NULL)
+	  {
+	    osbf_bucket_cluster (class, i, &first, &last);
+	    seq_begin (class, first, last);
+	  }
+	zeroed = osbf_microgroom (class, i);
+	if (class->seq != NULL)
+	  seq_end (class, first, last);
+	if (zeroed == 0)
+	  break;
+      }
+}
+
+/*
+ * Zero the counts of the entries with the lowest ones among the
+ * non-zero, so that at most keep are left. Of those with the count
+ * at the cut, the ones dropped are spread evenly over the array, not
+ * to leave the kept ones crowded at one end of the class.
+ */
+static int
+drop_entries (struct import_entry *e, uint32_t n, uint32_t keep)
+{
+  uint32_t *hist, i, v, count, drop_equal, equal;
+
+  hist = calloc (OSBF_MAX_BUCKET_VALUE + 1, sizeof (uint32_t));
+  if (hist == NULL)
+    return -1;
+  for (i = count = 0; i < n; i++)
+    if (e[i].value > 0)
+      {
+	hist[e[i].value < OSBF_MAX_BUCKET_VALUE ?
+	     e[i].value : OSBF_MAX_BUCKET_VALUE]++;
+	count++;
+      }
+
+  /* counts below v are dropped, and drop_equal of those equal to v */
+  for (v = 1; v < OSBF_MAX_BUCKET_VALUE && count - hist[v] >= keep; v++)
+    count -= hist[v];
+  drop_equal = count > keep ? count - keep : 0;
+  for (i = equal = 0; i < n; i++)
+    if (e[i].value > 0 && e[i].value < v)
+      e[i].value = 0;
+    else if (e[i].value == v)
+      {
+	if ((uint64_t) (equal + 1) * drop_equal / hist[v] >
+	    (uint64_t) equal * drop_equal / hist[v])
+	  e[i].value = 0;
+	equal++;
+      }
+
+  free (hist);
+  return 0;
+}
+
+/*
+ * Add the features of entries e[0..n-1], sorted by their right
+ * positions in the class, so the class is walked in bucket order.
+ * The features already in the class are updated in a first pass,
+ * and the new ones inserted in a second, after the ones with the
+ * lowest counts were dropped if they wouldn't fit. These take the
+ * free bucket at the end of their chains and microgrooming is left
+ * to groom_class, except in chains longer than
+ * OSBF_IMPORT_GROOM_FACTOR times the max chain len, which would make
+ * the lookups slow, and in Robin Hood classes, which must keep their
+ * order. Returns 0 if ok or -1 on errors.
+ */
+static int
+merge_entries (CLASS_STRUCT * class, struct import_entry *e, uint32_t n,
+	       char *errmsg)
+{
+  uint32_t i, bindex, home, distance, value, used, new_entries;
+
+  set_chain_length (class);
+  for (i = new_entries = 0; i < n; i++)
+    {
+      bindex = osbf_find_bucket (class, e[i].hash, e[i].key);
+      if (VALID_BUCKET (class, bindex) &&
+	  BUCKET_FOUND (class, bindex, e[i].hash, e[i].key))
+	{
+	  osbf_update_bucket (class, bindex, e[i].value);
+	  e[i].value = 0;
+	}
+      else
+	new_entries++;
+    }
+
+  for (i = used = 0; i < NUM_BUCKETS (class); i++)
+    if (BUCKET_IN_CHAIN (class, i))
+      used++;
+  if (used + new_entries > OSBF_IMPORT_MAX_USE (NUM_BUCKETS (class)) &&
+      drop_entries (e, n, used < OSBF_IMPORT_MAX_USE (NUM_BUCKETS (class)) ?
+		    OSBF_IMPORT_MAX_USE (NUM_BUCKETS (class)) - used : 0) != 0)
+    {
+      strncpy (errmsg, "Couldn't allocate memory for the import",
+	       OSBF_ERROR_MESSAGE_LEN);
+      return -1;
+    }
+
+  for (i = 0; i < n; i++)
+    {
+      if (e[i].value == 0)
+	continue;
+      bindex = osbf_find_bucket (class, e[i].hash, e[i].key);
+      if (!VALID_BUCKET (class, bindex))
+	{
+	  snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		    "%s is full!", class->classname);
+	  return -1;
+	}
+
+      home = HASH_INDEX (class, e[i].hash);
+      distance = bindex >= home ? bindex - home :
+	NUM_BUCKETS (class) - (home - bindex);
+      if (class->robin_hood ||
+	  distance > OSBF_IMPORT_GROOM_FACTOR * microgroom_chain_length)
+	{
+	  osbf_insert_bucket (class, bindex, e[i].hash, e[i].key,
+			      e[i].value);
+	  continue;
+	}
+
+      if (class->seq != NULL)
+	seq_begin (class, bindex, bindex);
+      BUCKET_HASH (class, bindex) = e[i].hash;
+      BUCKET_KEY (class, bindex) = e[i].key;
+      SET_FINGERPRINT (class, bindex, OSBF_FINGERPRINT (e[i].key));
+      osbf_bloom_add (class, e[i].hash, e[i].key);
+      value = e[i].value;
+      SET_BUCKET_VALUE (class, bindex, value < OSBF_MAX_BUCKET_VALUE ?
+			value : OSBF_MAX_BUCKET_VALUE);
+      if (class->seq != NULL)
+	seq_end (class, bindex, bindex);
+    }
+
+  if (!class->robin_hood)
+    groom_class (class);
+  return 0;
+}
+
+/*
+ * Import the buckets and counters of the classes in the NULL
+ * terminated array cfcfiles_from into cfcfile_to. The used buckets
+ * of all sources are sorted by their right positions in cfcfile_to,
+ * with the counts of a feature in several sources added, and merged
+ * walking it in bucket order by merge_entries. Returns 0 if ok or 1
+ * on errors.
+ */
+int
+osbf_import_sources (const char *cfcfile_to, const char *cfcfiles_from[],
+		     char *errmsg)
 {
-  FILE *fp_cfc, *fp_csv;
-  OSBF_BUCKET_STRUCT buckets[BUCKET_BUFFER_SIZE];
-  OSBF_HEADER_STRUCT header;
-  int32_t i, size_in_buckets;
+  CLASS_STRUCT class_to, *from;
+  struct import_entry *e = NULL;
+  uint32_t f, i, j, n = 0, start, num_from, used = 0;
   int error = 0;
 
-  fp_cfc = fopen (cfcfile, "rb");
-  if (fp_cfc != NULL)
+  for (num_from = 0; cfcfiles_from[num_from] != NULL; num_from++);
+  from = calloc (num_from + 1, sizeof (CLASS_STRUCT));
+  if (from == NULL)
     {
-      int32_t num_buckets;
+      strncpy (errmsg, "Error allocating memory", OSBF_ERROR_MESSAGE_LEN);
+      return 1;
+    }
 
-      if (1 == fread (&header, sizeof (header), 1, fp_cfc))
+  /* open the class to be trained and mmap it into memory */
+  if (osbf_open_class (cfcfile_to, 0, O_RDWR, &class_to, errmsg) != 0)
+    {
+      free (from);
+      return 1;
+    }
+  for (f = 0; f < num_from; f++)
+    {
+      if (osbf_open_class (cfcfiles_from[f], 0, O_RDONLY, &from[f],
+			   errmsg) != 0)
 	{
-	  size_in_buckets = header.num_buckets + header.buckets_start;
-	  fp_csv = fopen (csvfile, "w");
-	  if (fp_csv != NULL)
-	    {
-	      fseek (fp_cfc, 0, SEEK_SET);
-	      while (size_in_buckets > 0)
-		{
-		  num_buckets = fread (buckets, sizeof (OSBF_BUCKET_STRUCT),
-				       BUCKET_BUFFER_SIZE, fp_cfc);
-		  if (num_buckets > 0)
-		    {
-		      for (i = 0; i < num_buckets; i++)
-			{
-			  fprintf (fp_csv,
-				   "%" PRIu32 ";%" PRIu32 ";%" PRIu32 "\n",
-				   buckets[i].hash, buckets[i].key,
-				   buckets[i].value);
-			}
-		    }
-		  size_in_buckets -= num_buckets;
-		}
-	      fclose (fp_cfc);
-	      fclose (fp_csv);
-	      if (size_in_buckets != 0)
-		{
-		  error = 1;
-		  strncpy (errmsg, "Not a valid cfc file",
-			   OSBF_ERROR_MESSAGE_LEN);
-		}
-	    }
-	  else
-	    {
-	      error = 1;
-	      strncpy (errmsg, "Can't create csv file",
-		       OSBF_ERROR_MESSAGE_LEN);
-	    }
+	  error = 1;
+	  break;
 	}
-      else
+      if (from[f].num_columns > 1)
 	{
+	  strncpy (errmsg, "Import of multi-class files is not supported",
+		   OSBF_ERROR_MESSAGE_LEN);
 	  error = 1;
-	  strncpy (errmsg, "Error reading cfc file", OSBF_ERROR_MESSAGE_LEN);
+	  f++;
+	  break;
 	}
     }
-  else
+  /* the classes opened */
+  num_from = f;
+  if (error == 0 && class_to.num_columns > 1)
     {
+      strncpy (errmsg, "Import of multi-class files is not supported",
+	       OSBF_ERROR_MESSAGE_LEN);
       error = 1;
-      strncpy (errmsg, "Can't open cfc file", OSBF_ERROR_MESSAGE_LEN);
     }
 
-  return error;
-}
-
-/*****************************************************************/
-
-int
-osbf_restore (const char *cfcfile, const char *csvfile, char *errmsg)
-{
-  FILE *fp_cfc, *fp_csv;
-  OSBF_BUCKET_STRUCT buckets[BUCKET_BUFFER_SIZE];
-  OSBF_HEADER_STRUCT *header = (OSBF_HEADER_STRUCT *) buckets;
-  int32_t size_in_buckets;
-  int error = 0;
-
-/*
-  if (check_file(cfcfile) >= 0)
+  if (error == 0)
     {
-      strncpy (errmsg, "The .cfc file already exists!", OSBF_ERROR_MESSAGE_LEN);
-      return 1;
+      for (f = 0; f < num_from; f++)
+	for (i = 0; i < NUM_BUCKETS (&from[f]); i++)
+	  if (BUCKET_VALUE (&from[f], i) != 0)
+	    used++;
+      /* with room for sort_entries */
+      e = malloc ((used > 0 ? 2 * used : 1) *
+		  sizeof (struct import_entry));
+      if (e == NULL)
+	{
+	  strncpy (errmsg, "Error allocating memory",
+		   OSBF_ERROR_MESSAGE_LEN);
+	  error = 1;
+	}
     }
-*/
 
-  fp_csv = fopen (csvfile, "r");
-  if (fp_csv != NULL)
+  if (error == 0)
     {
-      /* read header */
-      if (5 ==
-	  fscanf (fp_csv,
-		  "%" SCNu32 ";%" SCNu32 ";%" SCNu32 "\n%" SCNu32 ";%" SCNu32
-		  "\n", &header->version, &header->db_flags,
-		  &header->buckets_start, &header->num_buckets,
-		  &header->learnings))
+      n = 0;
+      for (f = 0; f < num_from; f++)
 	{
-	  size_in_buckets = header->buckets_start + header->num_buckets;
-	  fp_cfc = fopen (cfcfile, "wb");
-	  fseek (fp_csv, 0, SEEK_SET);
-	  if (fp_cfc != NULL)
-	    {
-
-	      while (error == 0
-		     && 3 == fscanf (fp_csv,
-				     "%" SCNu32 ";%" SCNu32 ";%" SCNu32
-				     "\n", (uint32_t *) & buckets[0].hash,
-				     (uint32_t *) & buckets[0].key,
-				     (uint32_t *) & buckets[0].value))
-		{
-		  if (1 ==
-		      fwrite (buckets, sizeof (OSBF_BUCKET_STRUCT), 1,
-			      fp_cfc))
-		    {
-		      size_in_buckets--;
-		    }
-		  else
-		    {
-		      error = 1;
-		      strncpy (errmsg, "Error writing to cfc file",
-			       OSBF_ERROR_MESSAGE_LEN);
-		    }
-		}
-	      if (!(feof (fp_csv) && size_in_buckets == 0))
-		{
-		  remove (cfcfile);
-		  error = 1;
-		  strncpy (errmsg,
-			   "Error reading csv or not a valid csv file",
-			   OSBF_ERROR_MESSAGE_LEN);
-		}
-	      fclose (fp_cfc);
-	      fclose (fp_csv);
-	    }
-	  else
-	    {
-	      fclose (fp_csv);
-	      error = 1;
-	      strncpy (errmsg, "Can't create cfc file",
-		       OSBF_ERROR_MESSAGE_LEN);
-	    }
+	  for (i = 0; i < NUM_BUCKETS (&from[f]); i++)
+	    if (BUCKET_VALUE (&from[f], i) != 0)
+	      {
+		e[n].home = HASH_INDEX (&class_to, BUCKET_HASH (&from[f], i));
+		e[n].hash = BUCKET_HASH (&from[f], i);
+		e[n].key = BUCKET_KEY (&from[f], i);
+		e[n].value = BUCKET_VALUE (&from[f], i);
+		n++;
+	      }
+	  class_to.header->learnings += from[f].header->learnings;
+	  class_to.header->extra_learnings +=
+	    from[f].header->extra_learnings;
+	  __atomic_fetch_add (&class_to.header->classifications,
+			      from[f].header->classifications,
+			      __ATOMIC_RELAXED);
+	  class_to.header->mistakes += from[f].header->mistakes;
 	}
-      else
+      if (sort_entries (e, e + n, n) != 0)
 	{
-	  fclose (fp_csv);
-	  remove (cfcfile);
-	  error = 1;
-	  strncpy (errmsg, "csv file doesn't have a valid header",
+	  strncpy (errmsg, "Error allocating memory",
 		   OSBF_ERROR_MESSAGE_LEN);
+	  error = 1;
 	}
     }
-  else
+
+  if (error == 0)
     {
-      error = 1;
-      strncpy (errmsg, "Can't open csv file", OSBF_ERROR_MESSAGE_LEN);
+      /*
+       * join the counts of a feature in several sources, which are in
+       * the few entries with the same home
+       */
+      for (i = used = start = 0; i < n; i++)
+	{
+	  if (used == 0 || e[used - 1].home != e[i].home)
+	    start = used;
+	  for (j = start; j < used; j++)
+	    if (e[j].hash == e[i].hash && e[j].key == e[i].key)
+	      break;
+	  if (j < used)
+	    {
+	      e[j].value += e[i].value;
+	      if (e[j].value > OSBF_MAX_BUCKET_VALUE)
+		e[j].value = OSBF_MAX_BUCKET_VALUE;
+	    }
+	  else
+	    e[used++] = e[i];
+	}
+
+      if (merge_entries (&class_to, e, used, errmsg) != 0)
+	error = 1;
+      osbf_mark_dirty (&class_to, 0, class_to.fsize);
     }
 
+  free (e);
+  for (f = 0; f < num_from; f++)
+    osbf_close_class (&from[f], errmsg);
+  free (from);
+  if (osbf_close_class (&class_to, errmsg) != 0)
+    error = 1;
+
   return error;
 }
 
-/*****************************************************************/
-
+/* import a single class file into another */
 int
 osbf_import (const char *cfcfile_to, const char *cfcfile_from, char *errmsg)
 {
-  uint32_t bindex;
-  CLASS_STRUCT class_to, class_from;
-  int error = 0;
-
-  /* open the class to be trained and mmap it into memory */
-  error = osbf_open_class (cfcfile_to, O_RDWR, &class_to, errmsg);
-  if (error != 0)
-    return 1;
-  error = osbf_open_class (cfcfile_from, O_RDONLY, &class_from, errmsg);
-  if (error != 0)
-    return 1;
-
-  {
-    uint32_t i = 0;
-
-    class_to.header->learnings += class_from.header->learnings;
-    class_to.header->extra_learnings += class_from.header->extra_learnings;
-    class_to.header->classifications += class_from.header->classifications;
-    class_to.header->mistakes += class_from.header->mistakes;
-
-    for (i = 0; i < class_from.header->num_buckets; i++)
-      {
-	if (class_from.buckets[i].value == 0)
-	  continue;
-
-	bindex = osbf_find_bucket (&class_to,
-				   class_from.buckets[i].hash,
-				   class_from.buckets[i].key);
-	if (bindex < class_to.header->num_buckets)
-	  {
-	    if (BUCKET_IN_CHAIN (&class_to, bindex))
-	      {
-		osbf_update_bucket (&class_to, bindex,
-				    class_from.buckets[i].value);
-	      }
-	    else
-	      {
-		osbf_insert_bucket (&class_to, bindex,
-				    class_from.buckets[i].hash,
-				    class_from.buckets[i].key,
-				    class_from.buckets[i].value);
-	      }
-	  }
-	else
-	  {
-	    error = 1;
-	    strncpy (errmsg, ".cfc file is full!", OSBF_ERROR_MESSAGE_LEN);
-	    break;
-	  }
-
-      }
-
-    osbf_close_class (&class_to, errmsg);
-    osbf_close_class (&class_from, errmsg);
-  }
+  const char *from[2];
 
-  return error;
+  from[0] = cfcfile_from;
+  from[1] = NULL;
+  return osbf_import_sources (cfcfile_to, from, errmsg);
 }
 
 /*****************************************************************/
 
 int
-osbf_stats (const char *cfcfile, STATS_STRUCT * stats,
+osbf_stats (const char *cfcfile, uint32_t column, STATS_STRUCT * stats,
 	    char *errmsg, int full)
 {
-
-  FILE *fp_cfc;
-  OSBF_BUCKET_STRUCT *buckets = NULL;
-  OSBF_HEADER_STRUCT header;
-  uint32_t i = 0, j = 0;
-  int error = 0;
+  CLASS_STRUCT class;
+  uint32_t i;
 
   uint32_t used_buckets = 0, unreachable = 0;
   uint32_t max_chain = 0, num_chains = 0;
-  uint32_t max_value = 0, first_chain_len = 0;
   uint32_t max_displacement = 0, chain_len_sum = 0;
+  uint32_t chain_len = 0;
+  uint32_t fp_probes = 0, fp_false_hits = 0;
 
-  fp_cfc = fopen (cfcfile, "rb");
-  if (fp_cfc != NULL)
+  if (osbf_map_class (cfcfile, column, O_RDONLY, &class, errmsg) != 0)
     {
+      if (check_file (cfcfile) < 0)
+	strncpy (errmsg, "Can't open cfc file", OSBF_ERROR_MESSAGE_LEN);
+      return 1;
+    }
 
-      if (1 == fread (&header, sizeof (header), 1, fp_cfc))
+  if (full == 1 && class.frozen)
+    {
+      /* no chains, each feature is in its own bucket */
+      for (i = 0; i < NUM_BUCKETS (&class); i++)
+	if (BUCKET_IN_CLASS (&class, i))
+	  used_buckets++;
+    }
+  else if (full == 1)
+    {
+      for (i = 0; i < NUM_BUCKETS (&class); i++)
 	{
-	  uint32_t chain_len = 0, value;
-	  uint32_t buckets_in_buffer = 0, buffer_readings = 0;
-	  uint32_t bucket_buffer_size = 0;
-
-	  /* Check version */
-	  if (header.version != OSBF_VERSION || header.db_flags != 0)
-	    {
-	      strncpy (errmsg, "Error: not a valid OSBF-Bayes file",
-		       OSBF_ERROR_MESSAGE_LEN);
-	      error = 1;
-	    }
-	  else
+	  if (BUCKET_IN_CHAIN (&class, i))
 	    {
-	      bucket_buffer_size =
-		header.num_buckets * sizeof (OSBF_BUCKET_STRUCT);
-	      buckets = malloc (bucket_buffer_size);
-	      if (buckets == NULL)
-		{
-		  strncpy (errmsg, "Error allocating memory",
-			   OSBF_ERROR_MESSAGE_LEN);
-		  error = 1;
-		}
-	      else if (error == 0)
-		{
-		  error = fseek (fp_cfc,
-				 header.buckets_start *
-				 sizeof (OSBF_BUCKET_STRUCT), SEEK_SET);
-		  if (error == 0)
-		    {
-		      buckets_in_buffer =
-			fread (buckets, sizeof (OSBF_BUCKET_STRUCT),
-			       header.num_buckets, fp_cfc);
-		      if (buckets_in_buffer != header.num_buckets)
-			{
-			  error = 1;
-			  snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
-				    "Wrong number of buckets read from '%s'",
-				    cfcfile);
-			}
-		    }
-		  else
-		    {
-		      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
-				"'%s': fseek error", cfcfile);
-		    }
+	      uint32_t distance, right_position;
+	      uint32_t real_position, rp;
 
-		  buffer_readings = chain_len = j = 0;
-		}
-	    }
+	      used_buckets++;
+	      chain_len++;
 
-	  if (full == 1) {
-	  while (error == 0 && buckets_in_buffer > 0)
-	    {
-	      j++;		/* number of reads */
-	      if (buckets_in_buffer > 0)
+	      /* calculate max displacement */
+	      right_position = HASH_INDEX (&class, BUCKET_HASH (&class, i));
+	      real_position = i;
+	      if (right_position <= real_position)
+		distance = real_position - right_position;
+	      else
+		distance = NUM_BUCKETS (&class) + real_position -
+		  right_position;
+	      if (distance > max_displacement)
+		max_displacement = distance;
+
+	      /* check if the bucket is unreachable */
+	      for (rp = right_position; rp != real_position; rp++)
 		{
-		  for (i = 0; i < buckets_in_buffer; i++)
+		  if (rp >= NUM_BUCKETS (&class))
 		    {
-		      if ((value = buckets[i].value) != 0)
-			{
-			  uint32_t distance, right_position;
-			  uint32_t real_position, rp;
-
-			  used_buckets++;
-			  chain_len++;
-			  if (value > max_value)
-			    max_value = value;
-
-			  /* calculate max displacement */
-			  right_position = buckets[i].hash %
-			    header.num_buckets;
-			  real_position = i;
-			  if (right_position <= real_position)
-			    distance = real_position - right_position;
-			  else
-			    distance = header.num_buckets + real_position -
-			      right_position;
-			  if (distance > max_displacement)
-			    max_displacement = distance;
-
-			  /* check if the bucket is unreachable */
-			  for (rp = right_position; rp != real_position; rp++)
-			    {
-			      if (rp >= header.num_buckets)
-				{
-				  rp = 0;
-				  if (rp == real_position)
-				    break;
-				}
-			      if (buckets[rp].value == 0)
-				break;
-			    }
-			  if (rp != real_position)
-			    {
-			      unreachable++;
-			    }
-			}
-		      else
-			{
-			  if (chain_len > 0)
-			    {
-			      if (chain_len > max_chain)
-				max_chain = chain_len;
-			      chain_len_sum += chain_len;
-			      num_chains++;
-			      chain_len = 0;
-			      /* check if the first chain starts */
-			      /* at the the first bucket */
-			      if (j == 1 && num_chains == 1 &&
-				  buckets[0].value != 0)
-				first_chain_len = chain_len;
-			    }
-			}
+		      rp = 0;
+		      if (rp == real_position)
+			break;
+		    }
+		  if (!BUCKET_IN_CHAIN (&class, rp))
+		    break;
+		  /* a lookup of this bucket checks the fingerprint of */
+		  /* each bucket before it in the chain               */
+		  if (class.fingerprints != NULL)
+		    {
+		      fp_probes++;
+		      if (class.fingerprints[rp] == class.fingerprints[i])
+			fp_false_hits++;
 		    }
-		  buckets_in_buffer = fread (buckets,
-					     sizeof (OSBF_BUCKET_STRUCT),
-					     bucket_buffer_size, fp_cfc);
-		  if (feof (fp_cfc))
-		    buckets_in_buffer = 0;
-		  if (buckets_in_buffer > 0)
-		    buffer_readings++;
 		}
-	    }
-	  }
-
-	  if (error != 0)
-	    {
-	      if (ferror (fp_cfc))
+	      if (rp != real_position)
 		{
-		  error = 1;
-		  strncpy (errmsg, "Error reading cfc file",
-			   OSBF_ERROR_MESSAGE_LEN);
+		  unreachable++;
 		}
 	    }
-	  else
+	  else if (chain_len > 0)
 	    {
-	      /* check if last and first chains are the same */
-	      if (chain_len > 0)
-		{
-		  if (first_chain_len == 0)
-		    num_chains++;
-		  else
-		    chain_len += first_chain_len;
-		  chain_len_sum += chain_len;
-		  if (chain_len > max_chain)
-		    max_chain = chain_len;
-		}
+	      if (chain_len > max_chain)
+		max_chain = chain_len;
+	      chain_len_sum += chain_len;
+	      num_chains++;
+	      chain_len = 0;
 	    }
-	  fclose (fp_cfc);
 	}
-      else
+
+      /* last chain */
+      if (chain_len > 0)
 	{
-	  error = 1;
-	  fclose (fp_cfc);
-	  strncpy (errmsg, "Error reading cfc file", OSBF_ERROR_MESSAGE_LEN);
+	  num_chains++;
+	  chain_len_sum += chain_len;
+	  if (chain_len > max_chain)
+	    max_chain = chain_len;
 	}
     }
-  else
+
+  stats->version = class.header->version;
+  stats->total_buckets = class.header->num_buckets;
+  stats->bucket_size = class.bucket_words * sizeof (uint32_t);
+  stats->header_size = class.header->buckets_start * stats->bucket_size;
+  if (class.packed)
     {
-      error = 1;
-      strncpy (errmsg, "Can't open cfc file", OSBF_ERROR_MESSAGE_LEN);
+      stats->bucket_size = OSBF_PACKED_BUCKET_SIZE;
+      stats->header_size = class.header->buckets_start * OSBF_LINE_SIZE;
     }
-
-  if (error == 0)
+  stats->used_buckets = used_buckets;
+  stats->learnings = class.header->learnings;
+  stats->extra_learnings = class.header->extra_learnings;
+  stats->mistakes = class.header->mistakes;
+  stats->classifications = class.header->classifications;
+  stats->num_chains = num_chains;
+  stats->max_chain = max_chain;
+  if (num_chains > 0)
+    stats->avg_chain = (double) chain_len_sum / num_chains;
+  else
+    stats->avg_chain = 0;
+  stats->max_displacement = max_displacement;
+  stats->unreachable = unreachable;
+  stats->num_classes = class.num_columns;
+  stats->db_flags = class.header->db_flags;
+  stats->fingerprint_probes = fp_probes;
+  stats->fingerprint_false_hits = fp_false_hits;
+  stats->bloom_stale = 0;
+  stats->bloom_false_positives = 0;
+  if (class.bloom != NULL)
     {
-      stats->version = header.version;
-      stats->total_buckets = header.num_buckets;
-      stats->bucket_size = sizeof (OSBF_BUCKET_STRUCT);
-      stats->used_buckets = used_buckets;
-      stats->header_size = header.buckets_start * sizeof (OSBF_BUCKET_STRUCT);
-      stats->learnings = header.learnings;
-      stats->extra_learnings = header.extra_learnings;
-      stats->mistakes = header.mistakes;
-      stats->classifications = header.classifications;
-      stats->num_chains = num_chains;
-      stats->max_chain = max_chain;
-      if (num_chains > 0)
-	stats->avg_chain = (double) chain_len_sum / num_chains;
-      else
-	stats->avg_chain = 0;
-      stats->max_displacement = max_displacement;
-      stats->unreachable = unreachable;
+      stats->bloom_stale = *class.bloom_stale;
+      if (full == 1)
+	{
+	  /* a check of a new feature fails only if all its bits are set */
+	  double fp_sum = 0;
+	  uint32_t b, w, set;
+
+	  for (b = 0; b < class.bloom_blocks; b++)
+	    {
+	      for (set = 0, w = 0; w < 8; w++)
+		set += __builtin_popcountll (class.bloom[8 * b + w]);
+	      fp_sum += pow (set / 512.0, OSBF_BLOOM_HASHES);
+	    }
+	  stats->bloom_false_positives = fp_sum / class.bloom_blocks;
+	}
     }
 
-  return error;
+  osbf_close_class (&class, errmsg);
+  return 0;
 }
 
 /*****************************************************************/
@@ -25,6 +25,15 @@
 #include <sys/mman.h>
 #include <inttypes.h>
 #include <errno.h>
+#include <stddef.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#ifndef OSBF_NO_THREADS
+#include <pthread.h>
+#endif
 
 #define DEBUG 0
 
@@ -37,7 +46,16 @@ struct token_search
   unsigned char *ptok_max;
   uint32_t toklen;
   uint32_t hash;
-  const char *delims;
+  const DELIM_TABLE_STRUCT *dt;
+};
+
+/* a feature of the text, as looked up in the classes */
+/* scoring constants of a classification */
+struct weights
+{
+  uint32_t total_learnings;
+  uint32_t trainings[OSBF_MAX_CLASSES];	/* learnings in the headers */
+  double feature_weight[OSB_BAYES_WINDOW_LEN + 1];
 };
 
 #define TMPBUFFSIZE 512
@@ -47,6 +65,26 @@ extern uint32_t microgroom_chain_length;
 uint32_t max_token_size = OSBF_MAX_TOKEN_SIZE;
 uint32_t max_long_tokens = OSBF_MAX_LONG_TOKENS;
 uint32_t limit_token_size = 0;
+uint32_t prefetch_distance = OSBF_PREFETCH_DISTANCE;
+
+/* hint the CPU to fetch the head bucket of a chain, and its */
+/* fingerprints, if the class has them. Frozen files have no */
+/* chains, so there's no head bucket to fetch                */
+#if defined(__GNUC__)
+#define PREFETCH_BUCKET(cd, h) \
+  do \
+    { \
+      uint32_t pindex = HASH_INDEX (cd, h); \
+      if ((cd)->frozen) \
+        break; \
+      if ((cd)->fingerprints) \
+        __builtin_prefetch ((cd)->fingerprints + pindex, 0, 3); \
+      __builtin_prefetch (&BUCKET_HASH (cd, pindex), 0, 3); \
+    } \
+  while (0)
+#else
+#define PREFETCH_BUCKET(cd, h)
+#endif
 
 /*
  *   the hash coefficient tables should be full of relatively prime numbers,
@@ -109,34 +147,212 @@ conf_factor (uint32_t n, uint32_t k, double interval)
 
 /*****************************************************************/
 
-static unsigned char *
-get_next_token (unsigned char *p_text, unsigned char *max_p,
-		const char *delims, uint32_t * p_toklen)
+/*
+ * Build the table of token chars for a delimiter string. A char can
+ * be part of a token if it's a graphic char (isgraph) and it's not one
+ * of the extra delimiters. The SIMD scanner is enabled only if the
+ * table agrees with its assumptions about printable ASCII chars, so
+ * both scanners always produce the same tokens.
+ */
+void
+osbf_build_delim_table (DELIM_TABLE_STRUCT * dt, const char *delims)
 {
-  unsigned char *p_ini = p_text;
+  int c;
 
   if (delims == NULL)
-    return NULL;
+    delims = "";
 
-  /* find nongraph delimited token */
-  while ((p_text < max_p) &&
-	 (!isgraph ((int) *p_text) || strchr (delims, (int) *p_text)))
+  for (c = 0; c < 256; c++)
+    dt->tokchar[c] = (isgraph (c) && strchr (delims, c) == NULL);
+
+  dt->simd = 1;
+  dt->num_simd_delims = 0;
+  for (c = 0; c < 0x80; c++)
+    {
+      if (c <= ' ' || c == 0x7F)
+	{
+	  /* must never be a token char */
+	  if (dt->tokchar[c])
+	    dt->simd = 0;
+	}
+      else if (!isgraph (c))
+	dt->simd = 0;
+      else if (!dt->tokchar[c])
+	{
+	  /* printable ASCII delimiter */
+	  if (dt->num_simd_delims < OSBF_MAX_SIMD_DELIMS)
+	    dt->simd_delims[dt->num_simd_delims++] = c;
+	  else
+	    dt->simd = 0;
+	}
+    }
+}
+
+/*****************************************************************/
+
+/*
+ * SIMD block classification. Returns a bit mask with the bits set
+ * for the chars that are printable ASCII token chars and, in *high,
+ * the mask of non-ASCII chars, which must be checked in the table.
+ */
+#if defined(__AVX2__)
+static uint32_t
+avx2_token_mask (const unsigned char *p, const DELIM_TABLE_STRUCT * dt,
+		 uint32_t * high)
+{
+  uint32_t i;
+  __m256i v, tok, delim;
+
+  v = _mm256_loadu_si256 ((const __m256i *) p);
+  /* signed compare: 0x21 - 0x7F are greater than 0x20 */
+  tok = _mm256_andnot_si256 (_mm256_cmpeq_epi8 (v, _mm256_set1_epi8 (0x7F)),
+			     _mm256_cmpgt_epi8 (v, _mm256_set1_epi8 (0x20)));
+  for (i = 0; i < dt->num_simd_delims; i++)
+    {
+      delim = _mm256_cmpeq_epi8 (v, _mm256_set1_epi8 (dt->simd_delims[i]));
+      tok = _mm256_andnot_si256 (delim, tok);
+    }
+  *high = (uint32_t) _mm256_movemask_epi8 (v);
+  return (uint32_t) _mm256_movemask_epi8 (tok);
+}
+#endif
+
+#if defined(__SSE2__)
+static uint32_t
+sse2_token_mask (const unsigned char *p, const DELIM_TABLE_STRUCT * dt,
+		 uint32_t * high)
+{
+  uint32_t i;
+  __m128i v, tok, delim;
+
+  v = _mm_loadu_si128 ((const __m128i *) p);
+  /* signed compare: 0x21 - 0x7F are greater than 0x20 */
+  tok = _mm_andnot_si128 (_mm_cmpeq_epi8 (v, _mm_set1_epi8 (0x7F)),
+			  _mm_cmpgt_epi8 (v, _mm_set1_epi8 (0x20)));
+  for (i = 0; i < dt->num_simd_delims; i++)
+    {
+      delim = _mm_cmpeq_epi8 (v, _mm_set1_epi8 (dt->simd_delims[i]));
+      tok = _mm_andnot_si128 (delim, tok);
+    }
+  *high = (uint32_t) _mm_movemask_epi8 (v);
+  return (uint32_t) _mm_movemask_epi8 (tok);
+}
+#endif
+
+/* find the first token char in [p_text, max_p) */
+static unsigned char *
+skip_delims (unsigned char *p_text, unsigned char *max_p,
+	     const DELIM_TABLE_STRUCT * dt)
+{
+#if defined(__SSE2__)
+  uint32_t mask, high;
+
+  if (dt->simd)
+    {
+#if defined(__AVX2__)
+      while (p_text + 32 <= max_p)
+	{
+	  mask = avx2_token_mask (p_text, dt, &high) | high;
+	  if (mask == 0)
+	    {
+	      p_text += 32;
+	      continue;
+	    }
+	  p_text += __builtin_ctz (mask);
+	  if (dt->tokchar[*p_text])
+	    return p_text;
+	  p_text++;
+	}
+#endif
+      while (p_text + 16 <= max_p)
+	{
+	  mask = sse2_token_mask (p_text, dt, &high) | high;
+	  if (mask == 0)
+	    {
+	      p_text += 16;
+	      continue;
+	    }
+	  p_text += __builtin_ctz (mask);
+	  if (dt->tokchar[*p_text])
+	    return p_text;
+	  p_text++;
+	}
+    }
+#endif
+
+  while (p_text < max_p && !dt->tokchar[*p_text])
+    p_text++;
+  return p_text;
+}
+
+/* find the first non-token char in [p_text, max_p) */
+static unsigned char *
+skip_token (unsigned char *p_text, unsigned char *max_p,
+	    const DELIM_TABLE_STRUCT * dt)
+{
+#if defined(__SSE2__)
+  uint32_t mask, high;
+
+  if (dt->simd)
+    {
+#if defined(__AVX2__)
+      while (p_text + 32 <= max_p)
+	{
+	  mask = ~avx2_token_mask (p_text, dt, &high);
+	  if (mask == 0)
+	    {
+	      p_text += 32;
+	      continue;
+	    }
+	  p_text += __builtin_ctz (mask);
+	  if (!dt->tokchar[*p_text])
+	    return p_text;
+	  p_text++;
+	}
+#endif
+      while (p_text + 16 <= max_p)
+	{
+	  mask = ~sse2_token_mask (p_text, dt, &high) & 0xFFFF;
+	  if (mask == 0)
+	    {
+	      p_text += 16;
+	      continue;
+	    }
+	  p_text += __builtin_ctz (mask);
+	  if (!dt->tokchar[*p_text])
+	    return p_text;
+	  p_text++;
+	}
+    }
+#endif
+
+  while (p_text < max_p && dt->tokchar[*p_text])
     p_text++;
-  p_ini = p_text;
+  return p_text;
+}
+
+/*****************************************************************/
+
+static unsigned char *
+get_next_token (unsigned char *p_text, unsigned char *max_p,
+		const DELIM_TABLE_STRUCT * dt, uint32_t * p_toklen)
+{
+  unsigned char *p_ini;
+
+  /* find nongraph delimited token */
+  p_ini = p_text = skip_delims (p_text, max_p, dt);
 
   if (limit_token_size == 0)
     {
       /* don't limit the tokens */
-      while ((p_text < max_p) && isgraph ((int) *p_text) &&
-	     !strchr (delims, (int) *p_text))
-	p_text++;
+      p_text = skip_token (p_text, max_p, dt);
     }
   else
     {
       /* limit the tokens to max_token_size */
-      while ((p_text < max_p) && (p_text < (p_ini + max_token_size)) &&
-	     isgraph ((int) *p_text) && !strchr (delims, (int) *p_text))
-	p_text++;
+      if (max_p - p_ini > (long) max_token_size)
+	max_p = p_ini + max_token_size;
+      p_text = skip_token (p_text, max_p, dt);
     }
 
   *p_toklen = p_text - p_ini;
@@ -167,7 +383,7 @@ get_next_hash (struct token_search *pts)
 
   pts->ptok += pts->toklen;
   pts->ptok = get_next_token (pts->ptok, pts->ptok_max,
-			      pts->delims, &(pts->toklen));
+			      pts->dt, &(pts->toklen));
 
 #ifdef OSBF_MAX_TOKEN_SIZE
   /* long tokens, probably encoded lines */
@@ -180,7 +396,7 @@ get_next_hash (struct token_search *pts)
       /* advance the pointer and get next token */
       pts->ptok += pts->toklen;
       pts->ptok = get_next_token (pts->ptok, pts->ptok_max,
-				  pts->delims, &(pts->toklen));
+				  pts->dt, &(pts->toklen));
     }
 
 
@@ -202,72 +418,57 @@ get_next_hash (struct token_search *pts)
   return (error);
 }
 
-/******************************************************************/
-/* Train the specified class with the text pointed to by "p_text" */
-/******************************************************************/
-int osbf_bayes_learn (const unsigned char *p_text,	/* pointer to text */
-		      unsigned long text_len,	/* length of text */
-		      const char *delims,	/* token delimiters */
-		      const char *classnames[],	/* class file names */
-		      uint32_t ctbt,	/* index of the class to be trained */
-		      int sense,	/* 1 => learn;  -1 => unlearn */
-		      uint32_t flags,	/* flags */
-		      char *errmsg)
+/*****************************************************************/
+
+/*
+ * Extract the features of a text: the sparse bigrams of each token
+ * with the OSB_BAYES_WINDOW_LEN - 1 tokens before it. If "paddings"
+ * is set, the features of the fake tokens a training inserts after
+ * the last real one are extracted too, after the first num_features.
+ */
+static int
+extract_features (const unsigned char *p_text, unsigned long text_len,
+		  const DELIM_TABLE_STRUCT * dt, int paddings,
+		  OSBF_TEXT_FEATURES_STRUCT * tf, char *errmsg)
 {
-  int err;
-  uint32_t window_idx;
-  int32_t learn_error;
+  uint32_t window_idx, n = 0, max_features;
   int32_t h;
-  off_t fsize;
   uint32_t hashpipe[OSB_BAYES_WINDOW_LEN + 1];
   int32_t num_hash_paddings;
-  int microgroom;
+  int eof = 0;
   struct token_search ts;
-  CLASS_STRUCT class[OSBF_MAX_CLASSES];
-
-  /* fprintf(stderr, "Starting learning...\n"); */
+  OSBF_FEATURE_STRUCT *features;
 
   ts.ptok = (unsigned char *) p_text;
   ts.ptok_max = (unsigned char *) (p_text + text_len);
   ts.toklen = 0;
   ts.hash = 0;
-  ts.delims = delims;
+  ts.dt = dt;
 
-  microgroom = 1;
-  if (flags & NO_MICROGROOM)
-    microgroom = 0;
+  /* init the hashpipe with 0xDEADBEEF  */
+  for (h = 0; h < OSB_BAYES_WINDOW_LEN; h++)
+    hashpipe[h] = 0xDEADBEEF;
 
-  fsize = check_file (classnames[ctbt]);
-  if (fsize < 0)
+  max_features = (uint32_t) (text_len / 4) + OSB_BAYES_WINDOW_LEN;
+  features = malloc (max_features * sizeof (OSBF_FEATURE_STRUCT));
+  if (features == NULL)
     {
-      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN, "File not available: %s.",
-		classnames[ctbt]);
+      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		"Couldn't allocate memory for features array.");
       return (-1);
     }
 
-  /* open the class to be trained and mmap it into memory */
-  err = osbf_open_class (classnames[ctbt], O_RDWR, &class[ctbt], errmsg);
-  if (err != 0)
-    {
-      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN, "Couldn't open %s.",
-		classnames[ctbt]);
-      fprintf (stderr, "Couldn't open %s.", classnames[ctbt]);
-      return err;
-    }
-
-  /*   init the hashpipe with 0xDEADBEEF  */
-  for (h = 0; h < OSB_BAYES_WINDOW_LEN; h++)
-    hashpipe[h] = 0xDEADBEEF;
-
-  learn_error = 0;
-  /* experimental code - set num_hash_paddings = 0 to disable */
-  /* num_hash_paddings = OSB_BAYES_WINDOW_LEN - 1; */
-  num_hash_paddings = OSB_BAYES_WINDOW_LEN - 1;
-  while (learn_error == 0 && ts.ptok <= ts.ptok_max)
+  tf->num_features = 0;
+  num_hash_paddings = paddings ? OSB_BAYES_WINDOW_LEN - 1 : 0;
+  while (ts.ptok <= ts.ptok_max)
     {
-
       if (get_next_hash (&ts) != 0)
 	{
+	  if (!eof)
+	    {
+	      tf->num_features = n;
+	      eof = 1;
+	    }
 	  /* after eof, insert fake tokens until the last real */
 	  /* token comes out at the other end of the hashpipe */
 	  if (num_hash_paddings-- > 0)
@@ -276,7 +477,7 @@ int osbf_bayes_learn (const unsigned char *p_text,	/* pointer to text */
 	    break;
 	}
 
-      /*  Shift the hash pipe down one and insert new hash */
+      /* Shift the hash pipe down one and insert new hash */
       for (h = OSB_BAYES_WINDOW_LEN - 1; h > 0; h--)
 	hashpipe[h] = hashpipe[h - 1];
       hashpipe[0] = ts.hash;
@@ -290,217 +491,1279 @@ int osbf_bayes_learn (const unsigned char *p_text,	/* pointer to text */
       }
 #endif
 
-      {
-	uint32_t hindex, bindex;
-	uint32_t h1, h2;
+      if (n + OSB_BAYES_WINDOW_LEN > max_features)
+	{
+	  OSBF_FEATURE_STRUCT *new_features;
 
-	for (window_idx = 1; window_idx < OSB_BAYES_WINDOW_LEN; window_idx++)
-	  {
+	  max_features *= 2;
+	  new_features = realloc (features,
+				  max_features * sizeof (OSBF_FEATURE_STRUCT));
+	  if (new_features == NULL)
+	    {
+	      free (features);
+	      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+			"Couldn't allocate memory for features array.");
+	      return (-1);
+	    }
+	  features = new_features;
+	}
 
-	    h1 =
-	      hashpipe[0] * hctable1[0] +
-	      hashpipe[window_idx] * hctable1[window_idx];
-	    h2 = hashpipe[0] * hctable2[0] +
+      for (window_idx = 1; window_idx < OSB_BAYES_WINDOW_LEN; window_idx++)
+	{
+	  features[n].h1 =
+	    hashpipe[0] * hctable1[0] +
+	    hashpipe[window_idx] * hctable1[window_idx];
+	  features[n].h2 = hashpipe[0] * hctable2[0] +
 #ifdef CRM114_COMPATIBILITY
-	      hashpipe[window_idx] * hctable2[window_idx - 1];
+	    hashpipe[window_idx] * hctable2[window_idx - 1];
 #else
-	      hashpipe[window_idx] * hctable2[window_idx];
+	    hashpipe[window_idx] * hctable2[window_idx];
 #endif
-	    hindex = h1 % class[ctbt].header->num_buckets;
+	  features[n].window_idx = window_idx;
+	  n++;
+	}
+    }
 
-#if (DEBUG)
-	    fprintf (stderr,
-		     "Polynomial %" PRIu32 " has h1:%" PRIu32 "  h2: %"
-		     PRIu32 "\n", window_idx, h1, h2);
-#endif
+  if (!eof)
+    tf->num_features = n;
+  tf->num_learn_features = n;
+  tf->features = features;
+  tf->text_len = text_len;
+  return 0;
+}
 
-	    bindex = osbf_find_bucket (&class[ctbt], h1, h2);
-	    if (bindex < class[ctbt].header->num_buckets)
-	      {
-		if (BUCKET_IN_CHAIN (&class[ctbt], bindex))
-		  {
-		    if (!BUCKET_IS_LOCKED (&class[ctbt], bindex))
-		      osbf_update_bucket (&class[ctbt], bindex, sense);
-		  }
-		else if (sense > 0)
-		  {
-		    osbf_insert_bucket (&class[ctbt], bindex, h1, h2, sense);
-		  }
-	      }
-	    else
-	      {
-		snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
-			  ".cfc file is full!");
-		learn_error = -1;
-		break;
-	      }
-	  }
-      }
-    }				/*   end the while k==0 */
+/* extract the features of a text for classifications and trainings */
+int
+osbf_text_features (const unsigned char *p_text, unsigned long text_len,
+		    const DELIM_TABLE_STRUCT * dt,
+		    OSBF_TEXT_FEATURES_STRUCT * tf, char *errmsg)
+{
+  return extract_features (p_text, text_len, dt, 1, tf, errmsg);
+}
 
+void
+osbf_free_text_features (OSBF_TEXT_FEATURES_STRUCT * tf)
+{
+  free (tf->features);
+  tf->features = NULL;
+  tf->num_features = tf->num_learn_features = 0;
+}
 
-  if (learn_error == 0)
-    {
+/*****************************************************************/
+
+/* update or insert the bucket of a feature. Returns 0 if ok */
+static int
+learn_feature (CLASS_STRUCT * class, uint32_t h1, uint32_t h2, int sense,
+	       char *errmsg)
+{
+  uint32_t bindex;
 
-      if (sense > 0)
+  bindex = osbf_find_bucket (class, h1, h2);
+  if (bindex < class->header->num_buckets)
+    {
+      if (BUCKET_FOUND (class, bindex, h1, h2))
 	{
-	  /* extra learnings are all those done with the  */
-	  /* same document, after the first learning */
-	  if (flags & EXTRA_LEARNING)
-	    {
-	      /* increment extra learnings counter */
-	      class[ctbt].header->extra_learnings += 1;
-	    }
-	  else
-	    {
-	      /* increment normal learnings counter */
-
-	      /* old code disabled because the databases are disjoint and
-	         this correction should be applied to both simultaneously
-
-	         class[ctbt].header->learnings += 1;
-	         if (class[ctbt].header->learnings >= OSBF_MAX_BUCKET_VALUE)
-	         {
-	         uint32_t i;
-
-	         class[ctbt].header->learnings >>= 1;
-	         for (i = 0; i < NUM_BUCKETS (&class[ctbt]); i++)
-	         BUCKET_VALUE (&class[ctbt], i) =
-	         BUCKET_VALUE (&class[ctbt], i) >> 1;
-	         }
-	       */
-
-	      if (class[ctbt].header->learnings < OSBF_MAX_BUCKET_VALUE)
-		{
-		  class[ctbt].header->learnings += 1;
-		}
-
-	      /* increment mistakes counter */
-	      if (flags & MISTAKE)
-		{
-		  class[ctbt].header->mistakes += 1;
-		}
-	    }
+	  if (!BUCKET_IS_LOCKED (class, bindex))
+	    osbf_update_bucket (class, bindex, sense);
 	}
-      else
+      else if (sense > 0)
 	{
-	  if (flags & EXTRA_LEARNING)
-	    {
-	      /* decrement extra learnings counter */
-	      if (class[ctbt].header->extra_learnings > 0)
-		class[ctbt].header->extra_learnings -= 1;
-	    }
-	  else
-	    {
-	      /* decrement learnings counter */
-	      if (class[ctbt].header->learnings > 0)
-		class[ctbt].header->learnings -= 1;
-	      /* decrement mistakes counter */
-	      if ((flags & MISTAKE) && class[ctbt].header->mistakes > 0)
-		class[ctbt].header->mistakes -= 1;
-	    }
+	  osbf_insert_bucket (class, bindex, h1, h2, sense);
 	}
+      return 0;
     }
 
-  err = osbf_close_class (&class[ctbt], errmsg);
+  snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN, ".cfc file is full!");
+  return -1;
+}
 
-  if (learn_error != 0)
-    return (learn_error);
+/* a feature of a training with a striped lock */
+struct striped_feature
+{
+  uint32_t home;		/* right position of the feature */
+  uint32_t order;		/* position in the text */
+  uint32_t h1, h2;
+};
 
-  return (err);
+static int
+compare_striped_features (const void *a, const void *b)
+{
+  const struct striped_feature *fa = a, *fb = b;
 
+  if (fa->home != fb->home)
+    return fa->home < fb->home ? -1 : 1;
+  return fa->order < fb->order ? -1 : fa->order > fb->order;
 }
 
-
-/**********************************************************/
-/* Find out the best class for the text pointed to by     */
-/* "p_text", among those listed in the array "classnames" */
-/**********************************************************/
-int
-osbf_bayes_classify (const unsigned char *p_text,	/* pointer to text */
-		     unsigned long text_len,	/* length of text */
-		     const char *delims,	/* token delimiters */
-		     const char *classnames[],	/* hash file names */
-		     uint32_t flags,	/* flags */
-		     double min_pmax_pmin_ratio,
-		     /* returned values */
-		     double ptc[],	/* class probs */
-		     uint32_t ptt[],	/* number trainings per class */
-		     char *errmsg	/* err message, if any */
-  )
+/*
+ * Train the features of a document with a striped lock. They are
+ * trained in the order of their right positions, so the stripes are
+ * locked in increasing order, and the stripes already passed are
+ * unlocked: concurrent trainings follow each other through the file,
+ * instead of waiting for the whole of it. Before each feature, the
+ * stripes of the chains it may change are locked.
+ */
+static int
+learn_striped (CLASS_STRUCT * class, struct striped_feature *features,
+	       uint32_t num_features, int sense, char *errmsg)
 {
+  uint32_t i, first, last, locked_first, locked_last;
   int err = 0;
-  int32_t i, window_idx, class_idx;
-  int32_t h;			/* we use h for our hashpipe counter, as needed. */
 
-  off_t fsize;
-  double htf;			/* hits this feature got. */
-  double renorm = 0.0;
-  uint32_t hashpipe[OSB_BAYES_WINDOW_LEN + 1];
-  CLASS_STRUCT class[OSBF_MAX_CLASSES];
+  qsort (features, num_features, sizeof (struct striped_feature),
+	 compare_striped_features);
 
-  int32_t num_classes;
-  uint32_t total_learnings = 0;
-  uint32_t totalfeatures;	/* total features */
+  for (i = 0; i < num_features && err == 0; i++)
+    {
+      /* the chains may change until their stripes are locked */
+      osbf_bucket_cluster (class, features[i].home, &first, &last);
+      do
+	{
+	  locked_first = first;
+	  locked_last = last;
+	  err = osbf_lock_buckets (class, first, last, errmsg);
+	  if (err == 0)
+	    osbf_bucket_cluster (class, features[i].home, &first, &last);
+	}
+      while (err == 0 && (first != locked_first || last != locked_last));
 
-  /* empirical weights: (5 - d) ^ (5 - d) */
-  /* where d = number of skipped tokens in the sparse bigram */
-  double feature_weight[] = { 0, 3125, 256, 27, 4, 1 };
-  double exponent;
-  double confidence_factor;
-  int asymmetric = 0;		/* break local p loop early if asymmetric on */
-  int voodoo = 1;		/* turn on the "voodoo" CF formula - default */
+      if (err == 0)
+	{
+	  if (first <= last)
+	    osbf_release_buckets (class, first);
+	  err = learn_feature (class, features[i].h1, features[i].h2, sense,
+			       errmsg);
+	}
+    }
 
-  struct token_search ts;
+  return err;
+}
 
-  ts.ptok = (unsigned char *) p_text;
-  ts.ptok_max = (unsigned char *) (p_text + text_len);
-  ts.toklen = 0;
-  ts.hash = 0;
-  ts.delims = delims;
+/* update the counters of a class after a training of a document */
+static void
+update_counters (CLASS_STRUCT * class, int sense, uint32_t flags)
+{
+  if (sense > 0)
+    {
+      /* extra learnings are all those done with the  */
+      /* same document, after the first learning */
+      if (flags & EXTRA_LEARNING)
+	{
+	  /* increment extra learnings counter */
+	  class->header->extra_learnings += 1;
+	}
+      else
+	{
+	  /* increment normal learnings counter */
 
-  /* fprintf(stderr, "Starting classification...\n"); */
+	  /* old code disabled because the databases are disjoint and
+	     this correction should be applied to both simultaneously
 
-  if (flags & NO_EDDC)
-    voodoo = 0;
+	     class->header->learnings += 1;
+	     if (class->header->learnings >= OSBF_MAX_BUCKET_VALUE)
+	     {
+	     uint32_t i;
 
-  for (i = 0; (classnames[i] != NULL) && (i < OSBF_MAX_CLASSES); i++)
+	     class->header->learnings >>= 1;
+	     for (i = 0; i < NUM_BUCKETS (class); i++)
+	     BUCKET_VALUE (class, i) =
+	     BUCKET_VALUE (class, i) >> 1;
+	     }
+	   */
+
+	  if (class->header->learnings < OSBF_MAX_BUCKET_VALUE)
+	    {
+	      class->header->learnings += 1;
+	    }
+
+	  /* increment mistakes counter */
+	  if (flags & MISTAKE)
+	    {
+	      class->header->mistakes += 1;
+	    }
+	}
+    }
+  else
     {
-      fsize = check_file (classnames[i]);
-      if (fsize < 0)
+      if (flags & EXTRA_LEARNING)
 	{
-	  snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
-		    "Couldn't open the file %s.", classnames[i]);
-	  return (-1);
+	  /* decrement extra learnings counter */
+	  if (class->header->extra_learnings > 0)
+	    class->header->extra_learnings -= 1;
 	}
-
-      /*  mmap the hash file into memory */
-      err = osbf_open_class (classnames[i], O_RDONLY, &class[i], errmsg);
-      if (err != 0)
+      else
 	{
-	  snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
-		    "Couldn't open the file %s.", classnames[i]);
-	  return err;
+	  /* decrement learnings counter */
+	  if (class->header->learnings > 0)
+	    class->header->learnings -= 1;
+	  /* decrement mistakes counter */
+	  if ((flags & MISTAKE) && class->header->mistakes > 0)
+	    class->header->mistakes -= 1;
 	}
+    }
+}
 
-      ptt[i] = class[i].learnings = class[i].header->learnings;
+/******************************************************************/
+/* Train an open class with the features of a text                */
+/******************************************************************/
+static int
+learn_features (const OSBF_FEATURE_STRUCT * f,	/* features of the text */
+		uint32_t num_features,	/* paddings included */
+		unsigned long text_len,	/* length of text */
+		CLASS_STRUCT * class,	/* class to be trained */
+		int sense,	/* 1 => learn;  -1 => unlearn */
+		uint32_t flags,	/* flags */
+		char *errmsg)
+{
+  int32_t learn_error = 0;
+  uint32_t i;
+  struct striped_feature *features;
+
+  /* start a clean set of seen features for this document */
+  osbf_bflags_reset (&class->bflags, (uint32_t) (text_len / 2));
+
+  if (class->num_stripes == 0)
+    {
+      for (i = 0; i < num_features && learn_error == 0; i++)
+	learn_error = learn_feature (class, f[i].h1, f[i].h2, sense, errmsg);
+    }
+  else if (num_features > 0)
+    {
+      /* with a striped lock, train them all together */
+      features = malloc (num_features * sizeof (struct striped_feature));
+      if (features == NULL)
+	{
+	  snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		    "Couldn't allocate memory for features.");
+	  return (-1);
+	}
+      for (i = 0; i < num_features; i++)
+	{
+	  features[i].home = HASH_INDEX (class, f[i].h1);
+	  features[i].order = i;
+	  features[i].h1 = f[i].h1;
+	  features[i].h2 = f[i].h2;
+	}
+      learn_error = learn_striped (class, features, num_features, sense,
+				   errmsg);
+      free (features);
+    }
+
+  /* the counters are updated under the lock of the header */
+  if (learn_error == 0)
+    learn_error = osbf_lock_header (class, errmsg);
+
+  if (learn_error == 0 && class->bflags.error)
+    {
+      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		"Couldn't allocate memory for seen features array.");
+      learn_error = -1;
+    }
+
+  if (learn_error == 0)
+    update_counters (class, sense, flags);
+
+  return (learn_error);
+}
+
+/******************************************************************/
+/* Train an open class with the text pointed to by "p_text"       */
+/******************************************************************/
+static int
+bayes_learn (const unsigned char *p_text,	/* pointer to text */
+	     unsigned long text_len,	/* length of text */
+	     const DELIM_TABLE_STRUCT * dt,	/* token delimiters */
+	     CLASS_STRUCT * class,	/* class to be trained */
+	     int sense,		/* 1 => learn;  -1 => unlearn */
+	     uint32_t flags,	/* flags */
+	     char *errmsg)
+{
+  OSBF_TEXT_FEATURES_STRUCT tf;
+  int32_t learn_error;
+
+  if (extract_features (p_text, text_len, dt, 1, &tf, errmsg) != 0)
+    return (-1);
+
+  learn_error = learn_features (tf.features, tf.num_learn_features,
+				text_len, class, sense, flags, errmsg);
+  osbf_free_text_features (&tf);
+
+  return (learn_error);
+}
+
+/******************************************************************/
+/* Train the specified class with the text pointed to by "p_text" */
+/******************************************************************/
+int osbf_bayes_learn (const unsigned char *p_text,	/* pointer to text */
+		      unsigned long text_len,	/* length of text */
+		      const char *delims,	/* token delimiters */
+		      const char *classnames[],	/* class file names */
+		      uint32_t ctbt,	/* index of the class to be trained */
+		      int sense,	/* 1 => learn;  -1 => unlearn */
+		      uint32_t flags,	/* flags */
+		      char *errmsg)
+{
+  int err;
+  int32_t learn_error;
+  DELIM_TABLE_STRUCT dt;
+  CLASS_STRUCT class;
+
+  osbf_build_delim_table (&dt, delims);
+
+  /* open the class to be trained and mmap it into memory */
+  err = osbf_open_class_striped (classnames[ctbt],
+				 osbf_class_column (classnames, ctbt),
+				 &class, errmsg);
+  if (err == OSBF_FROZEN_ERROR)
+    return err;
+  if (err != 0)
+    {
+      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN, "Couldn't open %s.",
+		classnames[ctbt]);
+      fprintf (stderr, "Couldn't open %s.", classnames[ctbt]);
+      return err;
+    }
+
+  learn_error = bayes_learn (p_text, text_len, &dt, &class, sense, flags,
+			     errmsg);
+
+  err = osbf_close_class (&class, errmsg);
+
+  if (learn_error != 0)
+    return (learn_error);
+
+  return (err);
+}
+
+/******************************************************************/
+/* Train a class of an open database set with the features of a   */
+/* text, extracted by osbf_text_features                          */
+/******************************************************************/
+int
+osbf_bayes_learn_features (DBSET_STRUCT * dbset,	/* open database set */
+			   const OSBF_TEXT_FEATURES_STRUCT * tf,
+			   uint32_t ctbt,	/* index of the class to be trained */
+			   int sense,	/* 1 => learn;  -1 => unlearn */
+			   uint32_t flags,	/* flags */
+			   char *errmsg)
+{
+  int err;
+  int32_t learn_error;
+  CLASS_STRUCT *class;
+
+  if (ctbt >= dbset->num_classes)
+    {
+      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN, "Invalid class index: %"
+		PRIu32, ctbt + 1);
+      return (-1);
+    }
+  if (dbset->flags != O_RDWR)
+    {
+      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		"Database set was opened read-only.");
+      return (-1);
+    }
+
+  class = &dbset->class[ctbt];
+  err = osbf_lock_dbset_class (dbset, ctbt, errmsg);
+  if (err != 0)
+    return err;
+
+  learn_error = learn_features (tf->features, tf->num_learn_features,
+				tf->text_len, class, sense, flags, errmsg);
+
+  err = osbf_unlock_class (class, errmsg);
+
+  if (learn_error != 0)
+    return (learn_error);
+
+  return (err);
+}
+
+/******************************************************************/
+/* Train a class of an open database set                          */
+/******************************************************************/
+int
+osbf_bayes_learn_dbset (DBSET_STRUCT * dbset,	/* open database set */
+			const unsigned char *p_text,	/* pointer to text */
+			unsigned long text_len,	/* length of text */
+			uint32_t ctbt,	/* index of the class to be trained */
+			int sense,	/* 1 => learn;  -1 => unlearn */
+			uint32_t flags,	/* flags */
+			char *errmsg)
+{
+  OSBF_TEXT_FEATURES_STRUCT tf;
+  int err;
+
+  if (extract_features (p_text, text_len, &dbset->dt, 1, &tf, errmsg) != 0)
+    return (-1);
+
+  err = osbf_bayes_learn_features (dbset, &tf, ctbt, sense, flags, errmsg);
+  osbf_free_text_features (&tf);
+
+  return (err);
+}
+
+
+/******************************************************************/
+/* Learn journal                                                  */
+/******************************************************************/
+
+/*
+ * Trainings can be appended to a journal file instead of being done
+ * at once. An entry holds the hashes of the features of a document,
+ * so the applier, osbf_apply_journal, never tokenizes texts again: it
+ * takes all entries appended so far, opens each class once, applies
+ * the features of all its entries in the order of their buckets and
+ * updates the counters of the class once. Appenders hold a read lock
+ * on the journal only while they write an entry, and never lock the
+ * classes.
+ */
+
+/* a feature of a journal entry, as applied to its class */
+struct journal_feature
+{
+  uint32_t home;		/* right position of the feature */
+  uint32_t entry;		/* order of the entry in the batch */
+  uint32_t h1, h2;
+  int sense;
+};
+
+/* an entry read from a journal */
+struct journal_entry
+{
+  OSBF_JOURNAL_ENTRY_STRUCT header;
+  const char *classname;
+  const unsigned char *features;	/* h1, h2 pairs, maybe unaligned */
+  const unsigned char *image;	/* the whole entry */
+  int done;			/* 1 if already applied or given up */
+};
+
+static int
+compare_feature_pairs (const void *a, const void *b)
+{
+  const uint32_t *fa = a, *fb = b;
+
+  if (fa[0] != fb[0])
+    return fa[0] < fb[0] ? -1 : 1;
+  return fa[1] < fb[1] ? -1 : fa[1] > fb[1];
+}
+
+static int
+compare_journal_features (const void *a, const void *b)
+{
+  const struct journal_feature *fa = a, *fb = b;
+
+  if (fa->home != fb->home)
+    return fa->home < fb->home ? -1 : 1;
+  if (fa->h1 != fb->h1)
+    return fa->h1 < fb->h1 ? -1 : 1;
+  if (fa->h2 != fb->h2)
+    return fa->h2 < fb->h2 ? -1 : 1;
+  return fa->entry < fb->entry ? -1 : fa->entry > fb->entry;
+}
+
+/*
+ * Extract the features a training with the text would update, as
+ * h1, h2 pairs. A feature is trained only once per document, so the
+ * repeated ones are dropped. The caller frees *features.
+ */
+static int
+journal_features (const unsigned char *p_text, unsigned long text_len,
+		  const DELIM_TABLE_STRUCT * dt, uint32_t ** features,
+		  uint32_t * num_features, char *errmsg)
+{
+  uint32_t window_idx, n = 0, max_features, i, j;
+  int32_t h;
+  uint32_t hashpipe[OSB_BAYES_WINDOW_LEN + 1];
+  int32_t num_hash_paddings;
+  struct token_search ts;
+  uint32_t *pairs;
+
+  ts.ptok = (unsigned char *) p_text;
+  ts.ptok_max = (unsigned char *) (p_text + text_len);
+  ts.toklen = 0;
+  ts.hash = 0;
+  ts.dt = dt;
+
+  for (h = 0; h < OSB_BAYES_WINDOW_LEN; h++)
+    hashpipe[h] = 0xDEADBEEF;
+
+  max_features = (uint32_t) (text_len / 4) + OSB_BAYES_WINDOW_LEN;
+  pairs = malloc (2 * max_features * sizeof (uint32_t));
+  if (pairs == NULL)
+    {
+      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		"Couldn't allocate memory for features array.");
+      return (-1);
+    }
+
+  /* the same features bayes_learn trains, fake tokens included */
+  num_hash_paddings = OSB_BAYES_WINDOW_LEN - 1;
+  while (ts.ptok <= ts.ptok_max)
+    {
+      if (get_next_hash (&ts) != 0)
+	{
+	  if (num_hash_paddings-- > 0)
+	    ts.hash = 0xDEADBEEF;
+	  else
+	    break;
+	}
+
+      for (h = OSB_BAYES_WINDOW_LEN - 1; h > 0; h--)
+	hashpipe[h] = hashpipe[h - 1];
+      hashpipe[0] = ts.hash;
+
+      if (n + OSB_BAYES_WINDOW_LEN > max_features)
+	{
+	  uint32_t *more;
+
+	  max_features *= 2;
+	  more = realloc (pairs, 2 * max_features * sizeof (uint32_t));
+	  if (more == NULL)
+	    {
+	      free (pairs);
+	      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+			"Couldn't allocate memory for features array.");
+	      return (-1);
+	    }
+	  pairs = more;
+	}
+
+      for (window_idx = 1; window_idx < OSB_BAYES_WINDOW_LEN; window_idx++)
+	{
+	  pairs[2 * n] =
+	    hashpipe[0] * hctable1[0] +
+	    hashpipe[window_idx] * hctable1[window_idx];
+	  pairs[2 * n + 1] = hashpipe[0] * hctable2[0] +
+#ifdef CRM114_COMPATIBILITY
+	    hashpipe[window_idx] * hctable2[window_idx - 1];
+#else
+	    hashpipe[window_idx] * hctable2[window_idx];
+#endif
+	  n++;
+	}
+    }
+
+  /* drop the repeated features */
+  qsort (pairs, n, 2 * sizeof (uint32_t), compare_feature_pairs);
+  for (i = j = 0; i < n; i++)
+    if (j == 0 || pairs[2 * i] != pairs[2 * (j - 1)] ||
+	pairs[2 * i + 1] != pairs[2 * (j - 1) + 1])
+      {
+	pairs[2 * j] = pairs[2 * i];
+	pairs[2 * j + 1] = pairs[2 * i + 1];
+	j++;
+      }
+
+  *features = pairs;
+  *num_features = j;
+  return 0;
+}
+
+/*
+ * Append an entry to a journal, with a single write, under a read
+ * lock of the whole file, so that an applier, which write locks it,
+ * doesn't take the journal in the middle of the entry. If the journal
+ * was taken while we waited for the lock, the new one is opened.
+ */
+static int
+append_journal (const char *journal, const void *image, size_t size,
+		char *errmsg)
+{
+  struct stat fst, pst;
+  int attempts = 3, fd;
+  ssize_t written;
+
+  for (;;)
+    {
+      fd = open (journal, O_RDWR | O_APPEND | O_CREAT, 0666);
+      if (fd < 0)
+	{
+	  snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		    "Couldn't open the journal %s: %s", journal,
+		    strerror (errno));
+	  return -1;
+	}
+      if (osbf_read_lock_file (fd, 0, 0) != 0)
+	{
+	  close (fd);
+	  snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		    "Couldn't lock the journal %s.", journal);
+	  return -3;
+	}
+      if (fstat (fd, &fst) == 0 && stat (journal, &pst) == 0 &&
+	  fst.st_dev == pst.st_dev && fst.st_ino == pst.st_ino)
+	break;
+      close (fd);
+      if (--attempts == 0)
+	{
+	  snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		    "Couldn't open the journal %s.", journal);
+	  return -1;
+	}
+    }
+
+  written = write (fd, image, size);
+  if (written < 0 || (size_t) written != size)
+    {
+      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		"Couldn't write to the journal %s: %s", journal,
+		written < 0 ? strerror (errno) : "short write");
+      close (fd);
+      return -1;
+    }
+
+  /* closing the file releases the lock */
+  close (fd);
+  return 0;
+}
+
+/******************************************************************/
+/* Append a training of a class to a journal, to be done later by */
+/* osbf_apply_journal                                             */
+/******************************************************************/
+int
+osbf_journal_learn (const char *journal,	/* journal file */
+		    const unsigned char *p_text,	/* pointer to text */
+		    unsigned long text_len,	/* length of text */
+		    const char *delims,	/* token delimiters */
+		    const char *classnames[],	/* class file names */
+		    uint32_t ctbt,	/* index of the class to be trained */
+		    int sense,	/* 1 => learn;  -1 => unlearn */
+		    uint32_t flags,	/* flags */
+		    char *errmsg)
+{
+  DELIM_TABLE_STRUCT dt;
+  OSBF_JOURNAL_ENTRY_STRUCT entry;
+  uint32_t *features, num_features, name_len;
+  size_t size;
+  unsigned char *image;
+  char *classname;
+  int err;
+
+  /* the applier may run in another directory */
+  classname = realpath (classnames[ctbt], NULL);
+  if (classname == NULL)
+    {
+      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN, "Couldn't open %s.",
+		classnames[ctbt]);
+      return -1;
+    }
+
+  osbf_build_delim_table (&dt, delims);
+  if (journal_features (p_text, text_len, &dt, &features, &num_features,
+			errmsg) != 0)
+    {
+      free (classname);
+      return -1;
+    }
+
+  name_len = (uint32_t) ((strlen (classname) + 4) & ~(size_t) 3);
+  size = sizeof (entry) + name_len +
+    (size_t) num_features * 2 * sizeof (uint32_t);
+  image = calloc (size, 1);
+  if (size > UINT32_MAX || image == NULL)
+    {
+      free (image);
+      free (features);
+      free (classname);
+      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		"Couldn't allocate memory for the journal entry.");
+      return -1;
+    }
+
+  entry.magic = OSBF_JOURNAL_MAGIC;
+  entry.size = (uint32_t) size;
+  entry.checksum = 0;
+  entry.column = osbf_class_column (classnames, ctbt);
+  entry.sense = sense > 0 ? 1 : -1;
+  entry.flags = flags;
+  entry.name_len = name_len;
+  entry.num_features = num_features;
+  memcpy (image, &entry, sizeof (entry));
+  memcpy (image + sizeof (entry), classname, strlen (classname));
+  memcpy (image + sizeof (entry) + name_len, features,
+	  (size_t) num_features * 2 * sizeof (uint32_t));
+  entry.checksum =
+    strnhash (image + offsetof (OSBF_JOURNAL_ENTRY_STRUCT, column),
+	      (uint32_t) (size -
+			  offsetof (OSBF_JOURNAL_ENTRY_STRUCT, column)));
+  memcpy (image, &entry, sizeof (entry));
+
+  err = append_journal (journal, image, size, errmsg);
+
+  free (image);
+  free (features);
+  free (classname);
+  return err;
+}
+
+/* parse the entry at offset off of a journal image, 0 if ok */
+static int
+parse_journal_entry (const unsigned char *image, size_t image_size,
+		     size_t off, struct journal_entry *e)
+{
+  OSBF_JOURNAL_ENTRY_STRUCT *h = &e->header;
+  size_t name_off;
+
+  if (image_size - off < sizeof (*h))
+    return -1;
+  memcpy (h, image + off, sizeof (*h));
+  if ((h->magic != OSBF_JOURNAL_MAGIC && h->magic != OSBF_JOURNAL_DONE) ||
+      h->size > image_size - off ||
+      h->name_len == 0 || h->name_len % 4 != 0 ||
+      h->num_features > (h->size - sizeof (*h)) / (2 * sizeof (uint32_t))
+      || (uint64_t) sizeof (*h) + h->name_len +
+      (uint64_t) h->num_features * 2 * sizeof (uint32_t) != h->size ||
+      (h->sense != 1 && h->sense != -1))
+    return -1;
+  if (strnhash ((unsigned char *) image + off +
+		offsetof (OSBF_JOURNAL_ENTRY_STRUCT, column),
+		h->size - offsetof (OSBF_JOURNAL_ENTRY_STRUCT, column))
+      != h->checksum)
+    return -1;
+  name_off = off + sizeof (*h);
+  if (image[name_off + h->name_len - 1] != '\0')
+    return -1;
+
+  e->classname = (const char *) image + name_off;
+  e->features = image + name_off + h->name_len;
+  e->image = image + off;
+  e->done = h->magic == OSBF_JOURNAL_DONE;
+  return 0;
+}
+
+/*
+ * Check that a class has room for the features of a batch it doesn't
+ * have yet, so that applying the batch can't fail halfway. A bucket
+ * freed by an unlearning, or by the microgrooming of an insertion,
+ * only adds room.
+ */
+static int
+journal_class_room (CLASS_STRUCT * class, struct journal_feature *features,
+		    uint32_t n)
+{
+  uint32_t i, j, bindex, needed = 0, free_buckets = 0;
+  uint32_t value;
+
+  /* first a bound that needs no lookups: all new features are new */
+  for (i = 0; i < n; i = j)
+    {
+      value = 0;
+      for (j = i; j < n && features[j].h1 == features[i].h1 &&
+	   features[j].h2 == features[i].h2; j++)
+	if (features[j].sense > 0)
+	  value++;
+	else if (value > 0)
+	  value--;
+      if (value > 0)
+	needed++;
+    }
+  for (i = 0; i < NUM_BUCKETS (class) && free_buckets < needed; i++)
+    if (!BUCKET_IN_CHAIN (class, i))
+      free_buckets++;
+  if (free_buckets >= needed)
+    return 0;
+
+  /* almost full: count only the features not found */
+  needed = 0;
+  for (i = 0; i < n; i = j)
+    {
+      bindex = osbf_find_bucket (class, features[i].h1, features[i].h2);
+      value = 0;
+      for (j = i; j < n && features[j].h1 == features[i].h1 &&
+	   features[j].h2 == features[i].h2; j++)
+	if (features[j].sense > 0)
+	  value++;
+	else if (value > 0)
+	  value--;
+      if (value > 0 && (!VALID_BUCKET (class, bindex) ||
+			!BUCKET_FOUND (class, bindex, features[i].h1,
+				       features[i].h2)))
+	needed++;
+    }
+  return free_buckets >= needed ? 0 : -1;
+}
+
+/*
+ * Apply to a class opened for writing the features of a batch of its
+ * entries, sorted by their right positions. The successive trainings
+ * of each feature are folded into one update of its bucket, and the
+ * counters are updated last. Nothing is changed if the batch can't be
+ * applied whole.
+ */
+static int
+apply_class_entries (CLASS_STRUCT * class, struct journal_entry *entries[],
+		     uint32_t num_entries, char *errmsg)
+{
+  struct journal_feature *features;
+  uint64_t total = 0;
+  uint32_t i, j, n, bindex, pair[2];
+  uint32_t old_value, value;
+  int found;
+
+  for (i = 0; i < num_entries; i++)
+    total += entries[i]->header.num_features;
+  features = malloc ((total > 0 ? total : 1) * sizeof (*features));
+  if (features == NULL)
+    {
+      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		"Couldn't allocate memory for features array.");
+      return -1;
+    }
+
+  n = 0;
+  for (i = 0; i < num_entries; i++)
+    for (j = 0; j < entries[i]->header.num_features; j++)
+      {
+	memcpy (pair, entries[i]->features + j * sizeof (pair),
+		sizeof (pair));
+	features[n].home = HASH_INDEX (class, pair[0]);
+	features[n].entry = i;
+	features[n].h1 = pair[0];
+	features[n].h2 = pair[1];
+	features[n].sense = entries[i]->header.sense;
+	n++;
+      }
+  qsort (features, n, sizeof (*features), compare_journal_features);
+
+  osbf_bflags_reset (&class->bflags, n);
+  if (class->bflags.error)
+    {
+      free (features);
+      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		"Couldn't allocate memory for seen features array.");
+      return -1;
+    }
+  if (journal_class_room (class, features, n) != 0)
+    {
+      free (features);
+      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN, ".cfc file is full!");
+      return -1;
+    }
+
+  /* the set of seen buckets failing to grow from here on only */
+  /* weakens the microgrooming, the batch is still applied whole */
+  for (i = 0; i < n; i = j)
+    {
+      bindex = osbf_find_bucket (class, features[i].h1, features[i].h2);
+      found = BUCKET_FOUND (class, bindex, features[i].h1, features[i].h2);
+      old_value = value = found ? BUCKET_VALUE (class, bindex) : 0;
+
+      /* the trainings of the feature, in the order of the entries */
+      for (j = i; j < n && features[j].h1 == features[i].h1 &&
+	   features[j].h2 == features[i].h2; j++)
+	if (features[j].sense > 0)
+	  {
+	    if (value < OSBF_MAX_BUCKET_VALUE)
+	      value++;
+	  }
+	else if (value > 0)
+	  value--;
+
+      if (found && value != old_value)
+	osbf_update_bucket (class, bindex, (int) value - (int) old_value);
+      else if (!found && value > 0)
+	osbf_insert_bucket (class, bindex, features[i].h1, features[i].h2,
+			    value);
+    }
+  free (features);
+
+  for (i = 0; i < num_entries; i++)
+    update_counters (class, entries[i]->header.sense,
+		     entries[i]->header.flags);
+
+  return 0;
+}
+
+/*
+ * Mark the entries of a batch as done in the journal being applied,
+ * so that an applier interrupted later doesn't apply them again. A
+ * crash between the training of a class and this mark still trains
+ * the class twice, but only with the entries of that batch.
+ */
+static int
+mark_journal_entries (int fd, const unsigned char *image,
+		      struct journal_entry *batch[], uint32_t num_batch)
+{
+  uint32_t magic = OSBF_JOURNAL_DONE, j;
+
+  for (j = 0; j < num_batch; j++)
+    if (pwrite (fd, &magic, sizeof (magic),
+		(off_t) (batch[j]->image - image)) != sizeof (magic))
+      return -1;
+  return fsync (fd);
+}
+
+/*
+ * Apply the entries of a journal taken by an applier and remove it.
+ * The file stays write locked meanwhile, so another applier doesn't
+ * apply it too. Each class is trained with all its entries or with
+ * none: the entries of classes that couldn't be trained are appended
+ * to the journal again, to be retried. The file is removed only when
+ * all its entries are marked done.
+ */
+static int
+apply_journal_file (const char *journal, const char *work,
+		    uint32_t * applied, char *errmsg)
+{
+  struct stat st;
+  unsigned char *image = NULL;
+  struct journal_entry *entries = NULL, **batch = NULL;
+  uint32_t num_entries = 0, num_batch, num_done, i, j;
+  size_t off, got;
+  ssize_t r;
+  CLASS_STRUCT class;
+  char class_errmsg[OSBF_ERROR_MESSAGE_LEN];
+  char scratch[OSBF_ERROR_MESSAGE_LEN];
+  int fd, err = 0, class_err, failed = 0, left = 0;
+
+  fd = open (work, O_RDWR);
+  if (fd < 0)
+    {
+      if (errno == ENOENT)
+	return 0;
+      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		"Couldn't open the journal %s: %s", work, strerror (errno));
+      return -1;
+    }
+  if (osbf_lock_file (fd, 0, 0) != 0)
+    {
+      close (fd);
+      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		"Couldn't lock the journal %s.", work);
+      return -3;
+    }
+  /* already applied by another applier while we waited */
+  if (fstat (fd, &st) != 0 || st.st_nlink == 0)
+    {
+      close (fd);
+      return 0;
+    }
+
+  image = malloc (st.st_size > 0 ? (size_t) st.st_size : 1);
+  entries = malloc ((st.st_size / sizeof (OSBF_JOURNAL_ENTRY_STRUCT) + 1) *
+		    sizeof (*entries));
+  batch = malloc ((st.st_size / sizeof (OSBF_JOURNAL_ENTRY_STRUCT) + 1) *
+		  sizeof (*batch));
+  if (image == NULL || entries == NULL || batch == NULL)
+    {
+      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		"Couldn't allocate memory for the journal %s.", work);
+      err = -1;
+      goto done;
+    }
+  for (got = 0; got < (size_t) st.st_size; got += (size_t) r)
+    {
+      r = read (fd, image + got, (size_t) st.st_size - got);
+      if (r <= 0)
+	{
+	  snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		    "Couldn't read the journal %s.", work);
+	  err = -1;
+	  goto done;
+	}
+    }
+
+  /* bytes of entries cut by a crash are skipped up to a valid entry */
+  off = 0;
+  while (off < got)
+    if (parse_journal_entry (image, got, off, &entries[num_entries]) == 0)
+      off += entries[num_entries++].header.size;
+    else
+      off++;
+
+  /* each class is opened once, for all its entries */
+  for (i = 0; i < num_entries; i++)
+    {
+      if (entries[i].done)
+	continue;
+      num_batch = 0;
+      for (j = i; j < num_entries; j++)
+	if (!entries[j].done &&
+	    entries[j].header.column == entries[i].header.column &&
+	    strcmp (entries[j].classname, entries[i].classname) == 0)
+	  {
+	    entries[j].done = 1;
+	    batch[num_batch++] = &entries[j];
+	  }
+
+      class_err = osbf_open_class (entries[i].classname,
+				   entries[i].header.column, O_RDWR, &class,
+				   class_errmsg);
+      if (class_err == 0)
+	{
+	  class_err = apply_class_entries (&class, batch, num_batch,
+					   class_errmsg);
+	  osbf_close_class (&class, scratch);
+	  if (class_err == 0)
+	    *applied += num_batch;
+	}
+
+      /* keep the entries of a class not trained for a later attempt */
+      num_done = num_batch;
+      if (class_err != 0)
+	{
+	  for (num_done = 0; num_done < num_batch; num_done++)
+	    if (append_journal (journal, batch[num_done]->image,
+				batch[num_done]->header.size, scratch) != 0)
+	      break;
+	  /* requeued in part: the work file keeps the rest */
+	  if (num_done < num_batch)
+	    left = 1;
+	  if (failed++ == 0)
+	    strncpy (errmsg, class_errmsg, OSBF_ERROR_MESSAGE_LEN);
+	}
+
+      if (mark_journal_entries (fd, image, batch, num_done) != 0)
+	{
+	  snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		    "Couldn't update the journal %s: %s", work,
+		    strerror (errno));
+	  err = -1;
+	  goto done;
+	}
+    }
+
+  if (failed > 1)
+    snprintf (errmsg + strlen (errmsg),
+	      OSBF_ERROR_MESSAGE_LEN - strlen (errmsg),
+	      " (%d classes not trained)", failed);
+
+  /* entries neither applied nor requeued wait for the next call */
+  if (!left && unlink (work) != 0)
+    {
+      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		"Couldn't remove the journal %s: %s", work, strerror (errno));
+      err = -1;
+    }
+  else if (failed)
+    err = -1;
+
+done:
+  free (batch);
+  free (entries);
+  free (image);
+  close (fd);
+  return err;
+}
+
+/* take the entries appended to a journal so far, moving it to work */
+static int
+take_journal (const char *journal, const char *work, char *errmsg)
+{
+  struct stat fst, pst;
+  int fd, err = 0;
+
+  fd = open (journal, O_RDWR);
+  if (fd < 0)
+    {
+      if (errno == ENOENT)
+	return 0;
+      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		"Couldn't open the journal %s: %s", journal, strerror (errno));
+      return -1;
+    }
+
+  /* wait for the appenders in the middle of an entry */
+  if (osbf_lock_file (fd, 0, 0) != 0)
+    {
+      close (fd);
+      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		"Couldn't lock the journal %s.", journal);
+      return -3;
+    }
+
+  /* if the work file is still there, it's being applied, or its */
+  /* applier was interrupted: the journal waits for the next turn */
+  if (fstat (fd, &fst) == 0 && stat (journal, &pst) == 0 &&
+      fst.st_dev == pst.st_dev && fst.st_ino == pst.st_ino &&
+      fst.st_size > 0)
+    {
+      if (link (journal, work) == 0)
+	unlink (journal);
+      else if (errno != EEXIST)
+	{
+	  snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		    "Couldn't take the journal %s: %s", journal,
+		    strerror (errno));
+	  err = -1;
+	}
+    }
+
+  close (fd);
+  return err;
+}
+
+/******************************************************************/
+/* Apply the trainings appended to a journal so far, and return   */
+/* their number in *applied. The entries of a journal whose       */
+/* applier was interrupted are applied first, but for those it    */
+/* marked done.                                                   */
+/******************************************************************/
+int
+osbf_apply_journal (const char *journal, uint32_t * applied, char *errmsg)
+{
+  char *work;
+  int err;
+
+  *applied = 0;
+  work = malloc (strlen (journal) + sizeof (OSBF_JOURNAL_WORK_SUFFIX));
+  if (work == NULL)
+    {
+      strncpy (errmsg, "Error allocating memory", OSBF_ERROR_MESSAGE_LEN);
+      return -1;
+    }
+  sprintf (work, "%s%s", journal, OSBF_JOURNAL_WORK_SUFFIX);
+
+  /* the leftover of an interrupted applier goes first */
+  err = apply_journal_file (journal, work, applied, errmsg);
+  if (err == 0)
+    err = take_journal (journal, work, errmsg);
+  if (err == 0)
+    err = apply_journal_file (journal, work, applied, errmsg);
+
+  free (work);
+  return err;
+}
+
+/**********************************************************/
+/* Scoring constants, which depend only on the number of  */
+/* learnings of the classes. They are computed once per   */
+/* call and shared by all texts classified in it.         */
+/**********************************************************/
+static void
+classify_weights (CLASS_STRUCT class[],	/* open classes */
+		  int32_t num_classes,	/* number of classes */
+		  struct weights *w)
+{
+  int32_t i;
+  double exponent;
+  /* empirical weights: (5 - d) ^ (5 - d) */
+  /* where d = number of skipped tokens in the sparse bigram */
+  static const double default_weight[] = { 0, 3125, 256, 27, 4, 1 };
+
+  memcpy (w->feature_weight, default_weight, sizeof (default_weight));
+  w->total_learnings = 0;
+  for (i = 0; i < num_classes; i++)
+    {
+      /* read only once, a training may change them meanwhile */
+      w->trainings[i] = class[i].header->learnings;
+      class[i].learnings = w->trainings[i];
       /* increment learnings to avoid division by 0 */
       if (class[i].learnings == 0)
 	class[i].learnings++;
 
       /* update total learnings */
-      total_learnings += class[i].learnings;
+      w->total_learnings += class[i].learnings;
     }
-  num_classes = i;
-  exponent = pow (total_learnings * 3, 0.2);
+  exponent = pow (w->total_learnings * 3, 0.2);
   if (exponent < 5)
     {
-      feature_weight[1] = pow (exponent, exponent);
-      feature_weight[2] = pow (exponent * 4.0 / 5.0, exponent * 4.0 / 5.0);
-      feature_weight[3] = pow (exponent * 3.0 / 5.0, exponent * 3.0 / 5.0);
-      feature_weight[4] = pow (exponent * 2.0 / 5.0, exponent * 2.0 / 5.0);
+      w->feature_weight[1] = pow (exponent, exponent);
+      w->feature_weight[2] =
+	pow (exponent * 4.0 / 5.0, exponent * 4.0 / 5.0);
+      w->feature_weight[3] =
+	pow (exponent * 3.0 / 5.0, exponent * 3.0 / 5.0);
+      w->feature_weight[4] =
+	pow (exponent * 2.0 / 5.0, exponent * 2.0 / 5.0);
+    }
+}
+
+/**********************************************************/
+
+/*
+ * Add n to the classifications counter of a class. The counter is
+ * updated with an atomic add on a shared writable mapping of the
+ * headers, so classifications don't take the file lock and concurrent
+ * ones, from threads or processes, don't lose counts. A class opened
+ * read-only maps its headers on the first count and keeps them mapped
+ * until it's closed.
+ */
+int
+osbf_count_classifications (CLASS_STRUCT * class, uint32_t n, char *errmsg)
+{
+  int fd;
+  void *map;
+  uint64_t *counter;
+  /* each class of a multi-class file has its own header */
+  size_t len = (class->column + 1) * sizeof (OSBF_HEADER_STRUCT);
+
+  if (class->flags != O_RDWR && class->counters == NULL)
+    {
+      fd = open (class->classname, O_RDWR);
+      if (fd < 0)
+	{
+	  /* for now, ignore if the file isn't writable */
+	  snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		    "Couldn't open file RDWR for counting: %s.",
+		    class->classname);
+	  return 0;
+	}
+      map = mmap (NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      close (fd);
+      if (map == MAP_FAILED)
+	{
+	  snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		    "Couldn't mmap %s for counting.", class->classname);
+	  return 0;
+	}
+      class->counters = map;
     }
 
+  if (class->flags == O_RDWR)
+    counter = &class->header->classifications;
+  else
+    counter = &class->counters[class->column].classifications;
+  __atomic_fetch_add (counter, n, __ATOMIC_RELAXED);
+  return 0;
+}
+
+/**********************************************************/
+/* Find out the best class for the features of a text,    */
+/* among the open classes in "class". Returns the index   */
+/* of the class with max probability, or -1.              */
+/**********************************************************/
+static int
+classify_features (const OSBF_FEATURE_STRUCT * features,	/* of the text */
+		   uint32_t num_features,	/* number of features */
+		   unsigned long text_len,	/* length of text */
+		   CLASS_STRUCT class[],	/* open classes */
+		   int32_t num_classes,	/* number of classes */
+		   const struct weights *w,	/* scoring constants */
+		   uint32_t flags,	/* flags */
+		   double min_pmax_pmin_ratio,
+		   /* returned values */
+		   double ptc[],	/* class probs */
+		   uint32_t ptt[],	/* number trainings per class */
+		   char *errmsg	/* err message, if any */
+  )
+{
+  int32_t i, window_idx, class_idx;
+
+  double htf;			/* hits this feature got. */
+  double renorm = 0.0;
+
+  uint32_t total_learnings = w->total_learnings;
+  uint32_t totalfeatures;	/* total features */
+  uint32_t feature_idx;
+
+  const double *feature_weight = w->feature_weight;
+  double confidence_factor;
+  /* counts of the feature in the classes */
+  uint32_t counts[OSBF_MAX_CLASSES];
+  int asymmetric = 0;		/* break local p loop early if asymmetric on */
+  int voodoo = 1;		/* turn on the "voodoo" CF formula - default */
+
+  /* fprintf(stderr, "Starting classification...\n"); */
+
+  if (flags & NO_EDDC)
+    voodoo = 0;
+
+  for (i = 0; i < num_classes; i++)
+    ptt[i] = w->trainings[i];
+
   if (num_classes == 0)
     {
       snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
@@ -537,405 +1800,445 @@ osbf_bayes_classify (const unsigned char *p_text,	/* pointer to text */
       return (-1);
     }
 
-  /* init the hashpipe with 0xDEADBEEF  */
-  for (h = 0; h < OSB_BAYES_WINDOW_LEN; h++)
-    {
-      hashpipe[h] = 0xDEADBEEF;
-    }
+  /* start clean sets of seen features for this document */
+  for (i = 0; i < num_classes; i++)
+    osbf_bflags_reset (&class[i].bflags, (uint32_t) (text_len / 2));
 
   totalfeatures = 0;
 
-  while (ts.ptok <= ts.ptok_max)
-    {
-      if (get_next_hash (&ts) != 0)
-	break;
-
-      /* Shift the hash pipe down one and insert new hash */
-      for (h = OSB_BAYES_WINDOW_LEN - 1; h > 0; h--)
-	{
-	  hashpipe[h] = hashpipe[h - 1];
-	}
-
-      hashpipe[0] = ts.hash;
-
-      /* clean hash */
-      ts.hash = 0;
-
-      {
-	uint32_t hindex;
-	uint32_t h1, h2;
-	/* remember indexes of classes with min and max local probabilities */
-	int i_min_p, i_max_p;
-	/* remember min and max local probabilities of a feature */
-	double min_local_p, max_local_p;
-	/* flag for already seen features */
-	int already_seen;
-
-	for (window_idx = 1; window_idx < OSB_BAYES_WINDOW_LEN; window_idx++)
-	  {
-	    h1 =
-	      hashpipe[0] * hctable1[0] +
-	      hashpipe[window_idx] * hctable1[window_idx];
-	    h2 = hashpipe[0] * hctable2[0] +
-#ifdef CRM114_COMPATIBILITY
-	      hashpipe[window_idx] * hctable2[window_idx - 1];
-#else
-	      hashpipe[window_idx] * hctable2[window_idx];
-#endif
+  /*
+   * The features of the whole text were extracted first and are now
+   * looked up in the classes, so that the buckets of the features a
+   * few positions ahead can be prefetched while the current one is
+   * scored. Probes into large .cfc files are mostly cache and TLB
+   * misses, and this lets their latencies overlap.
+   */
+  /* start the prefetch pipeline */
+  for (feature_idx = 0;
+       feature_idx < prefetch_distance && feature_idx < num_features;
+       feature_idx++)
+    for (class_idx = 0; class_idx < num_classes; class_idx++)
+      if (class_idx == 0 ||
+	  !SAME_DB (&class[class_idx], &class[class_idx - 1]))
+	PREFETCH_BUCKET (&class[class_idx], features[feature_idx].h1);
 
-	    hindex = h1;
+  for (feature_idx = 0; feature_idx < num_features; feature_idx++)
+    {
+      uint32_t h1, h2, lh_prev;
+      /* 1 if the feature is in the bucket found */
+      int found;
+      /* remember indexes of classes with min and max local probabilities */
+      int i_min_p, i_max_p;
+      /* remember min and max local probabilities of a feature */
+      double min_local_p, max_local_p;
+      /* flag for already seen features */
+      int already_seen;
+
+      if (prefetch_distance > 0 &&
+	  feature_idx + prefetch_distance < num_features)
+	for (class_idx = 0; class_idx < num_classes; class_idx++)
+	  if (class_idx == 0 ||
+	      !SAME_DB (&class[class_idx], &class[class_idx - 1]))
+	    PREFETCH_BUCKET (&class[class_idx],
+			     features[feature_idx + prefetch_distance].h1);
+
+      h1 = features[feature_idx].h1;
+      h2 = features[feature_idx].h2;
+      window_idx = features[feature_idx].window_idx;
 
 #if (DEBUG)
-	    fprintf (stderr,
-		     "Polynomial %" PRIu32 " has h1:%i" PRIu32 "  h2: %"
-		     PRIu32 "\n", window_idx, h1, h2);
+	fprintf (stderr,
+		 "Polynomial %" PRIu32 " has h1:%i" PRIu32 "  h2: %"
+		 PRIu32 "\n", window_idx, h1, h2);
 #endif
 
-	    htf = 0;
-	    totalfeatures++;
+	htf = 0;
+	totalfeatures++;
+
+	min_local_p = 1.0;
+	max_local_p = 0;
+	i_min_p = i_max_p = 0;
+	already_seen = 0;
+	lh_prev = 0;
+	found = 0;
+	for (class_idx = 0; class_idx < num_classes; class_idx++)
+	  {
+	    uint32_t lh, home, version, retries;
+	    double p_feat = 0;
+
+	    class[class_idx].hits = 0;
+
+	    /* look for feature with hashes h1 and h2. classes of the */
+	    /* same multi-class file share the bucket, so one probe   */
+	    /* is enough for all of them                              */
+	    if (class_idx > 0 &&
+		SAME_DB (&class[class_idx], &class[class_idx - 1]))
+	      lh = lh_prev;
+	    else if (class[class_idx].bloom != NULL &&
+		     !osbf_bloom_check (&class[class_idx], h1, h2))
+	      {
+		/* surely not in the class, skip the probe */
+		lh = NUM_BUCKETS (&class[class_idx]) + 1;
+		found = 0;
+		counts[class_idx] = 0;
+	      }
+	    else
+	      {
+		/* the probe and the counts read with it, for all */
+		/* classes of the file, are repeated if a training */
+		/* changed the chain meanwhile                     */
+		home = HASH_INDEX (&class[class_idx], h1);
+		retries = 0;
+		do
+		  {
+		    version = OSBF_READ_BEGIN (&class[class_idx], home);
+		    lh = osbf_find_bucket (&class[class_idx], h1, h2);
+		    found = VALID_BUCKET (&class[class_idx], lh) &&
+		      BUCKET_HASH_COMPARE (&class[class_idx], lh, h1, h2);
+		    i = class_idx;
+		    do
+		      {
+			counts[i] = found ? BUCKET_VALUE (&class[i], lh) : 0;
+			i++;
+		      }
+		    while (i < num_classes &&
+			   SAME_DB (&class[i], &class[i - 1]));
+		  }
+		while (OSBF_READ_CHANGED (&class[class_idx], home, version) &&
+		       osbf_read_retry (version, &retries));
+	      }
+	    lh_prev = lh;
 
-	    min_local_p = 1.0;
-	    max_local_p = 0;
-	    i_min_p = i_max_p = 0;
-	    already_seen = 0;
-	    for (class_idx = 0; class_idx < num_classes; class_idx++)
+	    /* the bucket is valid if its index is valid. if the     */
+	    /* index "lh" is >= the number of buckets, it means that */
+	    /* the .cfc file is full and the bucket wasn't found     */
+	    if (VALID_BUCKET (&class[class_idx], lh) &&
+		(BUCKET_FLAGS (&class[class_idx], lh) == 0 || !found))
 	      {
-		uint32_t lh, lh0;
-		double p_feat = 0;
+		/* only not previously seen features are considered */
+		if (counts[class_idx] != 0)
+		  {
+		    /* count unique features used */
+		    class[class_idx].uniquefeatures += 1;
 
-		lh = HASH_INDEX (&class[class_idx], hindex);
-		lh0 = lh;
-		class[class_idx].hits = 0;
+		    class[class_idx].hits = counts[class_idx];
 
-		/* look for feature with hashes h1 and h2 */
-		lh = osbf_find_bucket (&class[class_idx], h1, h2);
+		    /* remember totalhits */
+		    class[class_idx].totalhits += class[class_idx].hits;
 
-		/* the bucket is valid if its index is valid. if the     */
-		/* index "lh" is >= the number of buckets, it means that */
-		/* the .cfc file is full and the bucket wasn't found     */
-		if (VALID_BUCKET (&class[class_idx], lh) &&
-		    class[class_idx].bflags[lh] == 0)
-		  {
-		    /* only not previously seen features are considered */
-		    if (BUCKET_IN_CHAIN (&class[class_idx], lh))
+		    /* and hits-this-feature */
+		    htf += class[class_idx].hits;
+		    p_feat = class[class_idx].hits /
+		      class[class_idx].learnings;
+
+		    /* find class with minimum P(F) */
+		    if (p_feat <= min_local_p)
 		      {
-			/* count unique features used */
-			class[class_idx].uniquefeatures += 1;
-
-			class[class_idx].hits =
-			  BUCKET_VALUE (&class[class_idx], lh);
-
-			/* remember totalhits */
-			class[class_idx].totalhits += class[class_idx].hits;
-
-			/* and hits-this-feature */
-			htf += class[class_idx].hits;
-			p_feat = class[class_idx].hits /
-			  class[class_idx].learnings;
-
-			/* find class with minimum P(F) */
-			if (p_feat <= min_local_p)
-			  {
-			    i_min_p = class_idx;
-			    min_local_p = p_feat;
-			  }
-
-			/* find class with maximum P(F) */
-			if (p_feat >= max_local_p)
-			  {
-			    i_max_p = class_idx;
-			    max_local_p = p_feat;
-			  }
-
-			/* mark the feature as seen */
-			class[class_idx].bflags[lh] = 1;
+			i_min_p = class_idx;
+			min_local_p = p_feat;
 		      }
-		    else
+
+		    /* find class with maximum P(F) */
+		    if (p_feat >= max_local_p)
 		      {
-			/*
-			 * a feature that wasn't found can't be marked as
-			 * already seen in the doc because the index lh
-			 * doesn't refer to it, but to the first empty bucket
-			 * after the chain, which is common to all not-found
-			 * features in the same chain. This is not a problem
-			 * though, because if the feature is found in another
-			 * class, it'll be marked as seen on that class,
-			 * which is enough to mark it as seen. If it's not
-			 * found in any class, it will have zero count on
-			 * all classes and will be ignored as well. So, only
-			 * found features are marked as seen.
-			 */
-			i_min_p = class_idx;
-			min_local_p = p_feat = 0;
-			/* for statistics only (for now...) */
-			class[class_idx].missedfeatures += 1;
+			i_max_p = class_idx;
+			max_local_p = p_feat;
 		      }
+
+		    /* mark the feature as seen */
+		    SET_BUCKET_FLAGS (&class[class_idx], lh, 1);
 		  }
 		else
 		  {
-		    if (VALID_BUCKET (&class[class_idx], lh))
-		      {
-			already_seen = 1;
-			if (asymmetric != 0)
-			  break;
-		      }
-		    else
-		      {
-			/* bucket not valid. treat like feature not found */
-			i_min_p = class_idx;
-			min_local_p = p_feat = 0;
-			/* for statistics only (for now...) */
-			class[class_idx].missedfeatures += 1;
-		      }
+		    /*
+		     * a feature that wasn't found can't be marked as
+		     * already seen in the doc because the index lh
+		     * doesn't refer to it, but to the first empty bucket
+		     * after the chain, which is common to all not-found
+		     * features in the same chain (or, with Robin Hood
+		     * insertion, to the bucket of another feature where
+		     * it would be inserted). This is not a problem
+		     * though, because if the feature is found in another
+		     * class, it'll be marked as seen on that class,
+		     * which is enough to mark it as seen. If it's not
+		     * found in any class, it will have zero count on
+		     * all classes and will be ignored as well. So, only
+		     * found features are marked as seen.
+		     */
+		    i_min_p = class_idx;
+		    min_local_p = p_feat = 0;
+		    /* for statistics only (for now...) */
+		    class[class_idx].missedfeatures += 1;
 		  }
 	      }
+	    else
+	      {
+		if (VALID_BUCKET (&class[class_idx], lh))
+		  {
+		    already_seen = 1;
+		    if (asymmetric != 0)
+		      break;
+		  }
+		else
+		  {
+		    /* bucket not valid. treat like feature not found */
+		    i_min_p = class_idx;
+		    min_local_p = p_feat = 0;
+		    /* for statistics only (for now...) */
+		    class[class_idx].missedfeatures += 1;
+		  }
+	      }
+	  }
 
 
-	    /*=======================================================
-	     * Update the probabilities using Bayes:
-	     *
-	     *                      P(F|S) P(S)
-	     *     P(S|F) = -------------------------------
-	     *               P(F|S) P(S) +  P(F|NS) P(NS)
-	     *
-	     * S = class spam; NS = class nonspam; F = feature
-	     *
-	     * Here we adopt a different method for estimating
-	     * P(F|S). Instead of estimating P(F|S) as (hits[S][F] /
-	     * (hits[S][F] + hits[NS][F])), like in the original
-	     * code, we use (hits[S][F] / learnings[S]) which is the
-	     * ratio between the number of messages of the class S
-	     * where the feature F was observed during learnings and
-	     * the total number of learnings of that class. Both
-	     * values are kept in the respective .cfc file, the
-	     * number of learnings in the header and the number of
-	     * occurrences of the feature F as the value of its
-	     * feature bucket.
-	     *
-	     * It's worth noting another important difference here:
-	     * as we want to estimate the *number of messages* of a
-	     * given class where a certain feature F occurs, we
-	     * count only the first occurrence of each feature in a
-	     * message (repetitions are ignored), both when learning
-	     * and when classifying.
-	     * 
-	     * Advantages of this method, compared to the original:
-	     *
-	     * - First of all, and the most important: accuracy is
-	     * really much better, at about the same speed! With
-	     * this higher accuracy, it's also possible to increase
-	     * the speed, at the cost of a low decrease in accuracy,
-	     * using smaller .cfc files;
-	     *
-	     * - It is not affected by different sized classes
-	     * because the numerator and the denominator belong to
-	     * the same class;
-	     *
-	     * - It allows a simple and fast pruning method that
-	     * seems to introduce little noise: just zero features
-	     * with lower count in a overflowed chain, zeroing first
-	     * those in their right places, to increase the chances
-	     * of deleting older ones.
-	     *
-	     * Disadvantages:
-	     *
-	     * - It breaks compatibility with previous .css file
-	     * format because of different header structure and
-	     * meaning of the counts.
-	     *
-	     * Confidence factors
-	     *
-	     * The motivation for confidence factors is to reduce
-	     * the noise introduced by features with small counts
-	     * and/or low significance. This is an attempt to mimic
-	     * what we do when inspecting a message to tell if it is
-	     * spam or not. We intuitively consider only a few
-	     * tokens, those which carry strong indications,
-	     * according to what we've learned and remember, and
-	     * discard the ones that may occur (approximately)
-	     * equally in both classes.
-	     *
-	     * Once P(Feature|Class) is estimated as above, the
-	     * calculated value is adjusted using the following
-	     * formula:
-	     *
-	     *  CP(Feature|Class) = 0.5 + 
-	     *             CF(Feature) * (P(Feature|Class) - 0.5)
-	     *
-	     * Where CF(Feature) is the confidence factor and
-	     * CP(Feature|Class) is the adjusted estimate for the
-	     * probability.
-	     *
-	     * CF(Feature) is calculated taking into account the
-	     * weight, the max and the min frequency of the feature
-	     * over the classes, using the empirical formula:
-	     *
-	     *     (((Hmax - Hmin)^2 + Hmax*Hmin - K1/SH) / SH^2) ^ K2
-	     * CF(Feature) = ------------------------------------------
-	     *                    1 +  K3 / (SH * Weight)
-	     *
-	     * Hmax  - Number of documents with the feature "F" on
-	     * the class with max local probability;
-	     * Hmin  - Number of documents with the feature "F" on
-	     * the class with min local probability;
-	     * SH - Sum of Hmax and Hmin
-	     * K1, K2, K3 - Empirical constants
-	     *
-	     * OBS: - Hmax and Hmin are normalized to the max number
-	     *  of learnings of the 2 classes involved.
-	     *  - Besides modulating the estimated P(Feature|Class),
-	     *  reducing the noise, 0 <= CF < 1 is also used to
-	     *  restrict the probability range, avoiding the
-	     *  certainty falsely implied by a 0 count for a given
-	     *  class.
-	     *
-	     * -- Fidelis Assis
-	     *=======================================================*/
-
-	    /* ignore already seen features */
-	    /* ignore less significant features (CF = 0) */
-	    if ((already_seen != 0) || ((max_local_p - min_local_p) < 1E-6))
-	      continue;
-	    if ((min_local_p > 0)
-		&& ((max_local_p / min_local_p) < min_pmax_pmin_ratio))
-	      continue;
-
-	    /* code under testing... */
-	    /* calculate confidence_factor */
-	    {
-	      uint32_t hits_max_p, hits_min_p, sum_hits;
-	      int32_t diff_hits;
-	      double cfx = 1;
-	      /* constants used in the CF formula */
-	      /* K1 = 0.25; K2 = 10; K3 = 8;      */
-	      /* const double K1 = 0.25, K2 = 10, K3 = 8; */
-
-	      hits_min_p = class[i_min_p].hits;
-	      hits_max_p = class[i_max_p].hits;
-
-	      /* normalize hits to max learnings */
-	      if (class[i_min_p].learnings < class[i_max_p].learnings)
-		hits_min_p *=
-		  (double) class[i_max_p].learnings /
-		  (double) class[i_min_p].learnings;
-	      else
-		hits_max_p *=
-		  (double) class[i_min_p].learnings /
-		  (double) class[i_max_p].learnings;
-
-	      sum_hits = hits_max_p + hits_min_p;
-	      diff_hits = hits_max_p - hits_min_p;
-	      if (diff_hits < 0)
-		diff_hits = -diff_hits;
-
-	      /* calculate confidence factor (CF) */
-	      if (voodoo == 0)	/* || min_local_p > 0 ) */
-		confidence_factor = 1 - OSBF_DBL_MIN;
-	      else
+	/*=======================================================
+	 * Update the probabilities using Bayes:
+	 *
+	 *                      P(F|S) P(S)
+	 *     P(S|F) = -------------------------------
+	 *               P(F|S) P(S) +  P(F|NS) P(NS)
+	 *
+	 * S = class spam; NS = class nonspam; F = feature
+	 *
+	 * Here we adopt a different method for estimating
+	 * P(F|S). Instead of estimating P(F|S) as (hits[S][F] /
+	 * (hits[S][F] + hits[NS][F])), like in the original
+	 * code, we use (hits[S][F] / learnings[S]) which is the
+	 * ratio between the number of messages of the class S
+	 * where the feature F was observed during learnings and
+	 * the total number of learnings of that class. Both
+	 * values are kept in the respective .cfc file, the
+	 * number of learnings in the header and the number of
+	 * occurrences of the feature F as the value of its
+	 * feature bucket.
+	 *
+	 * It's worth noting another important difference here:
+	 * as we want to estimate the *number of messages* of a
+	 * given class where a certain feature F occurs, we
+	 * count only the first occurrence of each feature in a
+	 * message (repetitions are ignored), both when learning
+	 * and when classifying.
+	 * 
+	 * Advantages of this method, compared to the original:
+	 *
+	 * - First of all, and the most important: accuracy is
+	 * really much better, at about the same speed! With
+	 * this higher accuracy, it's also possible to increase
+	 * the speed, at the cost of a low decrease in accuracy,
+	 * using smaller .cfc files;
+	 *
+	 * - It is not affected by different sized classes
+	 * because the numerator and the denominator belong to
+	 * the same class;
+	 *
+	 * - It allows a simple and fast pruning method that
+	 * seems to introduce little noise: just zero features
+	 * with lower count in a overflowed chain, zeroing first
+	 * those in their right places, to increase the chances
+	 * of deleting older ones.
+	 *
+	 * Disadvantages:
+	 *
+	 * - It breaks compatibility with previous .css file
+	 * format because of different header structure and
+	 * meaning of the counts.
+	 *
+	 * Confidence factors
+	 *
+	 * The motivation for confidence factors is to reduce
+	 * the noise introduced by features with small counts
+	 * and/or low significance. This is an attempt to mimic
+	 * what we do when inspecting a message to tell if it is
+	 * spam or not. We intuitively consider only a few
+	 * tokens, those which carry strong indications,
+	 * according to what we've learned and remember, and
+	 * discard the ones that may occur (approximately)
+	 * equally in both classes.
+	 *
+	 * Once P(Feature|Class) is estimated as above, the
+	 * calculated value is adjusted using the following
+	 * formula:
+	 *
+	 *  CP(Feature|Class) = 0.5 + 
+	 *             CF(Feature) * (P(Feature|Class) - 0.5)
+	 *
+	 * Where CF(Feature) is the confidence factor and
+	 * CP(Feature|Class) is the adjusted estimate for the
+	 * probability.
+	 *
+	 * CF(Feature) is calculated taking into account the
+	 * weight, the max and the min frequency of the feature
+	 * over the classes, using the empirical formula:
+	 *
+	 *     (((Hmax - Hmin)^2 + Hmax*Hmin - K1/SH) / SH^2) ^ K2
+	 * CF(Feature) = ------------------------------------------
+	 *                    1 +  K3 / (SH * Weight)
+	 *
+	 * Hmax  - Number of documents with the feature "F" on
+	 * the class with max local probability;
+	 * Hmin  - Number of documents with the feature "F" on
+	 * the class with min local probability;
+	 * SH - Sum of Hmax and Hmin
+	 * K1, K2, K3 - Empirical constants
+	 *
+	 * OBS: - Hmax and Hmin are normalized to the max number
+	 *  of learnings of the 2 classes involved.
+	 *  - Besides modulating the estimated P(Feature|Class),
+	 *  reducing the noise, 0 <= CF < 1 is also used to
+	 *  restrict the probability range, avoiding the
+	 *  certainty falsely implied by a 0 count for a given
+	 *  class.
+	 *
+	 * -- Fidelis Assis
+	 *=======================================================*/
+
+	/* ignore already seen features */
+	/* ignore less significant features (CF = 0) */
+	if ((already_seen != 0) || ((max_local_p - min_local_p) < 1E-6))
+	  continue;
+	if ((min_local_p > 0)
+	    && ((max_local_p / min_local_p) < min_pmax_pmin_ratio))
+	  continue;
+
+	/* code under testing... */
+	/* calculate confidence_factor */
+	{
+	  uint32_t hits_max_p, hits_min_p, sum_hits;
+	  int32_t diff_hits;
+	  double cfx = 1;
+	  /* constants used in the CF formula */
+	  /* K1 = 0.25; K2 = 10; K3 = 8;      */
+	  /* const double K1 = 0.25, K2 = 10, K3 = 8; */
+
+	  hits_min_p = class[i_min_p].hits;
+	  hits_max_p = class[i_max_p].hits;
+
+	  /* normalize hits to max learnings */
+	  if (class[i_min_p].learnings < class[i_max_p].learnings)
+	    hits_min_p *=
+	      (double) class[i_max_p].learnings /
+	      (double) class[i_min_p].learnings;
+	  else
+	    hits_max_p *=
+	      (double) class[i_min_p].learnings /
+	      (double) class[i_max_p].learnings;
+
+	  sum_hits = hits_max_p + hits_min_p;
+	  diff_hits = hits_max_p - hits_min_p;
+	  if (diff_hits < 0)
+	    diff_hits = -diff_hits;
+
+	  /* calculate confidence factor (CF) */
+	  if (voodoo == 0)	/* || min_local_p > 0 ) */
+	    confidence_factor = 1 - OSBF_DBL_MIN;
+	  else
 #define EDDC_VARIANT 3
 #if   (EDDC_VARIANT == 1)
-		confidence_factor =
-		  pow ((diff_hits * diff_hits +
-			hits_max_p * hits_min_p -
-			K1 / sum_hits) / (sum_hits * sum_hits),
-		       K2) / (1.0 +
-			      K3 / (sum_hits * feature_weight[window_idx]));
+	    confidence_factor =
+	      pow ((diff_hits * diff_hits +
+		    hits_max_p * hits_min_p -
+		    K1 / sum_hits) / (sum_hits * sum_hits),
+		   K2) / (1.0 +
+			  K3 / (sum_hits * feature_weight[window_idx]));
 #elif (EDDC_VARIANT == 2)
-		confidence_factor =
-		  pow ((diff_hits * diff_hits - K1 / sum_hits) /
-		       (sum_hits * sum_hits), K2) / (1.0 +
-						     K3 / (sum_hits *
-							   feature_weight
-							   [window_idx]));
+	    confidence_factor =
+	      pow ((diff_hits * diff_hits - K1 / sum_hits) /
+		   (sum_hits * sum_hits), K2) / (1.0 +
+						 K3 / (sum_hits *
+						       feature_weight
+						       [window_idx]));
 #elif (EDDC_VARIANT == 3)
-		cfx =
-		  0.8 + (class[i_min_p].header->learnings +
-			 class[i_max_p].header->learnings) / 20.0;
-	      if (cfx > 1)
-		cfx = 1;
-	      confidence_factor = cfx *
-		pow (((double)diff_hits * diff_hits - K1 /
-		      (class[i_max_p].hits + class[i_min_p].hits)) /
-		     ((double)sum_hits * sum_hits), 2) /
-		(1.0 +
-		 K3 / ((class[i_max_p].hits + class[i_min_p].hits) *
-		       feature_weight[window_idx]));
+	    cfx =
+	      0.8 + (w->trainings[i_min_p] + w->trainings[i_max_p]) / 20.0;
+	  if (cfx > 1)
+	    cfx = 1;
+	  confidence_factor = cfx *
+	    pow (((double)diff_hits * diff_hits - K1 /
+		  (class[i_max_p].hits + class[i_min_p].hits)) /
+		 ((double)sum_hits * sum_hits), 2) /
+	    (1.0 +
+	     K3 / ((class[i_max_p].hits + class[i_min_p].hits) *
+		   feature_weight[window_idx]));
 #elif (EDDC_VARIANT == 4)
-		confidence_factor =
-		  conf_factor (sum_hits, diff_hits, 0.1) / (1.0 +
-							    K3 / (sum_hits *
-								  feature_weight
-								  [window_idx]));
+	    confidence_factor =
+	      conf_factor (sum_hits, diff_hits, 0.1) / (1.0 +
+							K3 / (sum_hits *
+							      feature_weight
+							      [window_idx]));
 #endif
 
 #if (DEBUG)
-	      fprintf
-		(stderr,
-		 "CF: %.4f, max_hits = %3" PRIu32 ", min_hits = %3" PRIu32
-		 ", " "weight: %5.1f\n", confidence_factor, hits_max_p,
-		 hits_min_p, feature_weight[window_idx]);
+	  fprintf
+	    (stderr,
+	     "CF: %.4f, max_hits = %3" PRIu32 ", min_hits = %3" PRIu32
+	     ", " "weight: %5.1f\n", confidence_factor, hits_max_p,
+	     hits_min_p, feature_weight[window_idx]);
 #endif
-	    }
+	}
 
-	    /* calculate the numerators - P(F|C) * P(C) */
-	    renorm = 0.0;
-	    for (class_idx = 0; class_idx < num_classes; class_idx++)
-	      {
-		/*
-		 * P(C) = learnings[k] / total_learnings
-		 * P(F|C) = hits[k]/learnings[k], adjusted by the
-		 * confidence factor.
-		 */
-		ptc[class_idx] = ptc[class_idx] * (0.5 + confidence_factor *
-						   (class[class_idx].
-						    hits /
-						    class[class_idx].
-						    learnings - 0.5));
-
-		if (ptc[class_idx] < 10 * OSBF_DBL_MIN)
-		  ptc[class_idx] = 10 * OSBF_DBL_MIN;
-		renorm += ptc[class_idx];
+	/* calculate the numerators - P(F|C) * P(C) */
+	renorm = 0.0;
+	for (class_idx = 0; class_idx < num_classes; class_idx++)
+	  {
+	    /*
+	     * P(C) = learnings[k] / total_learnings
+	     * P(F|C) = hits[k]/learnings[k], adjusted by the
+	     * confidence factor.
+	     */
+	    ptc[class_idx] = ptc[class_idx] * (0.5 + confidence_factor *
+					       (class[class_idx].
+						hits /
+						class[class_idx].
+						learnings - 0.5));
+
+	    if (ptc[class_idx] < 10 * OSBF_DBL_MIN)
+	      ptc[class_idx] = 10 * OSBF_DBL_MIN;
+	    renorm += ptc[class_idx];
 #if (DEBUG)
-		fprintf (stderr, "CF: %.4f, class[k].totalhits: %" PRIu32 ", "
-			 "missedfeatures[k]: %" PRIu32
-			 ", uniquefeatures[k]: %" PRIu32 ", "
-			 "totalfeatures: %" PRIu32 ", weight: %5.1f\n",
-			 confidence_factor, class[class_idx].totalhits,
-			 class[class_idx].missedfeatures,
-			 class[class_idx].uniquefeatures, totalfeatures,
-			 feature_weight[window_idx]);
+	    fprintf (stderr, "CF: %.4f, class[k].totalhits: %" PRIu32 ", "
+		     "missedfeatures[k]: %" PRIu32
+		     ", uniquefeatures[k]: %" PRIu32 ", "
+		     "totalfeatures: %" PRIu32 ", weight: %5.1f\n",
+		     confidence_factor, class[class_idx].totalhits,
+		     class[class_idx].missedfeatures,
+		     class[class_idx].uniquefeatures, totalfeatures,
+		     feature_weight[window_idx]);
 #endif
 
-	      }
+	  }
 
-	    /* renormalize probabilities */
-	    for (class_idx = 0; class_idx < num_classes; class_idx++)
-	      ptc[class_idx] = ptc[class_idx] / renorm;
+	/* renormalize probabilities */
+	for (class_idx = 0; class_idx < num_classes; class_idx++)
+	  ptc[class_idx] = ptc[class_idx] / renorm;
 
 #if (DEBUG)
+	{
+	  for (class_idx = 0; class_idx < num_classes; class_idx++)
 	    {
-	      for (class_idx = 0; class_idx < num_classes; class_idx++)
-		{
-		  fprintf (stderr,
-			   " poly: %" PRIu32 "  filenum: %" PRIu32
-			   ", HTF: %7.0f, " "learnings: %7" PRIu32
-			   ", hits: %7.0f, " "Pc: %6.4e\n",
-			   window_idx, class_idx, htf,
-			   class[class_idx].header->learnings,
-			   class[class_idx].hits, ptc[class_idx]);
-		}
+	      fprintf (stderr,
+		       " poly: %" PRIu32 "  filenum: %" PRIu32
+		       ", HTF: %7.0f, " "learnings: %7" PRIu32
+		       ", hits: %7.0f, " "Pc: %6.4e\n",
+		       window_idx, class_idx, htf,
+		       class[class_idx].header->learnings,
+		       class[class_idx].hits, ptc[class_idx]);
 	    }
+	}
 #endif
-	  }
-      }
     }
 
+  for (i = 0; i < num_classes; i++)
+    if (class[i].bflags.error)
+      {
+	snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		  "Couldn't allocate memory for seen features array.");
+	return (-1);
+      }
 
-  /* find class with max probability and close all open files */
+  /* find class with max probability */
   {
     int max_ptc_idx = 0;
     double max_ptc = 0;
-    OSBF_HEADER_STRUCT header;
 
     for (class_idx = 0; class_idx < num_classes; class_idx++)
       {
@@ -944,52 +2247,370 @@ osbf_bayes_classify (const unsigned char *p_text,	/* pointer to text */
 	    max_ptc_idx = class_idx;
 	    max_ptc = ptc[class_idx];
 	  }
-	err = osbf_close_class (&class[class_idx], errmsg);
       }
 
-    if (err == 0 && (flags & COUNT_CLASSIFICATIONS))
-      {
-	int fd;
-
-	fd = open (class[max_ptc_idx].classname, O_RDWR);
-	if (fd >= 0)
-	  {
-	    if (osbf_lock_file (fd, 0, sizeof (header)) == 0)
-	      {
-		read (fd, &header, sizeof (header));
-		header.classifications += 1;
-		lseek (fd, 0, SEEK_SET);
-		write (fd, &header, sizeof (header));
+#if (DEBUG)
+    {
+      for (class_idx = 0; class_idx < num_classes; class_idx++)
+	fprintf (stderr,
+		 "Probability of match for file %" PRIu32 ": %f\n",
+		 class_idx, ptc[class_idx]);
+    }
+#endif
 
-		if (osbf_unlock_file (fd, 0, sizeof (header)) != 0)
-		  {
-		    snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
-			      "Couldn't Unlock file: %s.",
-			      class[max_ptc_idx].classname);
-		    err = -1;
-		  }
-	      }
-	    /* for now, ignore if file couldn't be locked */
-	    close (fd);
-	  }
-	else
-	  {
-	    snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
-		      "Couldn't open file RDWR for locking: %s.",
-		      class[max_ptc_idx].classname);
-	  }
-	/* for now, ignore if file couldn't be locked */
-      }
+    return max_ptc_idx;
   }
+}
 
-#if (DEBUG)
-  {
-    for (class_idx = 0; class_idx < num_classes; class_idx++)
-      fprintf (stderr,
-	       "Probability of match for file %" PRIu32 ": %f\n",
-	       class_idx, ptc[class_idx]);
-  }
+/**********************************************************/
+/* Find out the best class for the text pointed to by     */
+/* "p_text", among the open classes in "class".           */
+/**********************************************************/
+static int
+bayes_classify (const unsigned char *p_text,	/* pointer to text */
+		unsigned long text_len,	/* length of text */
+		const DELIM_TABLE_STRUCT * dt,	/* token delimiters */
+		CLASS_STRUCT class[],	/* open classes */
+		int32_t num_classes,	/* number of classes */
+		const struct weights *w,	/* scoring constants */
+		uint32_t flags,	/* flags */
+		double min_pmax_pmin_ratio,
+		/* returned values */
+		double ptc[],	/* class probs */
+		uint32_t ptt[],	/* number trainings per class */
+		char *errmsg	/* err message, if any */
+  )
+{
+  OSBF_TEXT_FEATURES_STRUCT tf;
+  int err;
+
+  if (extract_features (p_text, text_len, dt, 0, &tf, errmsg) != 0)
+    return (-1);
+
+  err = classify_features (tf.features, tf.num_features, text_len, class,
+			   num_classes, w, flags, min_pmax_pmin_ratio, ptc,
+			   ptt, errmsg);
+  osbf_free_text_features (&tf);
+
+  return (err);
+}
+
+/**********************************************************/
+/* Find out the best class for the text pointed to by     */
+/* "p_text", among those listed in the array "classnames" */
+/**********************************************************/
+int
+osbf_bayes_classify (const unsigned char *p_text,	/* pointer to text */
+		     unsigned long text_len,	/* length of text */
+		     const char *delims,	/* token delimiters */
+		     const char *classnames[],	/* hash file names */
+		     uint32_t flags,	/* flags */
+		     double min_pmax_pmin_ratio,
+		     /* returned values */
+		     double ptc[],	/* class probs */
+		     uint32_t ptt[],	/* number trainings per class */
+		     char *errmsg	/* err message, if any */
+  )
+{
+  int err = 0;
+  int32_t i, num_classes;
+  CLASS_STRUCT class[OSBF_MAX_CLASSES];
+  DELIM_TABLE_STRUCT dt;
+  struct weights w;
+
+  osbf_build_delim_table (&dt, delims);
+
+  for (i = 0; (classnames[i] != NULL) && (i < OSBF_MAX_CLASSES); i++)
+    {
+      /*  mmap the hash file into memory */
+      err = osbf_open_class (classnames[i], osbf_class_column (classnames, i),
+			     O_RDONLY, &class[i], errmsg);
+      if (err != 0)
+	{
+	  snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		    "Couldn't open the file %s.", classnames[i]);
+	  while (--i >= 0)
+	    osbf_close_class (&class[i], errmsg);
+	  return err;
+	}
+    }
+  num_classes = i;
+
+  classify_weights (class, num_classes, &w);
+  err = bayes_classify (p_text, text_len, &dt, class, num_classes, &w,
+			flags, min_pmax_pmin_ratio, ptc, ptt, errmsg);
+  if (err >= 0)
+    err = (flags & COUNT_CLASSIFICATIONS) ?
+      osbf_count_classifications (&class[err], 1, errmsg) : 0;
+
+  for (i = 0; i < num_classes; i++)
+    osbf_close_class (&class[i], errmsg);
+
+  return (err);
+}
+
+/**********************************************************/
+/* Classify a text using the classes of an open database  */
+/* set. The classes are remapped if their files changed.  */
+/**********************************************************/
+int
+osbf_bayes_classify_dbset (DBSET_STRUCT * dbset,	/* open database set */
+			   const unsigned char *p_text,	/* pointer to text */
+			   unsigned long text_len,	/* length of text */
+			   uint32_t flags,	/* flags */
+			   double min_pmax_pmin_ratio,
+			   /* returned values */
+			   double ptc[],	/* class probs */
+			   uint32_t ptt[],	/* number trainings per class */
+			   char *errmsg	/* err message, if any */
+  )
+{
+  struct weights w;
+  int err;
+
+  if (osbf_check_dbset (dbset, errmsg) != 0)
+    return (-1);
+
+  classify_weights (dbset->class, dbset->num_classes, &w);
+  err = bayes_classify (p_text, text_len, &dbset->dt, dbset->class,
+			dbset->num_classes, &w, flags, min_pmax_pmin_ratio,
+			ptc, ptt, errmsg);
+  if (err >= 0)
+    err = (flags & COUNT_CLASSIFICATIONS) ?
+      osbf_count_classifications (&dbset->class[err], 1, errmsg) : 0;
+
+  return (err);
+}
+
+/**********************************************************/
+/* Classify the features of a text, extracted by          */
+/* osbf_text_features, using the classes of an open       */
+/* database set.                                          */
+/**********************************************************/
+int
+osbf_bayes_classify_features (DBSET_STRUCT * dbset,	/* open database set */
+			      const OSBF_TEXT_FEATURES_STRUCT * tf,
+			      uint32_t flags,	/* flags */
+			      double min_pmax_pmin_ratio,
+			      /* returned values */
+			      double ptc[],	/* class probs */
+			      uint32_t ptt[],	/* number trainings per class */
+			      char *errmsg	/* err message, if any */
+  )
+{
+  struct weights w;
+  int err;
+
+  if (osbf_check_dbset (dbset, errmsg) != 0)
+    return (-1);
+
+  classify_weights (dbset->class, dbset->num_classes, &w);
+  err = classify_features (tf->features, tf->num_features, tf->text_len,
+			   dbset->class, dbset->num_classes, &w, flags,
+			   min_pmax_pmin_ratio, ptc, ptt, errmsg);
+  if (err >= 0)
+    err = (flags & COUNT_CLASSIFICATIONS) ?
+      osbf_count_classifications (&dbset->class[err], 1, errmsg) : 0;
+
+  return (err);
+}
+
+/**********************************************************/
+/* Batch classification                                   */
+/**********************************************************/
+
+/* a batch of texts to classify, shared by the workers */
+struct batch
+{
+  DBSET_STRUCT *dbset;
+  const struct weights *w;
+  uint32_t num_texts;
+  const unsigned char **texts;
+  const unsigned long *text_lens;
+  uint32_t flags;
+  double min_pmax_pmin_ratio;
+  uint32_t num_workers;
+  double *ptc;			/* num_texts x num_classes class probs */
+  int32_t *winners;		/* class with max probability per text */
+};
+
+/* a worker classifies every num_workers-th text, from "first" on */
+struct batch_worker
+{
+  struct batch *b;
+  uint32_t first;
+  CLASS_STRUCT class[OSBF_MAX_CLASSES];	/* private copies */
+  int err;
+  uint32_t err_text;		/* text where the error happened */
+  char errmsg[OSBF_ERROR_MESSAGE_LEN];
+#ifndef OSBF_NO_THREADS
+  pthread_t thread;
+  int started;
+#endif
+};
+
+static void *
+batch_worker (void *arg)
+{
+  struct batch_worker *bw = (struct batch_worker *) arg;
+  struct batch *b = bw->b;
+  uint32_t i, num_classes = b->dbset->num_classes;
+  uint32_t ptt[OSBF_MAX_CLASSES];
+  int32_t winner;
+
+  for (i = bw->first; i < b->num_texts; i += b->num_workers)
+    {
+      winner = bayes_classify (b->texts[i], b->text_lens[i], &b->dbset->dt,
+			       bw->class, num_classes, b->w, b->flags,
+			       b->min_pmax_pmin_ratio,
+			       &b->ptc[i * num_classes], ptt, bw->errmsg);
+      if (winner < 0)
+	{
+	  bw->err = -1;
+	  bw->err_text = i;
+	  break;
+	}
+      b->winners[i] = winner;
+    }
+
+  return NULL;
+}
+
+/**********************************************************/
+/* Classify "num_texts" texts with the classes of an open */
+/* database set. Scoring constants are computed once for  */
+/* the whole batch, and the texts are spread across       */
+/* "num_workers" threads. Class probabilities of text i   */
+/* are returned in ptc[i * num_classes ...].              */
+/**********************************************************/
+int
+osbf_bayes_classify_batch (DBSET_STRUCT * dbset,	/* open database set */
+			   uint32_t num_texts,	/* number of texts */
+			   const unsigned char *texts[],	/* texts */
+			   const unsigned long text_lens[],	/* lengths */
+			   uint32_t flags,	/* flags */
+			   double min_pmax_pmin_ratio,
+			   uint32_t num_workers,	/* number of threads */
+			   /* returned values */
+			   double ptc[],	/* class probs per text */
+			   uint32_t ptt[],	/* number trainings per class */
+			   char *errmsg	/* err message, if any */
+  )
+{
+  struct weights w;
+  struct batch b;
+  struct batch_worker *workers;
+  uint32_t i, t, num_classes, err_text;
+  uint32_t wins[OSBF_MAX_CLASSES];
+  int err = 0;
+
+  if (osbf_check_dbset (dbset, errmsg) != 0)
+    return (-1);
+
+  num_classes = dbset->num_classes;
+  classify_weights (dbset->class, num_classes, &w);
+  for (i = 0; i < num_classes; i++)
+    ptt[i] = w.trainings[i];
+  if (num_texts == 0)
+    return 0;
+
+#ifdef OSBF_NO_THREADS
+  num_workers = 1;
+#endif
+  if (num_workers > OSBF_MAX_WORKERS)
+    num_workers = OSBF_MAX_WORKERS;
+  if (num_workers > num_texts)
+    num_workers = num_texts;
+  if (num_workers < 1)
+    num_workers = 1;
+
+  b.winners = malloc (num_texts * sizeof (int32_t));
+  workers = calloc (num_workers, sizeof (struct batch_worker));
+  if (b.winners == NULL || workers == NULL)
+    {
+      free (b.winners);
+      free (workers);
+      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		"Couldn't allocate memory for batch classification.");
+      return (-1);
+    }
+
+  b.dbset = dbset;
+  b.w = &w;
+  b.num_texts = num_texts;
+  b.texts = texts;
+  b.text_lens = text_lens;
+  b.flags = flags;
+  b.min_pmax_pmin_ratio = min_pmax_pmin_ratio;
+  b.num_workers = num_workers;
+  b.ptc = ptc;
+
+  /*
+   * Classification only reads the mapped buckets, so the workers
+   * share the mappings. Each one has its own copies of the class
+   * structures, though, for the per-text scratch fields and the
+   * seen features sets.
+   */
+  for (t = 0; t < num_workers; t++)
+    {
+      workers[t].b = &b;
+      workers[t].first = t;
+      memcpy (workers[t].class, dbset->class,
+	      num_classes * sizeof (CLASS_STRUCT));
+      for (i = 0; i < num_classes; i++)
+	memset (&workers[t].class[i].bflags, 0, sizeof (BFLAGS_STRUCT));
+    }
+
+#ifndef OSBF_NO_THREADS
+  /* if a thread can't be created, its share is done below */
+  for (t = 1; t < num_workers; t++)
+    workers[t].started =
+      pthread_create (&workers[t].thread, NULL, batch_worker,
+		      &workers[t]) == 0;
+#endif
+
+  batch_worker (&workers[0]);
+
+  for (t = 1; t < num_workers; t++)
+    {
+#ifndef OSBF_NO_THREADS
+      if (workers[t].started)
+	{
+	  pthread_join (workers[t].thread, NULL);
+	  continue;
+	}
 #endif
+      batch_worker (&workers[t]);
+    }
+
+  /* report the error of the first failed text */
+  err_text = num_texts;
+  for (t = 0; t < num_workers; t++)
+    {
+      if (workers[t].err != 0 && workers[t].err_text < err_text)
+	{
+	  err_text = workers[t].err_text;
+	  snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN, "Text %" PRIu32 ": %.400s",
+		    err_text + 1, workers[t].errmsg);
+	  err = -1;
+	}
+      for (i = 0; i < num_classes; i++)
+	osbf_bflags_free (&workers[t].class[i].bflags);
+    }
+
+  /* update the classifications counters once per class */
+  if (err == 0 && (flags & COUNT_CLASSIFICATIONS))
+    {
+      memset (wins, 0, sizeof (wins));
+      for (i = 0; i < num_texts; i++)
+	wins[b.winners[i]]++;
+      for (i = 0; i < num_classes && err == 0; i++)
+	if (wins[i] > 0)
+	  err = osbf_count_classifications (&dbset->class[i], wins[i],
+					    errmsg);
+    }
 
+  free (b.winners);
+  free (workers);
   return (err);
 }
@@ -0,0 +1,811 @@
+/*
+ * osbf_corpus.c
+ *
+ * This software is licensed to the public under the Free Software
+ * Foundation's GNU GPL, version 2.  You may obtain a copy of the
+ * GPL by visiting the Free Software Foundations web site at
+ * www.fsf.org, and a copy is included in this distribution.
+ *
+ * Read the HISTORY_AND_AGREEMENT for details.
+ *
+ */
+
+/*
+ * Corpus runner: trains and evaluates a database set with a TREC style
+ * corpus, the same way spamfilter/toer.lua does, but with the databases
+ * kept mapped for the whole run. A reader thread reads the messages
+ * ahead, worker threads extract their features, and the caller trains
+ * them strictly in the order of the index, so the results don't depend
+ * on the number of threads.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <float.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifndef OSBF_NO_THREADS
+#include <pthread.h>
+#endif
+
+#include "osbflib.h"
+
+/* states of a message in the queue */
+#define MSG_FREE 0
+#define MSG_READ 1		/* read, waiting for a tokenizer */
+#define MSG_TOKENIZING 2
+#define MSG_READY 3		/* features extracted */
+
+/* a message of the corpus, from its reading to its training */
+struct corpus_msg
+{
+  int state;
+  char *line;			/* index line, holds the judge */
+  const char *judge;
+  char *file_name;
+  unsigned char *text;
+  unsigned long text_len;
+  unsigned long header_len;
+  OSBF_TEXT_FEATURES_STRUCT text_features, header_features;
+  int err;
+  char errmsg[OSBF_ERROR_MESSAGE_LEN];
+};
+
+/* state shared by the reader, the tokenizers and the learner */
+struct corpus
+{
+  FILE *index;
+  const char *index_name;
+  char *dir;			/* prefix of the message names */
+  uint32_t line;		/* index lines read */
+  const OSBF_CORPUS_PARAMS_STRUCT *params;
+  uint32_t ncfs;
+  DBSET_STRUCT dbset;
+  FILE *log;
+  struct corpus_msg msgs[OSBF_CORPUS_QUEUE];
+  /* message i is in msgs[i % OSBF_CORPUS_QUEUE] */
+  uint32_t read;		/* messages read */
+  uint32_t tokenized;		/* messages taken by tokenizers */
+  uint32_t trained;		/* messages trained */
+  int eof;			/* no more messages will be read */
+  int stop;			/* the learner gave up */
+  int reader_running;
+#ifndef OSBF_NO_THREADS
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+#endif
+};
+
+#ifndef OSBF_NO_THREADS
+#define CORPUS_LOCK(c) pthread_mutex_lock (&(c)->lock)
+#define CORPUS_UNLOCK(c) pthread_mutex_unlock (&(c)->lock)
+#define CORPUS_WAIT(c) pthread_cond_wait (&(c)->changed, &(c)->lock)
+#define CORPUS_CHANGED(c) pthread_cond_broadcast (&(c)->changed)
+#else
+#define CORPUS_LOCK(c)
+#define CORPUS_UNLOCK(c)
+#define CORPUS_WAIT(c)
+#define CORPUS_CHANGED(c)
+#endif
+
+/*****************************************************************/
+
+/* default parameters, those of toer.lua */
+void
+osbf_corpus_defaults (OSBF_CORPUS_PARAMS_STRUCT * params)
+{
+  params->threshold_offset = 5;
+  params->thick_threshold = 20;
+  params->header_learn_threshold = 14;
+  params->reinforcement_degree = 0.6;
+  params->threshold_reinforcement_degree = 1.5;
+  params->ham_reinforcement_limit = 4;
+  params->spam_reinforcement_limit = 4;
+  params->max_text_size = 500000;
+  params->testsize = 1000;
+  params->train_in_testset = 1;
+  params->nonspam_index = 0;
+  params->spam_index = 1;
+  params->min_pmax_pmin_ratio = OSBF_MIN_PMAX_PMIN_RATIO;
+  params->pR_scf = 0.59;
+  params->num_workers = OSBF_CORPUS_WORKERS;
+  params->training_log = NULL;
+}
+
+/*****************************************************************/
+
+static void
+free_msg (struct corpus_msg *m)
+{
+  free (m->line);
+  free (m->file_name);
+  free (m->text);
+  osbf_free_text_features (&m->text_features);
+  osbf_free_text_features (&m->header_features);
+  memset (m, 0, sizeof (struct corpus_msg));
+}
+
+/*
+ * Read the next message of the index into m. Returns 1 at the end of
+ * the index, 0 if ok and -1 on error, with the error in m.
+ */
+static int
+read_msg (struct corpus *c, struct corpus_msg *m)
+{
+  size_t size = 0, name_len;
+  ssize_t len;
+  char *name, *p;
+  struct stat st;
+  unsigned long to_read, got = 0;
+  int fd;
+
+  len = getline (&m->line, &size, c->index);
+  if (len < 0)
+    return 1;
+  c->line++;
+
+  /* judge and message name, separated by spaces */
+  while (len > 0 && (m->line[len - 1] == '\n' || m->line[len - 1] == '\r'))
+    m->line[--len] = '\0';
+  p = m->line + strcspn (m->line, " \t");
+  name = p + strspn (p, " \t");
+  name_len = strcspn (name, " \t");
+  if (p == m->line || name_len == 0 || name[name_len] != '\0')
+    {
+      snprintf (m->errmsg, OSBF_ERROR_MESSAGE_LEN,
+		"Invalid line %" PRIu32 " in %s.", c->line, c->index_name);
+      return (m->err = -1);
+    }
+  *p = '\0';
+  m->judge = m->line;
+
+  m->file_name = malloc (strlen (c->dir) + name_len + 1);
+  if (m->file_name == NULL)
+    {
+      snprintf (m->errmsg, OSBF_ERROR_MESSAGE_LEN,
+		"Couldn't allocate memory for message name.");
+      return (m->err = -1);
+    }
+  strcpy (m->file_name, c->dir);
+  strcat (m->file_name, name);
+
+  fd = open (m->file_name, O_RDONLY);
+  if (fd < 0 || fstat (fd, &st) != 0)
+    {
+      snprintf (m->errmsg, OSBF_ERROR_MESSAGE_LEN,
+		"Couldn't open %s: %s", m->file_name, strerror (errno));
+      if (fd >= 0)
+	close (fd);
+      return (m->err = -1);
+    }
+
+  /* only the part that will be used is read */
+  to_read = (unsigned long) st.st_size;
+  if (c->params->max_text_size > 0 && to_read > c->params->max_text_size)
+    to_read = c->params->max_text_size;
+
+  /* room for the first tokens, appended to the end */
+  m->text = malloc (2 * to_read + 2);
+  if (m->text == NULL)
+    {
+      close (fd);
+      snprintf (m->errmsg, OSBF_ERROR_MESSAGE_LEN,
+		"Couldn't allocate memory for %s.", m->file_name);
+      return (m->err = -1);
+    }
+  while (got < to_read)
+    {
+      len = read (fd, m->text + got, to_read - got);
+      if (len < 0 && errno == EINTR)
+	continue;
+      if (len <= 0)
+	break;
+      got += len;
+    }
+  if (len < 0)
+    {
+      snprintf (m->errmsg, OSBF_ERROR_MESSAGE_LEN,
+		"Couldn't read %s: %s", m->file_name, strerror (errno));
+      m->err = -1;
+    }
+  close (fd);
+  m->text_len = got;
+
+  return m->err;
+}
+
+/*
+ * Prepare the text as toer.lua does and extract the features of the
+ * text and of its header. A truncated text loses its last, maybe
+ * partial, token; then its first 4 tokens are appended to it, so that
+ * they're paired with the last ones too.
+ */
+static void
+tokenize_msg (struct corpus *c, struct corpus_msg *m)
+{
+  unsigned char *text = m->text;
+  unsigned long len = m->text_len, j, prefix;
+  int tok;
+  unsigned char *nl;
+
+  if (m->err != 0)
+    return;
+
+  if (c->params->max_text_size > 0)
+    {
+      j = len;
+      while (j > 0 && !isspace (text[j - 1]))
+	j--;
+      /* without spaces, the whole text is kept */
+      if (j > 0)
+	len = j - 1;
+    }
+
+  prefix = 0;
+  for (tok = 0; tok < 4; tok++)
+    {
+      while (prefix < len && isspace (text[prefix]))
+	prefix++;
+      while (prefix < len && !isspace (text[prefix]))
+	prefix++;
+    }
+  text[len] = ' ';
+  memmove (text + len + 1, text, prefix);
+  len += 1 + prefix;
+  text[len] = '\0';
+  m->text_len = len;
+
+  /* the header ends at the first empty line */
+  m->header_len = len;
+  for (nl = text; (nl = memchr (nl, '\n', len - (nl - text))) != NULL &&
+       nl + 1 < text + len; nl++)
+    if (nl[1] == '\n')
+      {
+	m->header_len = nl - text + 1;
+	break;
+      }
+
+  if (osbf_text_features (text, len, &c->dbset.dt, &m->text_features,
+			  m->errmsg) != 0 ||
+      osbf_text_features (text, m->header_len, &c->dbset.dt,
+			  &m->header_features, m->errmsg) != 0)
+    m->err = -1;
+}
+
+/*****************************************************************/
+
+#ifndef OSBF_NO_THREADS
+static void *
+corpus_reader (void *arg)
+{
+  struct corpus *c = (struct corpus *) arg;
+  struct corpus_msg *m;
+  int r;
+
+  CORPUS_LOCK (c);
+  while (!c->stop && !c->eof)
+    {
+      if (c->read - c->trained >= OSBF_CORPUS_QUEUE)
+	{
+	  CORPUS_WAIT (c);
+	  continue;
+	}
+      m = &c->msgs[c->read % OSBF_CORPUS_QUEUE];
+      CORPUS_UNLOCK (c);
+      r = read_msg (c, m);
+      CORPUS_LOCK (c);
+      if (r == 1)
+	{
+	  free_msg (m);
+	  c->eof = 1;
+	}
+      else
+	{
+	  m->state = MSG_READ;
+	  c->read++;
+	  /* the learner stops at the error */
+	  if (r != 0)
+	    c->eof = 1;
+	}
+      CORPUS_CHANGED (c);
+    }
+  CORPUS_UNLOCK (c);
+
+  return NULL;
+}
+
+static void *
+corpus_tokenizer (void *arg)
+{
+  struct corpus *c = (struct corpus *) arg;
+  struct corpus_msg *m;
+
+  CORPUS_LOCK (c);
+  while (!c->stop)
+    {
+      if (c->tokenized < c->read)
+	{
+	  m = &c->msgs[c->tokenized % OSBF_CORPUS_QUEUE];
+	  c->tokenized++;
+	  m->state = MSG_TOKENIZING;
+	  CORPUS_UNLOCK (c);
+	  tokenize_msg (c, m);
+	  CORPUS_LOCK (c);
+	  m->state = MSG_READY;
+	  CORPUS_CHANGED (c);
+	}
+      else if (c->eof)
+	break;
+      else
+	CORPUS_WAIT (c);
+    }
+  CORPUS_UNLOCK (c);
+
+  return NULL;
+}
+#endif
+
+/*
+ * Wait for message "seq" to be ready, reading or tokenizing it here if
+ * there's no thread to do it. Returns NULL at the end of the corpus.
+ */
+static struct corpus_msg *
+next_msg (struct corpus *c, uint32_t seq)
+{
+  struct corpus_msg *m = &c->msgs[seq % OSBF_CORPUS_QUEUE];
+  int r;
+
+  CORPUS_LOCK (c);
+  for (;;)
+    {
+      if (seq < c->read && m->state == MSG_READY)
+	break;
+      if (seq == c->tokenized && seq < c->read)
+	{
+	  c->tokenized++;
+	  m->state = MSG_TOKENIZING;
+	  CORPUS_UNLOCK (c);
+	  tokenize_msg (c, m);
+	  CORPUS_LOCK (c);
+	  m->state = MSG_READY;
+	  CORPUS_CHANGED (c);
+	  continue;
+	}
+      if (seq == c->read && c->eof)
+	{
+	  m = NULL;
+	  break;
+	}
+      if (seq == c->read && !c->reader_running)
+	{
+	  CORPUS_UNLOCK (c);
+	  r = read_msg (c, m);
+	  CORPUS_LOCK (c);
+	  if (r == 1)
+	    {
+	      free_msg (m);
+	      c->eof = 1;
+	    }
+	  else
+	    {
+	      m->state = MSG_READ;
+	      c->read++;
+	      if (r != 0)
+		c->eof = 1;
+	    }
+	  CORPUS_CHANGED (c);
+	  continue;
+	}
+      CORPUS_WAIT (c);
+    }
+  CORPUS_UNLOCK (c);
+
+  return m;
+}
+
+/*****************************************************************/
+
+/* classify the features and return pR, as osbf.classify */
+static int
+corpus_classify (struct corpus *c, const OSBF_TEXT_FEATURES_STRUCT * tf,
+		 double *pR, char *errmsg)
+{
+  double ptc[OSBF_MAX_CLASSES];
+  uint32_t ptt[OSBF_MAX_CLASSES];
+  double p_first_subset, p_second_subset;
+  uint32_t i;
+
+  if (osbf_bayes_classify_features (&c->dbset, tf, 0,
+				    c->params->min_pmax_pmin_ratio, ptc, ptt,
+				    errmsg) < 0)
+    return (-1);
+
+  p_first_subset = p_second_subset = 10 * DBL_MIN;
+  for (i = 0; i < c->dbset.num_classes; i++)
+    if (i < c->ncfs)
+      p_first_subset += ptc[i];
+    else
+      p_second_subset += ptc[i];
+  *pR = c->params->pR_scf * log10 (p_first_subset / p_second_subset);
+
+  return 0;
+}
+
+static int
+corpus_learn (struct corpus *c, const OSBF_TEXT_FEATURES_STRUCT * tf,
+	      uint32_t class_idx, uint32_t flags,
+	      OSBF_CORPUS_RESULTS_STRUCT * r, char *errmsg)
+{
+  r->learnings++;
+  return osbf_bayes_learn_features (&c->dbset, tf, class_idx, 1, flags,
+				    errmsg);
+}
+
+/*
+ * After a training of the whole message moved its score from pR to
+ * new_pR, train its header while the score is still inside the thick
+ * threshold and each training moves it enough. "sense" is 1 towards
+ * nonspam and -1 towards spam.
+ */
+static int
+reinforce_header (struct corpus *c, struct corpus_msg *m, int sense,
+		  double pR, double new_pR, OSBF_CORPUS_RESULTS_STRUCT * r,
+		  char *errmsg)
+{
+  const OSBF_CORPUS_PARAMS_STRUCT *p = c->params;
+  double threshold = p->threshold_offset + sense * p->thick_threshold;
+  double trd = p->threshold_reinforcement_degree * threshold;
+  double rd = p->reinforcement_degree * p->header_learn_threshold;
+  double old_pR;
+  uint32_t i = 0, limit;
+  uint32_t class_idx;
+
+  if (!(sense * new_pR < sense * threshold &&
+	sense * (new_pR - pR) < p->header_learn_threshold))
+    return 0;
+
+  /* toer.lua does one more for hams */
+  if (sense > 0)
+    {
+      class_idx = p->nonspam_index;
+      limit = p->ham_reinforcement_limit + 1;
+    }
+  else
+    {
+      class_idx = p->spam_index;
+      limit = p->spam_reinforcement_limit;
+    }
+
+  do
+    {
+      old_pR = new_pR;
+      if (corpus_learn (c, &m->header_features, class_idx, EXTRA_LEARNING,
+			r, errmsg) != 0 ||
+	  corpus_classify (c, &m->text_features, &new_pR, errmsg) != 0)
+	return (-1);
+      i++;
+    }
+  while (i < limit && sense * new_pR <= sense * trd &&
+	 sense * (new_pR - old_pR) < rd);
+
+  return 0;
+}
+
+/* classify and train a message, in the order of the index */
+static int
+train_msg (struct corpus *c, struct corpus_msg *m, uint32_t start_of_test,
+	   OSBF_CORPUS_RESULTS_STRUCT * r, char *errmsg)
+{
+  const OSBF_CORPUS_PARAMS_STRUCT *p = c->params;
+  double pR, new_pR;
+  int in_testset, train;
+
+  if (corpus_classify (c, &m->text_features, &pR, errmsg) != 0)
+    return (-1);
+
+  r->messages++;
+  in_testset = r->messages >= start_of_test;
+  train = !in_testset || p->train_in_testset;
+
+  if (strcmp (m->judge, "spam") == 0)
+    {
+      r->spams++;
+      if (in_testset)
+	r->spams_test++;
+      if (pR >= 0)
+	{
+	  /* false negative */
+	  r->false_negatives++;
+	  if (train)
+	    {
+	      if (corpus_learn (c, &m->text_features, p->spam_index, 0, r,
+				errmsg) != 0 ||
+		  corpus_classify (c, &m->text_features, &new_pR,
+				   errmsg) != 0)
+		return (-1);
+	      r->trainings++;
+	      if (p->header_learn_threshold > 0 &&
+		  reinforce_header (c, m, -1, pR, new_pR, r, errmsg) != 0)
+		return (-1);
+	    }
+	  if (in_testset)
+	    {
+	      r->false_negatives_test++;
+	      if (p->train_in_testset)
+		r->trainings_test++;
+	    }
+	}
+      else if (pR > p->threshold_offset - p->thick_threshold && train)
+	{
+	  /* correct, but inside the unsure zone */
+	  if (corpus_learn (c, &m->text_features, p->spam_index, 0, r,
+			    errmsg) != 0 ||
+	      corpus_classify (c, &m->text_features, &new_pR, errmsg) != 0 ||
+	      reinforce_header (c, m, -1, pR, new_pR, r, errmsg) != 0)
+	    return (-1);
+	  r->reinforcements++;
+	  if (in_testset)
+	    r->reinforcements_test++;
+	}
+    }
+  else
+    {
+      r->hams++;
+      if (in_testset)
+	r->hams_test++;
+      if (pR < 0)
+	{
+	  /* false positive */
+	  r->false_positives++;
+	  if (train)
+	    {
+	      if (corpus_learn (c, &m->text_features, p->nonspam_index, 0, r,
+				errmsg) != 0)
+		return (-1);
+	      r->trainings++;
+	    }
+	  /* toer.lua reinforces the header even when the text isn't */
+	  /* trained, in a testset without training                  */
+	  if (corpus_classify (c, &m->text_features, &new_pR, errmsg) != 0 ||
+	      reinforce_header (c, m, 1, pR, new_pR, r, errmsg) != 0)
+	    return (-1);
+	  if (in_testset)
+	    {
+	      r->false_positives_test++;
+	      if (p->train_in_testset)
+		r->trainings_test++;
+	    }
+	}
+      else if (pR < p->threshold_offset + p->thick_threshold && train)
+	{
+	  /* correct, but inside the unsure zone */
+	  if (corpus_learn (c, &m->text_features, p->nonspam_index, 0, r,
+			    errmsg) != 0 ||
+	      corpus_classify (c, &m->text_features, &new_pR, errmsg) != 0 ||
+	      reinforce_header (c, m, 1, pR, new_pR, r, errmsg) != 0)
+	    return (-1);
+	  r->reinforcements++;
+	  if (in_testset)
+	    r->reinforcements_test++;
+	}
+    }
+
+  if (c->log != NULL)
+    {
+      fprintf (c->log, "file=%s judge=%s class=%s score=%.4f"
+	       " user= genre= runid=none\n", m->file_name, m->judge,
+	       pR < 0 ? "spam" : "ham", 0 - pR);
+      fflush (c->log);
+    }
+
+  return 0;
+}
+
+/*****************************************************************/
+
+/* number of lines of the index */
+static uint32_t
+count_lines (FILE * f)
+{
+  char buf[8192];
+  size_t len, i;
+  uint32_t lines = 0;
+  char last = '\n';
+
+  while ((len = fread (buf, 1, sizeof (buf), f)) > 0)
+    {
+      for (i = 0; i < len; i++)
+	if (buf[i] == '\n')
+	  lines++;
+      last = buf[len - 1];
+    }
+  if (last != '\n')
+    lines++;
+  rewind (f);
+
+  return lines;
+}
+
+/*****************************************************************/
+
+/*
+ * Train the classes with the messages listed in "index", one per line,
+ * with the judge, "spam" or "ham", and the message file name, relative
+ * to the directory of the index. The results are counted in "results"
+ * and, if params->training_log is given, each message is logged there
+ * in the format of toer.lua.
+ */
+int
+osbf_run_corpus (const char *index, const char *classnames[],
+		 const char *delims, uint32_t ncfs,
+		 const OSBF_CORPUS_PARAMS_STRUCT * params,
+		 OSBF_CORPUS_RESULTS_STRUCT * results, char *errmsg)
+{
+  struct corpus *c;
+  struct corpus_msg *m;
+  uint32_t i, seq, total, start_of_test;
+  const char *slash;
+  struct timespec ini, end;
+  char scratch[OSBF_ERROR_MESSAGE_LEN];
+  int err = 0;
+#ifndef OSBF_NO_THREADS
+  pthread_t reader, workers[OSBF_MAX_WORKERS];
+  uint32_t num_workers, started = 0;
+#endif
+
+  memset (results, 0, sizeof (OSBF_CORPUS_RESULTS_STRUCT));
+  clock_gettime (CLOCK_MONOTONIC, &ini);
+
+  c = calloc (1, sizeof (struct corpus));
+  if (c == NULL)
+    {
+      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		"Couldn't allocate memory for the corpus.");
+      return (-1);
+    }
+  c->params = params;
+  c->index_name = index;
+
+  if (params->nonspam_index >= OSBF_MAX_CLASSES ||
+      params->spam_index >= OSBF_MAX_CLASSES ||
+      classnames[params->nonspam_index] == NULL ||
+      classnames[params->spam_index] == NULL)
+    {
+      free (c);
+      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		"Invalid nonspam or spam class index.");
+      return (-1);
+    }
+
+  c->index = fopen (index, "r");
+  if (c->index == NULL)
+    {
+      free (c);
+      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN, "Couldn't open %s: %s",
+		index, strerror (errno));
+      return (-1);
+    }
+
+  slash = strrchr (index, '/');
+  c->dir = malloc (slash != NULL ? slash - index + 2 : 1);
+  if (c->dir == NULL)
+    {
+      fclose (c->index);
+      free (c);
+      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		"Couldn't allocate memory for the corpus.");
+      return (-1);
+    }
+  if (slash != NULL)
+    {
+      memcpy (c->dir, index, slash - index + 1);
+      c->dir[slash - index + 1] = '\0';
+    }
+  else
+    c->dir[0] = '\0';
+
+  err = osbf_open_dbset (&c->dbset, classnames, delims, O_RDWR, errmsg);
+  if (err != 0)
+    {
+      fclose (c->index);
+      free (c->dir);
+      free (c);
+      return err;
+    }
+  c->ncfs = ncfs < c->dbset.num_classes ? ncfs : c->dbset.num_classes;
+
+  if (params->training_log != NULL)
+    {
+      c->log = fopen (params->training_log, "w");
+      if (c->log == NULL)
+	{
+	  snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN, "Couldn't open %s: %s",
+		    params->training_log, strerror (errno));
+	  osbf_close_dbset (&c->dbset, scratch);
+	  fclose (c->index);
+	  free (c->dir);
+	  free (c);
+	  return (-1);
+	}
+    }
+
+  /* the final testsize messages form the testset */
+  total = count_lines (c->index);
+  start_of_test = total >= params->testsize ?
+    total - params->testsize + 1 : 1;
+
+#ifndef OSBF_NO_THREADS
+  num_workers = params->num_workers;
+  if (num_workers > OSBF_MAX_WORKERS)
+    num_workers = OSBF_MAX_WORKERS;
+  pthread_mutex_init (&c->lock, NULL);
+  pthread_cond_init (&c->changed, NULL);
+  /* without a thread, the learner does its job */
+  c->reader_running =
+    pthread_create (&reader, NULL, corpus_reader, c) == 0;
+  for (started = 0; started < num_workers; started++)
+    if (pthread_create (&workers[started], NULL, corpus_tokenizer, c) != 0)
+      break;
+#endif
+
+  for (seq = 0; err == 0 && (m = next_msg (c, seq)) != NULL; seq++)
+    {
+      if (m->err != 0)
+	{
+	  strcpy (errmsg, m->errmsg);
+	  err = -1;
+	}
+      else
+	err = train_msg (c, m, start_of_test, results, errmsg);
+
+      CORPUS_LOCK (c);
+      free_msg (m);
+      c->trained++;
+      CORPUS_CHANGED (c);
+      CORPUS_UNLOCK (c);
+    }
+
+  CORPUS_LOCK (c);
+  c->stop = 1;
+  CORPUS_CHANGED (c);
+  CORPUS_UNLOCK (c);
+#ifndef OSBF_NO_THREADS
+  if (c->reader_running)
+    pthread_join (reader, NULL);
+  for (i = 0; i < started; i++)
+    pthread_join (workers[i], NULL);
+  pthread_cond_destroy (&c->changed);
+  pthread_mutex_destroy (&c->lock);
+#endif
+
+  /* messages read ahead of an error */
+  for (i = 0; i < OSBF_CORPUS_QUEUE; i++)
+    free_msg (&c->msgs[i]);
+
+  if (c->log != NULL && fclose (c->log) != 0 && err == 0)
+    {
+      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN, "Couldn't write %s: %s",
+		params->training_log, strerror (errno));
+      err = -1;
+    }
+  if (osbf_close_dbset (&c->dbset, err == 0 ? errmsg : scratch) != 0 &&
+      err == 0)
+    err = -1;
+  fclose (c->index);
+  free (c->dir);
+  free (c);
+
+  clock_gettime (CLOCK_MONOTONIC, &end);
+  results->duration = (end.tv_sec - ini.tv_sec) +
+    (end.tv_nsec - ini.tv_nsec) / 1e9;
+
+  return err;
+}
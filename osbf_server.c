@@ -0,0 +1,720 @@
+/*
+ * osbf_server.c
+ *
+ * This software is licensed to the public under the Free Software
+ * Foundation's GNU GPL, version 2.  You may obtain a copy of the
+ * GPL by visiting the Free Software Foundations web site at
+ * www.fsf.org, and a copy is included in this distribution.
+ *
+ * Read the HISTORY_AND_AGREEMENT for details.
+ *
+ */
+
+/*
+ * Classification server: keeps the classes of a database set mapped
+ * and answers classify, learn, unlearn and stats requests of local
+ * clients over a Unix domain socket, so that each message filtered
+ * doesn't pay for loading the scripts and mapping the databases.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <time.h>
+#ifndef OSBF_NO_THREADS
+#include <pthread.h>
+#endif
+
+#include "osbflib.h"
+
+/*
+ * State shared by the dispatcher and the workers of a server. The
+ * dispatcher polls the idle connections and queues the ones with a
+ * request in ready; a worker serves one request of a connection and
+ * hands it back in served. An idle connection doesn't hold a worker.
+ */
+struct server
+{
+  int listen_fd;
+  int wake_fd[2];		/* pipe waking up the dispatcher */
+  volatile int stop;		/* set by a shutdown request */
+  /* a ring and a stack of up to OSBF_SERVER_MAX_CONNECTIONS fds */
+  int *ready, *served;
+  uint32_t first_ready, num_ready, num_served;
+  uint32_t num_connections;	/* accepted and not closed */
+  uint32_t ncfs;
+  const char **classnames;
+  const char *delims;
+  /* trainings go through this dbset, one at a time: file locks */
+  /* don't exclude threads of the same process                   */
+  DBSET_STRUCT trainer;
+#ifndef OSBF_NO_THREADS
+  pthread_mutex_t train_lock;
+  pthread_mutex_t queue_lock;	/* protects the rings and counters */
+  pthread_cond_t queue_cond;	/* signaled when a request is ready */
+#endif
+};
+
+/* a worker serves one request at a time, with its own mappings */
+struct server_worker
+{
+  struct server *s;
+  DBSET_STRUCT dbset;
+  unsigned char *text;		/* request buffer */
+  uint32_t text_size;
+#ifndef OSBF_NO_THREADS
+  pthread_t thread;
+  int started;
+#endif
+};
+
+#ifndef OSBF_NO_THREADS
+#define TRAIN_LOCK(s) pthread_mutex_lock (&(s)->train_lock)
+#define TRAIN_UNLOCK(s) pthread_mutex_unlock (&(s)->train_lock)
+#define QUEUE_LOCK(s) pthread_mutex_lock (&(s)->queue_lock)
+#define QUEUE_UNLOCK(s) pthread_mutex_unlock (&(s)->queue_lock)
+#else
+#define TRAIN_LOCK(s)
+#define TRAIN_UNLOCK(s)
+#define QUEUE_LOCK(s)
+#define QUEUE_UNLOCK(s)
+#endif
+
+/* how long the rest of a request is waited for, in seconds */
+#define SERVER_REQUEST_TIMEOUT 10
+/* how often a read checks that timeout, in seconds */
+#define SERVER_READ_CHECK 1
+
+/*****************************************************************/
+
+/*
+ * Read exactly len bytes, 0 if ok, -1 on error, end of file or, if
+ * deadline isn't 0, when it's passed.
+ */
+static int
+read_full (int fd, void *buf, size_t len, time_t deadline)
+{
+  size_t got = 0;
+  ssize_t r;
+
+  while (got < len)
+    {
+      if (deadline != 0 && time (NULL) > deadline)
+	return -1;
+      r = read (fd, (char *) buf + got, len - got);
+      if (r > 0)
+	got += (size_t) r;
+      else if (r < 0 && errno == EINTR)
+	continue;
+      else if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) &&
+	       deadline != 0)
+	continue;
+      else
+	return -1;
+    }
+  return 0;
+}
+
+/* wake up the dispatcher, waiting in poll */
+static void
+wake_dispatcher (struct server *s)
+{
+  char c = 0;
+
+  while (write (s->wake_fd[1], &c, 1) < 0 && errno == EINTR)
+    ;
+}
+
+/* write exactly len bytes, 0 if ok */
+static int
+write_full (int fd, const void *buf, size_t len)
+{
+  size_t done = 0;
+  ssize_t r;
+
+  while (done < len)
+    {
+      r = send (fd, (const char *) buf + done, len - done, MSG_NOSIGNAL);
+      if (r > 0)
+	done += (size_t) r;
+      else if (r < 0 && errno == EINTR)
+	continue;
+      else
+	return -1;
+    }
+  return 0;
+}
+
+static int
+send_reply (int fd, struct server *s, int32_t status, const void *data,
+	    uint32_t len)
+{
+  OSBF_REPLY_STRUCT reply;
+
+  memset (&reply, 0, sizeof (reply));
+  reply.magic = OSBF_SERVER_MAGIC;
+  reply.status = status;
+  reply.num_classes = s->trainer.num_classes;
+  reply.ncfs = s->ncfs;
+  reply.len = len;
+  if (write_full (fd, &reply, sizeof (reply)) != 0)
+    return -1;
+  if (len > 0 && write_full (fd, data, len) != 0)
+    return -1;
+  return 0;
+}
+
+static int
+send_error (int fd, struct server *s, const char *errmsg)
+{
+  return send_reply (fd, s, -1, errmsg, (uint32_t) strlen (errmsg) + 1);
+}
+
+/*****************************************************************/
+
+/* answer a request, 0 if the connection can go on */
+static int
+serve_request (int fd, struct server_worker *w, OSBF_REQUEST_STRUCT * req)
+{
+  struct server *s = w->s;
+  uint32_t num_classes = s->trainer.num_classes;
+  /* probabilities, then trainings */
+  unsigned char result[OSBF_MAX_CLASSES * (sizeof (double) +
+					   sizeof (uint32_t))];
+  double ptc[OSBF_MAX_CLASSES];
+  uint32_t ptt[OSBF_MAX_CLASSES];
+  STATS_STRUCT stats;
+  char errmsg[OSBF_ERROR_MESSAGE_LEN] = { '\0' };
+  int err;
+
+  switch (req->op)
+    {
+    case OSBF_OP_CLASSIFY:
+      /* the counter is updated with an atomic add, without locks */
+      err = osbf_bayes_classify_dbset (&w->dbset, w->text, req->text_len,
+				       req->flags, req->min_pmax_pmin_ratio,
+				       ptc, ptt, errmsg);
+      if (err < 0)
+	return send_error (fd, s, errmsg);
+      memcpy (result, ptc, num_classes * sizeof (double));
+      memcpy (result + num_classes * sizeof (double), ptt,
+	      num_classes * sizeof (uint32_t));
+      return send_reply (fd, s, 0, result, num_classes *
+			 (sizeof (double) + sizeof (uint32_t)));
+
+    case OSBF_OP_LEARN:
+    case OSBF_OP_UNLEARN:
+      TRAIN_LOCK (s);
+      err = osbf_bayes_learn_dbset (&s->trainer, w->text, req->text_len,
+				    req->class_idx,
+				    req->op == OSBF_OP_LEARN ? 1 : -1,
+				    req->flags, errmsg);
+      TRAIN_UNLOCK (s);
+      if (err < 0)
+	return send_error (fd, s, errmsg);
+      return send_reply (fd, s, 0, NULL, 0);
+
+    case OSBF_OP_STATS:
+      if (req->class_idx >= num_classes)
+	{
+	  snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		    "Invalid class index: %" PRIu32, req->class_idx + 1);
+	  return send_error (fd, s, errmsg);
+	}
+      if (osbf_stats (s->classnames[req->class_idx],
+		      osbf_class_column (s->classnames, req->class_idx),
+		      &stats, errmsg, req->flags != 0) != 0)
+	return send_error (fd, s, errmsg);
+      return send_reply (fd, s, 0, &stats, sizeof (stats));
+
+    case OSBF_OP_SHUTDOWN:
+      s->stop = 1;
+      wake_dispatcher (s);
+      send_reply (fd, s, 0, NULL, 0);
+      return -1;
+
+    default:
+      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		"Invalid request: %" PRIu32, req->op);
+      send_error (fd, s, errmsg);
+      return -1;
+    }
+}
+
+/* serve the next request of a connection, 0 if it can go on */
+static int
+serve_connection (int fd, struct server_worker *w)
+{
+  OSBF_REQUEST_STRUCT req;
+  unsigned char *more;
+  time_t deadline = time (NULL) + SERVER_REQUEST_TIMEOUT;
+
+  if (read_full (fd, &req, sizeof (req), deadline) != 0)
+    return -1;
+  if (req.magic != OSBF_SERVER_MAGIC || req.text_len > OSBF_SERVER_MAX_TEXT)
+    {
+      send_error (fd, w->s, "Invalid request.");
+      return -1;
+    }
+  if (req.text_len + 1 > w->text_size)
+    {
+      more = realloc (w->text, req.text_len + 1);
+      if (more == NULL)
+	{
+	  send_error (fd, w->s, "Couldn't allocate memory for the text.");
+	  return -1;
+	}
+      w->text = more;
+      w->text_size = req.text_len + 1;
+    }
+  if (read_full (fd, w->text, req.text_len, deadline) != 0)
+    return -1;
+  w->text[req.text_len] = '\0';
+  return serve_request (fd, w, &req);
+}
+
+#ifndef OSBF_NO_THREADS
+/* give a connection back to the dispatcher, or close it */
+static void
+connection_served (struct server *s, int fd, int err)
+{
+  QUEUE_LOCK (s);
+  if (err != 0 || s->stop)
+    {
+      close (fd);
+      s->num_connections--;
+    }
+  else
+    s->served[s->num_served++] = fd;
+  QUEUE_UNLOCK (s);
+  wake_dispatcher (s);
+}
+
+static void *
+serve_worker (void *arg)
+{
+  struct server_worker *w = (struct server_worker *) arg;
+  struct server *s = w->s;
+  int fd;
+
+  for (;;)
+    {
+      QUEUE_LOCK (s);
+      while (s->num_ready == 0 && !s->stop)
+	pthread_cond_wait (&s->queue_cond, &s->queue_lock);
+      if (s->stop)
+	{
+	  QUEUE_UNLOCK (s);
+	  break;
+	}
+      fd = s->ready[s->first_ready];
+      s->first_ready = (s->first_ready + 1) % OSBF_SERVER_MAX_CONNECTIONS;
+      s->num_ready--;
+      QUEUE_UNLOCK (s);
+
+      connection_served (s, fd, serve_connection (fd, w));
+    }
+  return NULL;
+}
+#endif
+
+/*
+ * Accept connections and hand their requests to the workers, one at
+ * a time, until a shutdown request. Without workers, the requests are
+ * served here, by w. Returns the connections left in conns.
+ */
+static uint32_t
+dispatch (struct server *s, struct server_worker *w, int *conns,
+	  struct pollfd *pfd)
+{
+  uint32_t num_conns = 0, keep, i, n, open;
+  struct timeval tv;
+  int fd, flags;
+  char buf[64];
+
+  tv.tv_sec = SERVER_READ_CHECK;
+  tv.tv_usec = 0;
+
+  while (!s->stop)
+    {
+      /* take back the connections served */
+      QUEUE_LOCK (s);
+      while (s->num_served > 0)
+	conns[num_conns++] = s->served[--s->num_served];
+      open = s->num_connections;
+      QUEUE_UNLOCK (s);
+
+      pfd[0].fd = s->wake_fd[0];
+      pfd[0].events = POLLIN;
+      /* the listening socket waits while there are too many connections */
+      pfd[1].fd = open < OSBF_SERVER_MAX_CONNECTIONS ? s->listen_fd : -1;
+      pfd[1].events = POLLIN;
+      for (i = 0; i < num_conns; i++)
+	{
+	  pfd[i + 2].fd = conns[i];
+	  pfd[i + 2].events = POLLIN;
+	}
+      n = num_conns + 2;
+      if (poll (pfd, n, -1) < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  break;
+	}
+      if (pfd[0].revents != 0)
+	while (read (s->wake_fd[0], buf, sizeof (buf)) > 0)
+	  ;
+      if (s->stop)
+	break;
+
+      /* connections with a request, or closed, go to the workers */
+      for (i = keep = 0; i < num_conns; i++)
+	if (pfd[i + 2].revents == 0)
+	  conns[keep++] = conns[i];
+	else if (w != NULL)
+	  {
+	    if (serve_connection (conns[i], w) == 0 && !s->stop)
+	      conns[keep++] = conns[i];
+	    else
+	      {
+		close (conns[i]);
+		s->num_connections--;
+	      }
+	  }
+	else
+	  {
+#ifndef OSBF_NO_THREADS
+	    QUEUE_LOCK (s);
+	    s->ready[(s->first_ready + s->num_ready) %
+		     OSBF_SERVER_MAX_CONNECTIONS] = conns[i];
+	    s->num_ready++;
+	    pthread_cond_signal (&s->queue_cond);
+	    QUEUE_UNLOCK (s);
+#endif
+	  }
+      num_conns = keep;
+
+      if (pfd[1].fd >= 0 && pfd[1].revents != 0)
+	{
+	  fd = accept (s->listen_fd, NULL, NULL);
+	  if (fd >= 0)
+	    {
+	      /* the listening socket doesn't block, the connections do */
+	      flags = fcntl (fd, F_GETFL);
+	      if (flags >= 0)
+		fcntl (fd, F_SETFL, flags & ~O_NONBLOCK);
+	      setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+	      QUEUE_LOCK (s);
+	      s->num_connections++;
+	      QUEUE_UNLOCK (s);
+	      conns[num_conns++] = fd;
+	    }
+	}
+    }
+  return num_conns;
+}
+
+/*****************************************************************/
+
+/* create the listening socket, replacing a stale one */
+static int
+server_socket (const char *socket_path, char *errmsg)
+{
+  struct sockaddr_un addr;
+  int fd, errsv;
+
+  if (strlen (socket_path) >= sizeof (addr.sun_path))
+    {
+      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		"Socket path too long: %s", socket_path);
+      return -1;
+    }
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  strcpy (addr.sun_path, socket_path);
+
+  /* a socket nobody listens to is left by a server that died */
+  fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (fd >= 0 && connect (fd, (struct sockaddr *) &addr, sizeof (addr)) == 0)
+    {
+      close (fd);
+      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		"A server is already running on %s.", socket_path);
+      return -1;
+    }
+  errsv = errno;
+  if (fd >= 0)
+    close (fd);
+  if (errsv == ECONNREFUSED)
+    unlink (socket_path);
+
+  fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || bind (fd, (struct sockaddr *) &addr, sizeof (addr)) != 0 ||
+      listen (fd, 64) != 0)
+    {
+      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		"Couldn't listen on %s: %s", socket_path, strerror (errno));
+      if (fd >= 0)
+	close (fd);
+      return -1;
+    }
+  /* a client gone before it's accepted doesn't block the dispatcher */
+  fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+  return fd;
+}
+
+/* the pipe waking up the dispatcher, which never blocks */
+static int
+wake_pipe (int wake_fd[2], char *errmsg)
+{
+  int i;
+
+  if (pipe (wake_fd) != 0)
+    {
+      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		"Couldn't create the server pipe: %s", strerror (errno));
+      return -1;
+    }
+  for (i = 0; i < 2; i++)
+    fcntl (wake_fd[i], F_SETFL, fcntl (wake_fd[i], F_GETFL) | O_NONBLOCK);
+  return 0;
+}
+
+/******************************************************************/
+/* Serve the classes of a database set on a Unix domain socket,   */
+/* num_workers requests at once, until a shutdown request.        */
+/******************************************************************/
+int
+osbf_serve (const char *socket_path,	/* socket to listen on */
+	    const char *classnames[],	/* class file names */
+	    const char *delims,	/* token delimiters */
+	    uint32_t ncfs,	/* classes in the first subset */
+	    uint32_t num_workers,	/* requests served at once */
+	    char *errmsg)
+{
+  struct server s;
+  struct server_worker *workers;
+  int *conns;
+  struct pollfd *pfd;
+  uint32_t t, opened, num_conns, started = 0;
+  char scratch[OSBF_ERROR_MESSAGE_LEN];
+  int err = 0;
+
+#ifdef OSBF_NO_THREADS
+  num_workers = 1;
+#endif
+  if (num_workers < 1)
+    num_workers = 1;
+  if (num_workers > OSBF_SERVER_MAX_WORKERS)
+    num_workers = OSBF_SERVER_MAX_WORKERS;
+
+  memset (&s, 0, sizeof (s));
+  s.ncfs = ncfs;
+  s.delims = delims;
+  if (osbf_open_dbset (&s.trainer, classnames, delims, O_RDWR, errmsg) != 0)
+    return -1;
+  /* the caller's names may go away, the dbset keeps copies */
+  s.classnames = (const char **) s.trainer.classnames;
+
+  workers = calloc (num_workers, sizeof (struct server_worker));
+  s.ready = malloc (OSBF_SERVER_MAX_CONNECTIONS * sizeof (int));
+  s.served = malloc (OSBF_SERVER_MAX_CONNECTIONS * sizeof (int));
+  conns = malloc (OSBF_SERVER_MAX_CONNECTIONS * sizeof (int));
+  pfd = malloc ((OSBF_SERVER_MAX_CONNECTIONS + 2) * sizeof (struct pollfd));
+  if (workers == NULL || s.ready == NULL || s.served == NULL ||
+      conns == NULL || pfd == NULL)
+    {
+      free (workers);
+      free (s.ready);
+      free (s.served);
+      free (conns);
+      free (pfd);
+      osbf_close_dbset (&s.trainer, scratch);
+      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		"Couldn't allocate memory for the server.");
+      return -1;
+    }
+
+  /* each worker maps the classes on its own, so remapping a */
+  /* replaced file doesn't pull them from under the others   */
+  for (opened = 0; opened < num_workers && err == 0; opened++)
+    {
+      workers[opened].s = &s;
+      err = osbf_open_dbset (&workers[opened].dbset, classnames, delims,
+			     O_RDONLY, errmsg);
+    }
+  if (err != 0)
+    opened--;
+  else if (wake_pipe (s.wake_fd, errmsg) != 0)
+    err = -1;
+  else
+    {
+      s.listen_fd = server_socket (socket_path, errmsg);
+      if (s.listen_fd < 0)
+	{
+	  close (s.wake_fd[0]);
+	  close (s.wake_fd[1]);
+	  err = -1;
+	}
+    }
+
+  if (err == 0)
+    {
+#ifndef OSBF_NO_THREADS
+      pthread_mutex_init (&s.train_lock, NULL);
+      pthread_mutex_init (&s.queue_lock, NULL);
+      pthread_cond_init (&s.queue_cond, NULL);
+      /* if a thread can't be created, there's one worker less */
+      for (t = 0; t < num_workers; t++)
+	{
+	  workers[t].started =
+	    pthread_create (&workers[t].thread, NULL, serve_worker,
+			    &workers[t]) == 0;
+	  if (workers[t].started)
+	    started++;
+	}
+#endif
+      /* without worker threads, the dispatcher serves the requests */
+      num_conns = dispatch (&s, started > 0 ? NULL : &workers[0], conns,
+			    pfd);
+      QUEUE_LOCK (&s);
+      s.stop = 1;
+#ifndef OSBF_NO_THREADS
+      pthread_cond_broadcast (&s.queue_cond);
+#endif
+      QUEUE_UNLOCK (&s);
+#ifndef OSBF_NO_THREADS
+      for (t = 0; t < num_workers; t++)
+	if (workers[t].started)
+	  pthread_join (workers[t].thread, NULL);
+      pthread_cond_destroy (&s.queue_cond);
+      pthread_mutex_destroy (&s.queue_lock);
+      pthread_mutex_destroy (&s.train_lock);
+#endif
+      /* the connections still open */
+      for (t = 0; t < num_conns; t++)
+	close (conns[t]);
+      for (t = 0; t < s.num_ready; t++)
+	close (s.ready[(s.first_ready + t) % OSBF_SERVER_MAX_CONNECTIONS]);
+      for (t = 0; t < s.num_served; t++)
+	close (s.served[t]);
+      close (s.listen_fd);
+      close (s.wake_fd[0]);
+      close (s.wake_fd[1]);
+      unlink (socket_path);
+    }
+
+  for (t = 0; t < opened; t++)
+    {
+      osbf_close_dbset (&workers[t].dbset, scratch);
+      free (workers[t].text);
+    }
+  free (workers);
+  free (s.ready);
+  free (s.served);
+  free (conns);
+  free (pfd);
+  osbf_close_dbset (&s.trainer, scratch);
+
+  return err;
+}
+
+/*****************************************************************/
+
+/* connect to a server, returns the socket or -1 */
+int
+osbf_connect (const char *socket_path, char *errmsg)
+{
+  struct sockaddr_un addr;
+  int fd;
+
+  if (strlen (socket_path) >= sizeof (addr.sun_path))
+    {
+      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		"Socket path too long: %s", socket_path);
+      return -1;
+    }
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  strcpy (addr.sun_path, socket_path);
+
+  fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect (fd, (struct sockaddr *) &addr, sizeof (addr)) != 0)
+    {
+      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		"Couldn't connect to %s: %s", socket_path, strerror (errno));
+      if (fd >= 0)
+	close (fd);
+      return -1;
+    }
+  return fd;
+}
+
+/*
+ * Send a request to a server and wait for its reply. Up to data_size
+ * bytes of the data that follow the reply are stored in data. Returns
+ * 0 if ok, -1 if the server couldn't be reached, or the status of the
+ * reply, with errmsg set.
+ */
+int
+osbf_server_request (int fd, OSBF_REQUEST_STRUCT * request,
+		     const unsigned char *text, OSBF_REPLY_STRUCT * reply,
+		     void *data, uint32_t data_size, char *errmsg)
+{
+  char buf[OSBF_ERROR_MESSAGE_LEN], skip[256];
+  uint32_t len, chunk;
+
+  request->magic = OSBF_SERVER_MAGIC;
+  if (write_full (fd, request, sizeof (*request)) != 0 ||
+      (request->text_len > 0 &&
+       write_full (fd, text, request->text_len) != 0) ||
+      read_full (fd, reply, sizeof (*reply), 0) != 0 ||
+      reply->magic != OSBF_SERVER_MAGIC)
+    {
+      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		"Lost the connection to the server.");
+      return -1;
+    }
+
+  if (reply->status < 0)
+    {
+      data = buf;
+      data_size = sizeof (buf) - 1;
+    }
+  len = reply->len;
+  chunk = len < data_size ? len : data_size;
+  if (read_full (fd, data, chunk, 0) != 0)
+    {
+      snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		"Lost the connection to the server.");
+      return -1;
+    }
+  /* skip what doesn't fit */
+  for (len -= chunk; len > 0; len -= chunk)
+    {
+      chunk = len < sizeof (skip) ? len : sizeof (skip);
+      if (read_full (fd, skip, chunk, 0) != 0)
+	{
+	  snprintf (errmsg, OSBF_ERROR_MESSAGE_LEN,
+		    "Lost the connection to the server.");
+	  return -1;
+	}
+    }
+
+  if (reply->status < 0)
+    {
+      buf[reply->len < sizeof (buf) ? reply->len : sizeof (buf) - 1] = '\0';
+      strncpy (errmsg, buf, OSBF_ERROR_MESSAGE_LEN);
+      return reply->status;
+    }
+  return 0;
+}
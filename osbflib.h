@@ -12,6 +12,7 @@
 
 #include <float.h>
 #include <inttypes.h>
+#include <sys/types.h>
 
 typedef struct
 {
@@ -23,15 +24,125 @@ typedef struct
 typedef struct
 {
   uint32_t version;		/* database version */
-  uint32_t db_flags;		/* for future use */
+  uint32_t db_flags;		/* OSBF_DB_* flags */
   uint32_t buckets_start;	/* offset to first bucket in bucket size units */
   uint32_t num_buckets;		/* number of buckets in the file */
   uint32_t learnings;		/* number of trainings done */
   uint32_t mistakes;		/* number of wrong classifications */
   uint64_t classifications;	/* number of classifications */
   uint32_t extra_learnings;	/* number of extra trainings done */
+  uint32_t num_classes;		/* classes in a multi-class file */
 } OSBF_HEADER_STRUCT;
 
+/*
+ * A multi-class file (version OSBF_MC_VERSION) starts with one header
+ * per class, followed by buckets with a hash, a key and one count per
+ * class, so a single probe finds a feature in all classes:
+ *
+ *   hash | key | count[0] | ... | count[num_classes - 1]
+ *
+ * buckets_start is in units of this bucket size. A bucket is in a
+ * chain if any of its counts is not zero.
+ */
+
+/*
+ * A packed file (version OSBF_PACKED_VERSION) is a single-class file
+ * with 16-bit counts, whose buckets are grouped in 64-byte lines, so
+ * no bucket straddles a cache line:
+ *
+ *   hash[0..5] | key[0..5] | count[0..5] (16 bits) | 4 bytes unused
+ *
+ * buckets_start is in units of lines, and the last line may be only
+ * partially used.
+ */
+
+/*
+ * A frozen file (version OSBF_FROZEN_VERSION) is a read-only snapshot
+ * of a dbset, made by osbf_freeze. It starts with one header per
+ * class, like a multi-class file, followed by an OSBF_FROZEN_STRUCT.
+ * Then come the used features only, with 16-bit counts of all classes:
+ *
+ *   hash | key | count[0] | ... | count[num_classes - 1] | padding
+ *
+ * padded to 32 bits. buckets_start is in units of this size and
+ * num_buckets is the number of features. A feature is found by a
+ * minimal perfect hash: its 64-bit hash selects a pilot, which with
+ * the hash gives a position in [0, table_size). Positions beyond
+ * num_buckets are remapped to the free ones below it by a table of
+ * 32-bit indexes, so the bucket at the final position must only be
+ * compared with the feature.
+ */
+typedef struct
+{
+  uint64_t seed;		/* seed of the feature hash */
+  uint32_t num_pilots;		/* number of pilots, 16 bits each */
+  uint32_t table_size;		/* number of positions, >= num_buckets */
+  uint64_t pilots_start;	/* offset of the pilots, in bytes */
+  uint64_t remap_start;		/* offset of the remap table, in bytes */
+} OSBF_FROZEN_STRUCT;
+
+/*
+ * A binary snapshot, written by osbf_dump_binary, holds a single class
+ * file in little-endian 32-bit words, so it can be restored in another
+ * architecture. It starts with OSBF_SNAPSHOT_MAGIC and the words
+ *
+ *   snapshot version | version | db_flags | buckets_start | num_buckets
+ *   | learnings | mistakes | classifications (low, high)
+ *   | extra_learnings | num_classes | CRC32C of all the above
+ *
+ * followed by blocks of at most OSBF_SNAPSHOT_BLOCK_RECORDS records,
+ * one per used bucket, in bucket order:
+ *
+ *   number of records | CRC32C of the records | records
+ *
+ * where a record is "gap | hash | key | value", gap being the number
+ * of free buckets before it. A block with no records ends the
+ * snapshot. The fingerprints and the Bloom filter are rebuilt.
+ */
+#define OSBF_SNAPSHOT_MAGIC "OSBFSNAP"
+#define OSBF_SNAPSHOT_VERSION 1
+#define OSBF_SNAPSHOT_HEADER_WORDS 12
+#define OSBF_SNAPSHOT_BLOCK_RECORDS 65536
+
+/* db_flags */
+/* buckets are inserted with Robin Hood displacement, which keeps the
+ * buckets of a chain sorted by their right positions */
+#define OSBF_DB_ROBIN_HOOD 1
+/* the buckets are followed, at the next 64-byte boundary, by an array
+ * of 8-bit fingerprints of their keys, 0 for free buckets, so probes
+ * can check many buckets at once and load only the ones that match */
+#define OSBF_DB_FINGERPRINTS 2
+/* then, at the next 64-byte boundary, by a blocked Bloom filter of the
+ * features: a 64-byte line whose first word counts the buckets freed
+ * since the filter was built, and 64-byte blocks, 8 bits per bucket.
+ * Each feature sets OSBF_BLOOM_HASHES bits in a single block, so a
+ * feature absent from the class costs one line instead of a probe */
+#define OSBF_DB_BLOOM 4
+/* flags known by this version, valid in single class files */
+#define OSBF_DB_KNOWN_FLAGS \
+  (OSBF_DB_ROBIN_HOOD | OSBF_DB_FINGERPRINTS | OSBF_DB_BLOOM)
+
+/* next 64-byte boundary of a file offset */
+#define OSBF_LINE_ALIGN(off) (((off) + 63) / 64 * 64)
+
+/* fingerprint of a key, never 0 */
+#define OSBF_FINGERPRINT(key) \
+  ((unsigned char) ((key) >> 24 ? (key) >> 24 : 1))
+/* size of the fingerprint array, with room for block loads at the end */
+#define OSBF_FINGERPRINTS_SIZE(n) (((off_t) (n) + 63) / 64 * 64 + 64)
+
+#define OSBF_BLOOM_HASHES 6
+#define OSBF_BLOOM_BLOCKS(n) (((off_t) (n) + 63) / 64)
+#define OSBF_BLOOM_SIZE(n) ((OSBF_BLOOM_BLOCKS (n) + 1) * 64)
+/* the filter is rebuilt when a writer unlocks the class after this */
+/* many buckets were freed, which are false positives until then   */
+#define OSBF_BLOOM_MAX_STALE(n) ((n) / 16)
+
+#define OSBF_LINE_SIZE 64
+#define OSBF_LINE_BUCKETS 6
+#define OSBF_LINE_WORDS (OSBF_LINE_SIZE / sizeof (uint32_t))
+#define OSBF_PACKED_BUCKET_SIZE (2 * sizeof (uint32_t) + sizeof (uint16_t))
+
 
 /* define header size to be a multiple of the bucket size, approx. 4 Kbytes */
 #define OSBF_CFC_HEADER_SIZE (4096 / sizeof(OSBF_BUCKET_STRUCT))
@@ -45,15 +156,70 @@ typedef union
   OSBF_BUCKET_STRUCT bih[OSBF_CFC_HEADER_SIZE];
 } OSBF_HEADER_BUCKET_UNION;
 
+/* bucket flags of the buckets touched by the current document */
+typedef struct
+{
+  uint32_t bindex;		/* bucket index */
+  uint16_t gen;			/* document generation of the entry */
+  unsigned char flags;		/* bucket flags */
+} BFLAGS_ENTRY;
+
+/* open-addressed set of bucket flags, sized by the document */
+typedef struct
+{
+  BFLAGS_ENTRY *entries;
+  uint32_t size;		/* number of entries, a power of 2 */
+  uint32_t bits;		/* log2 (size) */
+  uint32_t count;		/* entries in the current generation */
+  uint16_t gen;			/* current generation, never 0 */
+  int error;			/* 1 if the set couldn't grow */
+} BFLAGS_STRUCT;
+
 /* class structure */
 typedef struct
 {
   const char *classname;
-  OSBF_HEADER_STRUCT *header;
-  OSBF_BUCKET_STRUCT *buckets;
-  unsigned char *bflags;	/* bucket flags */
+  OSBF_HEADER_STRUCT *header;	/* header of this class */
+  OSBF_HEADER_STRUCT *counters;	/* headers mapped for writing, to */
+				/* count classifications, or NULL */
+  uint32_t *buckets;		/* bucket array */
+  void *map;			/* start of the mapped file */
+  uint32_t bucket_words;	/* bucket size, in 32-bit words */
+  uint32_t num_columns;		/* number of counts per bucket */
+  uint32_t column;		/* count of this class */
+  int packed;			/* 1 if buckets are in the packed format */
+  uint64_t hash_magic;		/* reciprocal of num_buckets for HASH_INDEX */
+  int robin_hood;		/* 1 if OSBF_DB_ROBIN_HOOD is set */
+  int frozen;			/* 1 if a read-only frozen file */
+  const uint16_t *pilots;	/* perfect hash of a frozen file */
+  const uint32_t *remap;
+  uint64_t mph_seed;
+  uint32_t mph_pilots;
+  uint32_t mph_size;
+  unsigned char *fingerprints;	/* key fingerprints, or NULL */
+  uint64_t *bloom;		/* Bloom filter blocks, or NULL */
+  uint32_t *bloom_stale;	/* buckets freed since it was built */
+  uint32_t bloom_blocks;	/* number of 64-byte blocks */
+  BFLAGS_STRUCT bflags;		/* bucket flags */
   int fd;
   int flags;			/* open flags, O_RDWR, O_RDONLY */
+  int locked;			/* 1 if locked for writing */
+  uint32_t num_stripes;		/* stripes of a striped lock, or 0 */
+  unsigned char *stripes;	/* 1 for each stripe locked */
+  uint32_t stripes_low;		/* the stripes locked are in */
+  uint32_t stripes_high;	/* [stripes_low, stripes_high) */
+  int header_locked;		/* 1 if its header is locked */
+  uint32_t *seq;		/* version counters of the regions, */
+  uint32_t seq_regions;		/* or NULL if there's no room */
+  uint32_t seq_shift;		/* log2 of the buckets per region */
+  dev_t dev;			/* device and inode of the mapped file, */
+  ino_t ino;			/* used to detect when it's replaced */
+  off_t fsize;			/* size of the mapping */
+  int mlocked;			/* 1 if locked in memory */
+  unsigned char *dirty;		/* bitmap of the pages written, or NULL */
+  uint64_t *checkpoint;		/* time of the last checkpoint of the */
+				/* file, in its header, or NULL */
+  uint64_t checkpoint_time;	/* the same, if there's no room there */
   uint32_t learnings;
   double hits;
   uint32_t totalhits;
@@ -61,6 +227,18 @@ typedef struct
   uint32_t missedfeatures;
 } CLASS_STRUCT;
 
+/* max number of printable ASCII delimiters handled by the SIMD scanner */
+#define OSBF_MAX_SIMD_DELIMS 16
+
+/* token delimiter table, built once per delimiter string */
+typedef struct
+{
+  unsigned char tokchar[256];	/* 1 if the char can be part of a token */
+  int simd;			/* 1 if the SIMD scanner can be used */
+  uint32_t num_simd_delims;	/* printable ASCII delimiters */
+  unsigned char simd_delims[OSBF_MAX_SIMD_DELIMS];
+} DELIM_TABLE_STRUCT;
+
 /* database statistics structure */
 typedef struct
 {
@@ -78,8 +256,80 @@ typedef struct
   double avg_chain;
   uint32_t max_displacement;
   uint32_t unreachable;
+  uint32_t num_classes;
+  uint32_t db_flags;
+  uint32_t fingerprint_probes;	/* fingerprints checked by lookups */
+  uint32_t fingerprint_false_hits;	/* of them, equal to a missed key */
+  uint32_t bloom_stale;		/* buckets freed since the filter was built */
+  double bloom_false_positives;	/* estimated from the bits set */
 } STATS_STRUCT;
 
+/* file lock statistics of the process */
+typedef struct
+{
+  uint64_t locks;		/* locks acquired */
+  uint64_t contended;		/* of them, not acquired at once */
+  uint64_t timeouts;		/* locks given up after lock_timeout */
+  uint64_t wait_ns;		/* total time waited for locks */
+  uint64_t max_wait_ns;		/* longest wait */
+  uint64_t read_retries;	/* probes repeated by unlocked readers */
+} LOCK_STATS_STRUCT;
+
+/* cost of making the trainings of the process durable */
+typedef struct
+{
+  uint64_t learnings;		/* trainings whose classes were unlocked */
+  uint64_t syncs;		/* msync calls */
+  uint64_t pages;		/* pages given to them */
+  uint64_t touches;		/* mtime updates */
+  uint64_t sync_ns;		/* total time in these calls */
+} SYNC_STATS_STRUCT;
+
+/*
+ * Entry of a learn journal, followed by the name of the class file,
+ * padded with zeros to a multiple of 4 bytes, and by the h1 and h2
+ * hashes of the distinct features of the document.
+ */
+typedef struct
+{
+  uint32_t magic;		/* OSBF_JOURNAL_MAGIC or OSBF_JOURNAL_DONE */
+  uint32_t size;		/* size of the whole entry, in bytes */
+  uint32_t checksum;		/* strnhash of the rest of the entry */
+  uint32_t column;		/* column of the class in its file */
+  int32_t sense;		/* 1 => learn;  -1 => unlearn */
+  uint32_t flags;		/* flags of the training */
+  uint32_t name_len;		/* length of the padded name */
+  uint32_t num_features;
+} OSBF_JOURNAL_ENTRY_STRUCT;
+
+#define OSBF_JOURNAL_MAGIC 0x4A425346	/* "FSBJ" */
+/* magic of an entry already applied, or requeued, by an applier */
+#define OSBF_JOURNAL_DONE 0x44425346	/* "FSBD" */
+/* suffix of the journal file taken by an applier */
+#define OSBF_JOURNAL_WORK_SUFFIX ".applying"
+
+/* a feature of a text: the hashes of a sparse bigram of its tokens */
+typedef struct
+{
+  uint32_t h1;
+  uint32_t h2;
+  uint32_t window_idx;		/* distance between the tokens */
+} OSBF_FEATURE_STRUCT;
+
+/*
+ * Features of a text, extracted once and then classified or trained
+ * any number of times. A training also takes the features of the fake
+ * tokens that push the last real ones through the window, so they
+ * follow those of the classification.
+ */
+typedef struct
+{
+  OSBF_FEATURE_STRUCT *features;
+  uint32_t num_features;	/* features classified */
+  uint32_t num_learn_features;	/* features trained, paddings included */
+  unsigned long text_len;
+} OSBF_TEXT_FEATURES_STRUCT;
+
 /* Database version */
 #define SBPH_VERSION		0
 #define OSB_VERSION		1
@@ -87,31 +337,120 @@ typedef struct
 #define NEURAL_VERSION		3
 #define OSB_WINNOW_VERSION	4
 #define OSBF_VERSION		5
-#define UNKNOWN_VERSION		6
+#define OSBF_MC_VERSION		6
+#define OSBF_PACKED_VERSION	7
+#define OSBF_FROZEN_VERSION	8
+#define UNKNOWN_VERSION		9
+/* error of osbf_map_class when a frozen file is opened for writing */
+#define OSBF_FROZEN_ERROR	(-7)
 
 #define BUCKET_LOCK_MASK  0x80
 #define BUCKET_FREE_MASK  0x40
-#define HASH_INDEX(cd, h) (h % NUM_BUCKETS(cd))
+/*
+ * h % n without a division (Lemire's fastmod), using the reciprocal
+ * m = 2^64 / n + 1 computed when the class is mapped. The result is
+ * exact for all 32-bit h and n.
+ */
+#if defined(__SIZEOF_INT128__) && !defined(OSBF_NO_FASTMOD)
+__extension__ typedef unsigned __int128 osbf_uint128_t;
+#define OSBF_FASTMOD_MAGIC(n) ((n) > 0 ? UINT64_MAX / (n) + 1 : 0)
+#define OSBF_FASTMOD(h, m, n) \
+  ((uint32_t) (((osbf_uint128_t) ((m) * (uint64_t) (h)) * (n)) >> 64))
+#else
+#define OSBF_FASTMOD_MAGIC(n) 0
+#define OSBF_FASTMOD(h, m, n) ((h) % (n))
+#endif
+#define HASH_INDEX(cd, h) \
+  OSBF_FASTMOD(h, (cd)->hash_magic, NUM_BUCKETS(cd))
 #define NUM_BUCKETS(cd) ((cd)->header->num_buckets)
 #define VALID_BUCKET(cd, i) (i < NUM_BUCKETS(cd))
-#define BUCKET_HASH(cd, i) (((cd)->buckets)[i].hash)
-#define BUCKET_KEY(cd, i) (((cd)->buckets)[i].key)
-#define BUCKET_VALUE(cd, i) (((cd)->buckets)[i].value)
-#define BUCKET_FLAGS(cd, i) (((cd)->bflags)[i])
-#define BUCKET_RAW_VALUE(cd, i) (((cd)->buckets)[i].value)
-#define BUCKET_IS_LOCKED(cd, i) ((((cd)->bflags)[i]) & BUCKET_LOCK_MASK)
-#define MARKED_FREE(cd, i) ((((cd)->bflags)[i]) & BUCKET_FREE_MASK)
-#define MARK_IT_FREE(cd, i) ((((cd)->bflags)[i]) |= BUCKET_FREE_MASK)
-#define UNMARK_IT_FREE(cd, i) (((cd)->bflags)[i]) &= (~BUCKET_FREE_MASK)
-#define LOCK_BUCKET(cd, i) (((cd)->bflags)[i]) |= BUCKET_LOCK_MASK
-#define UNLOCK_BUCKET(cd, i) (((cd)->bflags)[i]) &= (~BUCKET_LOCK_MASK)
-#define SET_BUCKET_VALUE(cd, i, val) (((cd)->buckets)[i].value) = val
-#define SETL_BUCKET_VALUE(cd, i, val) (((cd)->buckets)[i].value) = (val);  \
+#define BUCKET_WORD(cd, i, w) \
+  (((cd)->buckets)[(size_t) (i) * (cd)->bucket_words + (w)])
+/* hash (w = 0) and key (w = 1) of a bucket in the packed format */
+#define PACKED_WORD(cd, i, w) \
+  (((cd)->buckets)[(size_t) ((i) / OSBF_LINE_BUCKETS) * OSBF_LINE_WORDS + \
+                   (w) * OSBF_LINE_BUCKETS + (i) % OSBF_LINE_BUCKETS])
+#define PACKED_VALUE(cd, i) \
+  (((uint16_t *) (cd)->buckets) \
+   [(size_t) ((i) / OSBF_LINE_BUCKETS) * (OSBF_LINE_WORDS * 2) + \
+    4 * OSBF_LINE_BUCKETS + (i) % OSBF_LINE_BUCKETS])
+#define BUCKET_HASH(cd, i) (*((cd)->packed ? &PACKED_WORD(cd, i, 0) : \
+                                             &BUCKET_WORD(cd, i, 0)))
+#define BUCKET_KEY(cd, i) (*((cd)->packed ? &PACKED_WORD(cd, i, 1) : \
+                                            &BUCKET_WORD(cd, i, 1)))
+/* count of a bucket in a frozen file */
+#define FROZEN_VALUE(cd, i) \
+  (((uint16_t *) &BUCKET_WORD(cd, i, 2))[(cd)->column])
+#define BUCKET_VALUE(cd, i) ((cd)->packed ? (uint32_t) PACKED_VALUE(cd, i) : \
+                             (cd)->frozen ? (uint32_t) FROZEN_VALUE(cd, i) : \
+                             BUCKET_WORD(cd, i, 2 + (cd)->column))
+#define BUCKET_FLAGS(cd, i) osbf_get_bflags(&(cd)->bflags, i)
+#define SET_BUCKET_FLAGS(cd, i, f) osbf_set_bflags(&(cd)->bflags, i, f)
+#define BUCKET_RAW_VALUE(cd, i) BUCKET_VALUE(cd, i)
+#define BUCKET_IS_LOCKED(cd, i) (BUCKET_FLAGS(cd, i) & BUCKET_LOCK_MASK)
+#define MARKED_FREE(cd, i) (BUCKET_FLAGS(cd, i) & BUCKET_FREE_MASK)
+#define MARK_IT_FREE(cd, i) \
+  SET_BUCKET_FLAGS(cd, i, BUCKET_FLAGS(cd, i) | BUCKET_FREE_MASK)
+#define UNMARK_IT_FREE(cd, i) \
+  SET_BUCKET_FLAGS(cd, i, BUCKET_FLAGS(cd, i) & ~BUCKET_FREE_MASK)
+#define LOCK_BUCKET(cd, i) \
+  SET_BUCKET_FLAGS(cd, i, BUCKET_FLAGS(cd, i) | BUCKET_LOCK_MASK)
+#define UNLOCK_BUCKET(cd, i) \
+  SET_BUCKET_FLAGS(cd, i, BUCKET_FLAGS(cd, i) & ~BUCKET_LOCK_MASK)
+#define SET_BUCKET_VALUE(cd, i, val) \
+  ((cd)->packed ? (void) (PACKED_VALUE(cd, i) = (val)) : \
+                  (void) (BUCKET_WORD(cd, i, 2 + (cd)->column) = (val)))
+#define SETL_BUCKET_VALUE(cd, i, val) SET_BUCKET_VALUE(cd, i, val);  \
                                         LOCK_BUCKET(cd, i)
 
-#define BUCKET_IN_CHAIN(cd, i) (BUCKET_VALUE(cd, i) != 0)
-#define BUCKET_HASH_COMPARE(cd, i, h, k) (((cd)->buckets[i].hash) == (h) && \
-                                          ((cd)->buckets[i].key)  == (k))
+/* the bucket is used by some class */
+#define BUCKET_IN_CHAIN(cd, i) (BUCKET_VALUE(cd, i) != 0 || \
+                                ((cd)->num_columns > 1 && \
+                                 osbf_bucket_shared(cd, i)))
+/* the bucket is used by this class */
+#define BUCKET_IN_CLASS(cd, i) (BUCKET_VALUE(cd, i) != 0)
+/* count used to choose the buckets to be zeroed by microgroom */
+#define BUCKET_GROOM_VALUE(cd, i) ((cd)->num_columns > 1 ? \
+                                   osbf_bucket_total(cd, i) : \
+                                   BUCKET_VALUE(cd, i))
+#define SET_FINGERPRINT(cd, i, fp) \
+  ((cd)->fingerprints ? (void) ((cd)->fingerprints[i] = (fp)) : (void) 0)
+#define COPY_BUCKET(cd, to, from) \
+  ((cd)->packed ? \
+   (void) (PACKED_WORD(cd, to, 0) = PACKED_WORD(cd, from, 0), \
+           PACKED_WORD(cd, to, 1) = PACKED_WORD(cd, from, 1), \
+           PACKED_VALUE(cd, to) = PACKED_VALUE(cd, from)) : \
+   (void) memcpy (&BUCKET_WORD(cd, to, 0), &BUCKET_WORD(cd, from, 0), \
+                  (cd)->bucket_words * sizeof (uint32_t)), \
+   SET_FINGERPRINT(cd, to, (cd)->fingerprints[from]))
+#define CLEAR_BUCKET(cd, i) \
+  ((cd)->packed ? (void) (PACKED_VALUE(cd, i) = 0) : \
+   (void) memset (&BUCKET_WORD(cd, i, 2), 0, \
+                  (cd)->num_columns * sizeof (uint32_t)), \
+   SET_FINGERPRINT(cd, i, 0))
+#define BUCKET_HASH_COMPARE(cd, i, h, k) (BUCKET_HASH(cd, i) == (h) && \
+                                          BUCKET_KEY(cd, i)  == (k))
+/* the bucket returned by osbf_find_bucket holds the feature. With     */
+/* Robin Hood insertion a missing feature may return a used bucket */
+#define BUCKET_FOUND(cd, i, h, k) (BUCKET_IN_CHAIN(cd, i) && \
+                                   BUCKET_HASH_COMPARE(cd, i, h, k))
+/* classes of the same multi-class file, which share the buckets */
+#define SAME_DB(cd1, cd2) ((cd1)->num_columns > 1 && \
+                           (cd1)->dev == (cd2)->dev && \
+                           (cd1)->ino == (cd2)->ino)
+/* version counter of the region of a bucket */
+#define BUCKET_SEQ(cd, i) ((cd)->seq + ((i) >> (cd)->seq_shift))
+/* start a read of the chains around bucket i, by a reader that */
+/* doesn't lock the class: the version of their region, or 0    */
+#define OSBF_READ_BEGIN(cd, i) ((cd)->seq == NULL ? 0 : \
+  __atomic_load_n (BUCKET_SEQ(cd, i), __ATOMIC_ACQUIRE))
+/* 1 if a writer was changing them during the read, which must */
+/* then be repeated if osbf_read_retry allows                  */
+#define OSBF_READ_CHANGED(cd, i, version) ((cd)->seq != NULL && \
+  (__atomic_thread_fence (__ATOMIC_ACQUIRE), \
+   ((version) & OSBF_SEQ_WRITERS) != 0 || \
+   __atomic_load_n (BUCKET_SEQ(cd, i), __ATOMIC_RELAXED) != (version)))
+
 #define NEXT_BUCKET(cd, i) ((i) == (NUM_BUCKETS(cd) - 1) ? 0 : i + 1)
 #define PREV_BUCKET(cd, i) ((i) == 0 ?  (NUM_BUCKETS(cd) - 1) : (i) - 1)
 
@@ -138,6 +477,15 @@ extern const char *db_version_names[];
 /* max number of buckets groom-zeroed */
 #define OSBF_MICROGROOM_STOP_AFTER 128
 
+/*
+ * imports leave microgrooming to a sweep at the end, unless a chain
+ * grows past OSBF_IMPORT_GROOM_FACTOR times the max chain len. New
+ * features that would take more than OSBF_IMPORT_MAX_USE of the
+ * buckets are dropped instead, the ones with the lowest counts first.
+ */
+#define OSBF_IMPORT_GROOM_FACTOR 4
+#define OSBF_IMPORT_MAX_USE(n) ((n) / 4 * 3)
+
 /* groom locked buckets? 0 => no; 1 => yes */
 /* comment the line below to enable locked buckets grooming */
 #define OSBF_MICROGROOM_LOCKED 0
@@ -154,12 +502,180 @@ extern const char *db_version_names[];
 #define OSBF_MAX_LONG_TOKENS 1000
 #endif
 
+/* number of features ahead whose buckets are prefetched during
+ * classification (0 => no prefetching) */
+#define OSBF_PREFETCH_DISTANCE 8
+
 /* min ratio between max and min P(F|C) */
 #define OSBF_MIN_PMAX_PMIN_RATIO 1
 
 /* max number of classes */
 #define OSBF_MAX_CLASSES 128
 
+/* max time waited for a file lock, in milliseconds. A busy lock is
+ * retried after a wait that doubles from OSBF_LOCK_MIN_WAIT up to
+ * OSBF_LOCK_MAX_WAIT microseconds */
+#define OSBF_LOCK_TIMEOUT 20000
+#define OSBF_LOCK_MIN_WAIT 20
+#define OSBF_LOCK_MAX_WAIT 5000
+
+/*
+ * Striped locks of the trainings, if lock_stripes > 0: the buckets
+ * are split into lock_stripes stripes and a training only write
+ * locks the stripes of the chains it changes, and the header of its
+ * class. Stripe s is locked at the byte OSBF_STRIPE_LOCK_START + s,
+ * never written, and the byte before it is read locked during the
+ * whole training, to keep out the whole-file locks of other writers.
+ */
+#define OSBF_STRIPE_LOCK_START 0x40000000
+#define OSBF_MAX_LOCK_STRIPES 65536
+
+/*
+ * Version counters of the bucket regions, for the readers, which
+ * don't lock the file. They're kept in the unused end of the header,
+ * from the 64-byte boundary after the class headers: one 32-bit word
+ * per region, up to OSBF_SEQ_REGIONS, each of the same power of 2 of
+ * buckets. A writer adds 1 to the counters of the buckets around a
+ * chain before changing it, and OSBF_SEQ_DONE - 1 after, so the low
+ * 16 bits count the writers in the region and the high ones count its
+ * changes. A reader repeats a probe, at most OSBF_SEQ_RETRIES times,
+ * if the counter of its first bucket had a writer or changed meanwhile.
+ */
+#define OSBF_SEQ_REGIONS 256
+#define OSBF_SEQ_WRITERS 0xFFFF
+#define OSBF_SEQ_DONE 0x10000
+#define OSBF_SEQ_RETRIES 16
+
+/* map_advice: madvise given to the mapped class files */
+#define OSBF_MAP_NORMAL 0
+#define OSBF_MAP_RANDOM 1	/* no read-ahead around faults */
+#define OSBF_MAP_WILLNEED 2	/* start reading the whole file */
+
+/*
+ * durability: when the pages written by the trainings are flushed
+ * to the file. Except with OSBF_DURABILITY_NONE, which leaves them
+ * to the kernel, the pages written are tracked and only they and the
+ * header are given to msync, in runs that join dirty pages up to
+ * OSBF_SYNC_GAP pages apart, or more in big files, so that a flush
+ * makes at most about OSBF_SYNC_MAX_CALLS msync calls.
+ */
+#define OSBF_DURABILITY_NONE 0
+#define OSBF_DURABILITY_ASYNC 1	/* MS_ASYNC after each training */
+#define OSBF_DURABILITY_SYNC 2	/* MS_SYNC when the class is closed */
+#define OSBF_DURABILITY_CHECKPOINT 3	/* MS_SYNC every checkpoint_interval */
+#define OSBF_CHECKPOINT_INTERVAL 30	/* seconds */
+/*
+ * The time of the last checkpoint, in seconds since the epoch, is kept
+ * in the unused end of the header, after the room of the version
+ * counters, so it outlasts the opens of the file and is shared by all
+ * its writers. A file with no room there keeps it per open.
+ */
+#define OSBF_CHECKPOINT_OFFSET(num_columns) \
+  (OSBF_LINE_ALIGN ((off_t) (num_columns) * sizeof (OSBF_HEADER_STRUCT)) + \
+   OSBF_SEQ_REGIONS * sizeof (uint32_t))
+#define OSBF_SYNC_GAP 8
+#define OSBF_SYNC_MAX_CALLS 16
+
+/* max number of worker threads of a batch classification */
+#define OSBF_MAX_WORKERS 16
+
+/*
+ * Framed protocol of the classification server: each request is an
+ * OSBF_REQUEST_STRUCT followed by text_len bytes of text, answered by
+ * an OSBF_REPLY_STRUCT followed by len bytes: the class probabilities
+ * (doubles) and trainings (uint32_t) of a classification, the
+ * STATS_STRUCT of stats, or the error message if status < 0. Both
+ * ends run on the same host, so numbers are in host byte order.
+ */
+typedef struct
+{
+  uint32_t magic;		/* OSBF_SERVER_MAGIC */
+  uint32_t op;			/* OSBF_OP_* */
+  uint32_t class_idx;		/* class to train or get the stats of */
+  uint32_t flags;		/* classify or learn flags, full stats */
+  double min_pmax_pmin_ratio;
+  uint32_t text_len;
+  uint32_t reserved;
+} OSBF_REQUEST_STRUCT;
+
+typedef struct
+{
+  uint32_t magic;		/* OSBF_SERVER_MAGIC */
+  int32_t status;		/* 0 if ok */
+  uint32_t num_classes;		/* classes of the served dbset */
+  uint32_t ncfs;		/* of them, classes in the first subset */
+  uint32_t len;			/* bytes that follow */
+  uint32_t reserved;
+} OSBF_REPLY_STRUCT;
+
+#define OSBF_SERVER_MAGIC 0x4F534246	/* "OSBF" */
+#define OSBF_OP_CLASSIFY 1
+#define OSBF_OP_LEARN 2
+#define OSBF_OP_UNLEARN 3
+#define OSBF_OP_STATS 4
+#define OSBF_OP_SHUTDOWN 5
+/* max text accepted in a request */
+#define OSBF_SERVER_MAX_TEXT (64 * 1024 * 1024)
+/* default and max number of requests served at once */
+#define OSBF_SERVER_WORKERS 4
+#define OSBF_SERVER_MAX_WORKERS 64
+/* max number of open connections, idle ones included */
+#define OSBF_SERVER_MAX_CONNECTIONS 1024
+
+/*
+ * Parameters of a corpus run, the TOER training of spamfilter/toer.lua:
+ * train on error and, for messages scored inside the thick threshold,
+ * reinforce with the whole message and then with its header.
+ */
+typedef struct
+{
+  double threshold_offset;	/* center of the unsure zone */
+  double thick_threshold;	/* half width of the unsure zone */
+  double header_learn_threshold;	/* min pR change of a training */
+  double reinforcement_degree;
+  double threshold_reinforcement_degree;
+  uint32_t ham_reinforcement_limit;
+  uint32_t spam_reinforcement_limit;
+  uint32_t max_text_size;	/* 0 means full document */
+  uint32_t testsize;		/* messages in the final testset */
+  int train_in_testset;
+  uint32_t nonspam_index;	/* classes trained with hams and spams */
+  uint32_t spam_index;
+  double min_pmax_pmin_ratio;
+  double pR_scf;		/* pR scale calibration factor */
+  uint32_t num_workers;		/* tokenizer threads */
+  const char *training_log;	/* NULL for none */
+} OSBF_CORPUS_PARAMS_STRUCT;
+
+/* counters of a corpus run */
+typedef struct
+{
+  uint32_t messages, hams, spams, hams_test, spams_test;
+  uint32_t false_positives, false_negatives;
+  uint32_t false_positives_test, false_negatives_test;
+  uint32_t trainings, trainings_test;
+  uint32_t reinforcements, reinforcements_test;
+  uint32_t learnings;		/* all trainings, header ones included */
+  double duration;		/* seconds */
+} OSBF_CORPUS_RESULTS_STRUCT;
+
+/* messages read and tokenized ahead of the one being trained */
+#define OSBF_CORPUS_QUEUE 64
+#define OSBF_CORPUS_WORKERS 2
+
+/* set of classes kept open and mapped across calls */
+typedef struct
+{
+  uint32_t num_classes;
+  int flags;			/* open flags, O_RDWR, O_RDONLY */
+  char *classnames[OSBF_MAX_CLASSES];
+  CLASS_STRUCT class[OSBF_MAX_CLASSES];
+  DELIM_TABLE_STRUCT dt;
+  long minflt, majflt;		/* page faults before it was opened */
+  long open_minflt, open_majflt;	/* and while it was opened */
+  uint32_t mlock_errors;	/* classes that couldn't be locked */
+} DBSET_STRUCT;
+
 #define OSB_BAYES_WINDOW_LEN 5
 
 /* define the max length of a filename */
@@ -179,8 +695,16 @@ extern const char *db_version_names[];
 #define COUNT_CLASSIFICATIONS	2
 
 extern uint32_t strnhash (unsigned char *str, uint32_t len);
+extern void osbf_build_delim_table (DELIM_TABLE_STRUCT * dt,
+				    const char *delims);
 extern off_t check_file (const char *file);
 
+extern void osbf_bflags_reset (BFLAGS_STRUCT * bf, uint32_t expected);
+extern void osbf_bflags_free (BFLAGS_STRUCT * bf);
+extern unsigned char osbf_get_bflags (BFLAGS_STRUCT * bf, uint32_t bindex);
+extern void
+osbf_set_bflags (BFLAGS_STRUCT * bf, uint32_t bindex, unsigned char flags);
+
 extern void
 osbf_packchain (CLASS_STRUCT * dbclass, uint32_t packstart, uint32_t packlen);
 
@@ -198,6 +722,8 @@ extern uint32_t osbf_last_in_chain (CLASS_STRUCT * dbclass, uint32_t bindex);
 extern uint32_t
 osbf_find_bucket (CLASS_STRUCT * dbclass, uint32_t hash, uint32_t key);
 
+extern int osbf_read_retry (uint32_t version, uint32_t * retries);
+
 extern void
 osbf_update_bucket (CLASS_STRUCT * dbclass, uint32_t bindex, int delta);
 
@@ -207,11 +733,53 @@ osbf_insert_bucket (CLASS_STRUCT * dbclass, uint32_t bindex,
 extern int
 osbf_create_cfcfile (const char *cfcfile, uint32_t buckets,
 		     uint32_t major, uint32_t minor, char *errmsg);
+extern int
+osbf_create_mc_file (const char *mcfile, uint32_t num_buckets,
+		     uint32_t num_classes, char *errmsg);
+extern int
+osbf_interleave (const char *classnames[], const char *mcfile,
+		 uint32_t num_buckets, char *errmsg);
+extern int
+osbf_split (const char *mcfile, const char *classnames[], char *errmsg);
+extern int
+osbf_create_packed_file (const char *cfcfile, uint32_t num_buckets,
+			 uint32_t db_flags, char *errmsg);
+extern int
+osbf_convert (const char *cfcfile_from, const char *cfcfile_to,
+	      uint32_t version, uint32_t db_flags, uint32_t flags_mask,
+	      char *errmsg);
+extern void osbf_bloom_add (CLASS_STRUCT * class, uint32_t hash,
+			    uint32_t key);
+extern int osbf_bloom_check (CLASS_STRUCT * class, uint32_t hash,
+			     uint32_t key);
+extern int osbf_bloom_rebuild (CLASS_STRUCT * class, char *errmsg);
+extern int
+osbf_resize (const char *cfcfile, uint32_t num_buckets, char *errmsg);
+extern int
+osbf_freeze (const char *classnames[], const char *frozenfile,
+	     char *errmsg);
+extern int
+osbf_create_files (const char *files[], uint32_t num_buckets,
+		   uint32_t num_classes, uint32_t db_flags, char *errmsg);
+extern int
+osbf_resize_files (const char *classnames[], uint32_t num_buckets,
+		   char *errmsg);
+extern int osbf_bucket_shared (CLASS_STRUCT * class, uint32_t bindex);
+extern uint32_t osbf_bucket_total (CLASS_STRUCT * class, uint32_t bindex);
+extern uint32_t osbf_class_column (const char *classnames[], uint32_t idx);
 
 int osbf_dump (const char *cfcfile, const char *csvfile, char *errmsg);
 int osbf_restore (const char *cfcfile, const char *csvfile, char *errmsg);
+int osbf_dump_binary (const char *cfcfile, const char *snapfile,
+		      char *errmsg);
+int osbf_restore_binary (const char *cfcfile, const char *snapfile,
+			 char *errmsg);
 int osbf_import (const char *cfcfile, const char *csvfile, char *errmsg);
-int osbf_stats (const char *cfcfile, STATS_STRUCT * stats,
+int osbf_import_sources (const char *cfcfile_to, const char *cfcfiles_from[],
+			 char *errmsg);
+int osbf_import_files (const char *files[], const char **const sources[],
+		       char *errmsg);
+int osbf_stats (const char *cfcfile, uint32_t column, STATS_STRUCT * stats,
 		char *errmsg, int full);
 
 extern int
@@ -231,8 +799,120 @@ osbf_bayes_learn (const unsigned char *text,
 		  unsigned tc, int sense, uint32_t flags, char *errmsg);
 
 extern int
-osbf_open_class (const char *classname, int flags, CLASS_STRUCT * class,
-		 char *errmsg);
+osbf_bayes_classify_dbset (DBSET_STRUCT * dbset,
+			   const unsigned char *text,
+			   unsigned long len,
+			   uint32_t flags,
+			   double min_pmax_pmin_ratio, double ptc[],
+			   uint32_t ptt[], char *errmsg);
+
+extern int
+osbf_bayes_classify_batch (DBSET_STRUCT * dbset,
+			   uint32_t num_texts,
+			   const unsigned char *texts[],
+			   const unsigned long text_lens[],
+			   uint32_t flags,
+			   double min_pmax_pmin_ratio,
+			   uint32_t num_workers,
+			   double ptc[], uint32_t ptt[], char *errmsg);
+
+extern int
+osbf_bayes_learn_dbset (DBSET_STRUCT * dbset,
+			const unsigned char *text,
+			unsigned long len,
+			uint32_t tc, int sense, uint32_t flags, char *errmsg);
+
+extern int
+osbf_text_features (const unsigned char *text,
+		    unsigned long len,
+		    const DELIM_TABLE_STRUCT * dt,
+		    OSBF_TEXT_FEATURES_STRUCT * tf, char *errmsg);
+
+extern void osbf_free_text_features (OSBF_TEXT_FEATURES_STRUCT * tf);
+
+extern int
+osbf_bayes_classify_features (DBSET_STRUCT * dbset,
+			      const OSBF_TEXT_FEATURES_STRUCT * tf,
+			      uint32_t flags,
+			      double min_pmax_pmin_ratio, double ptc[],
+			      uint32_t ptt[], char *errmsg);
+
+extern int
+osbf_bayes_learn_features (DBSET_STRUCT * dbset,
+			   const OSBF_TEXT_FEATURES_STRUCT * tf,
+			   uint32_t tc, int sense, uint32_t flags,
+			   char *errmsg);
+
+extern int
+osbf_journal_learn (const char *journal,
+		    const unsigned char *text,
+		    unsigned long len,
+		    const char *pattern,
+		    const char *classes[],
+		    uint32_t tc, int sense, uint32_t flags, char *errmsg);
+
+extern int
+osbf_apply_journal (const char *journal, uint32_t * applied, char *errmsg);
+
+extern int
+osbf_open_class (const char *classname, uint32_t column, int flags,
+		 CLASS_STRUCT * class, char *errmsg);
+extern int
+osbf_open_class_striped (const char *classname, uint32_t column,
+			 CLASS_STRUCT * class, char *errmsg);
+extern int
+osbf_map_class (const char *classname, uint32_t column, int flags,
+		CLASS_STRUCT * class, char *errmsg);
 extern int osbf_close_class (CLASS_STRUCT * class, char *errmsg);
+extern int osbf_mlock_class (CLASS_STRUCT * class, char *errmsg);
+extern void osbf_page_faults (long *minor, long *major);
+extern int osbf_lock_class (CLASS_STRUCT * class, char *errmsg);
+extern int osbf_lock_class_striped (CLASS_STRUCT * class, char *errmsg);
+extern int
+osbf_lock_buckets (CLASS_STRUCT * class, uint32_t first, uint32_t last,
+		   char *errmsg);
+extern void osbf_release_buckets (CLASS_STRUCT * class, uint32_t bindex);
+extern int osbf_lock_header (CLASS_STRUCT * class, char *errmsg);
+extern void
+osbf_bucket_cluster (CLASS_STRUCT * class, uint32_t bindex,
+		     uint32_t * first, uint32_t * last);
+extern int osbf_unlock_class (CLASS_STRUCT * class, char *errmsg);
+extern int osbf_class_changed (CLASS_STRUCT * class);
+extern int osbf_check_class (CLASS_STRUCT * class, char *errmsg);
+
+extern int
+osbf_open_dbset (DBSET_STRUCT * dbset, const char *classnames[],
+		 const char *delims, int flags, char *errmsg);
+extern int osbf_close_dbset (DBSET_STRUCT * dbset, char *errmsg);
+extern int osbf_check_dbset (DBSET_STRUCT * dbset, char *errmsg);
+extern int
+osbf_lock_dbset_class (DBSET_STRUCT * dbset, uint32_t idx, char *errmsg);
+extern int
+osbf_count_classifications (CLASS_STRUCT * class, uint32_t n,
+			    char *errmsg);
+
+extern int
+osbf_serve (const char *socket_path, const char *classnames[],
+	    const char *delims, uint32_t ncfs, uint32_t num_workers,
+	    char *errmsg);
+extern int osbf_connect (const char *socket_path, char *errmsg);
+extern int
+osbf_server_request (int fd, OSBF_REQUEST_STRUCT * request,
+		     const unsigned char *text, OSBF_REPLY_STRUCT * reply,
+		     void *data, uint32_t data_size, char *errmsg);
+
+extern void osbf_corpus_defaults (OSBF_CORPUS_PARAMS_STRUCT * params);
+extern int
+osbf_run_corpus (const char *index, const char *classnames[],
+		 const char *delims, uint32_t ncfs,
+		 const OSBF_CORPUS_PARAMS_STRUCT * params,
+		 OSBF_CORPUS_RESULTS_STRUCT * results, char *errmsg);
+
 extern int osbf_lock_file (int fd, uint32_t start, uint32_t len);
+extern int osbf_read_lock_file (int fd, uint32_t start, uint32_t len);
 extern int osbf_unlock_file (int fd, uint32_t start, uint32_t len);
+extern void osbf_lock_stats (LOCK_STATS_STRUCT * stats, int reset);
+extern void osbf_mark_dirty (CLASS_STRUCT * class, size_t offset,
+			     size_t len);
+extern int osbf_sync_class (CLASS_STRUCT * class, int flags, char *errmsg);
+extern void osbf_sync_stats (SYNC_STATS_STRUCT * stats, int reset);
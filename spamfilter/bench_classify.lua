@@ -0,0 +1,68 @@
+#!/usr/local/bin/lua
+-- This script measures the classification time per feature, with and
+-- without prefetching of buckets, on the given databases. Use databases
+-- much larger than the CPU's last level cache to see the effect of the
+-- prefetching.
+--
+-- To get the cache misses per feature, run it under "perf stat -e
+-- cache-misses,dTLB-load-misses" once for each distance, passing it as
+-- the last argument, and divide the counts by the number of features
+-- printed.
+
+-- Usage ex.: bench_classify.lua nonspam.cfc spam.cfc message 1000
+
+local osbf = require "osbf"
+
+-- do we have the databases and the message?
+if (not arg[3]) then
+ print("Syntax: bench_classify.lua <class1.cfc> <class2.cfc> <message> " ..
+       "[<iterations> [<prefetch_distance>]]")
+ return 1
+end
+
+local iterations = tonumber(arg[4]) or 1000
+local dbset = {
+  classes = {arg[1], arg[2]},
+  ncfs = 1,
+  delimiters = ""
+}
+
+local f = assert(io.open(arg[3], "r"))
+local text = f:read("*a")
+f:close()
+
+-- each token generates one feature per window position, 4 in all.
+-- long tokens are accumulated, so this is an upper bound.
+local num_tokens = 0
+for _ in string.gmatch(text, "%S+") do
+  num_tokens = num_tokens + 1
+end
+local num_features = num_tokens * 4
+
+local db = assert(osbf.open(dbset, "r"))
+
+local function bench(distance)
+  osbf.config({prefetch_distance = distance})
+  -- warm up the page tables
+  db:classify(text)
+  local t = os.clock()
+  for i = 1, iterations do
+    assert(db:classify(text))
+  end
+  t = os.clock() - t
+  print(string.format("prefetch_distance: %2d  us/message: %9.2f" ..
+                      "  ns/feature: %7.2f",
+                      distance, t * 1E6 / iterations,
+                      t * 1E9 / (iterations * num_features)))
+end
+
+print(string.format("features per message: %d, iterations: %d",
+                    num_features, iterations))
+if arg[5] then
+  bench(tonumber(arg[5]))
+else
+  bench(0)
+  bench(8)
+  bench(16)
+end
+db:close()
@@ -19,12 +19,17 @@ end
 -- a string with a statistics report of the database
 function dbfile_stats (dbfile)
     local OSBF_Bayes_db_version = 5 -- OSBF-Bayes database indentifier
+    local OSBF_Bayes_packed_db_version = 7 -- packed, cache-line aligned
     local report = "-- Statistics for " .. dbfile .. "\n"
     local version = "OSBF-Bayes"
     local classifications, mistakes, error_rate;
     stats_lua, errmsg  = osbf.stats(dbfile)
 
-    if (stats_lua and stats_lua.version == OSBF_Bayes_db_version) then
+    if stats_lua and stats_lua.version == OSBF_Bayes_packed_db_version then
+      version = "OSBF-Bayes packed"
+    end
+    if (stats_lua and (stats_lua.version == OSBF_Bayes_db_version or
+        stats_lua.version == OSBF_Bayes_packed_db_version)) then
 
       report = report .. string.format(
         "%-35s%12s\n%-35s%12d\n%-35s%12.1f\n%-35s%12d\n%-35s%12d\n",
@@ -0,0 +1,32 @@
+#!/usr/local/bin/lua
+-- Script for converting the databases to the packed, cache-line
+-- aligned format, with 16-bit counts, or back to the standard one.
+-- The original databases are kept with the suffix ".bak".
+
+-- Usage: migrate_databases.lua [packed|standard]
+
+local osbf = require("osbf")
+
+-- database classes to be converted
+dbset = { classes = {"nonspam.cfc", "spam.cfc"} }
+
+local format = arg[1] or "packed"
+if format ~= "packed" and format ~= "standard" then
+  print("Syntax: migrate_databases.lua [packed|standard]")
+  os.exit(1)
+end
+
+for _, cfcfile in ipairs(dbset.classes) do
+  local tmpfile = cfcfile .. ".new"
+  local r, err = osbf.convert_db(cfcfile, tmpfile, format)
+  if r then
+    r, err = os.rename(cfcfile, cfcfile .. ".bak")
+  end
+  if r then
+    r, err = os.rename(tmpfile, cfcfile)
+  end
+  if not r then
+    print(err)
+    os.exit(1)
+  end
+end
@@ -0,0 +1,65 @@
+#!/usr/local/bin/lua
+-- Classification server for spamfilter.lua. It keeps the user databases
+-- open and mapped and answers classify, learn, unlearn and stats requests
+-- on a Unix domain socket, so that each message delivery doesn't have to
+-- open and map the databases again. spamfilter.lua uses it when
+-- osbf.cfg_socket is set in spamfilter_config.lua, or when the option
+-- --socket is given, and falls back to the databases if it's not running.
+--
+-- Usage: osbfd.lua [--udir=<dir>] [--cfgdir=<dir>] [--dbdir=<dir>]
+--                  [--socket=<path>] [--workers=<n>]
+--
+-- To stop the server, from Lua:
+--   local c = osbf.connect(socket); c:shutdown()
+
+local osbf = require "osbf"
+
+local function append_slash(path)
+  if path == nil then return nil end
+  if string.sub(path, -1) ~= "/" then
+    return path .. "/"
+  end
+  return path
+end
+
+local options = {}
+for _, o in ipairs(arg) do
+  local key, value = string.match(o, "^%-%-([^=]+)=(.*)")
+  if key == "udir" or key == "cfgdir" or key == "dbdir" or
+     key == "socket" or key == "workers" then
+    options[key] = value
+  else
+    io.stderr:write("Error: invalid option: ", o, "\n")
+    os.exit(1)
+  end
+end
+
+local user_dir     = append_slash(options.udir)   or "./"
+local config_dir   = append_slash(options.cfgdir) or user_dir
+local database_dir = append_slash(options.dbdir)  or user_dir
+
+-- spamfilter_config.lua sets its options in the osbf table
+local f, err = loadfile(config_dir .. "spamfilter_config.lua")
+if not f then
+  io.stderr:write("Error: ", err, "\n")
+  os.exit(1)
+end
+f()
+
+local socket = options.socket or osbf.cfg_socket or
+               (user_dir .. "osbfd.socket")
+local workers = tonumber(options.workers)
+
+-- same dbset as spamfilter.lua, so that class indexes match
+local dbset = {
+  classes = {database_dir .. osbf.cfg_nonspam_file,
+             database_dir .. osbf.cfg_spam_file},
+  ncfs = 1,
+  delimiters = osbf.cfg_extra_delimiters or ""
+}
+
+local r, err = osbf.serve(socket, dbset, workers)
+if not r then
+  io.stderr:write("Error: ", err, "\n")
+  os.exit(1)
+end
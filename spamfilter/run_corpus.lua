@@ -0,0 +1,179 @@
+#!/usr/local/bin/lua
+-- Script for training with TREC compatible corpora, like toer.lua, but
+-- with the training done by osbf.run_corpus: the databases stay mapped
+-- for the whole run, and the messages are read and tokenized by other
+-- threads ahead of the one being trained. The training method, the
+-- parameters and the reports are the same as toer.lua's, so their
+-- results can be compared, with the prefix "run-corpus" instead of
+-- "toer-lua" in the report names.
+
+--[[------------------------------------------------------------------
+
+How to use:
+
+$ ./run_corpus.lua <path_to_index> [<index_name>] [<workers>]
+
+The index file is a list of message files with two fields separated
+by a space per line. The first field is the judge ("spam" or "ham")
+and the second is the message filename, relative to <path_to_index>.
+<index_name> defaults to "index" and <workers>, the number of threads
+tokenizing messages, to 2.
+
+--]]----------------------------------------------------------------
+
+local osbf = require "osbf"  -- load osbf module
+local string = string
+
+local num_buckets	= 94321 -- min value recommended for production
+--local num_buckets	= 4000037 -- value used for TREC tests
+local preserve_db       = false -- preserve databases or not between corpora
+local min_p_ratio       = 1  -- minimum probability ratio over the classes a
+			     -- feature must have so as not to be ignored
+local corpora_dir	= arg[1] or "./"
+local corpora_index	= arg[2] or "index"
+local log_prefix        = "run-corpus"
+
+-- training parameters, see toer.lua
+local params = {
+	threshold_offset               = 5,
+	thick_threshold                = 20,
+	header_learn_threshold         = 14,
+	reinforcement_degree           = 0.6,
+	ham_reinforcement_limit        = 4,
+	spam_reinforcement_limit       = 4,
+	threshold_reinforcement_degree = 1.5,
+	max_text_size                  = 500000, -- 0 means full document
+	testsize                       = 1000,
+	train_in_testset               = true,
+	nonspam_index                  = 1,
+	spam_index                     = 2,
+	min_p_ratio                    = min_p_ratio,
+	workers                        = tonumber(arg[3]) or 2
+}
+
+local dbset = {
+	classes     = {"nonspam.cfc", "spam.cfc"},
+	ncfs        = 1,
+	delimiters  = ""
+}
+
+-------------------------------------------------------------------------
+
+-- receives a single class database filename and returns
+-- a string with a statistics report of the database
+local function dbfile_stats (dbfile)
+    local OSBF_Bayes_db_version = 5 -- OSBF-Bayes database indentifier
+    local report = "-- Statistics for " .. dbfile .. "\n"
+    local version = "OSBF-Bayes"
+    local stats_lua = osbf.stats(dbfile)
+    if (stats_lua.version == OSBF_Bayes_db_version) then
+      report = report .. string.format(
+        "%-35s%12s\n%-35s%12d\n%-35s%12.1f\n%-35s%12d\n%-35s%12d\n%-35s%12d\n",
+        "Database version:", version,
+        "Total buckets in database:", stats_lua.buckets,
+        "Buckets used (%):", stats_lua.use * 100,
+        "Trainings:", stats_lua.learnings,
+        "Bucket size (bytes):", stats_lua.bucket_size,
+        "Header size (bytes):", stats_lua.header_size)
+      report = report .. string.format("%-35s%12d\n%-35s%12d\n%-35s%12d\n\n",
+        "Number of chains:", stats_lua.chains,
+        "Max chain len (buckets):", stats_lua.max_chain,
+        "Average chain length (buckets):", stats_lua.avg_chain,
+        "Max bucket displacement:", stats_lua.max_displacement)
+    else
+    	report = report .. string.format("%-35s%12s\n", "Database version:",
+	    "Unknown")
+    end
+
+    return report
+end
+
+-- check if a file exists
+local function file_exists(file)
+  local f = io.open(file, "r")
+  if f then
+    f:close()
+    return true
+  else
+    return nil, "File not found"
+  end
+end
+
+-------------------------------------------------------------------------
+
+if preserve_db then
+  if not (file_exists(dbset.classes[1]) and
+	 file_exists(dbset.classes[2])) then
+    assert(osbf.create_db(dbset.classes, num_buckets))
+  end
+else
+  osbf.remove_db(dbset.classes)
+  assert(osbf.create_db(dbset.classes, num_buckets))
+end
+
+local suffix = string.format("o%d_t%d_u%g_b%d_r%d_%s_%s",
+		params.threshold_offset, params.thick_threshold,
+		params.header_learn_threshold, num_buckets, min_p_ratio,
+		string.gsub(corpora_dir, "/", "_"), corpora_index)
+params.training_log = log_prefix .. "_training-log_" .. suffix
+local training_stats_report = log_prefix .. "_training-stats_" .. suffix
+local db_stats_report = log_prefix .. "_db-stats_" .. suffix
+
+local r, err = osbf.run_corpus(corpora_dir .. corpora_index, dbset, params)
+if not r then
+  io.stderr:write("Error: ", err, "\n")
+  os.exit(1)
+end
+
+-- print database stats report
+local db_stats_fh = assert(io.open(db_stats_report, "w"))
+for _, dbfile in ipairs(dbset.classes) do
+  db_stats_fh:write(dbfile_stats(dbfile))
+end
+db_stats_fh:close()
+
+-- print training stats report
+local testsize = params.testsize
+local t_stats_fh = assert(io.open(training_stats_report, "w"))
+t_stats_fh:write("-- Training statistics report\n\n")
+t_stats_fh:write("Message corpus\n")
+t_stats_fh:write(string.format("  %-26s%7d\n  %-26s%7d\n  %-26s%7d\n\n",
+  "Hams:", r.hams, "Spams:", r.spams, "Total messages:", r.hams + r.spams))
+
+t_stats_fh:write("Training (OSBFBayes)\n")
+t_stats_fh:write(string.format(
+  "  %-26s%7d\n  %-26s%7d\n  %-26s%7d\n  %-26s%7d\n  %-26s%7d\n  %-26s%7d\n\n",
+  "Thick treshold:", params.thick_threshold,
+  "Header learn-treshold:", params.header_learn_threshold,
+  "Trainings on error:", r.false_positives + r.false_negatives,
+  "Reinforcements:", r.reinforcements,
+  "Total learnings:",
+    r.false_positives + r.false_negatives + r.reinforcements,
+  "Duration (sec):", math.floor(r.duration + 0.5)))
+
+t_stats_fh:write(
+  string.format("Performance in the final %d messages (testset)\n", testsize))
+t_stats_fh:write(string.format(
+  "  %-26s%7d\n  %-26s%7d\n  %-26s%7d\n",
+  "Hams in testset:", r.hams_test,
+  "Spams in testset:", r.spams_test,
+  "False positives:", r.false_positives_test))
+
+t_stats_fh:write(string.format(
+  "  %-26s%7d\n  %-26s%7d\n  %-26s%7d\n  %-26s%10.2f\n  " ..
+    "%-26s%10.2f\n  %-26s%10.2f\n  %-26s%10.2f\n  %-26s%10.2f\n",
+  "False negatives:", r.false_negatives_test,
+  "Total errors in testset:",
+    r.false_positives_test + r.false_negatives_test,
+  "Reinforcements in testset:", r.reinforcements_test,
+  "Ham recall (%):",
+    100 * (r.hams_test - r.false_positives_test) / r.hams_test,
+  "Ham precision (%):", 100 * (r.hams_test - r.false_positives_test) /
+    (r.hams_test - r.false_positives_test + r.false_negatives_test),
+  "Spam recall (%):",
+    100 * (r.spams_test - r.false_negatives_test) / r.spams_test,
+  "Spam precision (%):", 100 * (r.spams_test - r.false_negatives_test) /
+    (r.spams_test - r.false_negatives_test + r.false_positives_test),
+  "Accuracy (%):",
+    100 * (1 - (r.false_positives_test + r.false_negatives_test) / testsize)))
+t_stats_fh:close()
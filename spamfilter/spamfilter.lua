@@ -219,7 +219,7 @@ end
 gOptind, gOptions = getopt(arg,
 	{ udir = 1, gdir = 1, learn = 1, unlearn = 1, classify = 0,
 	  score = 0, cfgdir = 1, dbdir = 1, listsdir = 1, source = 1,
-	  output = 1, help = 0})
+	  output = 1, socket = 1, help = 0})
 
 gMyPath = string.match(arg[0], "^(.*/)") or "./"
 
@@ -306,6 +306,12 @@ depending on COMMAND.
         default report or the original message classified as spam or ham,
         according to the training command.
 
+  --socket=<socket_path>
+        send classifications  and trainings  to the  osbfd.lua server
+        listening on  <socket_path>, instead  of opening the databases.
+        If the server is not running, the databases are used directly.
+        Overrides osbf.cfg_socket in the configuration file.
+
 If no command-line command is specified, spamfilter.lua looks for one of
 the send-to-yourself  commands in  the subject line  and executes  it if
 found. If  no subject line command  is found, it searches  the first 100
@@ -405,6 +411,57 @@ osbf.cfg_dbset = {
 osbf.cfg_nonspam_index  = 1
 osbf.cfg_spam_index     = 2
 
+-- If an osbfd.lua server is running on the configured socket, route
+-- classifications, trainings and stats of cfg_dbset through it. The
+-- server keeps the databases mapped, saving their opening and mapping
+-- on each message.
+if gOptions["socket"] then
+  osbf.cfg_socket = gOptions["socket"]
+end
+if osbf.cfg_socket then
+  local classify, learn, unlearn, stats =
+	osbf.classify, osbf.learn, osbf.unlearn, osbf.stats
+  local dbset = osbf.cfg_dbset
+  local conn
+
+  -- connect on the first request, not before it's needed; without a
+  -- server, the databases are used directly
+  local function server()
+    if conn == nil then
+      conn = osbf.connect(osbf.cfg_socket) or false
+    end
+    return conn
+  end
+
+  osbf.classify = function(text, set, flags, min_p_ratio)
+    if set ~= dbset or not server() then
+      return classify(text, set, flags, min_p_ratio)
+    end
+    return conn:classify(text, flags, min_p_ratio)
+  end
+  -- the server doesn't take the extra arguments, like a journal
+  osbf.learn = function(text, set, index, flags, ...)
+    if set ~= dbset or select("#", ...) > 0 or not server() then
+      return learn(text, set, index, flags, ...)
+    end
+    return conn:learn(text, index, flags)
+  end
+  osbf.unlearn = function(text, set, index, flags, ...)
+    if set ~= dbset or select("#", ...) > 0 or not server() then
+      return unlearn(text, set, index, flags, ...)
+    end
+    return conn:unlearn(text, index, flags)
+  end
+  osbf.stats = function(dbfile, full)
+    for i, class in ipairs(dbset.classes) do
+      if class == dbfile and server() then
+        return conn:stats(i, full)
+      end
+    end
+    return stats(dbfile, full)
+  end
+end
+
 -- read white and black lists
 if not my_dofile(gLists_dir .. "whitelist.lua") then
   whitelist = {}
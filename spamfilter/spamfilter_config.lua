@@ -51,6 +51,11 @@ osbf.cfg_log_dir           = "log" -- relative to the user osbf-lua dir
 -- Count classifications? Comment or set to false to turn off
 osbf.cfg_count_classifications = true
 
+-- Socket of an osbfd.lua server holding the databases open. When set and
+-- the server is running, classifications and trainings are sent to it;
+-- otherwise the databases are opened directly. Uncomment to enable:
+--osbf.cfg_socket = "/home/user/.osbf-lua/osbfd.socket"
+
 -- This option specifies that the original message will be written to stdout
 -- after a training, with the correct tag. To have the original behavior,
 -- that is, just a report message, comment this option out.